@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FuseDaemon"
+
+#include "include/libfuse_jni/DirectoryListingCache.h"
+
+#include <algorithm>
+
+namespace mediaprovider {
+namespace fuse {
+
+uint64_t DirectoryListingCache::GetEpoch() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return epoch_;
+}
+
+std::shared_ptr<const DirectoryEntries> DirectoryListingCache::Lookup(uint64_t parent, uid_t uid,
+                                                                      Clock::time_point now) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = entries_.find(Key(parent, uid));
+    if (it == entries_.end()) {
+        misses_++;
+        return nullptr;
+    }
+    if (it->second.expiry <= now) {
+        entries_.erase(it);
+        misses_++;
+        return nullptr;
+    }
+    hits_++;
+    return it->second.entries;
+}
+
+void DirectoryListingCache::Insert(uint64_t parent, uid_t uid, const DirectoryEntries& entries,
+                                   uint64_t epoch, Clock::time_point now) {
+    if (ttl_ == Clock::duration::zero() || !max_entries_ || entries.error()) {
+        return;
+    }
+    // Copy before taking the lock, listings can be large
+    auto listing = std::make_shared<const DirectoryEntries>(entries);
+
+    std::lock_guard<std::mutex> guard(lock_);
+    if (epoch != epoch_) {
+        // The directory may have changed while it was listed
+        return;
+    }
+
+    const Key key(parent, uid);
+    if (entries_.size() >= max_entries_ && entries_.find(key) == entries_.end()) {
+        auto oldest = std::min_element(entries_.begin(), entries_.end(),
+                                       [](const auto& a, const auto& b) {
+                                           return a.second.expiry < b.second.expiry;
+                                       });
+        entries_.erase(oldest);
+    }
+    entries_[key] = {std::move(listing), now + ttl_};
+}
+
+void DirectoryListingCache::Invalidate(uint64_t parent) {
+    std::lock_guard<std::mutex> guard(lock_);
+    epoch_++;
+
+    auto begin = entries_.lower_bound(Key(parent, 0));
+    auto end = begin;
+    while (end != entries_.end() && end->first.first == parent) {
+        ++end;
+        invalidated_++;
+    }
+    entries_.erase(begin, end);
+}
+
+void DirectoryListingCache::InvalidateAll() {
+    std::lock_guard<std::mutex> guard(lock_);
+    epoch_++;
+    invalidated_ += entries_.size();
+    entries_.clear();
+}
+
+DirectoryListingCache::Stats DirectoryListingCache::GetStats() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return {entries_.size(), hits_, misses_, invalidated_};
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DirectoryListingCacheTest"
+
+#include "libfuse_jni/DirectoryListingCache.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+using namespace mediaprovider::fuse;
+using namespace std::chrono_literals;
+
+typedef DirectoryListingCache::Clock Clock;
+
+class DirectoryListingCacheTest : public ::testing::Test {
+  protected:
+    static DirectoryEntries Listing(const char* name) {
+        DirectoryEntries entries;
+        entries.Add(name, strlen(name), DT_REG);
+        return entries;
+    }
+
+    void Insert(uint64_t parent, uid_t uid, const char* name) {
+        cache_.Insert(parent, uid, Listing(name), cache_.GetEpoch(), now_);
+    }
+
+    // Returns the name of the only entry of the cached listing, or "" if there is none
+    std::string Lookup(uint64_t parent, uid_t uid, Clock::duration later = 0s) {
+        std::shared_ptr<const DirectoryEntries> entries = cache_.Lookup(parent, uid, now_ + later);
+        return entries ? entries->name(0) : "";
+    }
+
+    const Clock::time_point now_ = Clock::now();
+    DirectoryListingCache cache_{1s, 2};
+};
+
+TEST_F(DirectoryListingCacheTest, testLookup_perUid) {
+    Insert(1, 10000, "a");
+    Insert(1, 10001, "b");
+
+    EXPECT_EQ("a", Lookup(1, 10000));
+    EXPECT_EQ("b", Lookup(1, 10001));
+    EXPECT_EQ("", Lookup(1, 10002));
+    EXPECT_EQ("", Lookup(2, 10000));
+
+    const DirectoryListingCache::Stats stats = cache_.GetStats();
+    EXPECT_EQ(2, stats.entries);
+    EXPECT_EQ(2, stats.hits);
+    EXPECT_EQ(2, stats.misses);
+}
+
+TEST_F(DirectoryListingCacheTest, testLookup_expires) {
+    Insert(1, 10000, "a");
+
+    EXPECT_EQ("a", Lookup(1, 10000, 999ms));
+    EXPECT_EQ("", Lookup(1, 10000, 1s));
+    EXPECT_EQ(0, cache_.GetStats().entries);
+}
+
+TEST_F(DirectoryListingCacheTest, testInvalidate) {
+    Insert(1, 10000, "a");
+    Insert(2, 10000, "b");
+    const uint64_t epoch = cache_.GetEpoch();
+
+    cache_.Invalidate(1);
+    EXPECT_EQ("", Lookup(1, 10000));
+    EXPECT_EQ("b", Lookup(2, 10000));
+
+    // Listed before the invalidation, so possibly without the change
+    cache_.Insert(1, 10000, Listing("a"), epoch, now_);
+    EXPECT_EQ("", Lookup(1, 10000));
+
+    cache_.InvalidateAll();
+    EXPECT_EQ("", Lookup(2, 10000));
+    EXPECT_EQ(2, cache_.GetStats().invalidated);
+}
+
+TEST_F(DirectoryListingCacheTest, testInsert_boundedAndSkipsErrors) {
+    Insert(1, 10000, "a");
+    Insert(2, 10000, "b");
+    Insert(3, 10000, "c");
+    EXPECT_EQ(2, cache_.GetStats().entries);
+    EXPECT_EQ("c", Lookup(3, 10000));
+
+    DirectoryEntries failed;
+    failed.SetError(EACCES);
+    cache_.Insert(4, 10000, failed, cache_.GetEpoch(), now_);
+    EXPECT_EQ(nullptr, cache_.Lookup(4, 10000, now_));
+
+    DirectoryListingCache disabled(0s);
+    disabled.Insert(1, 10000, Listing("a"), disabled.GetEpoch(), now_);
+    EXPECT_EQ(0, disabled.GetStats().entries);
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FuseDaemon"
+
+#include "include/libfuse_jni/FAdviser.h"
+
+#include <android-base/logging.h>
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+FAdviser::Policy FAdviser::Policy::ForMemory(uint64_t total_ram) {
+    // The defaults suit a device with 4GiB of memory
+    Policy policy;
+    policy.threshold = std::clamp<uint64_t>(total_ram / 64, 16 * 1024 * 1024, 512 * 1024 * 1024);
+    policy.target = policy.threshold / 2;
+    policy.readahead_size = std::clamp<uint64_t>(total_ram / 2048, 512 * 1024, 4 * 1024 * 1024);
+    return policy;
+}
+
+FAdviser::FAdviser() : FAdviser(Policy()) {}
+
+FAdviser::FAdviser(const Policy& policy, Advise advise)
+    : policy_(policy),
+      advise_(std::move(advise)),
+      ring_(new Cell[kRingSize]),
+      push_pos_(0),
+      pop_pos_(0),
+      pending_size_(0),
+      pending_messages_(0),
+      generations_(new std::atomic<uint32_t>[kGenerations]),
+      advise_locks_(new std::mutex[kAdviseLocks]),
+      total_size_(0) {
+    for (size_t i = 0; i < kRingSize; i++) {
+        ring_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < kGenerations; i++) {
+        generations_[i].store(0, std::memory_order_relaxed);
+    }
+    thread_ = std::thread(&FAdviser::MessageLoop, this);
+}
+
+FAdviser::~FAdviser() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void FAdviser::Record(int fd, off_t off, size_t size) {
+    const uint32_t gen = GetGeneration(fd).load(std::memory_order_relaxed);
+    SendMessage({Message::record, fd, gen, off, size});
+}
+
+void FAdviser::Close(int fd) {
+    uint32_t gen;
+    {
+        // Waits for advice being given on |fd|, any later advice sees the new generation
+        std::lock_guard<std::mutex> lock(GetAdviseLock(fd));
+        gen = GetGeneration(fd).fetch_add(1, std::memory_order_relaxed);
+    }
+    // Only for the accounting thread to forget about the file, nothing is left to wait for
+    SendMessage({Message::close, fd, gen, 0, 0});
+}
+
+void FAdviser::AdviseIfOpen(int fd, uint32_t gen, off_t offset, off_t len, int advice) {
+    std::lock_guard<std::mutex> lock(GetAdviseLock(fd));
+    if (GetGeneration(fd).load(std::memory_order_relaxed) != gen) return;
+    advise_(fd, offset, len, advice);
+}
+
+bool FAdviser::File::IsSequential() const {
+    return sequential_count >= kSequentialCount;
+}
+
+void FAdviser::UpdateAccessPattern(int fd, File* file, off_t off, size_t size) {
+    const bool was_sequential = file->IsSequential();
+    const off_t end = off + size;
+    if (off >= file->next_off - kSequentialSlack && off <= file->next_off + kSequentialSlack) {
+        if (file->sequential_count < kSequentialCount) file->sequential_count++;
+        file->next_off = std::max(file->next_off, end);
+    } else {
+        file->sequential_count = 0;
+        file->next_off = end;
+    }
+
+    if (!policy_.readahead_size) return;
+
+    if (file->IsSequential() != was_sequential) {
+        // Have the lower filesystem read further ahead of streams, and stop doing so once they
+        // turn out to be seeked through.
+        AdviseIfOpen(fd, file->gen, 0, 0,
+                     file->IsSequential() ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+        file->readahead_end = 0;
+    }
+
+    // Keep up to readahead_size ahead of the stream in flight, in steps of half of that
+    const off_t readahead_size = policy_.readahead_size;
+    if (file->IsSequential() && file->next_off + readahead_size / 2 >= file->readahead_end) {
+        const off_t begin = std::max(file->next_off, file->readahead_end);
+        file->readahead_end = file->next_off + readahead_size;
+        AdviseIfOpen(fd, file->gen, begin, file->readahead_end - begin, POSIX_FADV_WILLNEED);
+    }
+}
+
+void FAdviser::RecordImpl(int fd, uint32_t gen, off_t off, size_t size) {
+    if (GetGeneration(fd).load(std::memory_order_relaxed) != gen) {
+        // Recorded before |fd| was closed, there is nothing left to advise
+        return;
+    }
+
+    File& file = files_[fd];
+    if (file.gen != gen) {
+        // The number was reused before the close of the previous file was accounted for
+        total_size_ -= file.size;
+        file = File();
+        file.gen = gen;
+    }
+
+    total_size_ += size;
+    if (file.size) {
+        file.begin = std::min<off_t>(file.begin, off);
+        file.end = std::max<off_t>(file.end, off + size);
+    } else {
+        file.begin = off;
+        file.end = off + size;
+    }
+    file.size += size;
+    UpdateAccessPattern(fd, &file, off, size);
+
+    if (total_size_ < policy_.threshold) return;
+
+    // Crossing the threshold takes tens of megabytes of I/O, so finding the files to drop here is
+    // much cheaper than keeping them ordered on every record. Streamed files are unlikely to be
+    // read again soon, so they go first, and files accessed at random are kept cached for longer.
+    std::vector<std::tuple<bool, size_t, int>> candidates;
+    candidates.reserve(files_.size());
+    for (const auto& entry : files_) {
+        if (entry.second.size) {
+            candidates.emplace_back(entry.second.IsSequential(), entry.second.size, entry.first);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), std::greater<std::tuple<bool, size_t, int>>());
+
+    LOG(INFO) << "Threshold exceeded - fadvising " << total_size_;
+    for (const auto& candidate : candidates) {
+        if (total_size_ <= policy_.target) break;
+        File& dropped = files_[std::get<2>(candidate)];
+        total_size_ -= dropped.size;
+        AdviseIfOpen(std::get<2>(candidate), dropped.gen, dropped.begin,
+                     dropped.end - dropped.begin, POSIX_FADV_DONTNEED);
+        dropped.size = 0;
+    }
+    LOG(INFO) << "Threshold now " << total_size_;
+}
+
+void FAdviser::CloseImpl(int fd, uint32_t gen) {
+    auto file = files_.find(fd);
+    if (file == files_.end() || file->second.gen != gen) return;
+
+    total_size_ -= file->second.size;
+    files_.erase(file);
+}
+
+void FAdviser::MessageLoop() {
+    while (1) {
+        bool quit;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return wake_ || quit_; });
+            wake_ = false;
+            quit = quit_;
+        }
+
+        pending_size_.store(0, std::memory_order_relaxed);
+        pending_messages_.store(0, std::memory_order_relaxed);
+
+        Message message;
+        while (Pop(&message)) {
+            switch (message.type) {
+                case Message::record:
+                    RecordImpl(message.fd, message.gen, message.off, message.size);
+                    break;
+
+                case Message::close:
+                    CloseImpl(message.fd, message.gen);
+                    break;
+            }
+        }
+
+        if (quit) return;
+    }
+}
+
+bool FAdviser::Push(const Message& message) {
+    size_t pos = push_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (1) {
+        cell = &ring_[pos % kRingSize];
+        const size_t seq = cell->seq.load(std::memory_order_acquire);
+        const ptrdiff_t diff = static_cast<ptrdiff_t>(seq - pos);
+        if (diff == 0) {
+            if (push_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            // The message sent kRingSize messages ago was not taken yet
+            return false;
+        } else {
+            pos = push_pos_.load(std::memory_order_relaxed);
+        }
+    }
+    cell->message = message;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool FAdviser::Pop(Message* message) {
+    Cell* cell = &ring_[pop_pos_ % kRingSize];
+    if (cell->seq.load(std::memory_order_acquire) != pop_pos_ + 1) {
+        // Empty, or the sender of the next message is still writing it. It is taken on the next
+        // wake up then.
+        return false;
+    }
+    *message = cell->message;
+    cell->seq.store(pop_pos_ + kRingSize, std::memory_order_release);
+    pop_pos_++;
+    return true;
+}
+
+void FAdviser::SendMessage(const Message& message) {
+    while (!Push(message)) {
+        // Only happens if the accounting thread falls far behind, let it catch up
+        Wake();
+        std::this_thread::yield();
+    }
+
+    // Only wake the accounting thread up when a batch is complete, rather than on every read
+    bool wake = false;
+    if (message.size) {
+        const size_t old_size = pending_size_.fetch_add(message.size, std::memory_order_relaxed);
+        wake |= old_size < policy_.batch_size && old_size + message.size >= policy_.batch_size;
+    }
+    const size_t old_messages = pending_messages_.fetch_add(1, std::memory_order_relaxed);
+    wake |= old_messages + 1 == kMaxPendingMessages;
+
+    if (wake) Wake();
+}
+
+void FAdviser::Wake() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wake_ = true;
+    }
+    cv_.notify_one();
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the cost FAdviser adds to every read and write, as seen by the FUSE threads.
+
+#include "libfuse_jni/FAdviser.h"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+using mediaprovider::fuse::FAdviser;
+
+namespace {
+
+// The mutex and condition variable queue FAdviser used to have, kept here for comparison.
+class LockedQueue {
+  public:
+    LockedQueue() : thread_([this] { Loop(); }) {}
+
+    ~LockedQueue() {
+        Send(-1, 0);
+        thread_.join();
+    }
+
+    void Send(int fd, size_t size) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            queue_.push({fd, size});
+        }
+        cv_.notify_one();
+    }
+
+  private:
+    void Loop() {
+        while (1) {
+            std::pair<int, size_t> message;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return !queue_.empty(); });
+                message = queue_.front();
+                queue_.pop();
+            }
+            if (message.first == -1) return;
+            sizes_[message.first] += message.second;
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::queue<std::pair<int, size_t>> queue_;
+    std::map<int, size_t> sizes_;
+    std::thread thread_;
+};
+
+FAdviser::Policy makePolicy() {
+    // Never reaches the threshold, so that only the bookkeeping is measured
+    FAdviser::Policy policy;
+    policy.threshold = SIZE_MAX;
+    policy.target = SIZE_MAX;
+    return policy;
+}
+
+FAdviser fadviser(makePolicy(), [](int, off_t, off_t, int) {});
+LockedQueue locked_queue;
+
+// Each benchmark thread does I/O on its own file
+std::atomic<int> next_fd(0);
+thread_local const int fd = next_fd++;
+
+// Stands in for the time a FUSE thread spends serving a request. With a gap between requests,
+// the accounting thread falls asleep and has to be woken up again.
+void serveRequest(int64_t micros) {
+    const auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(micros);
+    while (std::chrono::steady_clock::now() < end) {
+    }
+}
+
+void BM_FAdviserRecord(benchmark::State& state) {
+    off_t off = 0;
+    for (auto _ : state) {
+        fadviser.Record(fd, off, 128 * 1024);
+        off += 128 * 1024;
+        serveRequest(state.range(0));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FAdviserRecord)->Arg(0)->Arg(20)->ThreadRange(1, 8)->UseRealTime();
+
+void BM_LockedQueueRecord(benchmark::State& state) {
+    for (auto _ : state) {
+        locked_queue.Send(fd, 128 * 1024);
+        serveRequest(state.range(0));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LockedQueueRecord)->Arg(0)->Arg(20)->ThreadRange(1, 8)->UseRealTime();
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FAdviserTest"
+
+#include "libfuse_jni/FAdviser.h"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+using namespace mediaprovider::fuse;
+
+constexpr size_t kMiB = 1024 * 1024;
+
+struct Advice {
+    int fd;
+    off_t offset;
+    off_t len;
+    int advice;
+
+    bool operator==(const Advice& other) const {
+        return fd == other.fd && offset == other.offset && len == other.len &&
+               advice == other.advice;
+    }
+};
+
+std::ostream& operator<<(std::ostream& os, const Advice& advice) {
+    return os << "{" << advice.fd << ", " << advice.offset << ", " << advice.len << ", "
+              << advice.advice << "}";
+}
+
+// Collects the advice given by an FAdviser
+class AdviseRecorder {
+  public:
+    FAdviser::Advise GetAdvise() {
+        return [this](int fd, off_t offset, off_t len, int advice) {
+            std::lock_guard<std::mutex> guard(lock_);
+            advice_.push_back({fd, offset, len, advice});
+            cv_.notify_all();
+        };
+    }
+
+    // Returns the advice once there are at least |count|, or whatever was advised after a
+    // timeout
+    std::vector<Advice> WaitFor(size_t count) {
+        std::unique_lock<std::mutex> lock(lock_);
+        cv_.wait_for(lock, std::chrono::seconds(5), [&] { return advice_.size() >= count; });
+        return advice_;
+    }
+
+  private:
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::vector<Advice> advice_;
+};
+
+// Accounts for every record right away and doesn't hint sequential streams
+FAdviser::Policy makePolicy(size_t threshold, size_t target) {
+    FAdviser::Policy policy;
+    policy.threshold = threshold;
+    policy.target = target;
+    policy.batch_size = 1;
+    policy.readahead_size = 0;
+    return policy;
+}
+
+TEST(FAdviserTest, testAdvisesLargestFiles) {
+    AdviseRecorder recorder;
+    FAdviser fadviser(makePolicy(10 * kMiB, 5 * kMiB), recorder.GetAdvise());
+
+    fadviser.Record(1, 0, 2 * kMiB);
+    fadviser.Record(2, 0, 3 * kMiB);
+    fadviser.Record(1, 2 * kMiB, 4 * kMiB);
+    fadviser.Record(3, 0, 1 * kMiB);
+
+    // Advising 1 alone brings the total from 10 down to 4
+    const Advice first = {1, 0, 6 * kMiB, POSIX_FADV_DONTNEED};
+    EXPECT_EQ(std::vector<Advice>({first}), recorder.WaitFor(1));
+
+    // 3 becomes the largest file, and advising it alone brings the total down to 3
+    fadviser.Record(3, 1 * kMiB, 6 * kMiB);
+    const Advice second = {3, 0, 7 * kMiB, POSIX_FADV_DONTNEED};
+    EXPECT_EQ(std::vector<Advice>({first, second}), recorder.WaitFor(2));
+}
+
+TEST(FAdviserTest, testAdvisesAccessedRangeOnly) {
+    AdviseRecorder recorder;
+    FAdviser fadviser(makePolicy(10 * kMiB, 5 * kMiB), recorder.GetAdvise());
+
+    fadviser.Record(1, 100 * kMiB, 4 * kMiB);
+    fadviser.Record(1, 96 * kMiB, 4 * kMiB);
+    fadviser.Record(1, 110 * kMiB, 2 * kMiB);
+
+    const Advice advice = {1, 96 * kMiB, 16 * kMiB, POSIX_FADV_DONTNEED};
+    EXPECT_EQ(std::vector<Advice>({advice}), recorder.WaitFor(1));
+}
+
+TEST(FAdviserTest, testAdvisesStreamsFirst) {
+    AdviseRecorder recorder;
+    FAdviser fadviser(makePolicy(10 * kMiB, 6 * kMiB), recorder.GetAdvise());
+
+    // 1 is seeked through and 2 is streamed, advising 2 is enough despite 1 being larger
+    const off_t offsets[] = {0, 50 * kMiB, 20 * kMiB, 70 * kMiB};
+    for (int i = 0; i < 4; i++) {
+        fadviser.Record(1, offsets[i], 1536 * 1024);
+        fadviser.Record(2, i * kMiB, kMiB);
+    }
+
+    const Advice advice = {2, 0, 4 * kMiB, POSIX_FADV_DONTNEED};
+    EXPECT_EQ(std::vector<Advice>({advice}), recorder.WaitFor(1));
+}
+
+TEST(FAdviserTest, testClosedFilesAreForgotten) {
+    AdviseRecorder recorder;
+    FAdviser fadviser(makePolicy(10 * kMiB, 5 * kMiB), recorder.GetAdvise());
+
+    fadviser.Record(1, 0, 9 * kMiB);
+    fadviser.Close(1);
+    fadviser.Record(2, 0, 6 * kMiB);
+    fadviser.Record(3, 0, 4 * kMiB);
+
+    const Advice advice = {2, 0, 6 * kMiB, POSIX_FADV_DONTNEED};
+    EXPECT_EQ(std::vector<Advice>({advice}), recorder.WaitFor(1));
+}
+
+TEST(FAdviserTest, testClose_dropsQueuedRecords) {
+    std::mutex lock;
+    std::vector<Advice> late;
+    bool closed = false;
+    {
+        FAdviser::Policy policy = makePolicy(SIZE_MAX, SIZE_MAX);
+        // Queued records are only accounted for once the fd was closed and reused
+        policy.batch_size = SIZE_MAX;
+        policy.readahead_size = 2 * kMiB;
+        FAdviser fadviser(policy, [&](int fd, off_t offset, off_t len, int advice) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (closed) late.push_back({fd, offset, len, advice});
+        });
+
+        // Enough for the stream to be hinted
+        for (int i = 0; i < 8; i++) {
+            fadviser.Record(1, i * kMiB, kMiB);
+        }
+        fadviser.Close(1);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closed = true;
+        }
+        // The fd is reused for another stream, which is only hinted once it was read through
+        // for as long as a fresh file
+        for (int i = 0; i < 4; i++) {
+            fadviser.Record(1, i * kMiB, kMiB);
+        }
+        // Whatever is left is accounted for as the FAdviser is destroyed
+    }
+    const Advice sequential = {1, 0, 0, POSIX_FADV_SEQUENTIAL};
+    const Advice readahead = {1, 4 * kMiB, 2 * kMiB, POSIX_FADV_WILLNEED};
+    EXPECT_EQ(std::vector<Advice>({sequential, readahead}), late);
+}
+
+TEST(FAdviserTest, testHintsSequentialStreams) {
+    AdviseRecorder recorder;
+    FAdviser::Policy policy = makePolicy(SIZE_MAX, SIZE_MAX);
+    policy.readahead_size = 2 * kMiB;
+    FAdviser fadviser(policy, recorder.GetAdvise());
+
+    constexpr size_t kReadSize = 128 * 1024;
+    // The stream is detected after 4 reads, and more is read ahead once it's halfway through
+    // what was read ahead
+    for (int i = 0; i < 12; i++) {
+        fadviser.Record(1, i * kReadSize, kReadSize);
+    }
+    // Seeking somewhere else ends the stream
+    fadviser.Record(1, 100 * kMiB, kReadSize);
+
+    const std::vector<Advice> expected = {
+            {1, 0, 0, POSIX_FADV_SEQUENTIAL},
+            {1, 4 * kReadSize, 2 * kMiB, POSIX_FADV_WILLNEED},
+            {1, 4 * kReadSize + 2 * kMiB, 1 * kMiB, POSIX_FADV_WILLNEED},
+            {1, 0, 0, POSIX_FADV_NORMAL},
+    };
+    EXPECT_EQ(expected, recorder.WaitFor(expected.size()));
+}
+
+TEST(FAdviserTest, testPolicyForMemory) {
+    constexpr uint64_t kGiB = 1024 * kMiB;
+
+    const FAdviser::Policy policy = FAdviser::Policy::ForMemory(4 * kGiB);
+    EXPECT_EQ(FAdviser::Policy::kDefaultThreshold, policy.threshold);
+    EXPECT_EQ(FAdviser::Policy::kDefaultTarget, policy.target);
+    EXPECT_EQ(FAdviser::Policy::kDefaultReadaheadSize, policy.readahead_size);
+
+    EXPECT_EQ(192 * kMiB, FAdviser::Policy::ForMemory(12 * kGiB).threshold);
+    EXPECT_EQ(96 * kMiB, FAdviser::Policy::ForMemory(12 * kGiB).target);
+    EXPECT_EQ(16 * kMiB, FAdviser::Policy::ForMemory(512 * kMiB).threshold);
+    EXPECT_EQ(512 * kMiB, FAdviser::Policy::ForMemory(64 * kGiB).threshold);
+    EXPECT_EQ(4 * kMiB, FAdviser::Policy::ForMemory(64 * kGiB).readahead_size);
+}
+
+TEST(FAdviserTest, testConcurrentRecords) {
+    AdviseRecorder recorder;
+    constexpr int kThreads = 4;
+    constexpr int kRecords = 10 * 1024;
+    {
+        // Each thread does 40 MiB of I/O on its own fd, so only the total reaches the threshold
+        FAdviser::Policy policy = makePolicy(kThreads * 40 * kMiB, 0);
+        policy.batch_size = 128 * 1024;
+        FAdviser fadviser(policy, recorder.GetAdvise());
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kThreads; i++) {
+            threads.emplace_back([&fadviser, i] {
+                for (int j = 0; j < kRecords; j++) {
+                    fadviser.Record(i, j * 4 * 1024, 4 * 1024);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        // Everything still queued is accounted for on destruction
+    }
+    std::vector<int> fds;
+    for (const Advice& advice : recorder.WaitFor(kThreads)) {
+        EXPECT_EQ(0, advice.offset);
+        EXPECT_EQ(40 * kMiB, advice.len);
+        fds.push_back(advice.fd);
+    }
+    std::sort(fds.begin(), fds.end());
+    EXPECT_EQ(std::vector<int>({0, 1, 2, 3}), fds);
+}
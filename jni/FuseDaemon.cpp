@@ -20,6 +20,7 @@
 
 #include <android-base/logging.h>
 #include <android-base/properties.h>
+#include <android-base/strings.h>
 #include <android/log.h>
 #include <android/trace.h>
 #include <ctype.h>
@@ -32,6 +33,7 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <linux/fuse.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,33 +46,50 @@
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/statvfs.h>
+#include <sys/sysinfo.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <list>
-#include <map>
 #include <mutex>
-#include <queue>
-#include <regex>
+#include <sstream>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #include "MediaProviderWrapper.h"
+#include "libfuse_jni/DirectoryListingCache.h"
+#include "libfuse_jni/FAdviser.h"
+#include "libfuse_jni/FuseStats.h"
 #include "libfuse_jni/FuseUtils.h"
+#include "libfuse_jni/InvalidationQueue.h"
+#include "libfuse_jni/NegativeEntryCache.h"
 #include "libfuse_jni/ReaddirHelper.h"
 #include "libfuse_jni/RedactionInfo.h"
+#include "libfuse_jni/WorkerPool.h"
 #include "node-inl.h"
 
-using mediaprovider::fuse::DirectoryEntry;
+using mediaprovider::fuse::DirectoryEntries;
+using mediaprovider::fuse::DirectoryListingCache;
+using mediaprovider::fuse::DirectoryScanner;
 using mediaprovider::fuse::dirhandle;
+using mediaprovider::fuse::FAdviser;
+using mediaprovider::fuse::FuseStats;
 using mediaprovider::fuse::handle;
+using mediaprovider::fuse::InvalidationQueue;
+using mediaprovider::fuse::NegativeEntryCache;
 using mediaprovider::fuse::node;
+using mediaprovider::fuse::PermissionCache;
 using mediaprovider::fuse::RedactionInfo;
+using mediaprovider::fuse::RedactionInfoCache;
+using mediaprovider::fuse::WorkerPool;
 using std::list;
 using std::string;
 using std::vector;
@@ -82,6 +101,10 @@ using std::vector;
 
 #define ATRACE_NAME(name) ScopedTrace ___tracer(name)
 #define ATRACE_CALL() ATRACE_NAME(__FUNCTION__)
+// Traces a request handler and records its latency as |op| in FuseStats
+#define ATRACE_OP(op) \
+    ATRACE_CALL();    \
+    FuseStats::ScopedOp ___op_stats(FuseStats::op)
 
 class ScopedTrace {
   public:
@@ -101,153 +124,181 @@ const bool IS_OS_DEBUGABLE = android::base::GetIntProperty("ro.debuggable", 0);
 // Stolen from: android_filesystem_config.h
 #define AID_APP_START 10000
 
-constexpr size_t MAX_READ_SIZE = 128 * 1024;
+// Largest read and write requests the kernel sends us, in bytes. The kernel can't go beyond 256
+// pages per request.
+constexpr size_t MIN_IO_SIZE = 4 * 1024;
+constexpr size_t DEFAULT_MAX_IO_SIZE = 128 * 1024;
+constexpr size_t MAX_IO_SIZE = 1024 * 1024;
+constexpr const char* PROP_MAX_READ = "persist.sys.fuse.max_read";
+constexpr const char* PROP_MAX_WRITE = "persist.sys.fuse.max_write";
+// Reads of a file whose redaction ranges are recomputed while it is written are retried this many
+// times if it is written during the read, and fail after that, see do_read_watched.
+constexpr int MAX_REDACTED_READ_ATTEMPTS = 3;
+// Asynchronous requests, e.g. readahead, the kernel keeps in flight, and how many of them make it
+// throttle writers. 0 keeps the kernel defaults.
+constexpr unsigned int MAX_MAX_BACKGROUND = 1024;
+constexpr const char* PROP_MAX_BACKGROUND = "persist.sys.fuse.max_background";
+constexpr const char* PROP_CONGESTION_THRESHOLD = "persist.sys.fuse.congestion_threshold";
+// Bounds for the size of readdir() replies, which honour the size requested by the kernel up to
+// the value of PROP_MAX_READDIR_SIZE.
+constexpr size_t MIN_READDIR_SIZE = 4 * 1024;
+constexpr size_t DEFAULT_MAX_READDIR_SIZE = 128 * 1024;
+constexpr size_t MAX_READDIR_SIZE = 1024 * 1024;
+constexpr const char* PROP_MAX_READDIR_SIZE = "persist.sys.fuse.max_readdir_size";
+// Override the FAdviser policy derived from the memory of the device, all in bytes.
+constexpr const char* PROP_FADVISE_THRESHOLD = "persist.sys.fuse.fadvise_threshold";
+constexpr const char* PROP_FADVISE_TARGET = "persist.sys.fuse.fadvise_target";
+constexpr const char* PROP_FADVISE_READAHEAD = "persist.sys.fuse.fadvise_readahead";
+// Worker threads libfuse keeps around while idle. Each new worker has to attach to the JVM again
+// before its first upcall, so keeping more of them trades memory for upcall latency under bursts.
+constexpr unsigned int DEFAULT_MAX_IDLE_THREADS = 10;
+constexpr unsigned int MAX_MAX_IDLE_THREADS = 64;
+constexpr const char* PROP_MAX_IDLE_THREADS = "persist.sys.fuse.max_idle_threads";
+// Requests are received by a pool of threads that serve cheap requests themselves and hand those
+// that may end in upcalls to MediaProvider to a second pool, see SessionLoop. Disabling it falls
+// back to the multi-threaded loop of libfuse. Upcalls mostly wait for MediaProvider rather than
+// run, and libfuse never capped the threads waiting on it, so the upcall pool may grow as far as
+// MAX_MAX_THREADS by default; lowering it queues upcalls instead, e.g. to bound how many binder
+// transactions a slow MediaProvider has to take at once.
+constexpr const char* PROP_WORKER_POOL = "persist.sys.fuse.worker_pool.enable";
+constexpr unsigned int DEFAULT_MIN_THREADS = 2;
+constexpr unsigned int DEFAULT_MAX_THREADS = 32;
+constexpr unsigned int MAX_MAX_THREADS = 256;
+constexpr const char* PROP_MIN_THREADS = "persist.sys.fuse.min_threads";
+constexpr const char* PROP_MAX_THREADS = "persist.sys.fuse.max_threads";
+constexpr unsigned int DEFAULT_MIN_UPCALL_THREADS = 2;
+constexpr unsigned int DEFAULT_MAX_UPCALL_THREADS = MAX_MAX_THREADS;
+constexpr const char* PROP_MIN_UPCALL_THREADS = "persist.sys.fuse.min_upcall_threads";
+constexpr const char* PROP_MAX_UPCALL_THREADS = "persist.sys.fuse.max_upcall_threads";
+// CPUs each pool may run on, one bit per CPU, e.g. to keep upcalls off the little cores. 0 allows
+// all CPUs.
+constexpr const char* PROP_CPU_MASK = "persist.sys.fuse.cpu_mask";
+constexpr const char* PROP_UPCALL_CPU_MASK = "persist.sys.fuse.upcall_cpu_mask";
+// How long the kernel may cache that a file doesn't exist, 0 disables caching failed lookups.
+constexpr unsigned int DEFAULT_NEGATIVE_TIMEOUT_MS = 5000;
+constexpr unsigned int MAX_NEGATIVE_TIMEOUT_MS = 60000;
+constexpr const char* PROP_NEGATIVE_TIMEOUT_MS = "persist.sys.fuse.negative_timeout_ms";
+// How long the kernel may cache entries and attributes, by default until they are invalidated.
+// Paths that may change behind our back get shorter timeouts, see get_entry_timeout.
+constexpr unsigned int MAX_TIMEOUT_MS = 24 * 60 * 60 * 1000;
+constexpr const char* PROP_ENTRY_TIMEOUT_MS = "persist.sys.fuse.entry_timeout_ms";
+constexpr const char* PROP_ATTR_TIMEOUT_MS = "persist.sys.fuse.attr_timeout_ms";
+// How long the kernel may cache entries below Android/media. MediaProvider invalidates the
+// directory of a package when installd may have deleted it, this covers the rest.
+constexpr unsigned int DEFAULT_MEDIA_TIMEOUT_MS = 1000;
+constexpr const char* PROP_MEDIA_TIMEOUT_MS = "persist.sys.fuse.media_timeout_ms";
+// Whether files that need no redaction are handed to the kernel to read and write directly, if
+// both the kernel and libfuse support FUSE passthrough.
+constexpr const char* PROP_PASSTHROUGH = "persist.sys.fuse.passthrough.enable";
+// How long the listing of a directory is reused for the same uid, 0 disables reusing listings.
+// Listings are dropped when the directory changes through FUSE, this bounds how long changes on
+// the lower file system go unnoticed.
+constexpr unsigned int DEFAULT_LISTING_TIMEOUT_MS = 1000;
+constexpr unsigned int MAX_LISTING_TIMEOUT_MS = 10000;
+constexpr const char* PROP_LISTING_TIMEOUT_MS = "persist.sys.fuse.listing_timeout_ms";
+// Whether opendir() starts listing and stat'ing the directory in the background, so that it's
+// done by the time the first readdir() comes in.
+constexpr const char* PROP_OPENDIR_PREFETCH = "persist.sys.fuse.opendir_prefetch.enable";
+// Whether the redaction ranges cache is saved for the next session to load, so that a restarted
+// daemon doesn't have to ask MediaProvider about every media file again. It is saved every
+// SNAPSHOT_INTERVAL_S and when the session ends, since the process is mostly killed rather than
+// unmounted. Entries are checked against their file before being used, but permissions granted
+// while no daemon was running go unnoticed, so snapshots older than MAX_SNAPSHOT_AGE_S are
+// ignored.
+constexpr const char* PROP_WARM_START = "persist.sys.fuse.warm_start.enable";
+constexpr std::chrono::seconds SNAPSHOT_INTERVAL_S(60);
+constexpr time_t MAX_SNAPSHOT_AGE_S = 600;
 // Stolen from: UserHandle#getUserId
 constexpr int PER_USER_RANGE = 100000;
 
-// Regex copied from FileUtils.java in MediaProvider, but without media directory.
-const std::regex PATTERN_OWNED_PATH(
-    "^/storage/[^/]+/(?:[0-9]+/)?Android/(?:data|obb|sandbox)/([^/]+)(/?.*)?",
-    std::regex_constants::icase);
-
-/*
- * In order to avoid double caching with fuse, call fadvise on the file handles
- * in the underlying file system. However, if this is done on every read/write,
- * the fadvises cause a very significant slowdown in tests (specifically fio
- * seq_write). So call fadvise on the file handles with the most reads/writes
- * only after a threshold is passed.
- */
-class FAdviser {
-  public:
-    FAdviser() : thread_(MessageLoop, this), total_size_(0) {}
-
-    ~FAdviser() {
-        SendMessage(Message::quit);
-        thread_.join();
-    }
-
-    void Record(int fd, size_t size) { SendMessage(Message::record, fd, size); }
-
-    void Close(int fd) { SendMessage(Message::close, fd); }
-
-  private:
-    struct Message {
-        enum Type { record, close, quit };
-        Type type;
-        int fd;
-        size_t size;
-    };
-
-    void RecordImpl(int fd, size_t size) {
-        total_size_ += size;
-
-        // Find or create record in files_
-        // Remove record from sizes_ if it exists, adjusting size appropriately
-        auto file = files_.find(fd);
-        if (file != files_.end()) {
-            auto old_size = file->second;
-            size += old_size->first;
-            sizes_.erase(old_size);
-        } else {
-            file = files_.insert(Files::value_type(fd, sizes_.end())).first;
-        }
-
-        // Now (re) insert record in sizes_
-        auto new_size = sizes_.insert(Sizes::value_type(size, fd));
-        file->second = new_size;
-
-        if (total_size_ < threshold_) return;
-
-        LOG(INFO) << "Threshold exceeded - fadvising " << total_size_;
-        while (!sizes_.empty() && total_size_ > target_) {
-            auto size = --sizes_.end();
-            total_size_ -= size->first;
-            posix_fadvise(size->second, 0, 0, POSIX_FADV_DONTNEED);
-            files_.erase(size->second);
-            sizes_.erase(size);
-        }
-        LOG(INFO) << "Threshold now " << total_size_;
-    }
-
-    void CloseImpl(int fd) {
-        auto file = files_.find(fd);
-        if (file == files_.end()) return;
-
-        total_size_ -= file->second->first;
-        sizes_.erase(file->second);
-        files_.erase(file);
-    }
-
-    void MessageLoopImpl() {
-        while (1) {
-            Message message;
-
-            {
-                std::unique_lock<std::mutex> lock(mutex_);
-                cv_.wait(lock, [this] { return !queue_.empty(); });
-                message = queue_.front();
-                queue_.pop();
-            }
-
-            switch (message.type) {
-                case Message::record:
-                    RecordImpl(message.fd, message.size);
-                    break;
-
-                case Message::close:
-                    CloseImpl(message.fd);
-                    break;
-
-                case Message::quit:
-                    return;
-            }
-        }
-    }
-
-    static int MessageLoop(FAdviser* ptr) {
-        ptr->MessageLoopImpl();
-        return 0;
-    }
-
-    void SendMessage(Message::Type type, int fd = -1, size_t size = 0) {
-        {
-            std::unique_lock<std::mutex> lock(mutex_);
-            Message message = {type, fd, size};
-            queue_.push(message);
-        }
-        cv_.notify_one();
-    }
+// Returns the user id of this process, as it appears in paths.
+static const string& get_user_id() {
+    static const string user_id = std::to_string(getuid() / PER_USER_RANGE);
+    return user_id;
+}
+
+// What a path is, as far as the timeouts of its entry go. See classify_path, the flags of a node
+// are cached on it.
+enum PathFlags : uint32_t {
+    // Below <root>/Android/media
+    PATH_MEDIA = 1 << 0,
+    // Owned by a package, see parsePath
+    PATH_PACKAGE_OWNED = 1 << 1,
+    // Mounted over, see containsMount
+    PATH_MOUNT = 1 << 2,
+};
 
-    std::mutex mutex_;
-    std::condition_variable cv_;
-    std::queue<Message> queue_;
-    std::thread thread_;
+class SessionLoop;
 
-    typedef std::multimap<size_t, int> Sizes;
-    typedef std::map<int, Sizes::iterator> Files;
+// A single thread, started when there is something to reclaim
+static WorkerPool::Config get_reclaimer_config() {
+    WorkerPool::Config config;
+    config.min_threads = 0;
+    config.max_threads = 1;
+    return config;
+}
 
-    Files files_;
-    Sizes sizes_;
-    size_t total_size_;
+// Each prefetch takes two threads, see prefetch_directory. Enough for a couple of them, so that
+// listing a large directory doesn't hold up all others
+static WorkerPool::Config get_prefetcher_config() {
+    WorkerPool::Config config;
+    config.min_threads = 0;
+    config.max_threads = 4;
+    return config;
+}
 
-    const size_t threshold_ = 64 * 1024 * 1024;
-    const size_t target_ = 32 * 1024 * 1024;
-};
+static DirectoryListingCache::Clock::duration get_listing_timeout() {
+    return std::chrono::milliseconds(android::base::GetUintProperty<unsigned int>(
+            PROP_LISTING_TIMEOUT_MS, DEFAULT_LISTING_TIMEOUT_MS, MAX_LISTING_TIMEOUT_MS));
+}
 
 /* Single FUSE mount */
 struct fuse {
-    explicit fuse(const std::string& _path)
+    explicit fuse(const std::string& _path, const FAdviser::Policy& fadvise_policy)
         : path(_path),
-          tracker(mediaprovider::fuse::NodeTracker(&lock)),
+          media_path(GetEffectiveRootPath() + "/Android/media"),
+          tracker(IS_OS_DEBUGABLE),
           root(node::CreateRoot(_path, &lock, &tracker)),
           mp(0),
-          zero_addr(0) {}
+          zero_addr(0),
+          max_read(DEFAULT_MAX_IO_SIZE),
+          max_write(DEFAULT_MAX_IO_SIZE),
+          max_background(0),
+          congestion_threshold(0),
+          max_readdir_size(DEFAULT_MAX_READDIR_SIZE),
+          negative_timeout(0),
+          entry_timeout(std::numeric_limits<double>::max()),
+          attr_timeout(std::numeric_limits<double>::max()),
+          media_timeout(0),
+          listings(get_listing_timeout()),
+          prefetch(false),
+          snapshot_stop(false),
+          passthrough(false),
+          passthrough_handles(0),
+          passthrough_failures(0),
+          loop(nullptr),
+          fadviser(fadvise_policy),
+          invalidations([this](const InvalidationQueue::Invalidation& invalidation) {
+              NotifyInvalidation(invalidation);
+          }),
+          prefetcher(get_prefetcher_config(), "fuse_prefetch"),
+          reclaimer(get_reclaimer_config(), "fuse_reclaim") {}
 
     inline bool IsRoot(const node* node) const { return node == root; }
 
+    void NotifyInvalidation(const InvalidationQueue::Invalidation& invalidation) {
+        if (fuse_lowlevel_notify_inval_entry(se, invalidation.parent, invalidation.name.c_str(),
+                                             invalidation.name.size()) &&
+            invalidation.child) {
+            // Invalidating the dentry can fail if there's no dcache entry, however, there may
+            // still be cached attributes, so attempt to invalidate those by invalidating the inode
+            fuse_lowlevel_notify_inval_inode(se, invalidation.child, 0, 0);
+        }
+    }
+
     inline string GetEffectiveRootPath() {
         if (path.find("/storage/emulated", 0) == 0) {
-            return path + "/" + std::to_string(getuid() / PER_USER_RANGE);
+            return path + "/" + get_user_id();
         }
         return path;
     }
@@ -264,6 +315,18 @@ struct fuse {
         return node::FromInode(inode, &tracker);
     }
 
+    // Like FromInode for the inodes of a batch of forgets
+    std::vector<node::Forget> FromForgets(const struct fuse_forget_data* forgets, size_t count) {
+        std::vector<node::Forget> res;
+        res.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            // This is a narrowing conversion from an unsigned 64bit to a 32bit value, as
+            // in do_forget
+            res.push_back({FromInode(forgets[i].ino), static_cast<uint32_t>(forgets[i].nlookup)});
+        }
+        return res;
+    }
+
     inline __u64 ToInode(node* node) const {
         if (IsRoot(node)) {
             return FUSE_ROOT_ID;
@@ -272,9 +335,14 @@ struct fuse {
         return node::ToInode(node);
     }
 
-    std::recursive_mutex lock;
+    // Guards the node tree rooted at |root|. Declared before |root| since the
+    // root node is created with it.
+    mediaprovider::fuse::NodeLock lock;
     const string path;
-    // The Inode tracker associated with this FUSE instance.
+    // See PATH_MEDIA
+    const string media_path;
+    // The Inode tracker associated with this FUSE instance. On debuggable builds, it also
+    // cross-checks every inode against the set of live nodes.
     mediaprovider::fuse::NodeTracker tracker;
     node* const root;
     struct fuse_session* se;
@@ -288,13 +356,64 @@ struct fuse {
 
     /*
      * Points to a range of zeroized bytes, used by pf_read to represent redacted ranges.
-     * The memory is read only and should never be modified.
+     * The memory is read only and should never be modified. It is |max_read| bytes long.
      */
     /* const */ char* zero_addr;
 
+    // Limits negotiated with the kernel in pf_init(), see PROP_MAX_READ and friends
+    size_t max_read;
+    size_t max_write;
+    unsigned int max_background;
+    unsigned int congestion_threshold;
+
+    // Upper bound for the size of a readdir() reply
+    size_t max_readdir_size;
+
+    // Seconds the kernel may cache failed lookups for, and the lookups it was told to cache
+    double negative_timeout;
+    NegativeEntryCache negative_entries;
+
+    // Seconds the kernel may cache entries and attributes for, see get_entry_timeout
+    double entry_timeout;
+    double attr_timeout;
+    double media_timeout;
+
+    // Recent listings of directories, see PROP_LISTING_TIMEOUT_MS
+    DirectoryListingCache listings;
+    // Whether directories are listed ahead of the first readdir(), see PROP_OPENDIR_PREFETCH
+    bool prefetch;
+
+    // Where caches are saved for the next session, empty if they aren't, see PROP_WARM_START
+    string snapshot_file;
+    // Wakes the thread saving them periodically up to stop, see save_snapshots
+    std::mutex snapshot_lock;
+    std::condition_variable snapshot_cv;
+    bool snapshot_stop;
+
+    // Whether passthrough was negotiated with the kernel, and how often registering an open file
+    // for it succeeded or fell back to serving the file through the daemon
+    bool passthrough;
+    std::atomic<uint64_t> passthrough_handles;
+    std::atomic<uint64_t> passthrough_failures;
+
+    // Serves requests of the session, unless libfuse's own loop does
+    SessionLoop* loop;
+
     FAdviser fadviser;
 
     std::atomic_bool* active;
+
+    // Notifies the kernel of the dentries to invalidate, off the request path. Must be shut down
+    // before |se| is destroyed.
+    InvalidationQueue invalidations;
+
+    // Lists directories ahead of the first readdir(), see pf_opendir. The handles of the
+    // directories wait for it when they are destroyed.
+    WorkerPool prefetcher;
+
+    // Deletes the nodes released by batches of forgets, off the request path. Declared last, so
+    // that it's done before the tree and tracker of the nodes go away.
+    WorkerPool reclaimer;
 };
 
 static inline string get_name(node* n) {
@@ -317,8 +436,8 @@ static inline __u64 ptr_to_id(void* ptr) {
  * system to an app over the ContentResolver interface. This allows us
  * check with is_file_locked if any reference to that fd is still open.
  */
-static int set_file_lock(int fd, bool for_read, const std::string& path) {
-    std::string lock_str = (for_read ? "read" : "write");
+static int set_file_lock(int fd, bool for_read, std::string_view path) {
+    const char* lock_str = for_read ? "read" : "write";
 
     struct flock fl{};
     fl.l_type = for_read ? F_RDLCK : F_WRLCK;
@@ -332,6 +451,17 @@ static int set_file_lock(int fd, bool for_read, const std::string& path) {
     return res;
 }
 
+// Removes the lock set_file_lock set on |fd|.
+static void clear_file_lock(int fd) {
+    struct flock fl{};
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+
+    if (fcntl(fd, F_OFD_SETLK, &fl)) {
+        PLOG(WARNING) << "Failed to clear lock";
+    }
+}
+
 /*
  * Check if an F_RDLCK or F_WRLCK is set on fd with fcntl(2).
  *
@@ -360,62 +490,129 @@ static struct fuse* get_fuse(fuse_req_t req) {
     return reinterpret_cast<struct fuse*>(fuse_req_userdata(req));
 }
 
-static bool is_package_owned_path(const string& path, const string& fuse_path) {
-    if (path.rfind(fuse_path, 0) != 0) {
-        return false;
+// Returns the PathFlags of |path|.
+static uint32_t classify_path(struct fuse* fuse, const string& path) {
+    uint32_t flags = 0;
+    if (android::base::StartsWith(path, fuse->media_path)) {
+        flags |= PATH_MEDIA;
     }
-    return std::regex_match(path, PATTERN_OWNED_PATH);
+    if (android::base::StartsWith(path, fuse->path) &&
+        !mediaprovider::fuse::parsePath(path).package.empty()) {
+        flags |= PATH_PACKAGE_OWNED;
+    }
+    if (mediaprovider::fuse::containsMount(path, get_user_id())) {
+        flags |= PATH_MOUNT;
+    }
+    return flags;
+}
+
+// Returns the PathFlags of the path of |node|, classifying it only once.
+static uint32_t get_path_flags(struct fuse* fuse, node* node) {
+    uint32_t flags = node->GetPathFlags();
+    if (flags == node::kPathFlagsUnknown) {
+        const std::shared_ptr<const string> path = node->GetPath();
+        flags = classify_path(fuse, *path);
+        node->SetPathFlags(path, flags);
+    }
+    return flags;
 }
 
-// See fuse_lowlevel.h fuse_lowlevel_notify_inval_entry for how to call this safetly without
-// deadlocking the kernel
-static void fuse_inval(fuse_session* se, fuse_ino_t parent_ino, fuse_ino_t child_ino,
+// Queues the invalidation of the dentry |child_name| of |parent_ino| at |path|, and of the inode
+// |child_ino|. The kernel is notified from the invalidation worker, which is safe to do from
+// requests without deadlocking the kernel, see fuse_lowlevel.h fuse_lowlevel_notify_inval_entry.
+static void fuse_inval(struct fuse* fuse, fuse_ino_t parent_ino, fuse_ino_t child_ino,
                        const string& child_name, const string& path) {
-    if (mediaprovider::fuse::containsMount(path, std::to_string(getuid() / PER_USER_RANGE))) {
+    if (mediaprovider::fuse::containsMount(path, get_user_id())) {
         LOG(WARNING) << "Ignoring attempt to invalidate dentry for FUSE mounts";
         return;
     }
 
-    if (fuse_lowlevel_notify_inval_entry(se, parent_ino, child_name.c_str(), child_name.size())) {
-        // Invalidating the dentry can fail if there's no dcache entry, however, there may still
-        // be cached attributes, so attempt to invalidate those by invalidating the inode
-        fuse_lowlevel_notify_inval_inode(se, child_ino, 0, 0);
-    }
+    fuse->invalidations.Add(parent_ino, child_name, child_ino);
 }
 
-static double get_timeout(struct fuse* fuse, const string& path, bool should_inval) {
-    string media_path = fuse->GetEffectiveRootPath() + "/Android/media";
-    if (should_inval || path.find(media_path, 0) == 0 || is_package_owned_path(path, fuse->path)) {
+// Returns how long the kernel may cache the entry of a path with PathFlags |flags|.
+static double get_entry_timeout(struct fuse* fuse, uint32_t flags, bool should_inval) {
+    if (should_inval || (flags & PATH_PACKAGE_OWNED)) {
         // We set dentry timeout to 0 for the following reasons:
         // 1. Case-insensitive lookups need to invalidate other case-insensitive dentry matches
-        // 2. Installd might delete Android/media/<package> dirs when app data is cleared.
-        // This can leave a stale entry in the kernel dcache, and break subsequent creation of the
-        // dir via FUSE.
-        // 3. With app data isolation enabled, app A should not guess existence of app B from the
+        // 2. With app data isolation enabled, app A should not guess existence of app B from the
         // Android/{data,obb}/<package> paths, hence we prevent the kernel from caching that
         // information.
         return 0;
     }
-    return std::numeric_limits<double>::max();
+    if (flags & PATH_MEDIA) {
+        // Installd might delete Android/media/<package> dirs when app data is cleared. This can
+        // leave a stale entry in the kernel dcache, and break subsequent creation of the dir via
+        // FUSE until it expires or MediaProvider invalidates it.
+        return std::min(fuse->media_timeout, fuse->entry_timeout);
+    }
+    return fuse->entry_timeout;
 }
 
-static node* make_node_entry(fuse_req_t req, node* parent, const string& name, const string& path,
-                             struct fuse_entry_param* e, int* error_code) {
-    struct fuse* fuse = get_fuse(req);
-    const struct fuse_ctx* ctx = fuse_req_ctx(req);
-    node* node;
+// Returns how long the kernel may cache the attributes of a path with PathFlags |flags|.
+static double get_attr_timeout(struct fuse* fuse, uint32_t flags, bool should_inval) {
+    return should_inval || (flags & PATH_PACKAGE_OWNED) ? 0 : fuse->attr_timeout;
+}
+
+// Fills |e| with a negative entry for the missing child |name| of |parent| at |path|, so that the
+// kernel caches the failed lookup. |generation| must have been read from fuse->negative_entries
+// before the child was found missing. Returns false if the failure must not be cached.
+static bool make_negative_entry(struct fuse* fuse, fuse_ino_t parent, const char* name,
+                                const string& path, uint64_t generation,
+                                struct fuse_entry_param* e) {
+    // Paths that may change behind our back, or that must not be cached at all, are left out
+    if (fuse->negative_timeout <= 0 ||
+        (classify_path(fuse, path) & (PATH_MEDIA | PATH_PACKAGE_OWNED))) {
+        return false;
+    }
+
+    const NegativeEntryCache::Clock::time_point now = NegativeEntryCache::Clock::now();
+    const NegativeEntryCache::Clock::time_point expiry =
+            now + std::chrono::duration_cast<NegativeEntryCache::Clock::duration>(
+                          std::chrono::duration<double>(fuse->negative_timeout));
+    if (!fuse->negative_entries.Insert(parent, name, expiry, generation, now)) {
+        return false;
+    }
 
     memset(e, 0, sizeof(*e));
-    if (lstat(path.c_str(), &e->attr) < 0) {
-        *error_code = errno;
-        return NULL;
+    e->ino = 0;
+    e->entry_timeout = fuse->negative_timeout;
+    return true;
+}
+
+// Invalidates the negative entries the kernel may hold for |name| in |parent| under any case, now
+// that it exists. The kernel replaces the negative entry for |name| itself when it was created or
+// looked up through FUSE, in which case |include_name| should be false. Invalidation is queued,
+// see fuse_inval.
+static void invalidate_negative_entries(struct fuse* fuse, node* parent, std::string_view name,
+                                        bool include_name) {
+    if (fuse->negative_timeout <= 0) {
+        // Nothing was ever cached
+        return;
+    }
+    const fuse_ino_t parent_ino = fuse->ToInode(parent);
+    std::vector<string> names = fuse->negative_entries.Invalidate(parent_ino, name);
+    if (!include_name) {
+        names.erase(std::remove(names.begin(), names.end(), name), names.end());
+    }
+    for (const string& name : names) {
+        fuse->invalidations.Add(parent_ino, name);
     }
+}
+
+// Fills |e| for the child |name| of |parent| at |path|, whose attributes must already be in
+// e->attr, and returns its node with an extra reference. The node is created if necessary.
+static node* fill_node_entry(fuse_req_t req, node* parent, std::string_view name,
+                             const string& path, struct fuse_entry_param* e) {
+    struct fuse* fuse = get_fuse(req);
+    node* node;
 
     bool should_inval = false;
     node = parent->LookupChildByName(name, true /* acquire */);
     if (!node) {
         node = ::node::Create(parent, name, &fuse->lock, &fuse->tracker);
-    } else if (!mediaprovider::fuse::containsMount(path, std::to_string(getuid() / PER_USER_RANGE))) {
+        invalidate_negative_entries(fuse, parent, name, false /* include_name */);
+    } else if (!(get_path_flags(fuse, node) & PATH_MOUNT)) {
         should_inval = true;
         // Only invalidate a path if it does not contain mount.
         // Invalidate both names to ensure there's no dentry left in the kernel after the following
@@ -427,37 +624,177 @@ static node* make_node_entry(fuse_req_t req, node* parent, const string& name, c
         // invalidate node_name if different case
         // Note that we invalidate async otherwise we will deadlock the kernel
         if (name != node->GetName()) {
-            // Make copies of the node name and path so we're not attempting to acquire
-            // any node locks from the invalidation thread. Depending on timing, we may end
-            // up invalidating the wrong inode but that shouldn't result in correctness issues.
-            const fuse_ino_t parent_ino = fuse->ToInode(parent);
-            const fuse_ino_t child_ino = fuse->ToInode(node);
-            const std::string& node_name = node->GetName();
-
-            std::thread t([=]() { fuse_inval(fuse->se, parent_ino, child_ino, node_name, path); });
-            t.detach();
+            // The queue copies the node name, so that the invalidation worker doesn't acquire
+            // any node locks. Depending on timing, we may end up invalidating the wrong inode
+            // but that shouldn't result in correctness issues.
+            fuse_inval(fuse, fuse->ToInode(parent), fuse->ToInode(node), node->GetName(), path);
         }
     }
     TRACE_NODE(node, req);
 
-    // This FS is not being exported via NFS so just a fixed generation number
-    // for now. If we do need this, we need to increment the generation ID each
-    // time the fuse daemon restarts because that's what it takes for us to
-    // reuse inode numbers.
-    e->generation = 0;
+    // Inode numbers are reused once their node is deleted, so (ino, generation) is what tells
+    // nodes apart. The tracker bumps the generation of an inode number on each reuse, but only
+    // for the lifetime of the daemon, as for NFS exports it would also have to across restarts.
     e->ino = fuse->ToInode(node);
-    e->entry_timeout = get_timeout(fuse, path, should_inval);
-    e->attr_timeout = is_package_owned_path(path, fuse->path) || should_inval
-                              ? 0
-                              : std::numeric_limits<double>::max();
+    e->generation = mediaprovider::fuse::NodeTracker::GetGeneration(e->ino);
+    const uint32_t flags = get_path_flags(fuse, node);
+    e->entry_timeout = get_entry_timeout(fuse, flags, should_inval);
+    e->attr_timeout = get_attr_timeout(fuse, flags, should_inval);
 
     return node;
 }
 
+static node* make_node_entry(fuse_req_t req, node* parent, std::string_view name,
+                             const string& path, struct fuse_entry_param* e, int* error_code) {
+    memset(e, 0, sizeof(*e));
+    if (lstat(path.c_str(), &e->attr) < 0) {
+        *error_code = errno;
+        return NULL;
+    }
+    return fill_node_entry(req, parent, name, path, e);
+}
+
 static inline bool is_requesting_write(int flags) {
     return flags & (O_WRONLY | O_RDWR);
 }
 
+namespace mediaprovider {
+namespace fuse {
+// Returns whether serving the request in |fbuf| may take an upcall to MediaProvider, which may
+// take milliseconds.
+static bool may_upcall(struct fuse* fuse, const struct fuse_buf& fbuf);
+}  // namespace fuse
+}  // namespace mediaprovider
+
+/*
+ * Serves the requests of a session. Like the multi-threaded loop of libfuse, a pool of threads
+ * receives requests from the kernel and grows whenever all of them are busy. Those threads serve
+ * requests themselves unless their handler may make an upcall, see may_upcall, in which case they
+ * are handed to a separate pool, so that cheap requests never queue behind upcalls.
+ *
+ * Threads are kept around between bursts, since each thread that makes an upcall has to attach to
+ * the JVM first, and both pools can be restricted to a set of CPUs.
+ */
+class SessionLoop {
+  public:
+    struct Config {
+        unsigned int min_threads;
+        unsigned int max_threads;
+        // Threads waiting for requests beyond which threads above min_threads exit
+        unsigned int max_idle_threads;
+        uint64_t cpu_mask;
+        WorkerPool::Config upcalls;
+    };
+
+    struct Stats {
+        size_t threads;
+        size_t idle_threads;
+        uint64_t requests;
+        uint64_t upcall_requests;
+        WorkerPool::Stats upcalls;
+    };
+
+    SessionLoop(struct fuse_session* se, struct fuse* fuse, const Config& config)
+        : se_(se), fuse_(fuse), config_(config), upcalls_(config.upcalls, "fuse_upcall") {}
+
+    // Serves requests until the session ends
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (unsigned int i = 0; i < std::max(1u, config_.min_threads); i++) {
+            StartThreadLocked();
+        }
+        exit_cv_.wait(lock, [this] { return threads_ == 0; });
+    }
+
+    Stats GetStats() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return {threads_, idle_threads_, requests_, upcall_requests_, upcalls_.GetStats()};
+    }
+
+  private:
+    void StartThreadLocked() {
+        threads_++;
+        // Threads exit on their own, and Run() waits for threads_ to drop to 0
+        std::thread(&SessionLoop::ThreadLoop, this).detach();
+    }
+
+    void ThreadLoop() {
+        pthread_setname_np(pthread_self(), "fuse_worker");
+        mediaprovider::fuse::SetCurrentThreadCpus(config_.cpu_mask);
+
+        // Allocated by libfuse on the first request and reused for the following ones
+        struct fuse_buf fbuf = {};
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!fuse_session_exited(se_)) {
+            idle_threads_++;
+            lock.unlock();
+            const int res = fuse_session_receive_buf(se_, &fbuf);
+            lock.lock();
+            idle_threads_--;
+
+            if (res == -EINTR) continue;
+            if (res <= 0) {
+                if (res < 0) {
+                    LOG(ERROR) << "Failed to receive request: " << strerror(-res);
+                    fuse_session_exit(se_);
+                }
+                break;
+            }
+
+            requests_++;
+            // Keep a thread waiting for the kernel while this one is busy
+            if (idle_threads_ == 0 && threads_ < config_.max_threads) {
+                StartThreadLocked();
+            }
+            lock.unlock();
+            Serve(fbuf);
+            lock.lock();
+
+            if (idle_threads_ >= config_.max_idle_threads && threads_ > config_.min_threads) {
+                break;
+            }
+        }
+        free(fbuf.mem);
+        threads_--;
+        exit_cv_.notify_all();
+    }
+
+    void Serve(const struct fuse_buf& fbuf) {
+        // Requests left in a pipe are writes, and the pipe belongs to this thread
+        if (!(fbuf.flags & FUSE_BUF_IS_FD) && fbuf.size >= sizeof(struct fuse_in_header)) {
+            const char* data = static_cast<const char*>(fbuf.mem);
+            if (mediaprovider::fuse::may_upcall(fuse_, fbuf)) {
+                {
+                    std::lock_guard<std::mutex> guard(mutex_);
+                    upcall_requests_++;
+                }
+                // |fbuf| is reused for the next request, so the pool gets its own copy
+                upcalls_.Submit([this, request = std::vector<char>(data, data + fbuf.size)] {
+                    struct fuse_buf buf = {};
+                    buf.size = request.size();
+                    buf.mem = const_cast<char*>(request.data());
+                    fuse_session_process_buf(se_, &buf);
+                });
+                return;
+            }
+        }
+        fuse_session_process_buf(se_, &fbuf);
+    }
+
+    struct fuse_session* const se_;
+    struct fuse* const fuse_;
+    const Config config_;
+    WorkerPool upcalls_;
+
+    std::mutex mutex_;
+    std::condition_variable exit_cv_;
+    // All guarded by mutex_.
+    size_t threads_ = 0;
+    size_t idle_threads_ = 0;
+    uint64_t requests_ = 0;
+    uint64_t upcall_requests_ = 0;
+};
+
 namespace mediaprovider {
 namespace fuse {
 
@@ -475,9 +812,31 @@ static void pf_init(void* userdata, struct fuse_conn_info* conn) {
                      FUSE_CAP_ASYNC_READ | FUSE_CAP_ATOMIC_O_TRUNC | FUSE_CAP_WRITEBACK_CACHE |
                      FUSE_CAP_EXPORT_SUPPORT | FUSE_CAP_FLOCK_LOCKS);
     conn->want |= conn->capable & mask;
-    conn->max_read = MAX_READ_SIZE;
 
     struct fuse* fuse = reinterpret_cast<struct fuse*>(userdata);
+    conn->max_read = fuse->max_read;
+    // libfuse lowers this to what its request buffers can hold
+    conn->max_write = fuse->max_write;
+    if (fuse->max_background) {
+        conn->max_background = fuse->max_background;
+    }
+    if (fuse->congestion_threshold) {
+        conn->congestion_threshold = fuse->congestion_threshold;
+    }
+    if (fuse->passthrough) {
+#ifdef FUSE_CAP_PASSTHROUGH
+        if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+            conn->want |= FUSE_CAP_PASSTHROUGH;
+        } else {
+            LOG(WARNING) << "Passthrough not supported by the kernel";
+            fuse->passthrough = false;
+        }
+#else
+        LOG(WARNING) << "Passthrough not supported by libfuse";
+        fuse->passthrough = false;
+#endif
+    }
+    LOG(INFO) << "Passthrough " << (fuse->passthrough ? "enabled" : "disabled");
     fuse->active->store(true, std::memory_order_release);
 }
 
@@ -485,9 +844,39 @@ static void pf_destroy(void* userdata) {
     struct fuse* fuse = reinterpret_cast<struct fuse*>(userdata);
     LOG(INFO) << "DESTROY " << fuse->path;
 
+    if (!fuse->snapshot_file.empty() && fuse->mp->SaveRedactionInfoCache(fuse->snapshot_file)) {
+        LOG(INFO) << "Saved redaction info cache to " << fuse->snapshot_file;
+    }
     node::DeleteTree(fuse->root);
 }
 
+// Saves the caches of |fuse| every SNAPSHOT_INTERVAL_S until fuse->snapshot_stop is set, so that a
+// recent snapshot is left behind however the process goes away.
+static void save_snapshots(struct fuse* fuse) {
+    std::unique_lock<std::mutex> lock(fuse->snapshot_lock);
+    while (!fuse->snapshot_cv.wait_for(lock, SNAPSHOT_INTERVAL_S,
+                                       [fuse] { return fuse->snapshot_stop; })) {
+        lock.unlock();
+        fuse->mp->SaveRedactionInfoCache(fuse->snapshot_file);
+        lock.lock();
+    }
+}
+
+// Fills the caches of |fuse| from the snapshot its previous session saved, if any.
+static void load_snapshot(struct fuse* fuse) {
+    struct stat st;
+    if (lstat(fuse->snapshot_file.c_str(), &st)) {
+        return;
+    }
+    if (time(nullptr) - st.st_mtime > MAX_SNAPSHOT_AGE_S) {
+        LOG(INFO) << "Ignoring stale snapshot " << fuse->snapshot_file;
+        unlink(fuse->snapshot_file.c_str());
+        return;
+    }
+    const size_t loaded = fuse->mp->LoadRedactionInfoCache(fuse->snapshot_file);
+    LOG(INFO) << "Loaded " << loaded << " redaction info cache entries";
+}
+
 // Return true if the path is accessible for that uid.
 static bool is_app_accessible_path(MediaProviderWrapper* mp, const string& path, uid_t uid) {
     if (uid < AID_APP_START) {
@@ -500,15 +889,14 @@ static bool is_app_accessible_path(MediaProviderWrapper* mp, const string& path,
         return false;
     }
 
-    std::smatch match;
-    if (std::regex_match(path, match, PATTERN_OWNED_PATH)) {
-        const std::string& pkg = match[1];
+    const std::string_view pkg = mediaprovider::fuse::parsePath(path).package;
+    if (!pkg.empty()) {
         // .nomedia is not a valid package. .nomedia always exists in /Android/data directory,
         // and it's not an external file/directory of any package
         if (pkg == ".nomedia") {
             return true;
         }
-        if (!mp->IsUidForPackage(pkg, uid)) {
+        if (!mp->IsUidForPackage(std::string(pkg), uid)) {
             PLOG(WARNING) << "Invalid other package file access from " << pkg << "(: " << path;
             return false;
         }
@@ -516,7 +904,83 @@ static bool is_app_accessible_path(MediaProviderWrapper* mp, const string& path,
     return true;
 }
 
-static std::regex storage_emulated_regex("^\\/storage\\/emulated\\/([0-9]+)");
+// Returns whether is_app_accessible_path may have to ask MediaProvider about |uid| accessing the
+// file of |ino|, i.e. whether it is in the directory of a package that isn't known to be one of
+// those of |uid|.
+static bool may_check_package(struct fuse* fuse, fuse_ino_t ino, uid_t uid) {
+    if (uid < AID_APP_START) {
+        return false;
+    }
+    node* node = fuse->FromInode(ino);
+    if (!node) {
+        return false;
+    }
+    const std::shared_ptr<const string> path = node->GetPath();
+    const std::string_view pkg = mediaprovider::fuse::parsePath(*path).package;
+    return !pkg.empty() && pkg != ".nomedia" &&
+           !fuse->mp->IsUidForPackageCached(std::string(pkg), uid);
+}
+
+static bool may_upcall(struct fuse* fuse, const struct fuse_buf& fbuf) {
+    const auto* in = static_cast<const struct fuse_in_header*>(fbuf.mem);
+    const char* arg = static_cast<const char*>(fbuf.mem) + sizeof(*in);
+    const size_t arg_size = fbuf.size - sizeof(*in);
+    switch (in->opcode) {
+        case FUSE_OPEN:
+        case FUSE_CREATE:
+        case FUSE_MKNOD:
+        case FUSE_MKDIR:
+        case FUSE_UNLINK:
+        case FUSE_RMDIR:
+        case FUSE_RENAME:
+        case FUSE_RENAME2:
+        case FUSE_OPENDIR:
+        case FUSE_READDIR:
+        case FUSE_READDIRPLUS:
+            return true;
+
+        case FUSE_LOOKUP:
+        case FUSE_GETATTR:
+            // Of the parent for lookups
+            return may_check_package(fuse, in->nodeid, in->uid);
+
+        case FUSE_ACCESS: {
+            // Anything but an exists() check asks MediaProvider for permission
+            if (arg_size < sizeof(struct fuse_access_in)) return false;
+            const auto* access_in = reinterpret_cast<const struct fuse_access_in*>(arg);
+            return access_in->mask != F_OK || may_check_package(fuse, in->nodeid, in->uid);
+        }
+
+        case FUSE_SETATTR: {
+            // Without a handle, the caller is checked for write permission
+            if (arg_size < sizeof(struct fuse_setattr_in)) return false;
+            const auto* setattr_in = reinterpret_cast<const struct fuse_setattr_in*>(arg);
+            return !(setattr_in->valid & FATTR_FH) || may_check_package(fuse, in->nodeid, in->uid);
+        }
+
+        case FUSE_READ: {
+            // Redaction ranges of files being written are recomputed on read, see
+            // refresh_redaction_info
+            if (arg_size < sizeof(struct fuse_read_in)) return false;
+            const auto* read_in = reinterpret_cast<const struct fuse_read_in*>(arg);
+            const handle* h = reinterpret_cast<const handle*>(read_in->fh);
+            return h->watch && !h->watch->done.load(std::memory_order_acquire);
+        }
+
+        default:
+            return false;
+    }
+}
+
+// Returns false if |path| is below /storage/emulated/<userid> for a user other than ours.
+static bool is_user_path_allowed(const string& path) {
+    const std::string_view userid = mediaprovider::fuse::parsePath(path).emulated_userid;
+    return userid.empty() || get_user_id() == userid;
+}
+
+// Looks up the child |name| of |parent|. Returns its node and fills |e| on success. Otherwise,
+// returns nullptr and sets |error_code|, or leaves it at 0 and fills |e| with a negative entry if
+// the child doesn't exist and the kernel may cache that.
 static node* do_lookup(fuse_req_t req, fuse_ino_t parent, const char* name,
                        struct fuse_entry_param* e, int* error_code) {
     struct fuse* fuse = get_fuse(req);
@@ -525,7 +989,8 @@ static node* do_lookup(fuse_req_t req, fuse_ino_t parent, const char* name,
         *error_code = ENOENT;
         return nullptr;
     }
-    string parent_path = parent_node->BuildPath();
+    const std::shared_ptr<const string> parent_path_ptr = parent_node->GetPath();
+    const string& parent_path = *parent_path_ptr;
     // We should always allow lookups on the root, because failing them could cause
     // bind mounts to be invalidated.
     if (!fuse->IsRoot(parent_node) && !is_app_accessible_path(fuse->mp, parent_path, req->ctx.uid)) {
@@ -537,22 +1002,29 @@ static node* do_lookup(fuse_req_t req, fuse_ino_t parent, const char* name,
 
     TRACE_NODE(parent_node, req);
 
-    std::smatch match;
-    std::regex_search(child_path, match, storage_emulated_regex);
-    if (match.size() == 2 && std::to_string(getuid() / PER_USER_RANGE) != match[1].str()) {
+    if (!is_user_path_allowed(child_path)) {
         // Ensure the FuseDaemon user id matches the user id in requested path
         *error_code = EPERM;
         return nullptr;
     }
-    return make_node_entry(req, parent_node, name, child_path, e, error_code);
+
+    // Only a child missing on the lower filesystem is missing for everyone, the kernel must not
+    // cache anything that depends on the calling app.
+    const uint64_t negative_generation = fuse->negative_entries.GetGeneration(parent, name);
+    node* node = make_node_entry(req, parent_node, name, child_path, e, error_code);
+    if (!node && *error_code == ENOENT &&
+        make_negative_entry(fuse, parent, name, child_path, negative_generation, e)) {
+        *error_code = 0;
+    }
+    return node;
 }
 
 static void pf_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpLookup);
     struct fuse_entry_param e;
 
     int error_code = 0;
-    if (do_lookup(req, parent, name, &e, &error_code)) {
+    if (do_lookup(req, parent, name, &e, &error_code) || error_code == 0) {
         fuse_reply_entry(req, &e);
     } else {
         CHECK(error_code != 0);
@@ -573,7 +1045,7 @@ static void do_forget(fuse_req_t req, struct fuse* fuse, fuse_ino_t ino, uint64_
 
 static void pf_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
     // Always allow to forget so no need to check is_app_accessible_path()
-    ATRACE_CALL();
+    ATRACE_OP(kOpForget);
     node* node;
     struct fuse* fuse = get_fuse(req);
 
@@ -584,11 +1056,17 @@ static void pf_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
 static void pf_forget_multi(fuse_req_t req,
                             size_t count,
                             struct fuse_forget_data* forgets) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpForgetMulti);
     struct fuse* fuse = get_fuse(req);
 
-    for (int i = 0; i < count; i++) {
-        do_forget(req, fuse, forgets[i].ino, forgets[i].nlookup);
+    // The kernel sends these in bulk when it evicts its dentries, so the whole batch is
+    // released under a single acquisition of the tree lock, and the nodes it frees are deleted
+    // on another thread so that other requests aren't held off meanwhile.
+    std::vector<node*> released;
+    node::ReleaseBatch(fuse->FromForgets(forgets, count), &released);
+    if (!released.empty()) {
+        fuse->reclaimer.Submit(
+                [released = std::move(released)] { node::DeleteReleased(released); });
     }
     fuse_reply_none(req);
 }
@@ -596,14 +1074,15 @@ static void pf_forget_multi(fuse_req_t req,
 static void pf_getattr(fuse_req_t req,
                        fuse_ino_t ino,
                        struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpGetattr);
     struct fuse* fuse = get_fuse(req);
     node* node = fuse->FromInode(ino);
     if (!node) {
         fuse_reply_err(req, ENOENT);
         return;
     }
-    string path = node->BuildPath();
+    const std::shared_ptr<const string> path_ptr = node->GetPath();
+    const string& path = *path_ptr;
     if (!is_app_accessible_path(fuse->mp, path, req->ctx.uid)) {
         fuse_reply_err(req, ENOENT);
         return;
@@ -615,8 +1094,7 @@ static void pf_getattr(fuse_req_t req,
     if (lstat(path.c_str(), &s) < 0) {
         fuse_reply_err(req, errno);
     } else {
-        fuse_reply_attr(req, &s, is_package_owned_path(path, fuse->path) ?
-                0 : std::numeric_limits<double>::max());
+        fuse_reply_attr(req, &s, get_attr_timeout(fuse, get_path_flags(fuse, node), false));
     }
 }
 
@@ -625,7 +1103,7 @@ static void pf_setattr(fuse_req_t req,
                        struct stat* attr,
                        int to_set,
                        struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpSetattr);
     struct fuse* fuse = get_fuse(req);
     node* node = fuse->FromInode(ino);
     if (!node) {
@@ -669,6 +1147,7 @@ static void pf_setattr(fuse_req_t req,
             fuse_reply_err(req, errno);
             return;
         }
+        fuse->mp->InvalidateRedactionInfoCache(path);
     }
 
     /* Handle changing atime and mtime.  If FATTR_ATIME_and FATTR_ATIME_NOW
@@ -711,12 +1190,12 @@ static void pf_setattr(fuse_req_t req,
     }
 
     lstat(path.c_str(), attr);
-    fuse_reply_attr(req, attr, is_package_owned_path(path, fuse->path) ?
-            0 : std::numeric_limits<double>::max());
+    fuse_reply_attr(req, attr, get_attr_timeout(fuse, get_path_flags(fuse, node), false));
 }
 
 static void pf_canonical_path(fuse_req_t req, fuse_ino_t ino)
 {
+    ATRACE_OP(kOpCanonicalPath);
     struct fuse* fuse = get_fuse(req);
     node* node = fuse->FromInode(ino);
     string path = node ? node->BuildPath() : "";
@@ -734,7 +1213,7 @@ static void pf_mknod(fuse_req_t req,
                      const char* name,
                      mode_t mode,
                      dev_t rdev) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpMknod);
     struct fuse* fuse = get_fuse(req);
     node* parent_node = fuse->FromInode(parent);
     if (!parent_node) {
@@ -756,6 +1235,7 @@ static void pf_mknod(fuse_req_t req,
         fuse_reply_err(req, errno);
         return;
     }
+    fuse->listings.Invalidate(parent);
 
     int error_code = 0;
     struct fuse_entry_param e;
@@ -771,7 +1251,7 @@ static void pf_mkdir(fuse_req_t req,
                      fuse_ino_t parent,
                      const char* name,
                      mode_t mode) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpMkdir);
     struct fuse* fuse = get_fuse(req);
     node* parent_node = fuse->FromInode(parent);
     if (!parent_node) {
@@ -800,6 +1280,7 @@ static void pf_mkdir(fuse_req_t req,
         fuse_reply_err(req, errno);
         return;
     }
+    fuse->listings.Invalidate(parent);
 
     int error_code = 0;
     struct fuse_entry_param e;
@@ -812,7 +1293,7 @@ static void pf_mkdir(fuse_req_t req,
 }
 
 static void pf_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpUnlink);
     struct fuse* fuse = get_fuse(req);
     node* parent_node = fuse->FromInode(parent);
     if (!parent_node) {
@@ -835,6 +1316,7 @@ static void pf_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
         fuse_reply_err(req, status);
         return;
     }
+    fuse->listings.Invalidate(parent);
 
     node* child_node = parent_node->LookupChildByName(name, false /* acquire */);
     TRACE_NODE(child_node, req);
@@ -846,7 +1328,7 @@ static void pf_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
 }
 
 static void pf_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpRmdir);
     struct fuse* fuse = get_fuse(req);
     node* parent_node = fuse->FromInode(parent);
     if (!parent_node) {
@@ -872,6 +1354,9 @@ static void pf_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
         fuse_reply_err(req, errno);
         return;
     }
+    fuse->listings.Invalidate(parent);
+    fuse->mp->InvalidatePermissionCache(child_path);
+    fuse->mp->InvalidateRedactionInfoCache(child_path);
 
     node* child_node = parent_node->LookupChildByName(name, false /* acquire */);
     TRACE_NODE(child_node, req);
@@ -933,7 +1418,10 @@ static int do_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_i
     // TODO(b/145663158): Lookups can go out of sync if file/directory is actually moved but
     // EFAULT/EIO is reported due to JNI exception.
     if (res == 0) {
+        fuse->listings.Invalidate(parent);
+        fuse->listings.Invalidate(new_parent);
         child_node->Rename(new_name, new_parent_node);
+        invalidate_negative_entries(fuse, new_parent_node, new_name, false /* include_name */);
     }
     TRACE_NODE(child_node, req) << "new_child";
 
@@ -943,6 +1431,7 @@ static int do_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_i
 
 static void pf_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t new_parent,
                       const char* new_name, unsigned int flags) {
+    ATRACE_OP(kOpRename);
     int res = do_rename(req, parent, name, new_parent, new_name, flags);
     fuse_reply_err(req, res);
 }
@@ -955,9 +1444,29 @@ static void pf_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t new_parent,
 }
 */
 
-static handle* create_handle_for_node(struct fuse* fuse, const string& path, int fd, node* node,
-                                      const RedactionInfo* ri) {
-    std::lock_guard<std::recursive_mutex> guard(fuse->lock);
+// Registers |fd| with the kernel, so that it reads and writes the lower file directly for the open
+// file described by |fi|. Returns false if that isn't possible, in which case the open file has to
+// be served through the daemon.
+static bool do_passthrough_enable(fuse_req_t req, struct fuse_file_info* fi, int fd) {
+#ifdef FUSE_CAP_PASSTHROUGH
+    const int passthrough_fh = fuse_passthrough_enable(req, fd);
+    if (passthrough_fh <= 0) {
+        PLOG(WARNING) << "Failed to enable passthrough, falling back to reads through the daemon";
+        return false;
+    }
+    fi->passthrough_fh = passthrough_fh;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Creates a handle for |fd| opened on |node| and fills the members of |fi| that go into the open
+// reply accordingly.
+static handle* create_handle_for_node(fuse_req_t req, struct fuse* fuse, const string& path, int fd,
+                                      node* node, const RedactionInfo* ri,
+                                      struct fuse_file_info* fi,
+                                      std::unique_ptr<handle::RedactionWatch> watch = nullptr) {
     // We don't want to use the FUSE VFS cache in two cases:
     // 1. When redaction is needed because app A with EXIF access might access
     // a region that should have been redacted for app B without EXIF access, but app B on
@@ -971,15 +1480,39 @@ static handle* create_handle_for_node(struct fuse* fuse, const string& path, int
     // b. Reading from a FUSE fd with caching enabled may not see the latest writes using
     // the lower fs fd because those writes did not go through the FUSE layer and reads from
     // FUSE after that write may be served from cache
-    bool direct_io = ri->isRedactionNeeded() || is_file_locked(fd, path);
+    // 3. When the file is being written, as the ranges to redact may change with what is
+    // written, see refresh_redaction_info
+    //
+    // The lock keeps FuseDaemon::ShouldOpenWithFuse from setting a lock on the file between
+    // checking for one and adding the handle.
+    std::lock_guard<std::mutex> guard(node->OpenLock());
+    bool direct_io = ri->isRedactionNeeded() || watch || is_file_locked(fd, path);
+
+    // Anything the page cache could get wrong is just as wrong for passthrough, where the kernel
+    // serves reads and writes from the lower filesystem without ever asking us.
+    bool passthrough = false;
+    if (fuse->passthrough && !direct_io) {
+        passthrough = do_passthrough_enable(req, fi, fd);
+        if (passthrough) {
+            fuse->passthrough_handles.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            fuse->passthrough_failures.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
 
-    handle* h = new handle(fd, ri, !direct_io);
+    handle* h = new handle(fd, ri, !direct_io, passthrough, is_requesting_write(fi->flags),
+                           std::move(watch));
     node->AddHandle(h);
+    fi->fh = ptr_to_id(h);
+    // Pages cached through the daemon may be stale once another handle wrote to the file via
+    // passthrough, so they aren't kept across opens while passthrough is on.
+    fi->keep_cache = !fuse->passthrough;
+    fi->direct_io = direct_io;
     return h;
 }
 
 static void pf_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpOpen);
     struct fuse* fuse = get_fuse(req);
     node* node = fuse->FromInode(ino);
     if (!node) {
@@ -987,7 +1520,8 @@ static void pf_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
         return;
     }
     const struct fuse_ctx* ctx = fuse_req_ctx(req);
-    const string path = node->BuildPath();
+    const std::shared_ptr<const string> path_ptr = node->GetPath();
+    const string& path = *path_ptr;
     if (!is_app_accessible_path(fuse->mp, path, ctx->uid)) {
         fuse_reply_err(req, ENOENT);
         return;
@@ -1026,10 +1560,26 @@ static void pf_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
 
     // We don't redact if the caller was granted write permission for this file
     std::unique_ptr<RedactionInfo> ri;
+    std::unique_ptr<handle::RedactionWatch> watch;
     if (is_requesting_write(fi->flags)) {
         ri = std::make_unique<RedactionInfo>();
+        // The file may be about to change, so any ranges computed for it may be stale.
+        fuse->mp->InvalidateRedactionInfoCache(path);
     } else {
-        ri = fuse->mp->GetRedactionInfo(path, req->ctx.uid, req->ctx.pid);
+        // Check for writers first, so that no write is missed between computing the ranges and
+        // finding out whether they may change.
+        const bool being_written = node->HasWriteHandle();
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            const int err = errno;
+            close(fd);
+            fuse_reply_err(req, err);
+            return;
+        }
+        ri = fuse->mp->GetRedactionInfo(path, st, req->ctx.uid, req->ctx.pid);
+        if (being_written) {
+            watch = std::make_unique<handle::RedactionWatch>(req->ctx.uid, req->ctx.pid, st);
+        }
     }
 
     if (!ri) {
@@ -1038,10 +1588,7 @@ static void pf_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
         return;
     }
 
-    handle* h = create_handle_for_node(fuse, path, fd, node, ri.release());
-    fi->fh = ptr_to_id(h);
-    fi->keep_cache = 1;
-    fi->direct_io = !h->cached;
+    create_handle_for_node(req, fuse, path, fd, node, ri.release(), fi, std::move(watch));
     fuse_reply_open(req, fi);
 }
 
@@ -1085,59 +1632,66 @@ static void create_file_fuse_buf(size_t size, off_t pos, int fd, fuse_buf* buf)
     buf->mem = nullptr;
 }
 
-static void do_read_with_redaction(fuse_req_t req, size_t size, off_t off, fuse_file_info* fi) {
+// Returns a bufvec with room for at least |count| buffers. The bufvec is owned by the calling
+// thread and reused across calls, so the redacted read path doesn't allocate once it's warm.
+static fuse_bufvec* get_scratch_bufvec(size_t count) {
+    thread_local std::vector<uint8_t> scratch;
+    const size_t bytes = sizeof(fuse_bufvec) + (count - 1) * sizeof(fuse_buf);
+    if (scratch.size() < bytes) {
+        scratch.resize(bytes);
+    }
+    return reinterpret_cast<fuse_bufvec*>(scratch.data());
+}
+
+static void do_read_with_redaction(fuse_req_t req, size_t size, off_t off, fuse_file_info* fi,
+                                   const RedactionInfo& ri) {
     handle* h = reinterpret_cast<handle*>(fi->fh);
-    auto overlapping_rr = h->ri->getOverlappingRedactionRanges(size, off);
+    const mediaprovider::fuse::RedactionRangeSpan overlapping_rr =
+            ri.getOverlappingRedactionRanges(size, off);
 
-    if (overlapping_rr->size() <= 0) {
+    if (overlapping_rr.empty()) {
         // no relevant redaction ranges for this request
         do_read(req, size, off, fi);
         return;
     }
     // the number of buffers we need, if the read doesn't start or end with
     //  a redaction range.
-    int num_bufs = overlapping_rr->size() * 2 + 1;
-    if (overlapping_rr->front().first <= off) {
+    int num_bufs = overlapping_rr.size() * 2 + 1;
+    if (overlapping_rr.front().first <= off) {
         // the beginning of the read request is redacted
         num_bufs--;
     }
-    if (overlapping_rr->back().second >= off + size) {
+    if (overlapping_rr.back().second >= off + size) {
         // the end of the read request is redacted
         num_bufs--;
     }
-    auto bufvec_ptr = std::unique_ptr<fuse_bufvec, decltype(free)*>{
-            reinterpret_cast<fuse_bufvec*>(
-                    malloc(sizeof(fuse_bufvec) + (num_bufs - 1) * sizeof(fuse_buf))),
-            free};
-    fuse_bufvec& bufvec = *bufvec_ptr;
+    fuse_bufvec& bufvec = *get_scratch_bufvec(num_bufs);
 
     // initialize bufvec
     bufvec.count = num_bufs;
     bufvec.idx = 0;
     bufvec.off = 0;
 
-    int rr_idx = 0;
+    size_t rr_idx = 0;
     off_t start = off;
-    // Add a dummy redaction range to make sure we don't go out of vector
-    // limits when computing the end of the last non-redacted range.
-    // This ranges is invalid because its starting point is larger than it's ending point.
-    overlapping_rr->push_back(RedactionRange(LLONG_MAX, LLONG_MAX - 1));
-
     for (int i = 0; i < num_bufs; ++i) {
         off_t end;
-        if (range_contains(overlapping_rr->at(rr_idx), start)) {
+        if (rr_idx < overlapping_rr.size() && range_contains(overlapping_rr[rr_idx], start)) {
             // Handle a redacted range
             // end should be the end of the redacted range, but can't be out of
             // the read request bounds
-            end = std::min(static_cast<off_t>(off + size - 1), overlapping_rr->at(rr_idx).second);
+            end = std::min(static_cast<off_t>(off + size - 1), overlapping_rr[rr_idx].second);
             create_mem_fuse_buf(/*size*/ end - start + 1, &(bufvec.buf[i]), get_fuse(req));
+            FuseStats::Add(FuseStats::kBytesRedacted, end - start + 1);
             ++rr_idx;
         } else {
             // Handle a non-redacted range
             // end should be right before the next redaction range starts or
             // the end of the read request
-            end = std::min(static_cast<off_t>(off + size - 1),
-                    overlapping_rr->at(rr_idx).first - 1);
+            end = static_cast<off_t>(off + size - 1);
+            if (rr_idx < overlapping_rr.size()) {
+                end = std::min(end, overlapping_rr[rr_idx].first - 1);
+            }
             create_file_fuse_buf(/*size*/ end - start + 1, start, h->fd, &(bufvec.buf[i]));
         }
         start = end + 1;
@@ -1146,16 +1700,103 @@ static void do_read_with_redaction(fuse_req_t req, size_t size, off_t off, fuse_
     fuse_reply_data(req, &bufvec, static_cast<fuse_buf_copy_flags>(0));
 }
 
+// Returns the redaction ranges of |h|, which has a watch, for the file |ino| as it is now, and
+// fills |version| with the size and mtime of the version of the file they were computed for.
+// Handles opened while the file was being written have their ranges recomputed whenever the file
+// changed since they were computed; that is, at the first read after each batch of writes, until
+// the last writer is gone.
+static std::shared_ptr<const RedactionInfo> refresh_redaction_info(struct fuse* fuse,
+                                                                   fuse_ino_t ino, handle* h,
+                                                                   struct stat* version) {
+    handle::RedactionWatch* watch = h->watch.get();
+    std::lock_guard<std::mutex> guard(watch->lock);
+    node* node = fuse->FromInode(ino);
+    // As in pf_open, writers are checked for before the version of the file.
+    const bool being_written = node->HasWriteHandle();
+    struct stat st;
+    bool current = false;
+    if (fstat(h->fd, &st) < 0) {
+        PLOG(WARNING) << "Failed to stat file to refresh redaction ranges";
+    } else if (watch->IsCurrentLocked(st)) {
+        current = true;
+    } else {
+        std::unique_ptr<RedactionInfo> ri =
+                fuse->mp->GetRedactionInfo(*node->GetPath(), st, watch->uid, watch->pid);
+        // If that fails, the ranges we had are kept and the read is retried, see do_read_watched
+        if (ri) {
+            h->SetRedactionInfo(std::move(ri));
+            watch->size = st.st_size;
+            watch->mtime = st.st_mtim;
+            current = true;
+        }
+    }
+    if (current && !being_written) {
+        // The ranges are up to date with the last write through FUSE, like those of handles
+        // opened afterwards.
+        watch->done.store(true, std::memory_order_release);
+    }
+    version->st_size = watch->size;
+    version->st_mtim = watch->mtime;
+    return h->LoadRedactionInfo();
+}
+
+// Reads through |h| while its redaction ranges may still change. The file may be written between
+// computing the ranges and reading it, so the read is only replied once the file turns out to
+// still be the version the ranges were computed for after reading it.
+static void do_read_watched(fuse_req_t req, size_t size, off_t off, fuse_ino_t ino, handle* h) {
+    struct fuse* fuse = get_fuse(req);
+    thread_local std::vector<char> buf;
+    if (buf.size() < size) buf.resize(size);
+
+    for (int attempt = 0; attempt < MAX_REDACTED_READ_ATTEMPTS; attempt++) {
+        struct stat version;
+        const std::shared_ptr<const RedactionInfo> ri =
+                refresh_redaction_info(fuse, ino, h, &version);
+        const ssize_t res = pread(h->fd, buf.data(), size, off);
+        if (res < 0) {
+            fuse_reply_err(req, errno);
+            return;
+        }
+        struct stat st;
+        if (fstat(h->fd, &st) < 0) {
+            fuse_reply_err(req, errno);
+            return;
+        }
+        if (st.st_size != version.st_size || st.st_mtim.tv_sec != version.st_mtim.tv_sec ||
+            st.st_mtim.tv_nsec != version.st_mtim.tv_nsec) {
+            // Written meanwhile, what was read may not be covered by the ranges
+            continue;
+        }
+
+        for (const RedactionRange& rr : ri->getOverlappingRedactionRanges(res, off)) {
+            const off_t begin = std::max<off_t>(rr.first, off);
+            const off_t end = std::min<off_t>(rr.second, off + res - 1);
+            memset(buf.data() + (begin - off), 0, end - begin + 1);
+            FuseStats::Add(FuseStats::kBytesRedacted, end - begin + 1);
+        }
+        fuse_reply_buf(req, buf.data(), res);
+        return;
+    }
+    LOG(WARNING) << "File kept changing while reading it for redaction";
+    fuse_reply_err(req, EIO);
+}
+
 static void pf_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                     struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpRead);
     handle* h = reinterpret_cast<handle*>(fi->fh);
     struct fuse* fuse = get_fuse(req);
 
-    fuse->fadviser.Record(h->fd, size);
+    fuse->fadviser.Record(h->fd, off, size);
+    FuseStats::Add(FuseStats::kBytesRead, size);
 
-    if (h->ri->isRedactionNeeded()) {
-        do_read_with_redaction(req, size, off, fi);
+    if (h->watch && !h->watch->done.load(std::memory_order_acquire)) {
+        do_read_watched(req, size, off, ino, h);
+        return;
+    }
+    const RedactionInfo& ri = h->GetRedactionInfo();
+    if (ri.isRedactionNeeded()) {
+        do_read_with_redaction(req, size, off, fi, ri);
     } else {
         do_read(req, size, off, fi);
     }
@@ -1174,7 +1815,7 @@ static void pf_write_buf(fuse_req_t req,
                          struct fuse_bufvec* bufv,
                          off_t off,
                          struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpWrite);
     handle* h = reinterpret_cast<handle*>(fi->fh);
     struct fuse_bufvec buf = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
     ssize_t size;
@@ -1184,13 +1825,16 @@ static void pf_write_buf(fuse_req_t req,
     buf.buf[0].pos = off;
     buf.buf[0].flags =
             (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
-    size = fuse_buf_copy(&buf, bufv, (enum fuse_buf_copy_flags) 0);
+    // When the data was spliced from the kernel, move its pages into the lower file rather than
+    // copying them, where the pipe allows it.
+    size = fuse_buf_copy(&buf, bufv, FUSE_BUF_SPLICE_MOVE);
 
     if (size < 0)
         fuse_reply_err(req, -size);
     else {
         fuse_reply_write(req, size);
-        fuse->fadviser.Record(h->fd, size);
+        fuse->fadviser.Record(h->fd, off, size);
+        FuseStats::Add(FuseStats::kBytesWritten, size);
     }
 }
 // Haven't tested this one. Not sure what calls it.
@@ -1226,7 +1870,7 @@ static void pf_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
 static void pf_flush(fuse_req_t req,
                      fuse_ino_t ino,
                      struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpFlush);
     struct fuse* fuse = get_fuse(req);
     TRACE_NODE(nullptr, req) << "noop";
     fuse_reply_err(req, 0);
@@ -1235,7 +1879,7 @@ static void pf_flush(fuse_req_t req,
 static void pf_release(fuse_req_t req,
                        fuse_ino_t ino,
                        struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpRelease);
     struct fuse* fuse = get_fuse(req);
 
     node* node = fuse->FromInode(ino);
@@ -1244,6 +1888,11 @@ static void pf_release(fuse_req_t req,
 
     fuse->fadviser.Close(h->fd);
     if (node) {
+        if (is_requesting_write(fi->flags)) {
+            // Readers that opened the file while it was being written may have had ranges cached
+            // for a version that is gone now.
+            fuse->mp->InvalidateRedactionInfoCache(*node->GetPath());
+        }
         node->DestroyHandle(h);
     }
 
@@ -1261,7 +1910,7 @@ static void pf_fsync(fuse_req_t req,
                      fuse_ino_t ino,
                      int datasync,
                      struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpFsync);
     handle* h = reinterpret_cast<handle*>(fi->fh);
     int err = do_sync_common(h->fd, datasync);
 
@@ -1272,16 +1921,137 @@ static void pf_fsyncdir(fuse_req_t req,
                         fuse_ino_t ino,
                         int datasync,
                         struct fuse_file_info* fi) {
+    ATRACE_OP(kOpFsyncdir);
     dirhandle* h = reinterpret_cast<dirhandle*>(fi->fh);
     int err = do_sync_common(dirfd(h->d), datasync);
 
     fuse_reply_err(req, err);
 }
 
+// Returns the end of the entries of |h| from |begin| on whose readdirplus() entries fit in |size|
+// bytes.
+static size_t get_reply_window_end(const dirhandle* h, size_t begin, size_t size) {
+    size_t end = begin;
+    for (size_t used = 0; end < h->de.size(); end++) {
+        used += FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + h->de.name_length(end));
+        if (used > size) break;
+    }
+    return end;
+}
+
+// Attributes of entries stat'ed ahead of the listing they belong to, by name.
+typedef std::unordered_map<string, dirhandle::entry_attr> entry_attrs_by_name;
+
+// Stats the entries of |h| up to |end| that weren't yet, relative to its directory, so that
+// readdirplus() doesn't need to resolve the full path of each child. Entries are stat'ed one reply
+// at a time, so that the first reply doesn't wait for the whole directory, and attributes are
+// fresh when they are replied. Entries found in |known| are taken from there instead.
+static void stat_directory_entries(dirhandle* h, size_t end,
+                                   const entry_attrs_by_name* known = nullptr) {
+    ATRACE_CALL();
+    const int dir_fd = dirfd(h->d);
+    const size_t first = h->attrs.size();
+    end = std::min(end, h->de.size());
+    if (end <= first) return;
+    h->attrs.resize(end);
+    for (size_t i = first; i < end; i++) {
+        dirhandle::entry_attr& entry = h->attrs[i];
+        if (known) {
+            const auto it = known->find(string(h->de.name(i), h->de.name_length(i)));
+            if (it != known->end()) {
+                entry = it->second;
+                continue;
+            }
+        }
+        entry.error = 0;
+        if (fstatat(dir_fd, h->de.name(i), &entry.attr, AT_SYMLINK_NOFOLLOW) < 0) {
+            entry.error = errno;
+        }
+    }
+}
+
+// Stats the first |max_entries| entries of the directory of |h| in the order the lower file system
+// lists them, into |attrs|. Reads its own fd of the directory, so that it can run while 'd' is
+// being listed.
+static void stat_lower_fs_entries(const dirhandle* h, size_t max_entries,
+                                  entry_attrs_by_name* attrs) {
+    ATRACE_CALL();
+    const int dir_fd = dirfd(h->d);
+    const int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    DirectoryEntries de;
+    DirectoryScanner scanner(fd);
+    while (de.size() < max_entries && scanner.ScanNext(nullptr /* filter */, &de)) {
+    }
+    const size_t end = std::min(de.size(), max_entries);
+    attrs->reserve(end);
+    for (size_t i = 0; i < end; i++) {
+        dirhandle::entry_attr entry;
+        entry.error = 0;
+        if (fstatat(dir_fd, de.name(i), &entry.attr, AT_SYMLINK_NOFOLLOW) < 0) {
+            entry.error = errno;
+        }
+        attrs->emplace(string(de.name(i), de.name_length(i)), entry);
+    }
+    close(fd);
+}
+
+// Fills the entries of |h| with the listing of directory |ino| at |path| for |uid|. The listing
+// is reused if the directory was listed for |uid| recently, see DirectoryListingCache.
+static void list_directory(struct fuse* fuse, fuse_ino_t ino, const string& path, uid_t uid,
+                           dirhandle* h) {
+    ATRACE_CALL();
+    const std::shared_ptr<const DirectoryEntries> cached = fuse->listings.Lookup(ino, uid);
+    if (cached) {
+        h->de = *cached;
+        return;
+    }
+    const uint64_t epoch = fuse->listings.GetEpoch();
+    h->de = fuse->mp->GetDirectoryEntries(uid, path, h->d);
+    fuse->listings.Insert(ino, uid, h->de, epoch);
+}
+
+// Lists the directory of |h| on the prefetcher and stats what fits in the first reply, for the
+// first readdirplus() to pick up. The listing mostly waits for MediaProvider, so the lower file
+// system entries are stat'ed at the same time, on another thread of the prefetcher. Whichever of
+// the two finishes last stats the listed entries the other one didn't.
+static void prefetch_directory(struct fuse* fuse, fuse_ino_t ino, const string& path, uid_t uid,
+                               dirhandle* h) {
+    struct prefetch_state {
+        std::atomic<int> pending{2};
+        entry_attrs_by_name lower_fs_attrs;
+        std::promise<void> done;
+    };
+    auto state = std::make_shared<prefetch_state>();
+    h->prefetch = state->done.get_future();
+    h->prefetch_uid = uid;
+
+    auto finish = [fuse, h, state] {
+        if (--state->pending) return;
+        if (!h->de.error()) {
+            stat_directory_entries(h, get_reply_window_end(h, 0, fuse->max_readdir_size),
+                                   &state->lower_fs_attrs);
+        }
+        state->done.set_value();
+    };
+    fuse->prefetcher.Submit([fuse, ino, path, uid, h, finish] {
+        list_directory(fuse, ino, path, uid, h);
+        finish();
+    });
+    // No more entries than this fit in the first reply
+    const size_t max_entries =
+            fuse->max_readdir_size / FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + 1);
+    fuse->prefetcher.Submit([h, state, max_entries, finish] {
+        stat_lower_fs_entries(h, max_entries, &state->lower_fs_attrs);
+        finish();
+    });
+}
+
 static void pf_opendir(fuse_req_t req,
                        fuse_ino_t ino,
                        struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpOpendir);
     struct fuse* fuse = get_fuse(req);
     node* node = fuse->FromInode(ino);
     if (!node) {
@@ -1289,7 +2059,8 @@ static void pf_opendir(fuse_req_t req,
         return;
     }
     const struct fuse_ctx* ctx = fuse_req_ctx(req);
-    const string path = node->BuildPath();
+    const std::shared_ptr<const string> path_ptr = node->GetPath();
+    const string& path = *path_ptr;
     if (!is_app_accessible_path(fuse->mp, path, ctx->uid)) {
         fuse_reply_err(req, ENOENT);
         return;
@@ -1310,13 +2081,37 @@ static void pf_opendir(fuse_req_t req,
     }
 
     dirhandle* h = new dirhandle(dir);
+    if (fuse->prefetch) {
+        prefetch_directory(fuse, ino, path, ctx->uid, h);
+    }
     node->AddDirHandle(h);
 
     fi->fh = ptr_to_id(h);
     fuse_reply_open(req, fi);
 }
 
-#define READDIR_BUF 8192LU
+// Returns a buffer of at least |size| bytes to build readdir() replies in. The buffer is owned by
+// the calling thread and reused across calls, so it only grows to the largest reply it was used
+// for.
+static char* get_readdir_buffer(size_t size) {
+    thread_local std::vector<char> buf;
+    if (buf.size() < size) {
+        buf.resize(size);
+    }
+    return buf.data();
+}
+
+// Reads more of the directory of |h| if it is streamed from the lower file system, until there are
+// entries from h->next_off on or it was read in full. Returns whether there are entries from
+// h->next_off on. A scan that fails leaves no entries, and the error in h->de.
+static bool scan_directory_entries(dirhandle* h) {
+    while (h->scanner && h->next_off >= static_cast<off_t>(h->de.size())) {
+        if (!h->scanner->ScanNext(nullptr /* filter */, &h->de)) {
+            h->scanner.reset();
+        }
+    }
+    return h->next_off < static_cast<off_t>(h->de.size());
+}
 
 static void do_readdir_common(fuse_req_t req,
                               fuse_ino_t ino,
@@ -1326,10 +2121,9 @@ static void do_readdir_common(fuse_req_t req,
                               bool plus) {
     struct fuse* fuse = get_fuse(req);
     dirhandle* h = reinterpret_cast<dirhandle*>(fi->fh);
-    size_t len = std::min<size_t>(size, READDIR_BUF);
-    char buf[READDIR_BUF];
+    size_t len = std::min<size_t>(size, fuse->max_readdir_size);
+    char* buf = get_readdir_buffer(len);
     size_t used = 0;
-    std::shared_ptr<DirectoryEntry> de;
 
     struct fuse_entry_param e;
     size_t entry_size = 0;
@@ -1339,7 +2133,8 @@ static void do_readdir_common(fuse_req_t req,
         fuse_reply_err(req, ENOENT);
         return;
     }
-    const string path = node->BuildPath();
+    const std::shared_ptr<const string> path_ptr = node->GetPath();
+    const string& path = *path_ptr;
     if (!is_app_accessible_path(fuse->mp, path, req->ctx.uid)) {
         fuse_reply_err(req, ENOENT);
         return;
@@ -1350,8 +2145,24 @@ static void do_readdir_common(fuse_req_t req,
     // directory handle. h->next_off = 0 indicates that current readdir() call
     // is first readdir() call for the directory handle, Avoid multiple JNI calls
     // for single directory handle.
-    if (h->next_off == 0) {
-        h->de = fuse->mp->GetDirectoryEntries(req->ctx.uid, path, h->d);
+    bool listed = false;
+    if (h->prefetch.valid()) {
+        // Listed by pf_opendir, for the uid that opened the handle
+        h->prefetch.get();
+        listed = h->prefetch_uid == req->ctx.uid;
+    }
+    if (h->next_off == 0 && !listed) {
+        h->attrs.clear();
+        if (fuse->mp->IsListingFromLowerFs(req->ctx.uid)) {
+            // Streamed, so that the first reply doesn't wait for the whole directory to be read.
+            // The handle may be listed again after a seek back to its start.
+            h->de.Clear();
+            rewinddir(h->d);
+            h->scanner = std::make_unique<DirectoryScanner>(dirfd(h->d));
+        } else {
+            h->scanner.reset();
+            list_directory(fuse, ino, path, req->ctx.uid, h);
+        }
     }
     // If the last entry in the previous readdir() call was rejected due to
     // buffer capacity constraints, update directory offset to start from
@@ -1359,25 +2170,47 @@ static void do_readdir_common(fuse_req_t req,
     // a seekdir() on the given directory handle.
     if (off != h->next_off) {
         h->next_off = off;
+        // Entries seeked back to are stat'ed again
+        h->attrs.resize(std::min<size_t>(h->attrs.size(), off));
     }
-    const int num_directory_entries = h->de.size();
-    // Check for errors. Any error/exception occurred while obtaining directory
-    // entries will be indicated by marking first directory entry name as empty
-    // string. In the erroneous case corresponding d_type will hold error number.
-    if (num_directory_entries && h->de[0]->d_name.empty()) {
-        fuse_reply_err(req, h->de[0]->d_type);
+    scan_directory_entries(h);
+    // Check for errors occurred while obtaining directory entries
+    if (h->de.error()) {
+        fuse_reply_err(req, h->de.error());
         return;
     }
 
-    while (h->next_off < num_directory_entries) {
-        de = h->de[h->next_off];
-        entry_size = 0;
+    // Reused across entries so we don't allocate a path for each of them
+    string child_path;
+    while (h->next_off < static_cast<off_t>(h->de.size()) || scan_directory_entries(h)) {
+        const char* d_name = h->de.name(h->next_off);
+        // Check whether the entry fits before looking it up. Otherwise we'd have to forget the
+        // node again, because the kernel doesn't track lookups for entries it never sees.
+        entry_size = plus ? fuse_add_direntry_plus(req, nullptr, 0, d_name, nullptr, 0)
+                          : fuse_add_direntry(req, nullptr, 0, d_name, nullptr, 0);
+        if (used + entry_size > len) {
+            break;
+        }
+        if (plus && h->next_off >= static_cast<off_t>(h->attrs.size())) {
+            stat_directory_entries(h, get_reply_window_end(h, h->next_off, len - used));
+        }
         h->next_off++;
         if (plus) {
-            int error_code = 0;
-            if (do_lookup(req, ino, de->d_name.c_str(), &e, &error_code)) {
-                entry_size = fuse_add_direntry_plus(req, buf + used, len - used, de->d_name.c_str(),
-                                                    &e, h->next_off);
+            // This is equivalent to do_lookup() on each entry, except that the checks on the
+            // parent were done above and that the entry was already stat'ed.
+            const std::string_view child_name(d_name, h->de.name_length(h->next_off - 1));
+            child_path.assign(path).append("/").append(child_name);
+            const dirhandle::entry_attr& entry = h->attrs[h->next_off - 1];
+            int error_code = entry.error;
+            if (!is_user_path_allowed(child_path)) {
+                error_code = EPERM;
+            }
+            if (error_code == 0) {
+                memset(&e, 0, sizeof(e));
+                e.attr = entry.attr;
+                fill_node_entry(req, node, child_name, child_path, &e);
+                fuse_add_direntry_plus(req, buf + used, len - used, d_name, &e,
+                                       h->next_off);
             } else {
                 // Ignore lookup errors on
                 // 1. non-existing files returned from MediaProvider database.
@@ -1389,32 +2222,25 @@ static void do_readdir_common(fuse_req_t req,
         } else {
             // This should never happen because we have readdir_plus enabled without adaptive
             // readdir_plus, FUSE_CAP_READDIRPLUS_AUTO
-            LOG(WARNING) << "Handling plain readdir for " << de->d_name << ". Invalid d_ino";
+            LOG(WARNING) << "Handling plain readdir for " << d_name << ". Invalid d_ino";
             e.attr.st_ino = FUSE_UNKNOWN_INO;
-            e.attr.st_mode = de->d_type << 12;
-            entry_size = fuse_add_direntry(req, buf + used, len - used, de->d_name.c_str(), &e.attr,
-                                           h->next_off);
-        }
-        // If buffer in fuse_add_direntry[_plus] is not large enough then
-        // the entry is not added to buffer but the size of the entry is still
-        // returned. Check available buffer size + returned entry size is less
-        // than actual buffer size to confirm entry is added to buffer.
-        if (used + entry_size > len) {
-            // When an entry is rejected, lookup called by readdir_plus will not be tracked by
-            // kernel. Call forget on the rejected node to decrement the reference count.
-            if (plus) {
-                do_forget(req, fuse, e.ino, 1);
-            }
-            break;
+            e.attr.st_mode = h->de.type(h->next_off - 1) << 12;
+            fuse_add_direntry(req, buf + used, len - used, d_name, &e.attr,
+                              h->next_off);
         }
         used += entry_size;
     }
+    if (!used && h->de.error()) {
+        // Streaming the directory failed, what was read before was already replied
+        fuse_reply_err(req, h->de.error());
+        return;
+    }
     fuse_reply_buf(req, buf, used);
 }
 
 static void pf_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                        struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpReaddir);
     do_readdir_common(req, ino, size, off, fi, false);
 }
 
@@ -1423,14 +2249,14 @@ static void pf_readdirplus(fuse_req_t req,
                            size_t size,
                            off_t off,
                            struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpReaddirplus);
     do_readdir_common(req, ino, size, off, fi, true);
 }
 
 static void pf_releasedir(fuse_req_t req,
                           fuse_ino_t ino,
                           struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpReleasedir);
     struct fuse* fuse = get_fuse(req);
 
     node* node = fuse->FromInode(ino);
@@ -1445,7 +2271,7 @@ static void pf_releasedir(fuse_req_t req,
 }
 
 static void pf_statfs(fuse_req_t req, fuse_ino_t ino) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpStatfs);
     struct statvfs st;
     struct fuse* fuse = get_fuse(req);
 
@@ -1478,7 +2304,7 @@ static void pf_removexattr(fuse_req_t req, fuse_ino_t ino, const char* name)
 }*/
 
 static void pf_access(fuse_req_t req, fuse_ino_t ino, int mask) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpAccess);
     struct fuse* fuse = get_fuse(req);
 
     node* node = fuse->FromInode(ino);
@@ -1486,7 +2312,8 @@ static void pf_access(fuse_req_t req, fuse_ino_t ino, int mask) {
         fuse_reply_err(req, ENOENT);
         return;
     }
-    const string path = node->BuildPath();
+    const std::shared_ptr<const string> path_ptr = node->GetPath();
+    const string& path = *path_ptr;
     if (path != "/storage/emulated" && !is_app_accessible_path(fuse->mp, path, req->ctx.uid)) {
         fuse_reply_err(req, ENOENT);
         return;
@@ -1537,7 +2364,7 @@ static void pf_create(fuse_req_t req,
                       const char* name,
                       mode_t mode,
                       struct fuse_file_info* fi) {
-    ATRACE_CALL();
+    ATRACE_OP(kOpCreate);
     struct fuse* fuse = get_fuse(req);
     node* parent_node = fuse->FromInode(parent);
     if (!parent_node) {
@@ -1582,6 +2409,7 @@ static void pf_create(fuse_req_t req,
         fuse_reply_err(req, error_code);
         return;
     }
+    fuse->listings.Invalidate(parent);
 
     int error_code = 0;
     struct fuse_entry_param e;
@@ -1596,14 +2424,9 @@ static void pf_create(fuse_req_t req,
     // Let MediaProvider know we've created a new file
     fuse->mp->OnFileCreated(child_path);
 
-    // TODO(b/147274248): Assume there will be no EXIF to redact.
-    // This prevents crashing during reads but can be a security hole if a malicious app opens an fd
-    // to the file before all the EXIF content is written. We could special case reads before the
-    // first close after a file has just been created.
-    handle* h = create_handle_for_node(fuse, child_path, fd, node, new RedactionInfo());
-    fi->fh = ptr_to_id(h);
-    fi->keep_cache = 1;
-    fi->direct_io = !h->cached;
+    // The creator is granted write permission, so its reads aren't redacted. Readers that open the
+    // file until it is closed have their ranges recomputed as it gets written, see pf_open.
+    create_handle_for_node(req, fuse, child_path, fd, node, new RedactionInfo(), fi);
     fuse_reply_create(req, &e, fi);
 }
 /*
@@ -1691,7 +2514,7 @@ static struct fuse_lowlevel_ops ops{
 
 static struct fuse_loop_config config = {
         .clone_fd = 1,
-        .max_idle_threads = 10,
+        .max_idle_threads = DEFAULT_MAX_IDLE_THREADS,
 };
 
 static std::unordered_map<enum fuse_log_level, enum android_LogPriority> fuse_to_android_loglevel({
@@ -1709,19 +2532,38 @@ static void fuse_logger(enum fuse_log_level level, const char* fmt, va_list ap)
     __android_log_vprint(fuse_to_android_loglevel.at(level), LIBFUSE_LOG_TAG, fmt, ap);
 }
 
-bool FuseDaemon::ShouldOpenWithFuse(int fd, bool for_read, const std::string& path) {
+bool FuseDaemon::ShouldOpenWithFuse(int fd, bool for_read, std::string_view path) {
     bool use_fuse = false;
 
     if (active.load(std::memory_order_acquire)) {
-        std::lock_guard<std::recursive_mutex> guard(fuse->lock);
-        const node* node = node::LookupAbsolutePath(fuse->root, path);
+        node* node = node::LookupAbsolutePath(fuse->root, path, true /* acquire */);
         if (node && node->HasCachedHandle()) {
+            // Handles are only added under the open lock, but a cached handle is reason enough
             use_fuse = true;
-        } else {
+        } else if (node) {
+            // Holding the open lock, no cached handle is added until the lock is set.
             // If we are unable to set a lock, we should use fuse since we can't track
             // when all fd references (including dups) are closed. This can happen when
             // we try to set a write lock twice on the same file
+            std::lock_guard<std::mutex> guard(node->OpenLock());
+            use_fuse = node->HasCachedHandle() || set_file_lock(fd, for_read, path);
+        } else {
             use_fuse = set_file_lock(fd, for_read, path);
+            // Without a node there's no lock to hold, but an open needs a lookup first. Once
+            // the lock is set, any open after this sees it, and one that got ahead of it is
+            // waited for and seen here.
+            node = use_fuse ? nullptr
+                            : node::LookupAbsolutePath(fuse->root, path, true /* acquire */);
+            if (node) {
+                std::lock_guard<std::mutex> guard(node->OpenLock());
+                if (node->HasCachedHandle()) {
+                    clear_file_lock(fd);
+                    use_fuse = true;
+                }
+            }
+        }
+        if (node) {
+            node->Release(1);
         }
     } else {
         LOG(WARNING) << "FUSE daemon is inactive. Cannot open file with FUSE";
@@ -1732,28 +2574,102 @@ bool FuseDaemon::ShouldOpenWithFuse(int fd, bool for_read, const std::string& pa
 
 void FuseDaemon::InvalidateFuseDentryCache(const std::string& path) {
     LOG(VERBOSE) << "Invalidating FUSE dentry cache";
+    // MediaProvider changed the path behind our back, so any decision we cached for it may be
+    // stale.
+    mp.InvalidatePermissionCache(path);
+    mp.InvalidateRedactionInfoCache(path);
     if (active.load(std::memory_order_acquire)) {
         string name;
         fuse_ino_t parent;
         fuse_ino_t child;
-        {
-            std::lock_guard<std::recursive_mutex> guard(fuse->lock);
-            const node* node = node::LookupAbsolutePath(fuse->root, path);
-            if (node) {
-                name = node->GetName();
-                child = fuse->ToInode(const_cast<class node*>(node));
-                parent = fuse->ToInode(node->GetParent());
-            }
+        node* node = node::LookupAbsolutePath(fuse->root, path, true /* acquire */);
+        if (node) {
+            name = node->GetName();
+            child = fuse->ToInode(node);
+            parent = fuse->ToInode(node->GetParent());
+            node->Release(1);
         }
 
         if (!name.empty()) {
-            fuse_inval(fuse->se, parent, child, name, path);
+            fuse->listings.Invalidate(parent);
+            fuse->listings.Invalidate(child);
+            fuse_inval(fuse, parent, child, name, path);
+        }
+
+        // The path may also have been created behind our back, while the kernel caches it as
+        // missing. Its parents may have been created along with it, e.g. when MediaProvider
+        // inserts a file into a new directory, so that what the kernel caches as missing is
+        // the first directory on the path that has no node.
+        std::string_view missing;
+        class node* ancestor = node::LookupDeepestNode(fuse->root, path, &missing);
+        if (ancestor) {
+            if (!missing.empty()) {
+                fuse->listings.Invalidate(fuse->ToInode(ancestor));
+                invalidate_negative_entries(fuse, ancestor, missing, true /* include_name */);
+            }
+            ancestor->Release(1);
         }
     } else {
         LOG(WARNING) << "FUSE daemon is inactive. Cannot invalidate dentry";
     }
 }
 
+void FuseDaemon::InvalidatePermissionCache(uid_t uid) {
+    if (uid == static_cast<uid_t>(-1)) {
+        mp.InvalidatePermissionCache();
+    } else {
+        mp.InvalidatePermissionCache(uid);
+    }
+    // What the uid may list may have changed too
+    if (active.load(std::memory_order_acquire)) {
+        fuse->listings.InvalidateAll();
+    }
+}
+
+std::string FuseDaemon::Dump() const {
+    const PermissionCache::Stats stats = mp.GetPermissionCacheStats();
+    std::stringstream ss;
+    ss << "Permission cache: package hits=" << stats.package_hits
+       << " misses=" << stats.package_misses << ", path hits=" << stats.path_hits
+       << " misses=" << stats.path_misses;
+    const RedactionInfoCache::Stats ri_stats = mp.GetRedactionInfoCacheStats();
+    ss << "\nRedaction cache: hits=" << ri_stats.hits << " misses=" << ri_stats.misses
+       << " evictions=" << ri_stats.evictions << ", entries=" << ri_stats.entries
+       << " bytes=" << ri_stats.bytes;
+    if (active.load(std::memory_order_acquire)) {
+        const NegativeEntryCache::Stats negative_stats = fuse->negative_entries.GetStats();
+        ss << "\nNegative entries: entries=" << negative_stats.entries
+           << " inserted=" << negative_stats.inserted << " rejected=" << negative_stats.rejected
+           << " invalidated=" << negative_stats.invalidated;
+        const DirectoryListingCache::Stats listing_stats = fuse->listings.GetStats();
+        ss << "\nDirectory listings: entries=" << listing_stats.entries
+           << " hits=" << listing_stats.hits << " misses=" << listing_stats.misses
+           << " invalidated=" << listing_stats.invalidated
+           << ", prefetch=" << (fuse->prefetch ? "enabled" : "disabled");
+        const InvalidationQueue::Stats inval_stats = fuse->invalidations.GetStats();
+        ss << "\nInvalidations: queued=" << inval_stats.queued
+           << " coalesced=" << inval_stats.coalesced << " notified=" << inval_stats.notified
+           << " batches=" << inval_stats.batches;
+        ss << "\nPassthrough: " << (fuse->passthrough ? "enabled" : "disabled")
+           << " handles=" << fuse->passthrough_handles.load(std::memory_order_relaxed)
+           << " failures=" << fuse->passthrough_failures.load(std::memory_order_relaxed);
+        if (fuse->loop) {
+            const SessionLoop::Stats loop_stats = fuse->loop->GetStats();
+            ss << "\nWorkers: threads=" << loop_stats.threads
+               << " idle=" << loop_stats.idle_threads << " requests=" << loop_stats.requests
+               << ", upcall threads=" << loop_stats.upcalls.threads
+               << " idle=" << loop_stats.upcalls.idle_threads
+               << " queued=" << loop_stats.upcalls.queued
+               << " requests=" << loop_stats.upcall_requests;
+        }
+    }
+    return ss.str();
+}
+
+std::string FuseDaemon::DumpStats() {
+    return FuseStats::GetSnapshot().ToString();
+}
+
 FuseDaemon::FuseDaemon(JNIEnv* env, jobject mediaProvider) : mp(env, mediaProvider),
                                                              active(false), fuse(nullptr) {}
 
@@ -1761,7 +2677,44 @@ bool FuseDaemon::IsStarted() const {
     return active.load(std::memory_order_acquire);
 }
 
-void FuseDaemon::Start(android::base::unique_fd fd, const std::string& path) {
+static FAdviser::Policy get_fadvise_policy() {
+    FAdviser::Policy policy;
+    struct sysinfo info;
+    if (sysinfo(&info) == 0) {
+        policy = FAdviser::Policy::ForMemory(static_cast<uint64_t>(info.totalram) * info.mem_unit);
+    } else {
+        PLOG(WARNING) << "Failed to get system memory, using default fadvise policy";
+    }
+
+    policy.threshold = android::base::GetUintProperty<size_t>(PROP_FADVISE_THRESHOLD,
+                                                              policy.threshold);
+    policy.target = std::min(
+            android::base::GetUintProperty<size_t>(PROP_FADVISE_TARGET, policy.target),
+            policy.threshold);
+    policy.readahead_size = android::base::GetUintProperty<size_t>(PROP_FADVISE_READAHEAD,
+                                                                   policy.readahead_size);
+    LOG(INFO) << "Fadvise threshold " << policy.threshold << ", target " << policy.target
+              << ", readahead " << policy.readahead_size;
+    return policy;
+}
+
+// Returns the request size set by |prop|, between MIN_IO_SIZE and MAX_IO_SIZE and in whole pages.
+static size_t get_io_size_property(const char* prop) {
+    const size_t page_size = getpagesize();
+    const size_t size =
+            android::base::GetUintProperty<size_t>(prop, DEFAULT_MAX_IO_SIZE, MAX_IO_SIZE);
+    return std::max(MIN_IO_SIZE, size / page_size * page_size);
+}
+
+// Returns the timeout set by |prop| in seconds, or no timeout if it isn't set or is invalid.
+static double get_timeout_property(const char* prop) {
+    const unsigned int timeout_ms =
+            android::base::GetUintProperty<unsigned int>(prop, UINT_MAX, MAX_TIMEOUT_MS);
+    return timeout_ms == UINT_MAX ? std::numeric_limits<double>::max() : timeout_ms / 1000.0;
+}
+
+void FuseDaemon::Start(android::base::unique_fd fd, const std::string& path,
+                       const std::string& snapshot_file) {
     android::base::SetDefaultTag(LOG_TAG);
 
     struct fuse_args args;
@@ -1779,14 +2732,28 @@ void FuseDaemon::Start(android::base::unique_fd fd, const std::string& path) {
         return;
     }
 
+    const size_t max_read = get_io_size_property(PROP_MAX_READ);
     args = FUSE_ARGS_INIT(0, nullptr);
     if (fuse_opt_add_arg(&args, path.c_str()) || fuse_opt_add_arg(&args, "-odebug") ||
-        fuse_opt_add_arg(&args, ("-omax_read=" + std::to_string(MAX_READ_SIZE)).c_str())) {
+        fuse_opt_add_arg(&args, ("-omax_read=" + std::to_string(max_read)).c_str())) {
         LOG(ERROR) << "ERROR: failed to set options";
         return;
     }
 
-    struct fuse fuse_default(path);
+    struct fuse fuse_default(path, get_fadvise_policy());
+    fuse_default.max_read = max_read;
+    fuse_default.max_write = get_io_size_property(PROP_MAX_WRITE);
+    fuse_default.max_background = android::base::GetUintProperty<unsigned int>(
+            PROP_MAX_BACKGROUND, 0, MAX_MAX_BACKGROUND);
+    fuse_default.congestion_threshold = android::base::GetUintProperty<unsigned int>(
+            PROP_CONGESTION_THRESHOLD, 0, MAX_MAX_BACKGROUND);
+    if (fuse_default.max_background) {
+        fuse_default.congestion_threshold =
+                std::min(fuse_default.congestion_threshold, fuse_default.max_background);
+    }
+    LOG(INFO) << "Max read " << fuse_default.max_read << ", max write " << fuse_default.max_write
+              << ", max background " << fuse_default.max_background << ", congestion threshold "
+              << fuse_default.congestion_threshold;
     fuse_default.mp = &mp;
     // fuse_default is stack allocated, but it's safe to save it as an instance variable because
     // this method blocks and FuseDaemon#active tells if we are currently blocking
@@ -1795,12 +2762,19 @@ void FuseDaemon::Start(android::base::unique_fd fd, const std::string& path) {
     // Used by pf_read: redacted ranges are represented by zeroized ranges of bytes,
     // so we mmap the maximum length of redacted ranges in the beginning and save memory allocations
     // on each read.
-    fuse_default.zero_addr = static_cast<char*>(mmap(
-            NULL, MAX_READ_SIZE, PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, /*fd*/ -1, /*off*/ 0));
+    fuse_default.zero_addr = static_cast<char*>(mmap(NULL, fuse_default.max_read, PROT_READ,
+                                                     MAP_ANONYMOUS | MAP_PRIVATE, /*fd*/ -1,
+                                                     /*off*/ 0));
     if (fuse_default.zero_addr == MAP_FAILED) {
         LOG(FATAL) << "mmap failed - could not start fuse! errno = " << errno;
     }
 
+    fuse_default.max_readdir_size = android::base::GetUintProperty<size_t>(
+            PROP_MAX_READDIR_SIZE, DEFAULT_MAX_READDIR_SIZE, MAX_READDIR_SIZE);
+    if (fuse_default.max_readdir_size < MIN_READDIR_SIZE) {
+        fuse_default.max_readdir_size = MIN_READDIR_SIZE;
+    }
+
     // Custom logging for libfuse
     if (android::base::GetBoolProperty("persist.sys.fuse.log", false)) {
         fuse_set_log_func(fuse_logger);
@@ -1817,18 +2791,91 @@ void FuseDaemon::Start(android::base::unique_fd fd, const std::string& path) {
     se->fd = fd.release();  // libfuse owns the FD now
     se->mountpoint = strdup(path.c_str());
 
+    fuse_default.negative_timeout =
+            android::base::GetUintProperty<unsigned int>(PROP_NEGATIVE_TIMEOUT_MS,
+                                                         DEFAULT_NEGATIVE_TIMEOUT_MS,
+                                                         MAX_NEGATIVE_TIMEOUT_MS) /
+            1000.0;
+    fuse_default.entry_timeout = get_timeout_property(PROP_ENTRY_TIMEOUT_MS);
+    fuse_default.attr_timeout = get_timeout_property(PROP_ATTR_TIMEOUT_MS);
+    fuse_default.media_timeout =
+            android::base::GetUintProperty<unsigned int>(PROP_MEDIA_TIMEOUT_MS,
+                                                         DEFAULT_MEDIA_TIMEOUT_MS, MAX_TIMEOUT_MS) /
+            1000.0;
+    LOG(INFO) << "Entry timeout " << fuse_default.entry_timeout << "s, attr timeout "
+              << fuse_default.attr_timeout << "s, media timeout " << fuse_default.media_timeout
+              << "s";
+
+    fuse_default.prefetch = android::base::GetBoolProperty(PROP_OPENDIR_PREFETCH, false);
+
+    std::thread snapshot_thread;
+    if (android::base::GetBoolProperty(PROP_WARM_START, false)) {
+        fuse_default.snapshot_file = snapshot_file;
+        load_snapshot(&fuse_default);
+        snapshot_thread = std::thread(save_snapshots, &fuse_default);
+    } else if (!snapshot_file.empty()) {
+        // Left behind while warm start was enabled
+        unlink(snapshot_file.c_str());
+    }
+
+    // Negotiated with the kernel in pf_init(), which turns it back off if unsupported
+    fuse_default.passthrough = android::base::GetBoolProperty(PROP_PASSTHROUGH, false);
+
+    config.max_idle_threads = android::base::GetUintProperty<unsigned int>(
+            PROP_MAX_IDLE_THREADS, DEFAULT_MAX_IDLE_THREADS, MAX_MAX_IDLE_THREADS);
+
     // Single thread. Useful for debugging
     // fuse_session_loop(se);
     // Multi-threaded
     LOG(INFO) << "Starting fuse...";
-    fuse_session_loop_mt(se, &config);
-    fuse->active->store(false, std::memory_order_release);
+    if (android::base::GetBoolProperty(PROP_WORKER_POOL, true)) {
+        SessionLoop::Config loop_config;
+        loop_config.min_threads = android::base::GetUintProperty<unsigned int>(
+                PROP_MIN_THREADS, DEFAULT_MIN_THREADS, MAX_MAX_THREADS);
+        loop_config.max_threads = std::max(
+                loop_config.min_threads,
+                android::base::GetUintProperty<unsigned int>(PROP_MAX_THREADS,
+                                                             DEFAULT_MAX_THREADS, MAX_MAX_THREADS));
+        loop_config.max_idle_threads = config.max_idle_threads;
+        loop_config.cpu_mask = android::base::GetUintProperty<uint64_t>(PROP_CPU_MASK, 0);
+        loop_config.upcalls.min_threads = android::base::GetUintProperty<unsigned int>(
+                PROP_MIN_UPCALL_THREADS, DEFAULT_MIN_UPCALL_THREADS, MAX_MAX_THREADS);
+        loop_config.upcalls.max_threads =
+                std::max(loop_config.upcalls.min_threads,
+                         android::base::GetUintProperty<unsigned int>(PROP_MAX_UPCALL_THREADS,
+                                                                      DEFAULT_MAX_UPCALL_THREADS,
+                                                                      MAX_MAX_THREADS));
+        loop_config.upcalls.cpu_mask =
+                android::base::GetUintProperty<uint64_t>(PROP_UPCALL_CPU_MASK, 0);
+        LOG(INFO) << "Worker threads " << loop_config.min_threads << "-"
+                  << loop_config.max_threads << ", upcall threads "
+                  << loop_config.upcalls.min_threads << "-" << loop_config.upcalls.max_threads;
+
+        SessionLoop loop(se, &fuse_default, loop_config);
+        fuse_default.loop = &loop;
+        loop.Run();
+        fuse->active->store(false, std::memory_order_release);
+        fuse_default.loop = nullptr;
+    } else {
+        fuse_session_loop_mt(se, &config);
+        fuse->active->store(false, std::memory_order_release);
+    }
     LOG(INFO) << "Ending fuse...";
 
-    if (munmap(fuse_default.zero_addr, MAX_READ_SIZE)) {
+    if (snapshot_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(fuse_default.snapshot_lock);
+            fuse_default.snapshot_stop = true;
+        }
+        fuse_default.snapshot_cv.notify_one();
+        snapshot_thread.join();
+    }
+
+    if (munmap(fuse_default.zero_addr, fuse_default.max_read)) {
         PLOG(ERROR) << "munmap failed!";
     }
 
+    fuse_default.invalidations.Shutdown();
     fuse_opt_free_args(&args);
     fuse_session_destroy(se);
     LOG(INFO) << "Ended fuse";
@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 
 #include <android-base/unique_fd.h>
 
@@ -35,9 +36,12 @@ class FuseDaemon final {
     ~FuseDaemon() = default;
 
     /**
-     * Start the FUSE daemon loop that will handle filesystem calls.
+     * Start the FUSE daemon loop that will handle filesystem calls. Caches are saved to
+     * |snapshot_file| when the loop ends and loaded from it when it starts, if warm start is
+     * enabled. An empty |snapshot_file| disables that.
      */
-    void Start(android::base::unique_fd fd, const std::string& path);
+    void Start(android::base::unique_fd fd, const std::string& path,
+               const std::string& snapshot_file);
 
     /**
      * Checks if the FUSE daemon is started.
@@ -47,13 +51,29 @@ class FuseDaemon final {
     /**
      * Check if file should be opened with FUSE
      */
-    bool ShouldOpenWithFuse(int fd, bool for_read, const std::string& path);
+    bool ShouldOpenWithFuse(int fd, bool for_read, std::string_view path);
 
     /**
-     * Invalidate FUSE VFS dentry cache entry for path
+     * Invalidate FUSE VFS dentry cache entry for path. The kernel is notified asynchronously.
      */
     void InvalidateFuseDentryCache(const std::string& path);
 
+    /**
+     * Invalidate the cached access decisions for uid, or for all uids if uid is -1
+     */
+    void InvalidatePermissionCache(uid_t uid);
+
+    /**
+     * Returns a human readable summary of the daemon state for dumpsys
+     */
+    std::string Dump() const;
+
+    /**
+     * Returns the request and upcall latencies and I/O counters of all daemons of the process for
+     * dumpsys
+     */
+    static std::string DumpStats();
+
   private:
     FuseDaemon(const FuseDaemon&) = delete;
     void operator=(const FuseDaemon&) = delete;
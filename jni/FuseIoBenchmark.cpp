@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures sequential read and write throughput through the FUSE daemon for each request size.
+// Must be run as root on a device, e.g.
+// adb shell /data/benchmarktest64/FuseIoBenchmark/FuseIoBenchmark
+//
+// Requests larger than persist.sys.fuse.max_read or persist.sys.fuse.max_write are split by the
+// kernel, so compare runs with different values of those to see what larger requests buy.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr const char* kLowerFile = "/data/media/0/fuse_io_benchmark.bin";
+constexpr const char* kFuseFile = "/storage/emulated/0/fuse_io_benchmark.bin";
+constexpr size_t kFileSize = 64 * 1024 * 1024;
+
+// Creates the file read by the benchmarks on the lower filesystem, once.
+bool populate() {
+    static bool populated = false;
+    if (populated) {
+        return true;
+    }
+    const int fd = open(kLowerFile, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0660);
+    if (fd < 0) {
+        return false;
+    }
+    const std::vector<char> chunk(1024 * 1024, 'a');
+    for (size_t written = 0; written < kFileSize; written += chunk.size()) {
+        if (write(fd, chunk.data(), chunk.size()) != static_cast<ssize_t>(chunk.size())) {
+            close(fd);
+            return false;
+        }
+    }
+    fsync(fd);
+    close(fd);
+    populated = true;
+    return true;
+}
+
+// Drops the file from the page cache of both FUSE and the lower filesystem, so that every read
+// has to go through the daemon.
+void dropCaches() {
+    for (const char* path : {kFuseFile, kLowerFile}) {
+        const int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+void BM_SequentialRead(benchmark::State& state) {
+    if (!populate()) {
+        state.SkipWithError("Failed to create file, are we running as root?");
+        return;
+    }
+
+    const size_t request_size = state.range(0);
+    std::vector<char> buf(request_size);
+    for (auto _ : state) {
+        state.PauseTiming();
+        dropCaches();
+        const int fd = open(kFuseFile, O_RDONLY | O_CLOEXEC);
+        state.ResumeTiming();
+        if (fd < 0) {
+            state.SkipWithError("Failed to open file through FUSE");
+            return;
+        }
+        while (read(fd, buf.data(), request_size) > 0) {
+        }
+        close(fd);
+    }
+    state.SetBytesProcessed(state.iterations() * kFileSize);
+}
+BENCHMARK(BM_SequentialRead)
+        ->RangeMultiplier(2)
+        ->Range(128 * 1024, 1024 * 1024)
+        ->Unit(benchmark::kMillisecond);
+
+void BM_SequentialWrite(benchmark::State& state) {
+    const size_t request_size = state.range(0);
+    const std::vector<char> buf(request_size, 'a');
+    for (auto _ : state) {
+        const int fd = open(kFuseFile, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0660);
+        if (fd < 0) {
+            state.SkipWithError("Failed to create file through FUSE, are we running as root?");
+            return;
+        }
+        for (size_t written = 0; written < kFileSize; written += request_size) {
+            if (write(fd, buf.data(), request_size) != static_cast<ssize_t>(request_size)) {
+                close(fd);
+                state.SkipWithError("Failed to write through FUSE");
+                return;
+            }
+        }
+        // Include flushing the write-back cache through the daemon
+        fsync(fd);
+        close(fd);
+    }
+    state.SetBytesProcessed(state.iterations() * kFileSize);
+}
+BENCHMARK(BM_SequentialWrite)
+        ->RangeMultiplier(2)
+        ->Range(128 * 1024, 1024 * 1024)
+        ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    unlink(kLowerFile);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures how fast directories can be listed through the FUSE daemon. Must be run as root on a
+// device, e.g. adb shell /data/benchmarktest64/FuseReaddirBenchmark/FuseReaddirBenchmark
+//
+// The directories are populated through the lower filesystem, which is much faster than going
+// through FUSE, and then listed through FUSE, which issues one readdirplus() per reply buffer.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+#include <set>
+#include <string>
+
+namespace {
+
+constexpr const char* kLowerRoot = "/data/media/0";
+constexpr const char* kFuseRoot = "/storage/emulated/0";
+constexpr const char* kDirPrefix = "fuse_readdir_benchmark_";
+
+std::set<int> populated_sizes;
+
+std::string lowerDir(int num_entries) {
+    return std::string(kLowerRoot) + "/" + kDirPrefix + std::to_string(num_entries);
+}
+
+std::string fuseDir(int num_entries) {
+    return std::string(kFuseRoot) + "/" + kDirPrefix + std::to_string(num_entries);
+}
+
+// Creates a directory with |num_entries| empty files on the lower filesystem, once per size.
+bool populate(int num_entries) {
+    if (populated_sizes.count(num_entries)) {
+        return true;
+    }
+    const std::string dir = lowerDir(num_entries);
+    // World readable, since the FUSE daemon doesn't run as root.
+    if (mkdir(dir.c_str(), 0775) && errno != EEXIST) {
+        return false;
+    }
+    for (int i = 0; i < num_entries; i++) {
+        const std::string file = dir + "/file_" + std::to_string(i) + ".txt";
+        const int fd = open(file.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0660);
+        if (fd < 0) {
+            return false;
+        }
+        close(fd);
+    }
+    populated_sizes.insert(num_entries);
+    return true;
+}
+
+void cleanup() {
+    for (int num_entries : populated_sizes) {
+        const std::string dir = lowerDir(num_entries);
+        for (int i = 0; i < num_entries; i++) {
+            unlink((dir + "/file_" + std::to_string(i) + ".txt").c_str());
+        }
+        rmdir(dir.c_str());
+    }
+}
+
+void BM_ListDirectory(benchmark::State& state) {
+    const int num_entries = state.range(0);
+    if (!populate(num_entries)) {
+        state.SkipWithError("Failed to populate directory, are we running as root?");
+        return;
+    }
+
+    const std::string dir = fuseDir(num_entries);
+    for (auto _ : state) {
+        DIR* d = opendir(dir.c_str());
+        if (!d) {
+            state.SkipWithError("Failed to open directory through FUSE");
+            return;
+        }
+        int count = 0;
+        while (readdir(d)) {
+            count++;
+        }
+        closedir(d);
+        benchmark::DoNotOptimize(count);
+    }
+    state.SetItemsProcessed(state.iterations() * num_entries);
+}
+BENCHMARK(BM_ListDirectory)->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+// Time to the first entry of a directory. Root bypasses MediaProvider, so the daemon streams the
+// directory from the lower filesystem and this shouldn't grow with its size.
+void BM_FirstEntry(benchmark::State& state) {
+    const int num_entries = state.range(0);
+    if (!populate(num_entries)) {
+        state.SkipWithError("Failed to populate directory, are we running as root?");
+        return;
+    }
+
+    const std::string dir = fuseDir(num_entries);
+    for (auto _ : state) {
+        DIR* d = opendir(dir.c_str());
+        if (!d) {
+            state.SkipWithError("Failed to open directory through FUSE");
+            return;
+        }
+        benchmark::DoNotOptimize(readdir(d));
+        closedir(d);
+    }
+}
+BENCHMARK(BM_FirstEntry)->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMicrosecond);
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    cleanup();
+    return 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FuseDaemon"
+
+#include "include/libfuse_jni/FuseStats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+namespace {
+
+// Indexed by FuseStats::Op
+const char* const kOpNames[FuseStats::kNumOps] = {
+        "lookup",
+        "forget",
+        "forget_multi",
+        "getattr",
+        "setattr",
+        "canonical_path",
+        "mknod",
+        "mkdir",
+        "unlink",
+        "rmdir",
+        "rename",
+        "open",
+        "read",
+        "write",
+        "flush",
+        "release",
+        "fsync",
+        "opendir",
+        "readdir",
+        "readdirplus",
+        "releasedir",
+        "fsyncdir",
+        "statfs",
+        "access",
+        "create",
+};
+
+// Indexed by FuseStats::Upcall
+const char* const kUpcallNames[FuseStats::kNumUpcalls] = {
+        "getRedactionInfo",
+        "insertFile",
+        "deleteFile",
+        "isOpenAllowed",
+        "isCreatingDirAllowed",
+        "isDeletingDirAllowed",
+        "getDirectoryEntries",
+        "isOpendirAllowed",
+        "isUidForPackage",
+        "rename",
+        "notify",
+};
+
+// Indexed by FuseStats::Counter
+const char* const kCounterNames[FuseStats::kNumCounters] = {
+        "bytes_read",
+        "bytes_written",
+        "bytes_redacted",
+};
+
+// Only ever written by the thread owning it, which can then get away with a plain load and store
+// instead of an atomic increment. Readers on other threads see every value whole.
+inline void increment(std::atomic<uint64_t>* value, uint64_t delta) {
+    value->store(value->load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+struct ThreadHistogram {
+    std::atomic<uint64_t> buckets[LatencyHistogram::kBuckets] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+
+    void Add(uint64_t ns) {
+        increment(&buckets[LatencyHistogram::GetBucket(ns)], 1);
+        increment(&count, 1);
+        increment(&total_ns, ns);
+        if (ns > max_ns.load(std::memory_order_relaxed)) {
+            max_ns.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    void MergeInto(LatencyHistogram* histogram) const {
+        for (int i = 0; i < LatencyHistogram::kBuckets; i++) {
+            histogram->buckets[i] += buckets[i].load(std::memory_order_relaxed);
+        }
+        histogram->count += count.load(std::memory_order_relaxed);
+        histogram->total_ns += total_ns.load(std::memory_order_relaxed);
+        histogram->max_ns = std::max(histogram->max_ns, max_ns.load(std::memory_order_relaxed));
+    }
+};
+
+struct ThreadStats {
+    ThreadHistogram ops[FuseStats::kNumOps];
+    ThreadHistogram upcalls[FuseStats::kNumUpcalls];
+    ThreadHistogram lock_wait;
+    std::atomic<uint64_t> counters[FuseStats::kNumCounters] = {};
+
+    void MergeInto(FuseStats::Snapshot* snapshot) const {
+        for (int i = 0; i < FuseStats::kNumOps; i++) {
+            ops[i].MergeInto(&snapshot->ops[i]);
+        }
+        for (int i = 0; i < FuseStats::kNumUpcalls; i++) {
+            upcalls[i].MergeInto(&snapshot->upcalls[i]);
+        }
+        lock_wait.MergeInto(&snapshot->lock_wait);
+        for (int i = 0; i < FuseStats::kNumCounters; i++) {
+            snapshot->counters[i] += counters[i].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+// The stats of all live threads, and those of threads that are gone
+struct Registry {
+    std::mutex lock;
+    std::vector<ThreadStats*> threads;
+    FuseStats::Snapshot exited;
+};
+
+Registry* getRegistry() {
+    // Leaked, threads may still exit after static destructors ran
+    static Registry* registry = new Registry();
+    return registry;
+}
+
+// Registers the stats of a thread on first use, and retires them when the thread exits
+class ThreadStatsHolder {
+  public:
+    ~ThreadStatsHolder() {
+        if (!stats_) return;
+        Registry* registry = getRegistry();
+        std::lock_guard<std::mutex> guard(registry->lock);
+        stats_->MergeInto(&registry->exited);
+        registry->threads.erase(
+                std::find(registry->threads.begin(), registry->threads.end(), stats_));
+        delete stats_;
+        // Anything recorded during the rest of the thread's teardown is kept, but never retired
+        stats_ = nullptr;
+    }
+
+    ThreadStats* Get() {
+        if (!stats_) {
+            stats_ = new ThreadStats();
+            Registry* registry = getRegistry();
+            std::lock_guard<std::mutex> guard(registry->lock);
+            registry->threads.push_back(stats_);
+        }
+        return stats_;
+    }
+
+  private:
+    ThreadStats* stats_ = nullptr;
+};
+
+thread_local ThreadStatsHolder tls_stats;
+
+void formatHistogram(std::ostream& os, const char* name, const LatencyHistogram& histogram) {
+    os << "\n  " << name << ": count=" << histogram.count
+       << " avg_us=" << histogram.total_ns / histogram.count / 1000
+       << " p50_us=" << histogram.GetPercentileUs(0.5)
+       << " p90_us=" << histogram.GetPercentileUs(0.9)
+       << " p99_us=" << histogram.GetPercentileUs(0.99)
+       << " max_us=" << histogram.max_ns / 1000;
+}
+
+}  // namespace
+
+int LatencyHistogram::GetBucket(uint64_t ns) {
+    const uint64_t us = ns / 1000;
+    if (!us) return 0;
+    return std::min(64 - __builtin_clzll(us), kBuckets - 1);
+}
+
+void LatencyHistogram::Add(uint64_t ns) {
+    buckets[GetBucket(ns)]++;
+    count++;
+    total_ns += ns;
+    max_ns = std::max(max_ns, ns);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+    for (int i = 0; i < kBuckets; i++) {
+        buckets[i] += other.buckets[i];
+    }
+    count += other.count;
+    total_ns += other.total_ns;
+    max_ns = std::max(max_ns, other.max_ns);
+}
+
+uint64_t LatencyHistogram::GetPercentileUs(double percentile) const {
+    const uint64_t rank = std::max<uint64_t>(1, percentile * count);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets - 1; i++) {
+        seen += buckets[i];
+        if (seen >= rank) return 1ULL << i;
+    }
+    return max_ns / 1000;
+}
+
+std::string FuseStats::Snapshot::ToString() const {
+    std::stringstream ss;
+    ss << "Requests:";
+    for (int i = 0; i < kNumOps; i++) {
+        if (ops[i].count) formatHistogram(ss, kOpNames[i], ops[i]);
+    }
+    ss << "\nUpcalls:";
+    for (int i = 0; i < kNumUpcalls; i++) {
+        if (upcalls[i].count) formatHistogram(ss, kUpcallNames[i], upcalls[i]);
+    }
+    ss << "\nLock waits:";
+    if (lock_wait.count) formatHistogram(ss, "node tree", lock_wait);
+    ss << "\nCounters:";
+    for (int i = 0; i < kNumCounters; i++) {
+        ss << " " << kCounterNames[i] << "=" << counters[i];
+    }
+    return ss.str();
+}
+
+const char* FuseStats::GetOpName(Op op) {
+    return kOpNames[op];
+}
+
+const char* FuseStats::GetUpcallName(Upcall upcall) {
+    return kUpcallNames[upcall];
+}
+
+uint64_t FuseStats::NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+void FuseStats::RecordOp(Op op, uint64_t ns) {
+    tls_stats.Get()->ops[op].Add(ns);
+}
+
+void FuseStats::RecordUpcall(Upcall upcall, uint64_t ns) {
+    tls_stats.Get()->upcalls[upcall].Add(ns);
+}
+
+void FuseStats::RecordLockWait(uint64_t ns) {
+    tls_stats.Get()->lock_wait.Add(ns);
+}
+
+void FuseStats::Add(Counter counter, uint64_t value) {
+    increment(&tls_stats.Get()->counters[counter], value);
+}
+
+FuseStats::Snapshot FuseStats::GetSnapshot() {
+    Registry* registry = getRegistry();
+    std::lock_guard<std::mutex> guard(registry->lock);
+    Snapshot snapshot = registry->exited;
+    for (const ThreadStats* stats : registry->threads) {
+        stats->MergeInto(&snapshot);
+    }
+    return snapshot;
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
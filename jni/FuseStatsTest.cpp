@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FuseStatsTest"
+
+#include "libfuse_jni/FuseStats.h"
+
+#include <gtest/gtest.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace mediaprovider::fuse;
+
+TEST(FuseStatsTest, testHistogramBuckets) {
+    EXPECT_EQ(0, LatencyHistogram::GetBucket(0));
+    EXPECT_EQ(0, LatencyHistogram::GetBucket(999));
+    EXPECT_EQ(1, LatencyHistogram::GetBucket(1000));
+    EXPECT_EQ(2, LatencyHistogram::GetBucket(2000));
+    EXPECT_EQ(2, LatencyHistogram::GetBucket(3999));
+    EXPECT_EQ(3, LatencyHistogram::GetBucket(4000));
+    EXPECT_EQ(LatencyHistogram::kBuckets - 1, LatencyHistogram::GetBucket(UINT64_MAX));
+}
+
+TEST(FuseStatsTest, testHistogramPercentiles) {
+    LatencyHistogram histogram;
+    for (int i = 0; i < 90; i++) {
+        histogram.Add(500);
+    }
+    for (int i = 0; i < 9; i++) {
+        histogram.Add(3000);
+    }
+    histogram.Add(100 * 1000);
+
+    EXPECT_EQ(100, histogram.count);
+    EXPECT_EQ(100 * 1000, histogram.max_ns);
+    EXPECT_EQ(1, histogram.GetPercentileUs(0.5));
+    EXPECT_EQ(1, histogram.GetPercentileUs(0.9));
+    EXPECT_EQ(4, histogram.GetPercentileUs(0.99));
+    EXPECT_EQ(128, histogram.GetPercentileUs(1));
+
+    // Beyond the last bucket, the maximum is all there is to go by
+    LatencyHistogram slow;
+    slow.Add(10ULL * 1000 * 1000 * 1000);
+    EXPECT_EQ(10 * 1000 * 1000, slow.GetPercentileUs(0.5));
+}
+
+TEST(FuseStatsTest, testMergesThreads) {
+    const FuseStats::Snapshot before = FuseStats::GetSnapshot();
+
+    std::mutex lock;
+    std::condition_variable cv;
+    bool done = false;
+    int recorded = 0;
+
+    // One thread records and exits, the other one stays alive until the snapshot was taken
+    std::thread exited([] {
+        FuseStats::RecordOp(FuseStats::kOpLookup, 1000);
+        FuseStats::Add(FuseStats::kBytesRead, 4096);
+    });
+    exited.join();
+    std::thread alive([&] {
+        FuseStats::RecordOp(FuseStats::kOpLookup, 2000);
+        FuseStats::RecordUpcall(FuseStats::kUpcallIsOpenAllowed, 5000);
+        FuseStats::RecordLockWait(100);
+        FuseStats::Add(FuseStats::kBytesRead, 4096);
+        std::unique_lock<std::mutex> guard(lock);
+        recorded++;
+        cv.notify_all();
+        cv.wait(guard, [&] { return done; });
+    });
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [&] { return recorded == 1; });
+    }
+
+    const FuseStats::Snapshot after = FuseStats::GetSnapshot();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        done = true;
+        cv.notify_all();
+    }
+    alive.join();
+
+    EXPECT_EQ(2, after.ops[FuseStats::kOpLookup].count - before.ops[FuseStats::kOpLookup].count);
+    EXPECT_EQ(3000, after.ops[FuseStats::kOpLookup].total_ns -
+                            before.ops[FuseStats::kOpLookup].total_ns);
+    EXPECT_EQ(1, after.upcalls[FuseStats::kUpcallIsOpenAllowed].count -
+                         before.upcalls[FuseStats::kUpcallIsOpenAllowed].count);
+    EXPECT_EQ(1, after.lock_wait.count - before.lock_wait.count);
+    EXPECT_EQ(8192, after.counters[FuseStats::kBytesRead] - before.counters[FuseStats::kBytesRead]);
+
+    // Nothing is lost once the other thread is gone too
+    const FuseStats::Snapshot last = FuseStats::GetSnapshot();
+    EXPECT_EQ(after.ops[FuseStats::kOpLookup].count, last.ops[FuseStats::kOpLookup].count);
+}
+
+TEST(FuseStatsTest, testToString) {
+    {
+        FuseStats::ScopedOp op(FuseStats::kOpReaddirplus);
+    }
+    const std::string dump = FuseStats::GetSnapshot().ToString();
+    EXPECT_NE(std::string::npos, dump.find("readdirplus: count="));
+    EXPECT_NE(std::string::npos, dump.find("bytes_redacted="));
+    // Requests that never happened are left out
+    EXPECT_EQ(std::string::npos, dump.find("canonical_path"));
+}
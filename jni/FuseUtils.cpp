@@ -22,6 +22,7 @@
 #include "android-base/strings.h"
 
 using std::string;
+using std::string_view;
 
 namespace mediaprovider {
 namespace fuse {
@@ -50,5 +51,69 @@ bool containsMount(const string& path, const string& userid) {
            android::base::EqualsIgnoreCase(path_suffix, obb_suffix);
 }
 
+namespace {
+
+// Returns the length of the run of decimal digits at the start of |s|.
+size_t countLeadingDigits(string_view s) {
+    size_t i = 0;
+    while (i < s.size() && s[i] >= '0' && s[i] <= '9') {
+        i++;
+    }
+    return i;
+}
+
+// If |s| starts with |prefix| (ignoring case), strips it and returns true.
+bool consumePrefixIgnoreCase(string_view* s, string_view prefix) {
+    if (!android::base::StartsWithIgnoreCase(*s, prefix)) {
+        return false;
+    }
+    s->remove_prefix(prefix.size());
+    return true;
+}
+
+}  // namespace
+
+PathInfo parsePath(string_view path) {
+    PathInfo info;
+
+    static constexpr string_view emulated_prefix = "/storage/emulated/";
+    if (android::base::StartsWith(path, emulated_prefix)) {
+        string_view rest_of_path = path.substr(emulated_prefix.size());
+        info.emulated_userid = rest_of_path.substr(0, countLeadingDigits(rest_of_path));
+    }
+
+    // "/storage/<volume>/"
+    string_view rest_of_path = path;
+    if (!consumePrefixIgnoreCase(&rest_of_path, "/storage/")) {
+        return info;
+    }
+    const size_t volume_end = rest_of_path.find('/');
+    if (volume_end == 0 || volume_end == string_view::npos) {
+        return info;
+    }
+    rest_of_path.remove_prefix(volume_end + 1);
+
+    // Optional "<userid>/"
+    const size_t userid_length = countLeadingDigits(rest_of_path);
+    if (userid_length > 0 && userid_length < rest_of_path.size() &&
+        rest_of_path[userid_length] == '/') {
+        rest_of_path.remove_prefix(userid_length + 1);
+    }
+
+    // "Android/{data,obb,sandbox}/"
+    if (!consumePrefixIgnoreCase(&rest_of_path, "Android/")) {
+        return info;
+    }
+    if (!consumePrefixIgnoreCase(&rest_of_path, "data/") &&
+        !consumePrefixIgnoreCase(&rest_of_path, "obb/") &&
+        !consumePrefixIgnoreCase(&rest_of_path, "sandbox/")) {
+        return info;
+    }
+
+    // "<package>", which must not be empty.
+    info.package = rest_of_path.substr(0, rest_of_path.find('/'));
+    return info;
+}
+
 }  // namespace fuse
 }  // namespace mediaprovider
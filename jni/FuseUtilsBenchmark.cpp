@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libfuse_jni/FuseUtils.h"
+
+#include <benchmark/benchmark.h>
+
+#include <regex>
+#include <string>
+#include <vector>
+
+using mediaprovider::fuse::parsePath;
+
+namespace {
+
+// The regexes parsePath replaced in FuseDaemon.cpp, kept here for comparison.
+const std::regex PATTERN_OWNED_PATH(
+        "^/storage/[^/]+/(?:[0-9]+/)?Android/(?:data|obb|sandbox)/([^/]+)(/?.*)?",
+        std::regex_constants::icase);
+const std::regex storage_emulated_regex("^\\/storage\\/emulated\\/([0-9]+)");
+
+const std::vector<std::string> kPaths = {
+        "/storage/emulated/0",
+        "/storage/emulated/0/DCIM/Camera/IMG_20200101_120000.jpg",
+        "/storage/emulated/0/Android/data/com.example.app/files/cache/entry",
+        "/storage/emulated/10/Android/obb/com.example.game/main.obb",
+        "/storage/emulated/0/Download/some/deeply/nested/directory/structure/file.txt",
+        "/storage/ABCD-1234/Music/Artist/Album/track.mp3",
+};
+
+void BM_Regex(benchmark::State& state) {
+    for (auto _ : state) {
+        for (const std::string& path : kPaths) {
+            std::smatch owned;
+            benchmark::DoNotOptimize(std::regex_match(path, owned, PATTERN_OWNED_PATH));
+            std::smatch emulated;
+            benchmark::DoNotOptimize(std::regex_search(path, emulated, storage_emulated_regex));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * kPaths.size());
+}
+BENCHMARK(BM_Regex);
+
+void BM_ParsePath(benchmark::State& state) {
+    for (auto _ : state) {
+        for (const std::string& path : kPaths) {
+            benchmark::DoNotOptimize(parsePath(path));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * kPaths.size());
+}
+BENCHMARK(BM_ParsePath);
+
+}  // namespace
+
+BENCHMARK_MAIN();
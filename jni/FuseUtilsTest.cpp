@@ -64,3 +64,44 @@ TEST(FuseUtilsTest, testContainsMount_isFalseForPathWithWrongUserid) {
     EXPECT_FALSE(containsMount("/storage/emulated/12345/Android/obb", "1234"));
     EXPECT_FALSE(containsMount("/storage/emulated/1234/Android/obb", "5678"));
 }
+
+TEST(FuseUtilsTest, testParsePath_package) {
+    EXPECT_EQ("com.foo", parsePath("/storage/emulated/0/Android/data/com.foo").package);
+    EXPECT_EQ("com.foo", parsePath("/storage/emulated/0/Android/data/com.foo/").package);
+    EXPECT_EQ("com.foo", parsePath("/storage/emulated/0/Android/obb/com.foo/a/b").package);
+    EXPECT_EQ("com.foo", parsePath("/storage/emulated/0/Android/sandbox/com.foo").package);
+    EXPECT_EQ("com.foo", parsePath("/storage/ABCD-1234/Android/data/com.foo/file").package);
+    EXPECT_EQ(".nomedia", parsePath("/storage/emulated/10/Android/data/.nomedia").package);
+}
+
+TEST(FuseUtilsTest, testParsePath_packageIsCaseInsensitive) {
+    EXPECT_EQ("com.foo", parsePath("/STORAGE/emulated/0/ANDROID/DATA/com.foo").package);
+    EXPECT_EQ("CoM.FoO", parsePath("/storage/emulated/0/android/Obb/CoM.FoO").package);
+}
+
+TEST(FuseUtilsTest, testParsePath_notPackageOwned) {
+    EXPECT_TRUE(parsePath("/storage/emulated/0/Android/data").package.empty());
+    EXPECT_TRUE(parsePath("/storage/emulated/0/Android/data/").package.empty());
+    EXPECT_TRUE(parsePath("/storage/emulated/0/Android/media/com.foo").package.empty());
+    EXPECT_TRUE(parsePath("/storage/emulated/0/DCIM/Android/data/com.foo").package.empty());
+    EXPECT_TRUE(parsePath("/storage/emulated/0/0/Android/data/com.foo").package.empty());
+    EXPECT_TRUE(parsePath("/storage/emulated/0a/Android/data/com.foo").package.empty());
+    EXPECT_TRUE(parsePath("/storage//Android/data/com.foo").package.empty());
+    EXPECT_TRUE(parsePath("/mnt/user/0/emulated/0/Android/data/com.foo").package.empty());
+    EXPECT_TRUE(parsePath("/storage").package.empty());
+    EXPECT_TRUE(parsePath("").package.empty());
+}
+
+TEST(FuseUtilsTest, testParsePath_emulatedUserid) {
+    EXPECT_EQ("0", parsePath("/storage/emulated/0").emulated_userid);
+    EXPECT_EQ("10", parsePath("/storage/emulated/10/DCIM").emulated_userid);
+    EXPECT_EQ("10", parsePath("/storage/emulated/10/Android/data/com.foo").emulated_userid);
+    EXPECT_EQ("10", parsePath("/storage/emulated/10abc").emulated_userid);
+
+    EXPECT_TRUE(parsePath("/storage/emulated").emulated_userid.empty());
+    EXPECT_TRUE(parsePath("/storage/emulated/").emulated_userid.empty());
+    EXPECT_TRUE(parsePath("/storage/emulated/abc").emulated_userid.empty());
+    EXPECT_TRUE(parsePath("/storage/ABCD-1234/0").emulated_userid.empty());
+    // Unlike the package, the userid is matched case sensitively.
+    EXPECT_TRUE(parsePath("/Storage/Emulated/0").emulated_userid.empty());
+}
@@ -0,0 +1,772 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays the FUSE requests of typical workloads against FuseDaemon, to tell how a change to it
+// affects request throughput and latency. Needs no root, no mount and no MediaProvider, e.g.
+// adb shell /data/benchmarktest64/FuseWorkloadBenchmark/FuseWorkloadBenchmark
+//
+// The benchmark plays the kernel on one end of a socket pair, and FuseDaemon serves the other end
+// as if it was /dev/fuse. MediaProviderWrapperStub.cpp stands in for MediaProvider and answers
+// upcalls after a configurable latency, the first argument of each benchmark.
+//
+// Each workload is a trace of the requests the kernel sends for it, written down rather than
+// produced by the kernel, so that a replay doesn't depend on what the kernel happens to cache.
+// The emulated kernel speaks protocol 7.13, from before splice support: splicing requests or
+// replies through a socket would not keep their message boundaries.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <linux/fuse.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <fuse_log.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "FuseDaemon.h"
+#include "MediaProviderWrapperStub.h"
+
+using mediaprovider::fuse::FuseDaemon;
+using mediaprovider::fuse::MediaProviderStubConfig;
+
+namespace {
+
+constexpr const char* kRoot = "/data/local/tmp/fuse_workload_benchmark";
+// Neither root nor shell, which would bypass MediaProvider
+constexpr uid_t kAppUid = 10123;
+constexpr uint64_t kRootNodeId = 1;
+
+// The default max_read and max_write of FuseDaemon. Messages of a socket pair are limited to its
+// send buffer, a little over 200K unless raised by root.
+constexpr uint32_t kIoSize = 128 * 1024;
+// What the kernel asks for with each readdirplus
+constexpr uint32_t kReaddirSize = 4096;
+// Large enough for any reply of FuseDaemon
+constexpr size_t kMaxMessageSize = 1024 * 1024 + 4096;
+
+// Redacted from every video, like location metadata
+const std::vector<off64_t> kRedactionRanges = {16 * 1024, 16 * 1024 + 64,
+                                               20 * 1024, 20 * 1024 + 512};
+
+uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+// The kernel side of a connection to a FuseDaemon
+class FuseConnection {
+  public:
+    struct Reply {
+        int error;
+        std::vector<char> data;
+    };
+
+    // Starts a FuseDaemon serving |root| and initializes the connection
+    bool Start(const std::string& root) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+            return false;
+        }
+        for (int fd : fds) {
+            // Best effort, the kernel caps this unless we are root
+            const int size = 2 * kMaxMessageSize;
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        }
+        fd_ = fds[0];
+        android::base::unique_fd daemon_fd(fds[1]);
+
+        daemon_ = std::make_unique<FuseDaemon>(nullptr, nullptr);
+        daemon_thread_ = std::thread([this, root, fd = daemon_fd.release()] {
+            daemon_->Start(android::base::unique_fd(fd), root, /* snapshot_file */ "");
+        });
+        reader_thread_ = std::thread(&FuseConnection::ReadLoop, this);
+
+        struct fuse_init_in init = {};
+        init.major = FUSE_KERNEL_VERSION;
+        init.minor = 13;
+        init.max_readahead = kIoSize;
+        init.flags = FUSE_ASYNC_READ | FUSE_ATOMIC_O_TRUNC | FUSE_EXPORT_SUPPORT |
+                     FUSE_BIG_WRITES | FUSE_DO_READDIRPLUS;
+        return Call(FUSE_INIT, 0, {{&init, sizeof(init)}}, nullptr).error == 0;
+    }
+
+    // Ends the connection and waits for the daemon to exit
+    void Stop() {
+        shutdown(fd_, SHUT_RDWR);
+        reader_thread_.join();
+        daemon_thread_.join();
+        close(fd_);
+    }
+
+    // Sends a request made of |args| and waits for its reply. Adds the time it took to |latencies|
+    // unless it's null.
+    Reply Call(uint32_t opcode, uint64_t nodeid, std::initializer_list<iovec> args,
+               std::vector<uint64_t>* latencies) {
+        const uint64_t unique = next_unique_++;
+        PendingCall call;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            pending_[unique] = &call;
+        }
+
+        const uint64_t start_ns = nowNs();
+        if (!Send(opcode, nodeid, unique, args)) {
+            std::lock_guard<std::mutex> guard(lock_);
+            pending_.erase(unique);
+            return {EIO, {}};
+        }
+        std::unique_lock<std::mutex> lock(lock_);
+        cv_.wait(lock, [&] { return call.done || closed_; });
+        pending_.erase(unique);
+        if (!call.done) {
+            return {EIO, {}};
+        }
+        if (latencies) {
+            latencies->push_back(nowNs() - start_ns);
+        }
+        return std::move(call.reply);
+    }
+
+    FuseDaemon* daemon() const { return daemon_.get(); }
+
+    // Sends a request that has no reply, like forget
+    bool Send(uint32_t opcode, uint64_t nodeid, std::initializer_list<iovec> args) {
+        return Send(opcode, nodeid, next_unique_++, args);
+    }
+
+  private:
+    struct PendingCall {
+        Reply reply;
+        bool done = false;
+    };
+
+    bool Send(uint32_t opcode, uint64_t nodeid, uint64_t unique,
+              std::initializer_list<iovec> args) {
+        struct fuse_in_header in = {};
+        in.opcode = opcode;
+        in.unique = unique;
+        in.nodeid = nodeid;
+        in.uid = kAppUid;
+        in.gid = kAppUid;
+        in.pid = gettid();
+
+        std::vector<iovec> iov;
+        iov.push_back({&in, sizeof(in)});
+        iov.insert(iov.end(), args.begin(), args.end());
+        size_t len = 0;
+        for (const iovec& v : iov) {
+            len += v.iov_len;
+        }
+        in.len = len;
+        // Each message of the socket pair is a request, like each write to /dev/fuse
+        return writev(fd_, iov.data(), iov.size()) == static_cast<ssize_t>(len);
+    }
+
+    void ReadLoop() {
+        std::vector<char> buf(kMaxMessageSize);
+        while (true) {
+            const ssize_t res = recv(fd_, buf.data(), buf.size(), 0);
+            if (res < static_cast<ssize_t>(sizeof(struct fuse_out_header))) {
+                break;
+            }
+            const auto* out = reinterpret_cast<const struct fuse_out_header*>(buf.data());
+            // Notifications, e.g. to invalidate an entry, come without a request
+            if (!out->unique) continue;
+
+            std::lock_guard<std::mutex> guard(lock_);
+            auto it = pending_.find(out->unique);
+            if (it == pending_.end()) continue;
+            it->second->reply.error = -out->error;
+            it->second->reply.data.assign(buf.data() + sizeof(*out), buf.data() + res);
+            it->second->done = true;
+            cv_.notify_all();
+        }
+        std::lock_guard<std::mutex> guard(lock_);
+        closed_ = true;
+        cv_.notify_all();
+    }
+
+    int fd_ = -1;
+    std::unique_ptr<FuseDaemon> daemon_;
+    std::thread daemon_thread_;
+    std::thread reader_thread_;
+    std::atomic<uint64_t> next_unique_{1};
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    // Guarded by lock_
+    std::unordered_map<uint64_t, PendingCall*> pending_;
+    bool closed_ = false;
+};
+
+FuseConnection* connection;
+
+// One request of a trace, on the node of |path|, relative to the root of the daemon. The kernel
+// knows of a node once it was looked up, created or listed by an earlier request of the trace.
+struct Step {
+    enum Op {
+        kLookup,
+        kGetattr,
+        kOpendir,
+        // Lists the whole directory, with as many requests as needed
+        kReaddirplus,
+        kReleasedir,
+        kOpen,
+        kRead,
+        kRelease,
+        kCreate,
+        kWrite,
+        kFlush,
+        kUnlink,
+    };
+
+    Op op;
+    std::string path;
+    uint64_t offset;
+    uint32_t size;
+};
+
+using Trace = std::vector<Step>;
+
+void add(Trace* trace, Step::Op op, const std::string& path, uint64_t offset = 0,
+         uint32_t size = 0) {
+    trace->push_back({op, path, offset, size});
+}
+
+// Looks up every component of |path|
+void addLookups(Trace* trace, const std::string& path) {
+    for (size_t pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        add(trace, Step::kLookup, path.substr(0, pos));
+    }
+    add(trace, Step::kLookup, path);
+}
+
+std::string getParent(const std::string& path) {
+    const size_t pos = path.rfind('/');
+    return pos == std::string::npos ? "" : path.substr(0, pos);
+}
+
+std::string getName(const std::string& path) {
+    return path.substr(path.rfind('/') + 1);
+}
+
+// Replays traces the way the kernel would send them, and keeps track of what the kernel would
+// remember in between: the nodes it looked up and the handles it opened.
+class Replayer {
+  public:
+    explicit Replayer(FuseConnection* connection) : connection_(connection) {
+        nodes_[""] = kRootNodeId;
+    }
+
+    // Replays |trace| and adds the latency of every request to |latencies| unless it's null
+    bool Replay(const Trace& trace, std::vector<uint64_t>* latencies) {
+        for (const Step& step : trace) {
+            if (!ReplayStep(step, latencies)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Forgets all nodes, like the kernel does when it evicts them
+    bool ForgetAll() {
+        std::vector<struct fuse_forget_one> forgets;
+        for (const auto& [nodeid, nlookup] : lookups_) {
+            forgets.push_back({nodeid, nlookup});
+        }
+        lookups_.clear();
+        nodes_.clear();
+        nodes_[""] = kRootNodeId;
+        if (forgets.empty()) {
+            return true;
+        }
+
+        struct fuse_batch_forget_in in = {};
+        in.count = forgets.size();
+        return connection_->Send(FUSE_BATCH_FORGET, 0,
+                                 {{&in, sizeof(in)},
+                                  {forgets.data(), forgets.size() * sizeof(forgets[0])}});
+    }
+
+    const std::string& error() const { return error_; }
+
+  private:
+    bool Fail(const Step& step, int error) {
+        error_ = "Request " + std::to_string(step.op) + " on " + step.path +
+                 " failed: " + strerror(error);
+        return false;
+    }
+
+    // Returns the node of |path|, which the trace must have made known first
+    bool GetNode(const std::string& path, uint64_t* nodeid) {
+        auto it = nodes_.find(path);
+        if (it == nodes_.end()) {
+            error_ = "Trace uses " + path + " before looking it up";
+            return false;
+        }
+        *nodeid = it->second;
+        return true;
+    }
+
+    void AddNode(const std::string& path, const struct fuse_entry_out& entry) {
+        if (!entry.nodeid) return;
+        nodes_[path] = entry.nodeid;
+        lookups_[entry.nodeid]++;
+    }
+
+    bool ReplayStep(const Step& step, std::vector<uint64_t>* latencies) {
+        if (step.op == Step::kLookup || step.op == Step::kCreate || step.op == Step::kUnlink) {
+            return ReplayOnParent(step, latencies);
+        }
+
+        uint64_t nodeid;
+        if (!GetNode(step.path, &nodeid)) {
+            return false;
+        }
+        FuseConnection::Reply reply;
+        switch (step.op) {
+            case Step::kGetattr: {
+                struct fuse_getattr_in in = {};
+                reply = connection_->Call(FUSE_GETATTR, nodeid, {{&in, sizeof(in)}}, latencies);
+                break;
+            }
+            case Step::kOpendir:
+            case Step::kOpen: {
+                struct fuse_open_in in = {};
+                in.flags = step.op == Step::kOpendir ? O_RDONLY | O_DIRECTORY : O_RDONLY;
+                reply = connection_->Call(step.op == Step::kOpendir ? FUSE_OPENDIR : FUSE_OPEN,
+                                          nodeid, {{&in, sizeof(in)}}, latencies);
+                if (reply.error) break;
+                handles_[step.path] =
+                        reinterpret_cast<const struct fuse_open_out*>(reply.data.data())->fh;
+                break;
+            }
+            case Step::kReaddirplus:
+                return ReplayReaddirplus(step, nodeid, latencies);
+            case Step::kReleasedir:
+            case Step::kRelease: {
+                struct fuse_release_in in = {};
+                in.fh = handles_[step.path];
+                handles_.erase(step.path);
+                reply = connection_->Call(
+                        step.op == Step::kReleasedir ? FUSE_RELEASEDIR : FUSE_RELEASE, nodeid,
+                        {{&in, sizeof(in)}}, latencies);
+                break;
+            }
+            case Step::kRead: {
+                struct fuse_read_in in = {};
+                in.fh = handles_[step.path];
+                in.offset = step.offset;
+                in.size = step.size;
+                reply = connection_->Call(FUSE_READ, nodeid, {{&in, sizeof(in)}}, latencies);
+                break;
+            }
+            case Step::kWrite: {
+                static const std::vector<char> data(kIoSize, 'x');
+                struct fuse_write_in in = {};
+                in.fh = handles_[step.path];
+                in.offset = step.offset;
+                in.size = std::min<uint32_t>(step.size, data.size());
+                reply = connection_->Call(
+                        FUSE_WRITE, nodeid,
+                        {{&in, sizeof(in)}, {const_cast<char*>(data.data()), in.size}},
+                        latencies);
+                break;
+            }
+            case Step::kFlush: {
+                struct fuse_flush_in in = {};
+                in.fh = handles_[step.path];
+                reply = connection_->Call(FUSE_FLUSH, nodeid, {{&in, sizeof(in)}}, latencies);
+                break;
+            }
+            default:
+                error_ = "Unexpected request " + std::to_string(step.op);
+                return false;
+        }
+        return reply.error ? Fail(step, reply.error) : true;
+    }
+
+    // Requests naming a child of the node they are sent for
+    bool ReplayOnParent(const Step& step, std::vector<uint64_t>* latencies) {
+        uint64_t parent;
+        if (!GetNode(getParent(step.path), &parent)) {
+            return false;
+        }
+        const std::string name = getName(step.path);
+        iovec name_iov = {const_cast<char*>(name.c_str()), name.size() + 1};
+
+        FuseConnection::Reply reply;
+        switch (step.op) {
+            case Step::kLookup:
+                reply = connection_->Call(FUSE_LOOKUP, parent, {name_iov}, latencies);
+                // Looking up what doesn't exist is part of creating it
+                if (reply.error == ENOENT) return true;
+                if (reply.error) break;
+                AddNode(step.path,
+                        *reinterpret_cast<const struct fuse_entry_out*>(reply.data.data()));
+                break;
+            case Step::kCreate: {
+                struct fuse_create_in in = {};
+                in.flags = O_WRONLY | O_CREAT | O_TRUNC;
+                in.mode = S_IFREG | 0664;
+                reply = connection_->Call(FUSE_CREATE, parent, {{&in, sizeof(in)}, name_iov},
+                                          latencies);
+                if (reply.error) break;
+                const auto* entry = reinterpret_cast<const struct fuse_entry_out*>(reply.data.data());
+                const auto* open = reinterpret_cast<const struct fuse_open_out*>(entry + 1);
+                AddNode(step.path, *entry);
+                handles_[step.path] = open->fh;
+                break;
+            }
+            case Step::kUnlink:
+                reply = connection_->Call(FUSE_UNLINK, parent, {name_iov}, latencies);
+                // The node is forgotten later on, like the kernel does once its dentry goes away
+                nodes_.erase(step.path);
+                break;
+            default:
+                break;
+        }
+        return reply.error ? Fail(step, reply.error) : true;
+    }
+
+    bool ReplayReaddirplus(const Step& step, uint64_t nodeid, std::vector<uint64_t>* latencies) {
+        struct fuse_read_in in = {};
+        in.fh = handles_[step.path];
+        in.size = kReaddirSize;
+        while (true) {
+            const FuseConnection::Reply reply =
+                    connection_->Call(FUSE_READDIRPLUS, nodeid, {{&in, sizeof(in)}}, latencies);
+            if (reply.error) {
+                return Fail(step, reply.error);
+            }
+            if (reply.data.empty()) {
+                return true;
+            }
+
+            size_t pos = 0;
+            while (pos + FUSE_NAME_OFFSET_DIRENTPLUS <= reply.data.size()) {
+                const auto* entry =
+                        reinterpret_cast<const struct fuse_direntplus*>(reply.data.data() + pos);
+                const std::string name(entry->dirent.name, entry->dirent.namelen);
+                if (name != "." && name != "..") {
+                    AddNode(step.path + "/" + name, entry->entry_out);
+                }
+                in.offset = entry->dirent.off;
+                pos += FUSE_DIRENTPLUS_SIZE(entry);
+            }
+        }
+    }
+
+    FuseConnection* const connection_;
+    std::unordered_map<std::string, uint64_t> nodes_;
+    std::unordered_map<uint64_t, uint64_t> lookups_;
+    std::unordered_map<std::string, uint64_t> handles_;
+    std::string error_;
+};
+
+bool makeDirs(const std::string& path) {
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+        const std::string dir = path.substr(0, pos);
+        if (mkdir(dir.c_str(), 0775) && errno != EEXIST) {
+            return false;
+        }
+        if (pos == std::string::npos) return true;
+    }
+}
+
+// Sparse, the content doesn't matter
+bool makeFile(const std::string& path, off_t size) {
+    android::base::unique_fd fd(open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0664));
+    return fd.ok() && !ftruncate(fd.get(), size);
+}
+
+void removeTree(const std::string& path) {
+    nftw(path.c_str(),
+         [](const char* file, const struct stat*, int, struct FTW*) { return remove(file); }, 16,
+         FTW_DEPTH | FTW_PHYS);
+}
+
+// A workload below its own directory of the daemon, so that threads don't share files
+struct Workload {
+    // Creates the files the workload starts with below |lower_dir| on the lower filesystem
+    bool (*setup)(const std::string& lower_dir);
+    // The requests of one run of the workload below |dir|
+    Trace (*trace)(const std::string& dir);
+    // Requests that undo the changes of a run, replayed without being measured
+    Trace (*teardown)(const std::string& dir);
+};
+
+Trace noTeardown(const std::string& dir) {
+    return {};
+}
+
+// Scrolling through a gallery: the camera directory is listed, and the beginning of each picture
+// read to decode its thumbnail.
+constexpr int kGalleryPictures = 200;
+constexpr off_t kPictureSize = 4 * 1024 * 1024;
+
+std::string getPicture(const std::string& dir, int i) {
+    char name[32];
+    snprintf(name, sizeof(name), "/IMG_%04d.jpg", i);
+    return dir + "/DCIM/Camera" + name;
+}
+
+bool setUpGallery(const std::string& lower_dir) {
+    if (!makeDirs(lower_dir + "/DCIM/Camera")) return false;
+    for (int i = 0; i < kGalleryPictures; i++) {
+        if (!makeFile(getPicture(lower_dir, i), kPictureSize)) return false;
+    }
+    return true;
+}
+
+Trace getGalleryScrollTrace(const std::string& dir) {
+    Trace trace;
+    const std::string camera = dir + "/DCIM/Camera";
+    addLookups(&trace, camera);
+    add(&trace, Step::kOpendir, camera);
+    add(&trace, Step::kReaddirplus, camera);
+    add(&trace, Step::kReleasedir, camera);
+    for (int i = 0; i < kGalleryPictures; i++) {
+        const std::string picture = getPicture(dir, i);
+        add(&trace, Step::kOpen, picture);
+        add(&trace, Step::kRead, picture, 0, kIoSize);
+        add(&trace, Step::kRelease, picture);
+    }
+    return trace;
+}
+
+// A camera burst: pictures are created one after the other and written in full.
+constexpr int kBurstPictures = 20;
+constexpr uint32_t kBurstPictureSize = 2 * 1024 * 1024;
+
+std::string getBurstPicture(const std::string& dir, int i) {
+    char name[32];
+    snprintf(name, sizeof(name), "/IMG_BURST_%04d.jpg", i);
+    return dir + "/DCIM/Camera" + name;
+}
+
+bool setUpCameraBurst(const std::string& lower_dir) {
+    return makeDirs(lower_dir + "/DCIM/Camera");
+}
+
+Trace getCameraBurstTrace(const std::string& dir) {
+    Trace trace;
+    addLookups(&trace, dir + "/DCIM/Camera");
+    for (int i = 0; i < kBurstPictures; i++) {
+        const std::string picture = getBurstPicture(dir, i);
+        // The kernel looks up the name before creating it
+        add(&trace, Step::kLookup, picture);
+        add(&trace, Step::kCreate, picture);
+        for (uint32_t off = 0; off < kBurstPictureSize; off += kIoSize) {
+            add(&trace, Step::kWrite, picture, off, kIoSize);
+        }
+        add(&trace, Step::kFlush, picture);
+        add(&trace, Step::kRelease, picture);
+    }
+    return trace;
+}
+
+Trace getCameraBurstTeardown(const std::string& dir) {
+    Trace trace;
+    for (int i = 0; i < kBurstPictures; i++) {
+        add(&trace, Step::kUnlink, getBurstPicture(dir, i));
+    }
+    return trace;
+}
+
+// Streaming a video from start to end, with its location redacted.
+constexpr uint32_t kVideoSize = 32 * 1024 * 1024;
+
+bool setUpVideoStream(const std::string& lower_dir) {
+    return makeDirs(lower_dir + "/Movies") && makeFile(lower_dir + "/Movies/VID_0001.mp4", kVideoSize);
+}
+
+Trace getVideoStreamTrace(const std::string& dir) {
+    Trace trace;
+    const std::string video = dir + "/Movies/VID_0001.mp4";
+    addLookups(&trace, video);
+    add(&trace, Step::kOpen, video);
+    for (uint32_t off = 0; off < kVideoSize; off += kIoSize) {
+        add(&trace, Step::kRead, video, off, kIoSize);
+    }
+    add(&trace, Step::kRelease, video);
+    return trace;
+}
+
+uint64_t getPercentileUs(std::vector<uint64_t>* latencies, double percentile) {
+    if (latencies->empty()) return 0;
+    const size_t rank = std::min(latencies->size() - 1,
+                                 static_cast<size_t>(percentile * latencies->size()));
+    std::nth_element(latencies->begin(), latencies->begin() + rank, latencies->end());
+    return (*latencies)[rank] / 1000;
+}
+
+void runWorkload(benchmark::State& state, const Workload& workload) {
+    MediaProviderStubConfig config;
+    config.upcall_latency_us = state.range(0);
+    config.redaction_ranges = kRedactionRanges;
+    mediaprovider::fuse::SetMediaProviderStubConfig(config);
+
+    const std::string dir = "workload_" + std::to_string(gettid());
+    const std::string lower_dir = std::string(kRoot) + "/" + dir;
+    if (!workload.setup(lower_dir)) {
+        state.SkipWithError("Failed to set up workload");
+        removeTree(lower_dir);
+        return;
+    }
+    const Trace trace = workload.trace(dir);
+    const Trace teardown = workload.teardown(dir);
+
+    Replayer replayer(connection);
+    std::vector<uint64_t> latencies;
+    for (auto _ : state) {
+        if (!replayer.Replay(trace, &latencies)) {
+            state.SkipWithError(replayer.error().c_str());
+            break;
+        }
+        state.PauseTiming();
+        const bool reset = replayer.Replay(teardown, nullptr) && replayer.ForgetAll();
+        state.ResumeTiming();
+        if (!reset) {
+            state.SkipWithError(replayer.error().c_str());
+            break;
+        }
+    }
+    replayer.ForgetAll();
+    removeTree(lower_dir);
+
+    state.SetItemsProcessed(latencies.size());
+    state.counters["p50_us"] = benchmark::Counter(getPercentileUs(&latencies, 0.5),
+                                                  benchmark::Counter::kAvgThreads);
+    state.counters["p99_us"] = benchmark::Counter(getPercentileUs(&latencies, 0.99),
+                                                  benchmark::Counter::kAvgThreads);
+}
+
+void BM_GalleryScroll(benchmark::State& state) {
+    runWorkload(state, {setUpGallery, getGalleryScrollTrace, noTeardown});
+}
+
+void BM_CameraBurst(benchmark::State& state) {
+    runWorkload(state, {setUpCameraBurst, getCameraBurstTrace, getCameraBurstTeardown});
+}
+
+void BM_VideoStream(benchmark::State& state) {
+    runWorkload(state, {setUpVideoStream, getVideoStreamTrace, noTeardown});
+}
+
+// Upcall latency in us, which MediaProvider usually answers within a few hundred
+void workloadArgs(benchmark::internal::Benchmark* b) {
+    b->ArgName("upcall_us")->Arg(0)->Arg(100)->Arg(1000);
+    b->Threads(1)->Threads(4)->UseRealTime()->Unit(benchmark::kMillisecond);
+}
+
+BENCHMARK(BM_GalleryScroll)->Apply(workloadArgs);
+BENCHMARK(BM_CameraBurst)->Apply(workloadArgs);
+BENCHMARK(BM_VideoStream)->Apply(workloadArgs);
+
+// What MediaProvider asks the daemon through JNI on every ContentResolver#openFile, before handing
+// out a file: whether to open it through FUSE, which it must while the kernel caches its pages for
+// a handle opened through FUSE. The argument is whether such a handle is open.
+void BM_ShouldOpenWithFuse(benchmark::State& state) {
+    mediaprovider::fuse::SetMediaProviderStubConfig(MediaProviderStubConfig());
+
+    const std::string dir = "should_open_" + std::to_string(gettid());
+    const std::string picture = getPicture(dir, 0);
+    const std::string lower_path = std::string(kRoot) + "/" + picture;
+    const bool cached_handle = state.range(0);
+    if (!makeDirs(getParent(lower_path)) || !makeFile(lower_path, kPictureSize)) {
+        state.SkipWithError("Failed to set up file");
+        removeTree(std::string(kRoot) + "/" + dir);
+        return;
+    }
+
+    Trace trace;
+    addLookups(&trace, picture);
+    Trace teardown;
+    if (cached_handle) {
+        add(&trace, Step::kOpen, picture);
+        add(&teardown, Step::kRelease, picture);
+    }
+    Replayer replayer(connection);
+    android::base::unique_fd fd(open(lower_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd.ok()) {
+        state.SkipWithError("Failed to open file");
+    } else if (!replayer.Replay(trace, nullptr)) {
+        state.SkipWithError(replayer.error().c_str());
+    } else {
+        FuseDaemon* daemon = connection->daemon();
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(daemon->ShouldOpenWithFuse(fd.get(), true, lower_path));
+        }
+    }
+    replayer.Replay(teardown, nullptr);
+    replayer.ForgetAll();
+    removeTree(std::string(kRoot) + "/" + dir);
+}
+
+BENCHMARK(BM_ShouldOpenWithFuse)
+        ->ArgName("cached_handle")
+        ->Arg(0)
+        ->Arg(1)
+        ->Threads(1)
+        ->Threads(4)
+        ->UseRealTime();
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+
+    // The daemon runs with -odebug, which would log every request to stderr
+    fuse_set_log_func([](enum fuse_log_level, const char*, va_list) {});
+    if (!makeDirs(kRoot)) {
+        std::cerr << "Failed to create " << kRoot << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    connection = new FuseConnection();
+    if (!connection->Start(kRoot)) {
+        std::cerr << "Failed to start FuseDaemon" << std::endl;
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+
+    // Per request latencies as measured by the daemon, to tell where the time went
+    std::cerr << FuseDaemon::DumpStats() << std::endl;
+    connection->Stop();
+    removeTree(kRoot);
+    return 0;
+}
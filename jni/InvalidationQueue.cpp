@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FuseDaemon"
+
+#include "include/libfuse_jni/InvalidationQueue.h"
+
+namespace mediaprovider {
+namespace fuse {
+namespace {
+
+WorkerPool::Config getWorkerConfig() {
+    WorkerPool::Config config;
+    config.min_threads = 0;
+    config.max_threads = 1;
+    return config;
+}
+
+}  // namespace
+
+InvalidationQueue::InvalidationQueue(Notifier notifier)
+    : notifier_(std::move(notifier)),
+      draining_(false),
+      shutdown_(false),
+      stats_({}),
+      worker_(getWorkerConfig(), "fuse_inval") {}
+
+InvalidationQueue::~InvalidationQueue() {
+    Shutdown();
+}
+
+void InvalidationQueue::Add(uint64_t parent, std::string_view name, uint64_t child) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (shutdown_) {
+        return;
+    }
+
+    stats_.queued++;
+    auto [it, inserted] = queued_.try_emplace(std::make_pair(parent, std::string(name)), child);
+    if (!inserted) {
+        stats_.coalesced++;
+        if (child) {
+            it->second = child;
+        }
+    }
+    if (!draining_) {
+        draining_ = true;
+        worker_.Submit([this] { Drain(); });
+    }
+}
+
+void InvalidationQueue::Drain() {
+    std::unique_lock<std::mutex> guard(lock_);
+    while (!queued_.empty()) {
+        Batch batch;
+        batch.swap(queued_);
+        stats_.batches++;
+        guard.unlock();
+
+        for (const auto& [key, child] : batch) {
+            notifier_({key.first, key.second, child});
+        }
+
+        guard.lock();
+        stats_.notified += batch.size();
+    }
+    draining_ = false;
+    idle_cv_.notify_all();
+}
+
+void InvalidationQueue::Flush() {
+    std::unique_lock<std::mutex> guard(lock_);
+    idle_cv_.wait(guard, [this] { return !draining_; });
+}
+
+void InvalidationQueue::Shutdown() {
+    std::unique_lock<std::mutex> guard(lock_);
+    shutdown_ = true;
+    idle_cv_.wait(guard, [this] { return !draining_; });
+}
+
+InvalidationQueue::Stats InvalidationQueue::GetStats() {
+    std::lock_guard<std::mutex> guard(lock_);
+    return stats_;
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
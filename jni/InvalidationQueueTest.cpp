@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "InvalidationQueueTest"
+
+#include "libfuse_jni/InvalidationQueue.h"
+
+#include <gtest/gtest.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace mediaprovider::fuse;
+
+namespace {
+
+// Records the invalidations it is notified of, the first one is held up until it is opened
+class Recorder {
+  public:
+    void Notify(const InvalidationQueue::Invalidation& invalidation) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notified_.push_back(invalidation);
+        thread_id_ = std::this_thread::get_id();
+        cv_.notify_all();
+        cv_.wait(lock, [this] { return open_; });
+    }
+
+    // Waits until the worker is stuck in the first notification
+    void WaitForFirst() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return !notified_.empty(); });
+    }
+
+    void Open() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        open_ = true;
+        cv_.notify_all();
+    }
+
+    std::vector<InvalidationQueue::Invalidation> GetNotified() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return notified_;
+    }
+
+    std::thread::id GetThreadId() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return thread_id_;
+    }
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool open_ = false;
+    std::vector<InvalidationQueue::Invalidation> notified_;
+    std::thread::id thread_id_;
+};
+
+InvalidationQueue::Notifier makeNotifier(Recorder* recorder) {
+    return [recorder](const InvalidationQueue::Invalidation& invalidation) {
+        recorder->Notify(invalidation);
+    };
+}
+
+}  // namespace
+
+TEST(InvalidationQueueTest, testNotifiesFromWorker) {
+    Recorder recorder;
+    recorder.Open();
+    InvalidationQueue queue(makeNotifier(&recorder));
+
+    queue.Add(5, "foo", 6);
+    queue.Flush();
+
+    const std::vector<InvalidationQueue::Invalidation> notified = recorder.GetNotified();
+    ASSERT_EQ(1, notified.size());
+    EXPECT_EQ(5, notified[0].parent);
+    EXPECT_EQ("foo", notified[0].name);
+    EXPECT_EQ(6, notified[0].child);
+    EXPECT_NE(std::this_thread::get_id(), recorder.GetThreadId());
+}
+
+TEST(InvalidationQueueTest, testCoalescesWhileBusy) {
+    Recorder recorder;
+    InvalidationQueue queue(makeNotifier(&recorder));
+
+    queue.Add(1, "first");
+    recorder.WaitForFirst();
+
+    // Everything queued while the worker is busy is notified in one batch, each dentry once
+    for (int i = 0; i < 10; i++) {
+        queue.Add(2, "foo");
+        queue.Add(2, "FOO");
+        queue.Add(3, "foo");
+    }
+    // A child to invalidate sticks to the dentry, whichever invalidation it came with
+    queue.Add(2, "foo", 7);
+    queue.Add(2, "foo");
+    recorder.Open();
+    queue.Flush();
+
+    const std::vector<InvalidationQueue::Invalidation> notified = recorder.GetNotified();
+    ASSERT_EQ(4, notified.size());
+    EXPECT_EQ("first", notified[0].name);
+    EXPECT_EQ(2, notified[1].parent);
+    EXPECT_EQ("FOO", notified[1].name);
+    EXPECT_EQ(0, notified[1].child);
+    EXPECT_EQ(2, notified[2].parent);
+    EXPECT_EQ("foo", notified[2].name);
+    EXPECT_EQ(7, notified[2].child);
+    EXPECT_EQ(3, notified[3].parent);
+
+    const InvalidationQueue::Stats stats = queue.GetStats();
+    EXPECT_EQ(33, stats.queued);
+    EXPECT_EQ(29, stats.coalesced);
+    EXPECT_EQ(4, stats.notified);
+    EXPECT_EQ(2, stats.batches);
+}
+
+TEST(InvalidationQueueTest, testRequeuesOnceNotifying) {
+    Recorder recorder;
+    InvalidationQueue queue(makeNotifier(&recorder));
+
+    // The dentry may have been cached again since the worker picked it up, so it isn't coalesced
+    queue.Add(1, "foo");
+    recorder.WaitForFirst();
+    queue.Add(1, "foo");
+    recorder.Open();
+    queue.Flush();
+
+    EXPECT_EQ(2, recorder.GetNotified().size());
+    EXPECT_EQ(0, queue.GetStats().coalesced);
+}
+
+TEST(InvalidationQueueTest, testShutdown) {
+    Recorder recorder;
+    InvalidationQueue queue(makeNotifier(&recorder));
+
+    queue.Add(1, "foo");
+    recorder.WaitForFirst();
+    queue.Add(1, "bar");
+    std::thread opener([&recorder] { recorder.Open(); });
+
+    // What was queued before is still notified, but nothing after
+    queue.Shutdown();
+    opener.join();
+    queue.Add(1, "baz");
+    queue.Flush();
+
+    const std::vector<InvalidationQueue::Invalidation> notified = recorder.GetNotified();
+    ASSERT_EQ(2, notified.size());
+    EXPECT_EQ("bar", notified[1].name);
+}
@@ -14,20 +14,20 @@
  * limitations under the License.
  */
 
+// The caching and bypass logic around MediaProvider. The calls into it are made by
+// MediaProviderWrapperJni.cpp, or MediaProviderWrapperStub.cpp in benchmarks.
+
 #include "MediaProviderWrapper.h"
+#include "libfuse_jni/FuseStats.h"
 #include "libfuse_jni/ReaddirHelper.h"
 
 #include <android-base/logging.h>
 #include <android-base/properties.h>
-#include <jni.h>
-#include <nativehelper/scoped_local_ref.h>
-#include <nativehelper/scoped_primitive_array.h>
-#include <nativehelper/scoped_utf_chars.h>
-
-#include <pthread.h>
-
+#include <chrono>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 namespace mediaprovider {
 namespace fuse {
@@ -37,6 +37,8 @@ using std::string;
 namespace {
 
 constexpr const char* kPropRedactionEnabled = "persist.sys.fuse.redaction-enabled";
+// Commit inserts and deletes from concurrent FUSE threads to the database at once.
+constexpr const char* kPropGroupCommit = "persist.sys.fuse.group_commit";
 
 constexpr uid_t ROOT_UID = 0;
 constexpr uid_t SHELL_UID = 2000;
@@ -47,261 +49,53 @@ inline bool shouldBypassMediaProvider(uid_t uid) {
     return uid == SHELL_UID || uid == ROOT_UID;
 }
 
-static bool CheckForJniException(JNIEnv* env) {
-    if (env->ExceptionCheck()) {
-        env->ExceptionDescribe();
-        env->ExceptionClear();
-        return true;
-    }
-    return false;
-}
-
-std::unique_ptr<RedactionInfo> getRedactionInfoInternal(JNIEnv* env, jobject media_provider_object,
-                                                        jmethodID mid_get_redaction_ranges,
-                                                        uid_t uid, pid_t tid, const string& path) {
-    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
-    ScopedLongArrayRO redaction_ranges(
-            env, static_cast<jlongArray>(env->CallObjectMethod(
-                         media_provider_object, mid_get_redaction_ranges, j_path.get(), uid, tid)));
-
-    if (CheckForJniException(env)) {
-        return nullptr;
-    }
-
-    std::unique_ptr<RedactionInfo> ri;
-    if (redaction_ranges.size() % 2) {
-        LOG(ERROR) << "Error while calculating redaction ranges: array length is uneven";
-    } else if (redaction_ranges.size() > 0) {
-        ri = std::make_unique<RedactionInfo>(redaction_ranges.size() / 2, redaction_ranges.get());
-    } else {
-        // No ranges to redact
-        ri = std::make_unique<RedactionInfo>();
-    }
-
-    return ri;
-}
-
-int insertFileInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid_insert_file,
-                       const string& path, uid_t uid) {
-    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
-    int res = env->CallIntMethod(media_provider_object, mid_insert_file, j_path.get(), uid);
-
-    if (CheckForJniException(env)) {
-        return EFAULT;
-    }
-    return res;
-}
-
-int deleteFileInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid_delete_file,
-                       const string& path, uid_t uid) {
-    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
-    int res = env->CallIntMethod(media_provider_object, mid_delete_file, j_path.get(), uid);
-
-    if (CheckForJniException(env)) {
-        return EFAULT;
-    }
-    return res;
-}
-
-int isOpenAllowedInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid_is_open_allowed,
-                          const string& path, uid_t uid, bool for_write) {
-    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
-    int res = env->CallIntMethod(media_provider_object, mid_is_open_allowed, j_path.get(), uid,
-                                 for_write);
-
-    if (CheckForJniException(env)) {
-        return EFAULT;
-    }
-    return res;
-}
-
-void scanFileInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid_scan_file,
-                      const string& path) {
-    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
-    env->CallVoidMethod(media_provider_object, mid_scan_file, j_path.get());
-    CheckForJniException(env);
-}
-
-int isMkdirOrRmdirAllowedInternal(JNIEnv* env, jobject media_provider_object,
-                                  jmethodID mid_is_mkdir_or_rmdir_allowed, const string& path,
-                                  uid_t uid, bool forCreate) {
-    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
-    int res = env->CallIntMethod(media_provider_object, mid_is_mkdir_or_rmdir_allowed, j_path.get(),
-                                 uid, forCreate);
-
-    if (CheckForJniException(env)) {
-        return EFAULT;
-    }
-    return res;
-}
-
-int isOpendirAllowedInternal(JNIEnv* env, jobject media_provider_object,
-                             jmethodID mid_is_opendir_allowed, const string& path, uid_t uid,
-                             bool forWrite) {
-    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
-    int res = env->CallIntMethod(media_provider_object, mid_is_opendir_allowed, j_path.get(), uid,
-                                 forWrite);
-
-    if (CheckForJniException(env)) {
-        return EFAULT;
-    }
-    return res;
-}
-
-bool isUidForPackageInternal(JNIEnv* env, jobject media_provider_object,
-                             jmethodID mid_is_uid_for_package, const string& pkg, uid_t uid) {
-    ScopedLocalRef<jstring> j_pkg(env, env->NewStringUTF(pkg.c_str()));
-    bool res = env->CallBooleanMethod(media_provider_object, mid_is_uid_for_package, j_pkg.get(),
-            uid);
-
-    if (CheckForJniException(env)) {
-        return false;
-    }
-    return res;
-}
-
-std::vector<std::shared_ptr<DirectoryEntry>> getFilesInDirectoryInternal(
-        JNIEnv* env, jobject media_provider_object, jmethodID mid_get_files_in_dir, uid_t uid,
-        const string& path) {
-    std::vector<std::shared_ptr<DirectoryEntry>> directory_entries;
-    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
-
-    ScopedLocalRef<jobjectArray> files_list(
-            env, static_cast<jobjectArray>(env->CallObjectMethod(
-                         media_provider_object, mid_get_files_in_dir, j_path.get(), uid)));
-
-    if (CheckForJniException(env)) {
-        directory_entries.push_back(std::make_shared<DirectoryEntry>("", EFAULT));
-        return directory_entries;
-    }
-
-    int de_count = env->GetArrayLength(files_list.get());
-    if (de_count == 1) {
-        ScopedLocalRef<jstring> j_d_name(env,
-                                         (jstring)env->GetObjectArrayElement(files_list.get(), 0));
-        ScopedUtfChars d_name(env, j_d_name.get());
-        if (d_name.c_str() == nullptr) {
-            LOG(ERROR) << "Error reading file name returned from MediaProvider at index " << 0;
-            directory_entries.push_back(std::make_shared<DirectoryEntry>("", EFAULT));
-            return directory_entries;
-        } else if (d_name.c_str()[0] == '\0') {
-            // Calling package has no storage permissions.
-            directory_entries.push_back(std::make_shared<DirectoryEntry>("", EPERM));
-            return directory_entries;
-        }
-    }
-
-    for (int i = 0; i < de_count; i++) {
-        ScopedLocalRef<jstring> j_d_name(env,
-                                         (jstring)env->GetObjectArrayElement(files_list.get(), i));
-        ScopedUtfChars d_name(env, j_d_name.get());
-
-        if (d_name.c_str() == nullptr) {
-            LOG(ERROR) << "Error reading file name returned from MediaProvider at index " << i;
-            directory_entries.resize(0);
-            directory_entries.push_back(std::make_shared<DirectoryEntry>("", EFAULT));
-            break;
-        }
-        directory_entries.push_back(std::make_shared<DirectoryEntry>(d_name.c_str(), DT_REG));
-    }
-    return directory_entries;
-}
-
-int renameInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid_rename,
-                   const string& old_path, const string& new_path, uid_t uid) {
-    ScopedLocalRef<jstring> j_old_path(env, env->NewStringUTF(old_path.c_str()));
-    ScopedLocalRef<jstring> j_new_path(env, env->NewStringUTF(new_path.c_str()));
-    int res = env->CallIntMethod(media_provider_object, mid_rename, j_old_path.get(),
-                                 j_new_path.get(), uid);
-
-    if (CheckForJniException(env)) {
-        return EFAULT;
-    }
-    return res;
-}
-
-void onFileCreatedInternal(JNIEnv* env, jobject media_provider_object,
-                           jmethodID mid_on_file_created, const string& path) {
-    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
-
-    env->CallVoidMethod(media_provider_object, mid_on_file_created, j_path.get());
-    CheckForJniException(env);
-    return;
-}
-
 }  // namespace
 /*****************************************************************************************/
 /******************************* Public API Implementation *******************************/
 /*****************************************************************************************/
 
-JavaVM* MediaProviderWrapper::gJavaVm = nullptr;
-pthread_key_t MediaProviderWrapper::gJniEnvKey;
-
-void MediaProviderWrapper::OneTimeInit(JavaVM* vm) {
-    gJavaVm = vm;
-    CHECK(gJavaVm != nullptr);
-
-    pthread_key_create(&MediaProviderWrapper::gJniEnvKey,
-                       MediaProviderWrapper::DetachThreadFunction);
+MediaProviderWrapper::MediaProviderWrapper(JNIEnv* env, jobject media_provider)
+    : group_commit_(GetBoolProperty(kPropGroupCommit, false)) {
+    InitMediaProvider(env, media_provider);
+    notification_thread_ = std::thread(&MediaProviderWrapper::NotificationLoop, this);
 }
 
-MediaProviderWrapper::MediaProviderWrapper(JNIEnv* env, jobject media_provider) {
-    if (!media_provider) {
-        LOG(FATAL) << "MediaProvider is null!";
-    }
-
-    media_provider_object_ = reinterpret_cast<jobject>(env->NewGlobalRef(media_provider));
-    media_provider_class_ = env->FindClass("com/android/providers/media/MediaProvider");
-    if (!media_provider_class_) {
-        LOG(FATAL) << "Could not find class MediaProvider";
+MediaProviderWrapper::~MediaProviderWrapper() {
+    {
+        std::lock_guard<std::mutex> guard(notification_lock_);
+        notification_quit_ = true;
     }
-    media_provider_class_ = reinterpret_cast<jclass>(env->NewGlobalRef(media_provider_class_));
-
-    // Cache methods - Before calling a method, make sure you cache it here
-    mid_get_redaction_ranges_ = CacheMethod(env, "getRedactionRanges", "(Ljava/lang/String;II)[J",
-                                            /*is_static*/ false);
-    mid_insert_file_ = CacheMethod(env, "insertFileIfNecessary", "(Ljava/lang/String;I)I",
-                                   /*is_static*/ false);
-    mid_delete_file_ = CacheMethod(env, "deleteFile", "(Ljava/lang/String;I)I", /*is_static*/ false);
-    mid_is_open_allowed_ = CacheMethod(env, "isOpenAllowed", "(Ljava/lang/String;IZ)I",
-                                       /*is_static*/ false);
-    mid_scan_file_ = CacheMethod(env, "scanFile", "(Ljava/lang/String;)V",
-                                 /*is_static*/ false);
-    mid_is_mkdir_or_rmdir_allowed_ = CacheMethod(env, "isDirectoryCreationOrDeletionAllowed",
-                                                 "(Ljava/lang/String;IZ)I", /*is_static*/ false);
-    mid_is_opendir_allowed_ = CacheMethod(env, "isOpendirAllowed", "(Ljava/lang/String;IZ)I",
-                                          /*is_static*/ false);
-    mid_get_files_in_dir_ =
-            CacheMethod(env, "getFilesInDirectory", "(Ljava/lang/String;I)[Ljava/lang/String;",
-                        /*is_static*/ false);
-    mid_rename_ = CacheMethod(env, "rename", "(Ljava/lang/String;Ljava/lang/String;I)I",
-                              /*is_static*/ false);
-    mid_is_uid_for_package_ = CacheMethod(env, "isUidForPackage", "(Ljava/lang/String;I)Z",
-                              /*is_static*/ false);
-    mid_on_file_created_ = CacheMethod(env, "onFileCreated", "(Ljava/lang/String;)V",
-                                       /*is_static*/ false);
-}
+    notification_queued_.notify_one();
+    notification_thread_.join();
 
-MediaProviderWrapper::~MediaProviderWrapper() {
-    JNIEnv* env = MaybeAttachCurrentThread();
-    env->DeleteGlobalRef(media_provider_object_);
-    env->DeleteGlobalRef(media_provider_class_);
+    ReleaseMediaProvider();
 }
 
-std::unique_ptr<RedactionInfo> MediaProviderWrapper::GetRedactionInfo(const string& path, uid_t uid,
-                                                                      pid_t tid) {
+std::unique_ptr<RedactionInfo> MediaProviderWrapper::GetRedactionInfo(const string& path,
+                                                                      const struct stat& st,
+                                                                      uid_t uid, pid_t tid) {
     if (shouldBypassMediaProvider(uid) || !GetBoolProperty(kPropRedactionEnabled, true)) {
         return std::make_unique<RedactionInfo>();
     }
 
+    std::unique_ptr<RedactionInfo> cached = redaction_info_cache_.Lookup(path, uid, st);
+    if (cached) {
+        return cached;
+    }
+
     // Default value in case JNI thread was being terminated, causes the read to fail.
     std::unique_ptr<RedactionInfo> res = nullptr;
 
-    JNIEnv* env = MaybeAttachCurrentThread();
-    auto ri = getRedactionInfoInternal(env, media_provider_object_, mid_get_redaction_ranges_, uid,
-                                       tid, path);
-    res = std::move(ri);
+    const uint64_t generation = redaction_info_cache_.GetGeneration(path, uid);
+    FuseStats::ScopedUpcall upcall(FuseStats::kUpcallGetRedactionInfo);
+    res = CallGetRedactionInfo(path, uid, tid);
 
+    // Only redacted files are cached; that is where the metadata has to be parsed, and an entry
+    // that outlives a permission grant can only redact too much. Requests from our own uid are
+    // answered based on the calling thread, so they are never cached.
+    if (res && res->isRedactionNeeded() && uid != getuid()) {
+        redaction_info_cache_.Insert(path, uid, st, *res, generation);
+    }
     return res;
 }
 
@@ -310,18 +104,33 @@ int MediaProviderWrapper::InsertFile(const string& path, uid_t uid) {
         return 0;
     }
 
-    JNIEnv* env = MaybeAttachCurrentThread();
-    return insertFileInternal(env, media_provider_object_, mid_insert_file_, path, uid);
+    int res;
+    FuseStats::ScopedUpcall upcall(FuseStats::kUpcallInsertFile);
+    if (group_commit_) {
+        res = RunGroupCommit(&insert_commit_, Batch::kInsertFiles, path, uid);
+    } else {
+        res = CallInsertFile(path, uid);
+    }
+    // The new row may change who can access the path.
+    permission_cache_.InvalidatePath(path);
+    redaction_info_cache_.InvalidatePath(path);
+    return res;
 }
 
 int MediaProviderWrapper::DeleteFile(const string& path, uid_t uid) {
+    int res;
     if (uid == ROOT_UID) {
-        int res = unlink(path.c_str());
-        return res;
+        res = unlink(path.c_str());
+    } else if (group_commit_) {
+        FuseStats::ScopedUpcall upcall(FuseStats::kUpcallDeleteFile);
+        res = RunGroupCommit(&delete_commit_, Batch::kDeleteFiles, path, uid);
+    } else {
+        FuseStats::ScopedUpcall upcall(FuseStats::kUpcallDeleteFile);
+        res = CallDeleteFile(path, uid);
     }
-
-    JNIEnv* env = MaybeAttachCurrentThread();
-    return deleteFileInternal(env, media_provider_object_, mid_delete_file_, path, uid);
+    permission_cache_.InvalidatePath(path);
+    redaction_info_cache_.InvalidatePath(path);
+    return res;
 }
 
 int MediaProviderWrapper::IsOpenAllowed(const string& path, uid_t uid, bool for_write) {
@@ -329,14 +138,26 @@ int MediaProviderWrapper::IsOpenAllowed(const string& path, uid_t uid, bool for_
         return 0;
     }
 
-    JNIEnv* env = MaybeAttachCurrentThread();
-    return isOpenAllowedInternal(env, media_provider_object_, mid_is_open_allowed_, path, uid,
-                                 for_write);
+    const PermissionCache::Op op =
+            for_write ? PermissionCache::Op::kOpenForWrite : PermissionCache::Op::kOpen;
+    int res;
+    if (permission_cache_.LookupPathDecision(uid, path, op, &res)) {
+        return res;
+    }
+
+    const uint64_t epoch = permission_cache_.GetEpoch();
+    FuseStats::ScopedUpcall upcall(FuseStats::kUpcallIsOpenAllowed);
+    res = CallIsOpenAllowed(path, uid, for_write);
+    // Only cache successful checks. Failures aren't worth caching and we may not be told when
+    // they stop applying, e.g. when a file is added to the database.
+    if (res == 0) {
+        permission_cache_.InsertPathDecision(uid, path, op, res, epoch);
+    }
+    return res;
 }
 
 void MediaProviderWrapper::ScanFile(const string& path) {
-    JNIEnv* env = MaybeAttachCurrentThread();
-    scanFileInternal(env, media_provider_object_, mid_scan_file_, path);
+    QueueNotification(Notification::kScanFile, path);
 }
 
 int MediaProviderWrapper::IsCreatingDirAllowed(const string& path, uid_t uid) {
@@ -344,10 +165,19 @@ int MediaProviderWrapper::IsCreatingDirAllowed(const string& path, uid_t uid) {
         return 0;
     }
 
-    JNIEnv* env = MaybeAttachCurrentThread();
-    return isMkdirOrRmdirAllowedInternal(env, media_provider_object_,
-                                         mid_is_mkdir_or_rmdir_allowed_, path, uid,
-                                         /*forCreate*/ true);
+    int res;
+    if (permission_cache_.LookupPathDecision(uid, path, PermissionCache::Op::kCreateDir, &res)) {
+        return res;
+    }
+
+    const uint64_t epoch = permission_cache_.GetEpoch();
+    FuseStats::ScopedUpcall upcall(FuseStats::kUpcallIsCreatingDirAllowed);
+    res = CallIsMkdirOrRmdirAllowed(path, uid, /*for_create*/ true);
+    if (res == 0) {
+        permission_cache_.InsertPathDecision(uid, path, PermissionCache::Op::kCreateDir, res,
+                                             epoch);
+    }
+    return res;
 }
 
 int MediaProviderWrapper::IsDeletingDirAllowed(const string& path, uid_t uid) {
@@ -355,44 +185,58 @@ int MediaProviderWrapper::IsDeletingDirAllowed(const string& path, uid_t uid) {
         return 0;
     }
 
-    JNIEnv* env = MaybeAttachCurrentThread();
-    return isMkdirOrRmdirAllowedInternal(env, media_provider_object_,
-                                         mid_is_mkdir_or_rmdir_allowed_, path, uid,
-                                         /*forCreate*/ false);
+    FuseStats::ScopedUpcall upcall(FuseStats::kUpcallIsDeletingDirAllowed);
+    return CallIsMkdirOrRmdirAllowed(path, uid, /*for_create*/ false);
 }
 
-std::vector<std::shared_ptr<DirectoryEntry>> MediaProviderWrapper::GetDirectoryEntries(
-        uid_t uid, const string& path, DIR* dirp) {
-    // Default value in case JNI thread was being terminated
-    std::vector<std::shared_ptr<DirectoryEntry>> res;
+DirectoryEntries MediaProviderWrapper::GetDirectoryEntries(uid_t uid, const string& path,
+                                                           DIR* dirp) {
+    DirectoryEntries res;
     if (shouldBypassMediaProvider(uid)) {
         addDirectoryEntriesFromLowerFs(dirp, /* filter */ nullptr, &res);
         return res;
     }
 
-    JNIEnv* env = MaybeAttachCurrentThread();
-    res = getFilesInDirectoryInternal(env, media_provider_object_, mid_get_files_in_dir_, uid, path);
+    FuseStats::ScopedUpcall upcall(FuseStats::kUpcallGetDirectoryEntries);
+    res = CallGetFilesInDirectory(uid, path);
 
-    const int res_size = res.size();
-    if (res_size && res[0]->d_name[0] == '/') {
+    if (res.error()) {
+        return res;
+    }
+    if (!res.empty() && res.name(0)[0] == '/') {
         // Path is unknown to MediaProvider, get files and directories from lower file system.
-        res.resize(0);
+        res.Clear();
         addDirectoryEntriesFromLowerFs(dirp, /* filter */ nullptr, &res);
-    } else if (res_size == 0 || !res[0]->d_name.empty()) {
+    } else {
         // add directory names from lower file system.
         addDirectoryEntriesFromLowerFs(dirp, /* filter */ &isDirectory, &res);
     }
     return res;
 }
 
+bool MediaProviderWrapper::IsListingFromLowerFs(uid_t uid) const {
+    return shouldBypassMediaProvider(uid);
+}
+
 int MediaProviderWrapper::IsOpendirAllowed(const string& path, uid_t uid, bool forWrite) {
     if (shouldBypassMediaProvider(uid)) {
         return 0;
     }
 
-    JNIEnv* env = MaybeAttachCurrentThread();
-    return isOpendirAllowedInternal(env, media_provider_object_, mid_is_opendir_allowed_, path, uid,
-                                    forWrite);
+    const PermissionCache::Op op =
+            forWrite ? PermissionCache::Op::kOpendirForWrite : PermissionCache::Op::kOpendir;
+    int res;
+    if (permission_cache_.LookupPathDecision(uid, path, op, &res)) {
+        return res;
+    }
+
+    const uint64_t epoch = permission_cache_.GetEpoch();
+    FuseStats::ScopedUpcall upcall(FuseStats::kUpcallIsOpendirAllowed);
+    res = CallIsOpendirAllowed(path, uid, forWrite);
+    if (res == 0) {
+        permission_cache_.InsertPathDecision(uid, path, op, res, epoch);
+    }
+    return res;
 }
 
 bool MediaProviderWrapper::IsUidForPackage(const string& pkg, uid_t uid) {
@@ -400,77 +244,162 @@ bool MediaProviderWrapper::IsUidForPackage(const string& pkg, uid_t uid) {
         return true;
     }
 
-    JNIEnv* env = MaybeAttachCurrentThread();
-    return isUidForPackageInternal(env, media_provider_object_, mid_is_uid_for_package_, pkg, uid);
+    bool res;
+    if (permission_cache_.LookupUidForPackage(uid, pkg, &res)) {
+        return res;
+    }
+
+    const uint64_t epoch = permission_cache_.GetEpoch();
+    FuseStats::ScopedUpcall upcall(FuseStats::kUpcallIsUidForPackage);
+    res = CallIsUidForPackage(pkg, uid);
+    // A JNI failure also returns false, so only cache matches.
+    if (res) {
+        permission_cache_.InsertUidForPackage(uid, pkg, res, epoch);
+    }
+    return res;
+}
+
+bool MediaProviderWrapper::IsUidForPackageCached(const string& pkg, uid_t uid) {
+    return shouldBypassMediaProvider(uid) || permission_cache_.HasUidForPackage(uid, pkg);
 }
 
 int MediaProviderWrapper::Rename(const string& old_path, const string& new_path, uid_t uid) {
     // Rename from SHELL_UID should go through MediaProvider to update database rows, so only bypass
     // MediaProvider for ROOT_UID.
+    int res;
     if (uid == ROOT_UID) {
-        int res = rename(old_path.c_str(), new_path.c_str());
+        res = rename(old_path.c_str(), new_path.c_str());
         if (res != 0) res = -errno;
-        return res;
+    } else {
+        FuseStats::ScopedUpcall upcall(FuseStats::kUpcallRename);
+        res = CallRename(old_path, new_path, uid);
     }
-
-    JNIEnv* env = MaybeAttachCurrentThread();
-    return renameInternal(env, media_provider_object_, mid_rename_, old_path, new_path, uid);
+    permission_cache_.InvalidatePath(old_path);
+    permission_cache_.InvalidatePath(new_path);
+    redaction_info_cache_.InvalidatePath(old_path);
+    redaction_info_cache_.InvalidatePath(new_path);
+    return res;
 }
 
 void MediaProviderWrapper::OnFileCreated(const string& path) {
-    JNIEnv* env = MaybeAttachCurrentThread();
+    QueueNotification(Notification::kFileCreated, path);
+}
 
-    return onFileCreatedInternal(env, media_provider_object_, mid_on_file_created_, path);
+void MediaProviderWrapper::InvalidatePermissionCache(uid_t uid) {
+    permission_cache_.InvalidateUid(uid);
+    // Whether a file is redacted depends on the permissions of the reader too.
+    redaction_info_cache_.InvalidateUid(uid);
+}
+
+void MediaProviderWrapper::InvalidatePermissionCache(const string& path) {
+    permission_cache_.InvalidatePath(path);
+}
+
+void MediaProviderWrapper::InvalidatePermissionCache() {
+    permission_cache_.InvalidateAll();
+    redaction_info_cache_.InvalidateAll();
+}
+
+PermissionCache::Stats MediaProviderWrapper::GetPermissionCacheStats() const {
+    return permission_cache_.GetStats();
+}
+
+void MediaProviderWrapper::InvalidateRedactionInfoCache(const string& path) {
+    redaction_info_cache_.InvalidatePath(path);
+}
+
+RedactionInfoCache::Stats MediaProviderWrapper::GetRedactionInfoCacheStats() const {
+    return redaction_info_cache_.GetStats();
+}
+
+bool MediaProviderWrapper::SaveRedactionInfoCache(const string& file) const {
+    return redaction_info_cache_.SaveSnapshot(file);
+}
+
+size_t MediaProviderWrapper::LoadRedactionInfoCache(const string& file) {
+    return redaction_info_cache_.LoadSnapshot(file);
 }
 
 /*****************************************************************************************/
 /******************************** Private member functions *******************************/
 /*****************************************************************************************/
 
-/**
- * Finds MediaProvider method and adds it to methods map so it can be quickly called later.
- */
-jmethodID MediaProviderWrapper::CacheMethod(JNIEnv* env, const char method_name[],
-                                            const char signature[], bool is_static) {
-    jmethodID mid;
-    string actual_method_name(method_name);
-    actual_method_name.append("ForFuse");
-    if (is_static) {
-        mid = env->GetStaticMethodID(media_provider_class_, actual_method_name.c_str(), signature);
-    } else {
-        mid = env->GetMethodID(media_provider_class_, actual_method_name.c_str(), signature);
-    }
-    if (!mid) {
-        // SHOULD NOT HAPPEN!
-        LOG(FATAL) << "Error caching method: " << method_name << signature;
-    }
-    return mid;
+void MediaProviderWrapper::QueueNotification(Notification::Type type, const string& path) {
+    std::unique_lock<std::mutex> lock(notification_lock_);
+    notification_sent_.wait(lock, [this] {
+        return notification_queue_.size() < kMaxQueuedNotifications;
+    });
+    notification_queue_.push({type, path});
+    lock.unlock();
+    notification_queued_.notify_one();
 }
 
-void MediaProviderWrapper::DetachThreadFunction(void* unused) {
-    int detach = gJavaVm->DetachCurrentThread();
-    CHECK_EQ(detach, 0);
+void MediaProviderWrapper::NotificationLoop() {
+    std::vector<string> paths;
+    paths.reserve(kMaxBatchSize);
+
+    while (true) {
+        std::unique_lock<std::mutex> lock(notification_lock_);
+        notification_queued_.wait(
+                lock, [this] { return notification_quit_ || !notification_queue_.empty(); });
+        if (notification_queue_.empty()) {
+            // Only quit once everything queued has been sent
+            return;
+        }
+
+        // Coalesce consecutive notifications of the same type, so that they are still sent in
+        // the order they were queued in
+        const Notification::Type type = notification_queue_.front().type;
+        paths.clear();
+        while (!notification_queue_.empty() && paths.size() < kMaxBatchSize &&
+               notification_queue_.front().type == type) {
+            paths.push_back(std::move(notification_queue_.front().path));
+            notification_queue_.pop();
+        }
+        lock.unlock();
+        notification_sent_.notify_all();
+
+        FuseStats::ScopedUpcall upcall(FuseStats::kUpcallNotify);
+        CallSendPaths(type, paths);
+    }
 }
 
-JNIEnv* MediaProviderWrapper::MaybeAttachCurrentThread() {
-    // We could use pthread_getspecific here as that's likely quicker but
-    // that would result in wrong behaviour for threads that don't need to
-    // be attached (e.g, those that were created in managed code).
-    JNIEnv* env = nullptr;
-    if (gJavaVm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_4) == JNI_OK) {
-        return env;
+int MediaProviderWrapper::RunGroupCommit(GroupCommit* commit, Batch kind, const string& path,
+                                         uid_t uid) {
+    GroupCommit::Call call = {&path, uid, 0, false};
+
+    std::unique_lock<std::mutex> lock(commit->lock);
+    commit->queue.push_back(&call);
+    commit->cv.wait(lock, [&] { return call.done || !commit->in_flight; });
+    if (call.done) {
+        return call.res;
     }
 
-    // This thread is currently unattached, so it must not have any TLS
-    // value. Note that we don't really care about the actual value we store
-    // in TLS -- we only care about the value destructor being called, which
-    // will happen as long as the key is not null.
-    CHECK(pthread_getspecific(gJniEnvKey) == nullptr);
-    CHECK_EQ(gJavaVm->AttachCurrentThread(&env, nullptr), 0);
-    CHECK(env != nullptr);
+    // Nothing is in flight, so commit everything that queued up, including our own call
+    std::vector<GroupCommit::Call*> batch;
+    batch.swap(commit->queue);
+    commit->in_flight = true;
+    lock.unlock();
+
+    std::vector<string> paths;
+    std::vector<uid_t> uids;
+    paths.reserve(batch.size());
+    uids.reserve(batch.size());
+    for (const GroupCommit::Call* queued : batch) {
+        paths.push_back(*queued->path);
+        uids.push_back(queued->uid);
+    }
+    const std::vector<int> res = CallBatch(kind, paths, uids);
 
-    pthread_setspecific(gJniEnvKey, env);
-    return env;
+    lock.lock();
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch[i]->res = res[i];
+        batch[i]->done = true;
+    }
+    commit->in_flight = false;
+    lock.unlock();
+    commit->cv.notify_all();
+    return call.res;
 }
 
 }  // namespace fuse
@@ -18,6 +18,7 @@
 #define MEDIAPROVIDER_FUSE_MEDIAPROVIDERWRAPPER_H_
 
 #include <jni.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <dirent.h>
@@ -28,9 +29,12 @@
 #include <queue>
 #include <string>
 #include <thread>
+#include <vector>
 
+#include "libfuse_jni/PermissionCache.h"
 #include "libfuse_jni/ReaddirHelper.h"
 #include "libfuse_jni/RedactionInfo.h"
+#include "libfuse_jni/RedactionInfoCache.h"
 
 namespace mediaprovider {
 namespace fuse {
@@ -49,13 +53,17 @@ class MediaProviderWrapper final {
      *
      * @param uid UID of the app requesting the read
      * @param path path of the requested file
+     * @param st attributes of the opened file, used to tell whether previously computed
+     * redaction ranges still apply
      * @return RedactionInfo on success, nullptr on failure to calculate
      * redaction ranges (e.g. exception was thrown in Java world)
      */
-    std::unique_ptr<RedactionInfo> GetRedactionInfo(const std::string& path, uid_t uid, pid_t tid);
+    std::unique_ptr<RedactionInfo> GetRedactionInfo(const std::string& path, const struct stat& st,
+                                                    uid_t uid, pid_t tid);
 
     /**
-     * Inserts a new entry for the given path and UID.
+     * Inserts a new entry for the given path and UID. With group commit enabled, inserts from
+     * concurrent callers are committed to the database at once.
      *
      * @param path the path of the file to be created
      * @param uid UID of the calling app
@@ -65,7 +73,8 @@ class MediaProviderWrapper final {
     int InsertFile(const std::string& path, uid_t uid);
 
     /**
-     * Delete the file denoted by the given path on behalf of the given UID.
+     * Delete the file denoted by the given path on behalf of the given UID. With group commit
+     * enabled, deletes from concurrent callers are committed to the database at once.
      *
      * @param path the path of the file to be deleted
      * @param uid UID of the calling app
@@ -83,12 +92,16 @@ class MediaProviderWrapper final {
      * File names in a directory are obtained from MediaProvider. If a path is unknown to
      * MediaProvider, file names are obtained from lower file system. All directory names in the
      * given directory are obtained from lower file system.
-     * An empty string in first directory entry name indicates the error occurred while obtaining
-     * directory entries, directory entry type will hold the corresponding errno information.
+     * DirectoryEntries::error() holds the errno of any error that occurred while obtaining
+     * directory entries.
      */
-    std::vector<std::shared_ptr<DirectoryEntry>> GetDirectoryEntries(uid_t uid,
-                                                                     const std::string& path,
-                                                                     DIR* dirp);
+    DirectoryEntries GetDirectoryEntries(uid_t uid, const std::string& path, DIR* dirp);
+
+    /**
+     * Returns whether GetDirectoryEntries lists all directories for the given UID from the lower
+     * file system alone, in which case callers may read them with DirectoryScanner instead.
+     */
+    bool IsListingFromLowerFs(uid_t uid) const;
 
     /**
      * Determines if the given UID is allowed to open the file denoted by the given path.
@@ -102,7 +115,7 @@ class MediaProviderWrapper final {
 
     /**
      * Potentially triggers a scan of the file before closing it and reconciles it with the
-     * MediaProvider database.
+     * MediaProvider database. The scan is queued and happens asynchronously.
      *
      * @param path the path of the file to be scanned
      */
@@ -145,6 +158,11 @@ class MediaProviderWrapper final {
      */
     bool IsUidForPackage(const std::string& pkg, uid_t uid);
 
+    /**
+     * Returns whether IsUidForPackage(pkg, uid) is answered without an upcall.
+     */
+    bool IsUidForPackageCached(const std::string& pkg, uid_t uid);
+
     /**
      * Renames a file or directory to new path.
      *
@@ -158,12 +176,58 @@ class MediaProviderWrapper final {
     int Rename(const std::string& old_path, const std::string& new_path, uid_t uid);
 
     /**
-     * Called whenever a file has been created through FUSE.
+     * Called whenever a file has been created through FUSE. MediaProvider is notified
+     * asynchronously.
      *
      * @param path path of the file that has been created.
      */
     void OnFileCreated(const std::string& path);
 
+    /**
+     * Drops the cached access decisions made for |uid|. Must be called whenever the packages
+     * or permissions of |uid| change.
+     */
+    void InvalidatePermissionCache(uid_t uid);
+
+    /**
+     * Drops the cached access decisions made for |path| and any path below it. Must be called
+     * whenever |path| is created, deleted or renamed other than through this class.
+     */
+    void InvalidatePermissionCache(const std::string& path);
+
+    /**
+     * Drops all cached access decisions.
+     */
+    void InvalidatePermissionCache();
+
+    /**
+     * Returns the hit and miss counters of the access decision cache.
+     */
+    PermissionCache::Stats GetPermissionCacheStats() const;
+
+    /**
+     * Drops the cached redaction ranges of |path| and any path below it. Must be called whenever
+     * |path| is modified.
+     */
+    void InvalidateRedactionInfoCache(const std::string& path);
+
+    /**
+     * Returns the counters and current size of the redaction ranges cache.
+     */
+    RedactionInfoCache::Stats GetRedactionInfoCacheStats() const;
+
+    /**
+     * Saves the redaction ranges cache to |file|, for a later instance to load with
+     * LoadRedactionInfoCache.
+     */
+    bool SaveRedactionInfoCache(const std::string& file) const;
+
+    /**
+     * Fills the redaction ranges cache from |file|, see RedactionInfoCache::LoadSnapshot.
+     * Returns the number of entries loaded.
+     */
+    size_t LoadRedactionInfoCache(const std::string& file);
+
     /**
      * Initializes per-process static variables associated with the lifetime of
      * a managed runtime.
@@ -179,15 +243,110 @@ class MediaProviderWrapper final {
     /** Cached MediaProvider method IDs **/
     jmethodID mid_get_redaction_ranges_;
     jmethodID mid_insert_file_;
+    jmethodID mid_insert_files_;
     jmethodID mid_delete_file_;
+    jmethodID mid_delete_files_;
     jmethodID mid_is_open_allowed_;
-    jmethodID mid_scan_file_;
+    jmethodID mid_scan_files_;
     jmethodID mid_is_mkdir_or_rmdir_allowed_;
     jmethodID mid_is_opendir_allowed_;
     jmethodID mid_get_files_in_dir_;
     jmethodID mid_rename_;
     jmethodID mid_is_uid_for_package_;
-    jmethodID mid_on_file_created_;
+    jmethodID mid_on_files_created_;
+    /** java.lang.String, for passing batches of paths to MediaProvider. */
+    jclass string_class_;
+    /**
+     * Successful access checks, so that apps repeatedly accessing the same files don't have to
+     * go through JNI each time.
+     */
+    PermissionCache permission_cache_;
+    /**
+     * Redaction ranges handed out to apps, so that reopening a file doesn't have its metadata
+     * parsed again.
+     */
+    RedactionInfoCache redaction_info_cache_;
+
+    /**
+     * A notification for MediaProvider that nothing waits for.
+     */
+    struct Notification {
+        enum Type { kFileCreated, kScanFile };
+        Type type;
+        std::string path;
+    };
+    /**
+     * Upper bound on queued notifications, FUSE threads wait for the queue to drain beyond it.
+     */
+    static constexpr size_t kMaxQueuedNotifications = 4096;
+    /**
+     * Upper bound on the number of paths passed to MediaProvider in a single call.
+     */
+    static constexpr size_t kMaxBatchSize = 256;
+
+    std::mutex notification_lock_;
+    /** Signalled when notifications are queued, or when the queue should be drained. */
+    std::condition_variable notification_queued_;
+    /** Signalled when there is room in the queue again. */
+    std::condition_variable notification_sent_;
+    std::queue<Notification> notification_queue_;
+    bool notification_quit_ = false;
+    /** Sends queued notifications to MediaProvider, in batches. */
+    std::thread notification_thread_;
+
+    void QueueNotification(Notification::Type type, const std::string& path);
+    void NotificationLoop();
+
+    /**
+     * Calls batched up while the previous batch is being committed. The first caller to find
+     * nothing in flight commits its own call along with any that queued up behind it, so an
+     * uncontended call goes through MediaProvider without delay.
+     */
+    struct GroupCommit {
+        struct Call {
+            const std::string* path;
+            uid_t uid;
+            int res;
+            bool done;
+        };
+
+        std::mutex lock;
+        std::condition_variable cv;
+        std::vector<Call*> queue;
+        bool in_flight = false;
+    };
+
+    /** Whether inserts and deletes are group committed, see kPropGroupCommit. */
+    const bool group_commit_;
+    GroupCommit insert_commit_;
+    GroupCommit delete_commit_;
+
+    /** Batched MediaProvider calls, as committed by RunGroupCommit. */
+    enum class Batch { kInsertFiles, kDeleteFiles };
+
+    int RunGroupCommit(GroupCommit* commit, Batch kind, const std::string& path, uid_t uid);
+
+    /**
+     * Calls into MediaProvider, made with JNI by MediaProviderWrapperJni.cpp. Benchmarks link
+     * MediaProviderWrapperStub.cpp instead, which answers them without a JVM. Bypassing and
+     * caching happens before them, so it is the same for both.
+     */
+    void InitMediaProvider(JNIEnv* env, jobject media_provider);
+    void ReleaseMediaProvider();
+    std::unique_ptr<RedactionInfo> CallGetRedactionInfo(const std::string& path, uid_t uid,
+                                                        pid_t tid);
+    int CallInsertFile(const std::string& path, uid_t uid);
+    int CallDeleteFile(const std::string& path, uid_t uid);
+    /** Returns one result for each of |paths|. */
+    std::vector<int> CallBatch(Batch kind, const std::vector<std::string>& paths,
+                               const std::vector<uid_t>& uids);
+    int CallIsOpenAllowed(const std::string& path, uid_t uid, bool for_write);
+    int CallIsMkdirOrRmdirAllowed(const std::string& path, uid_t uid, bool for_create);
+    int CallIsOpendirAllowed(const std::string& path, uid_t uid, bool for_write);
+    bool CallIsUidForPackage(const std::string& pkg, uid_t uid);
+    DirectoryEntries CallGetFilesInDirectory(uid_t uid, const std::string& path);
+    int CallRename(const std::string& old_path, const std::string& new_path, uid_t uid);
+    void CallSendPaths(Notification::Type type, const std::vector<std::string>& paths);
 
     /**
      * Auxiliary for caching MediaProvider methods.
@@ -0,0 +1,437 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+// The JNI calls into MediaProvider.java made by MediaProviderWrapper.cpp.
+
+#include "MediaProviderWrapper.h"
+#include "libfuse_jni/ReaddirHelper.h"
+
+#include <android-base/logging.h>
+#include <jni.h>
+#include <nativehelper/scoped_local_ref.h>
+#include <nativehelper/scoped_primitive_array.h>
+#include <nativehelper/scoped_utf_chars.h>
+
+#include <pthread.h>
+
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+using std::string;
+
+namespace {
+
+// Set for threads attached by MediaProviderWrapper::MaybeAttachCurrentThread. They stay attached
+// until they exit, so their JNIEnv remains valid in between upcalls.
+thread_local JNIEnv* tls_attached_env = nullptr;
+
+static bool CheckForJniException(JNIEnv* env) {
+    if (env->ExceptionCheck()) {
+        env->ExceptionDescribe();
+        env->ExceptionClear();
+        return true;
+    }
+    return false;
+}
+
+std::unique_ptr<RedactionInfo> getRedactionInfoInternal(JNIEnv* env, jobject media_provider_object,
+                                                        jmethodID mid_get_redaction_ranges,
+                                                        uid_t uid, pid_t tid, const string& path) {
+    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
+    ScopedLongArrayRO redaction_ranges(
+            env, static_cast<jlongArray>(env->CallObjectMethod(
+                         media_provider_object, mid_get_redaction_ranges, j_path.get(), uid, tid)));
+
+    if (CheckForJniException(env)) {
+        return nullptr;
+    }
+
+    std::unique_ptr<RedactionInfo> ri;
+    if (redaction_ranges.size() % 2) {
+        LOG(ERROR) << "Error while calculating redaction ranges: array length is uneven";
+    } else if (redaction_ranges.size() > 0) {
+        ri = std::make_unique<RedactionInfo>(redaction_ranges.size() / 2, redaction_ranges.get());
+    } else {
+        // No ranges to redact
+        ri = std::make_unique<RedactionInfo>();
+    }
+
+    return ri;
+}
+
+int insertFileInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid_insert_file,
+                       const string& path, uid_t uid) {
+    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
+    int res = env->CallIntMethod(media_provider_object, mid_insert_file, j_path.get(), uid);
+
+    if (CheckForJniException(env)) {
+        return EFAULT;
+    }
+    return res;
+}
+
+int deleteFileInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid_delete_file,
+                       const string& path, uid_t uid) {
+    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
+    int res = env->CallIntMethod(media_provider_object, mid_delete_file, j_path.get(), uid);
+
+    if (CheckForJniException(env)) {
+        return EFAULT;
+    }
+    return res;
+}
+
+int isOpenAllowedInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid_is_open_allowed,
+                          const string& path, uid_t uid, bool for_write) {
+    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
+    int res = env->CallIntMethod(media_provider_object, mid_is_open_allowed, j_path.get(), uid,
+                                 for_write);
+
+    if (CheckForJniException(env)) {
+        return EFAULT;
+    }
+    return res;
+}
+
+int isMkdirOrRmdirAllowedInternal(JNIEnv* env, jobject media_provider_object,
+                                  jmethodID mid_is_mkdir_or_rmdir_allowed, const string& path,
+                                  uid_t uid, bool forCreate) {
+    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
+    int res = env->CallIntMethod(media_provider_object, mid_is_mkdir_or_rmdir_allowed, j_path.get(),
+                                 uid, forCreate);
+
+    if (CheckForJniException(env)) {
+        return EFAULT;
+    }
+    return res;
+}
+
+int isOpendirAllowedInternal(JNIEnv* env, jobject media_provider_object,
+                             jmethodID mid_is_opendir_allowed, const string& path, uid_t uid,
+                             bool forWrite) {
+    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
+    int res = env->CallIntMethod(media_provider_object, mid_is_opendir_allowed, j_path.get(), uid,
+                                 forWrite);
+
+    if (CheckForJniException(env)) {
+        return EFAULT;
+    }
+    return res;
+}
+
+bool isUidForPackageInternal(JNIEnv* env, jobject media_provider_object,
+                             jmethodID mid_is_uid_for_package, const string& pkg, uid_t uid) {
+    ScopedLocalRef<jstring> j_pkg(env, env->NewStringUTF(pkg.c_str()));
+    bool res = env->CallBooleanMethod(media_provider_object, mid_is_uid_for_package, j_pkg.get(),
+            uid);
+
+    if (CheckForJniException(env)) {
+        return false;
+    }
+    return res;
+}
+
+DirectoryEntries getFilesInDirectoryInternal(JNIEnv* env, jobject media_provider_object,
+                                             jmethodID mid_get_files_in_dir, uid_t uid,
+                                             const string& path) {
+    DirectoryEntries directory_entries;
+    ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
+
+    ScopedLocalRef<jbyteArray> packed_entries(
+            env, static_cast<jbyteArray>(env->CallObjectMethod(
+                         media_provider_object, mid_get_files_in_dir, j_path.get(), uid)));
+
+    if (CheckForJniException(env) || packed_entries.get() == nullptr) {
+        directory_entries.SetError(EFAULT);
+        return directory_entries;
+    }
+
+    // The entries are copied out of the array in one go, without any JNI call while it's held
+    const jsize len = env->GetArrayLength(packed_entries.get());
+    void* data = env->GetPrimitiveArrayCritical(packed_entries.get(), nullptr);
+    if (data == nullptr) {
+        directory_entries.SetError(EFAULT);
+        return directory_entries;
+    }
+    const bool valid = directory_entries.AddPacked(static_cast<const char*>(data), len);
+    env->ReleasePrimitiveArrayCritical(packed_entries.get(), data, JNI_ABORT);
+
+    if (!valid) {
+        LOG(ERROR) << "Error reading file names returned from MediaProvider";
+        directory_entries.SetError(EFAULT);
+    } else if (directory_entries.size() == 1 && directory_entries.name_length(0) == 0) {
+        // Calling package has no storage permissions.
+        directory_entries.SetError(EPERM);
+    }
+    return directory_entries;
+}
+
+int renameInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid_rename,
+                   const string& old_path, const string& new_path, uid_t uid) {
+    ScopedLocalRef<jstring> j_old_path(env, env->NewStringUTF(old_path.c_str()));
+    ScopedLocalRef<jstring> j_new_path(env, env->NewStringUTF(new_path.c_str()));
+    int res = env->CallIntMethod(media_provider_object, mid_rename, j_old_path.get(),
+                                 j_new_path.get(), uid);
+
+    if (CheckForJniException(env)) {
+        return EFAULT;
+    }
+    return res;
+}
+
+jobjectArray newStringArray(JNIEnv* env, jclass string_class, const std::vector<string>& strings) {
+    jobjectArray array = env->NewObjectArray(strings.size(), string_class, nullptr);
+    if (!array) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < strings.size(); i++) {
+        ScopedLocalRef<jstring> j_string(env, env->NewStringUTF(strings[i].c_str()));
+        if (!j_string.get()) {
+            env->DeleteLocalRef(array);
+            return nullptr;
+        }
+        env->SetObjectArrayElement(array, i, j_string.get());
+    }
+    return array;
+}
+
+void sendPathsInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid,
+                       jclass string_class, const std::vector<string>& paths) {
+    ScopedLocalRef<jobjectArray> j_paths(env, newStringArray(env, string_class, paths));
+    if (CheckForJniException(env) || !j_paths.get()) {
+        return;
+    }
+
+    env->CallVoidMethod(media_provider_object, mid, j_paths.get());
+    CheckForJniException(env);
+}
+
+std::vector<int> batchCallInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid,
+                                   jclass string_class, const std::vector<string>& paths,
+                                   const std::vector<uid_t>& uids) {
+    // Default value in case of a JNI failure, fails all calls in the batch
+    std::vector<int> res(paths.size(), EFAULT);
+
+    const std::vector<jint> j_uid_values(uids.begin(), uids.end());
+    ScopedLocalRef<jobjectArray> j_paths(env, newStringArray(env, string_class, paths));
+    ScopedLocalRef<jintArray> j_uids(env, env->NewIntArray(j_uid_values.size()));
+    if (CheckForJniException(env) || !j_paths.get() || !j_uids.get()) {
+        return res;
+    }
+    env->SetIntArrayRegion(j_uids.get(), 0, j_uid_values.size(), j_uid_values.data());
+
+    ScopedLocalRef<jintArray> j_res(
+            env, static_cast<jintArray>(env->CallObjectMethod(media_provider_object, mid,
+                                                              j_paths.get(), j_uids.get())));
+    if (CheckForJniException(env) || !j_res.get()) {
+        return res;
+    }
+    if (env->GetArrayLength(j_res.get()) != static_cast<jsize>(res.size())) {
+        LOG(ERROR) << "MediaProvider returned the wrong number of results";
+        return res;
+    }
+    env->GetIntArrayRegion(j_res.get(), 0, res.size(), reinterpret_cast<jint*>(res.data()));
+    return res;
+}
+
+}  // namespace
+
+JavaVM* MediaProviderWrapper::gJavaVm = nullptr;
+pthread_key_t MediaProviderWrapper::gJniEnvKey;
+
+void MediaProviderWrapper::OneTimeInit(JavaVM* vm) {
+    gJavaVm = vm;
+    CHECK(gJavaVm != nullptr);
+
+    pthread_key_create(&MediaProviderWrapper::gJniEnvKey,
+                       MediaProviderWrapper::DetachThreadFunction);
+}
+
+void MediaProviderWrapper::InitMediaProvider(JNIEnv* env, jobject media_provider) {
+    if (!media_provider) {
+        LOG(FATAL) << "MediaProvider is null!";
+    }
+
+    media_provider_object_ = reinterpret_cast<jobject>(env->NewGlobalRef(media_provider));
+    media_provider_class_ = env->FindClass("com/android/providers/media/MediaProvider");
+    if (!media_provider_class_) {
+        LOG(FATAL) << "Could not find class MediaProvider";
+    }
+    media_provider_class_ = reinterpret_cast<jclass>(env->NewGlobalRef(media_provider_class_));
+
+    // Cache methods - Before calling a method, make sure you cache it here
+    mid_get_redaction_ranges_ = CacheMethod(env, "getRedactionRanges", "(Ljava/lang/String;II)[J",
+                                            /*is_static*/ false);
+    mid_insert_file_ = CacheMethod(env, "insertFileIfNecessary", "(Ljava/lang/String;I)I",
+                                   /*is_static*/ false);
+    mid_insert_files_ = CacheMethod(env, "insertFilesIfNecessary", "([Ljava/lang/String;[I)[I",
+                                    /*is_static*/ false);
+    mid_delete_file_ = CacheMethod(env, "deleteFile", "(Ljava/lang/String;I)I", /*is_static*/ false);
+    mid_delete_files_ = CacheMethod(env, "deleteFiles", "([Ljava/lang/String;[I)[I",
+                                    /*is_static*/ false);
+    mid_is_open_allowed_ = CacheMethod(env, "isOpenAllowed", "(Ljava/lang/String;IZ)I",
+                                       /*is_static*/ false);
+    mid_scan_files_ = CacheMethod(env, "scanFiles", "([Ljava/lang/String;)V",
+                                  /*is_static*/ false);
+    mid_is_mkdir_or_rmdir_allowed_ = CacheMethod(env, "isDirectoryCreationOrDeletionAllowed",
+                                                 "(Ljava/lang/String;IZ)I", /*is_static*/ false);
+    mid_is_opendir_allowed_ = CacheMethod(env, "isOpendirAllowed", "(Ljava/lang/String;IZ)I",
+                                          /*is_static*/ false);
+    mid_get_files_in_dir_ =
+            CacheMethod(env, "getPackedFilesInDirectory", "(Ljava/lang/String;I)[B",
+                        /*is_static*/ false);
+    mid_rename_ = CacheMethod(env, "rename", "(Ljava/lang/String;Ljava/lang/String;I)I",
+                              /*is_static*/ false);
+    mid_is_uid_for_package_ = CacheMethod(env, "isUidForPackage", "(Ljava/lang/String;I)Z",
+                              /*is_static*/ false);
+    mid_on_files_created_ = CacheMethod(env, "onFilesCreated", "([Ljava/lang/String;)V",
+                                        /*is_static*/ false);
+
+    string_class_ = reinterpret_cast<jclass>(env->NewGlobalRef(env->FindClass("java/lang/String")));
+    if (!string_class_) {
+        LOG(FATAL) << "Could not find class String";
+    }
+}
+
+void MediaProviderWrapper::ReleaseMediaProvider() {
+    JNIEnv* env = MaybeAttachCurrentThread();
+    env->DeleteGlobalRef(media_provider_object_);
+    env->DeleteGlobalRef(media_provider_class_);
+    env->DeleteGlobalRef(string_class_);
+}
+
+std::unique_ptr<RedactionInfo> MediaProviderWrapper::CallGetRedactionInfo(const string& path,
+                                                                          uid_t uid, pid_t tid) {
+    JNIEnv* env = MaybeAttachCurrentThread();
+    return getRedactionInfoInternal(env, media_provider_object_, mid_get_redaction_ranges_, uid,
+                                    tid, path);
+}
+
+int MediaProviderWrapper::CallInsertFile(const string& path, uid_t uid) {
+    JNIEnv* env = MaybeAttachCurrentThread();
+    return insertFileInternal(env, media_provider_object_, mid_insert_file_, path, uid);
+}
+
+int MediaProviderWrapper::CallDeleteFile(const string& path, uid_t uid) {
+    JNIEnv* env = MaybeAttachCurrentThread();
+    return deleteFileInternal(env, media_provider_object_, mid_delete_file_, path, uid);
+}
+
+std::vector<int> MediaProviderWrapper::CallBatch(Batch batch, const std::vector<string>& paths,
+                                                 const std::vector<uid_t>& uids) {
+    const jmethodID mid = batch == Batch::kInsertFiles ? mid_insert_files_ : mid_delete_files_;
+    JNIEnv* env = MaybeAttachCurrentThread();
+    return batchCallInternal(env, media_provider_object_, mid, string_class_, paths, uids);
+}
+
+int MediaProviderWrapper::CallIsOpenAllowed(const string& path, uid_t uid, bool for_write) {
+    JNIEnv* env = MaybeAttachCurrentThread();
+    return isOpenAllowedInternal(env, media_provider_object_, mid_is_open_allowed_, path, uid,
+                                 for_write);
+}
+
+int MediaProviderWrapper::CallIsMkdirOrRmdirAllowed(const string& path, uid_t uid,
+                                                    bool for_create) {
+    JNIEnv* env = MaybeAttachCurrentThread();
+    return isMkdirOrRmdirAllowedInternal(env, media_provider_object_,
+                                         mid_is_mkdir_or_rmdir_allowed_, path, uid, for_create);
+}
+
+int MediaProviderWrapper::CallIsOpendirAllowed(const string& path, uid_t uid, bool for_write) {
+    JNIEnv* env = MaybeAttachCurrentThread();
+    return isOpendirAllowedInternal(env, media_provider_object_, mid_is_opendir_allowed_, path,
+                                    uid, for_write);
+}
+
+bool MediaProviderWrapper::CallIsUidForPackage(const string& pkg, uid_t uid) {
+    JNIEnv* env = MaybeAttachCurrentThread();
+    return isUidForPackageInternal(env, media_provider_object_, mid_is_uid_for_package_, pkg, uid);
+}
+
+DirectoryEntries MediaProviderWrapper::CallGetFilesInDirectory(uid_t uid, const string& path) {
+    JNIEnv* env = MaybeAttachCurrentThread();
+    return getFilesInDirectoryInternal(env, media_provider_object_, mid_get_files_in_dir_, uid,
+                                       path);
+}
+
+int MediaProviderWrapper::CallRename(const string& old_path, const string& new_path, uid_t uid) {
+    JNIEnv* env = MaybeAttachCurrentThread();
+    return renameInternal(env, media_provider_object_, mid_rename_, old_path, new_path, uid);
+}
+
+void MediaProviderWrapper::CallSendPaths(Notification::Type type,
+                                         const std::vector<string>& paths) {
+    const jmethodID mid = type == Notification::kFileCreated ? mid_on_files_created_
+                                                             : mid_scan_files_;
+    JNIEnv* env = MaybeAttachCurrentThread();
+    sendPathsInternal(env, media_provider_object_, mid, string_class_, paths);
+}
+
+/**
+ * Finds MediaProvider method and adds it to methods map so it can be quickly called later.
+ */
+jmethodID MediaProviderWrapper::CacheMethod(JNIEnv* env, const char method_name[],
+                                            const char signature[], bool is_static) {
+    jmethodID mid;
+    string actual_method_name(method_name);
+    actual_method_name.append("ForFuse");
+    if (is_static) {
+        mid = env->GetStaticMethodID(media_provider_class_, actual_method_name.c_str(), signature);
+    } else {
+        mid = env->GetMethodID(media_provider_class_, actual_method_name.c_str(), signature);
+    }
+    if (!mid) {
+        // SHOULD NOT HAPPEN!
+        LOG(FATAL) << "Error caching method: " << method_name << signature;
+    }
+    return mid;
+}
+
+void MediaProviderWrapper::DetachThreadFunction(void* unused) {
+    int detach = gJavaVm->DetachCurrentThread();
+    CHECK_EQ(detach, 0);
+}
+
+JNIEnv* MediaProviderWrapper::MaybeAttachCurrentThread() {
+    // Threads we attached stay attached until they exit, so they never have to ask the VM again.
+    if (tls_attached_env) {
+        return tls_attached_env;
+    }
+
+    // We could use pthread_getspecific here as that's likely quicker but
+    // that would result in wrong behaviour for threads that don't need to
+    // be attached (e.g, those that were created in managed code).
+    JNIEnv* env = nullptr;
+    if (gJavaVm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_4) == JNI_OK) {
+        return env;
+    }
+
+    // This thread is currently unattached, so it must not have any TLS
+    // value. Note that we don't really care about the actual value we store
+    // in TLS -- we only care about the value destructor being called, which
+    // will happen as long as the key is not null.
+    CHECK(pthread_getspecific(gJniEnvKey) == nullptr);
+    CHECK_EQ(gJavaVm->AttachCurrentThread(&env, nullptr), 0);
+    CHECK(env != nullptr);
+
+    pthread_setspecific(gJniEnvKey, env);
+    tls_attached_env = env;
+    return env;
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
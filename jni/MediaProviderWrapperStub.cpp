@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+// Stands in for MediaProviderWrapperJni.cpp in benchmarks, see MediaProviderWrapperStub.h. Only
+// the calls into MediaProvider are replaced, bypassing and caching is left to
+// MediaProviderWrapper.cpp as is.
+
+#define LOG_TAG "MediaProviderWrapperStub"
+
+#include "MediaProviderWrapperStub.h"
+
+#include "MediaProviderWrapper.h"
+#include "libfuse_jni/ReaddirHelper.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <mutex>
+
+namespace mediaprovider {
+namespace fuse {
+using std::string;
+
+namespace {
+
+std::mutex config_lock;
+MediaProviderStubConfig config;
+
+unsigned int getUpcallLatencyUs() {
+    std::lock_guard<std::mutex> guard(config_lock);
+    return config.upcall_latency_us;
+}
+
+// Spins rather than sleeps, an upcall keeps a CPU busy with JNI and database work for its
+// duration, and sleeping would round short latencies up to the timer slack.
+void simulateUpcall() {
+    const unsigned int latency_us = getUpcallLatencyUs();
+    if (!latency_us) return;
+
+    const auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::microseconds(latency_us);
+    while (std::chrono::steady_clock::now() < deadline) {
+    }
+}
+
+std::unique_ptr<RedactionInfo> getStubRedactionInfo(const string& path) {
+    std::lock_guard<std::mutex> guard(config_lock);
+    const string& suffix = config.redacted_suffix;
+    if (config.redaction_ranges.empty() || path.size() < suffix.size() ||
+        path.compare(path.size() - suffix.size(), suffix.size(), suffix)) {
+        return std::make_unique<RedactionInfo>();
+    }
+    return std::make_unique<RedactionInfo>(config.redaction_ranges.size() / 2,
+                                           config.redaction_ranges.data());
+}
+
+}  // namespace
+
+void SetMediaProviderStubConfig(const MediaProviderStubConfig& new_config) {
+    std::lock_guard<std::mutex> guard(config_lock);
+    config = new_config;
+}
+
+void MediaProviderWrapper::InitMediaProvider(JNIEnv* env, jobject media_provider) {
+    media_provider_class_ = nullptr;
+    media_provider_object_ = nullptr;
+    string_class_ = nullptr;
+}
+
+void MediaProviderWrapper::ReleaseMediaProvider() {}
+
+std::unique_ptr<RedactionInfo> MediaProviderWrapper::CallGetRedactionInfo(const string& path,
+                                                                          uid_t uid, pid_t tid) {
+    simulateUpcall();
+    return getStubRedactionInfo(path);
+}
+
+int MediaProviderWrapper::CallInsertFile(const string& path, uid_t uid) {
+    simulateUpcall();
+    return 0;
+}
+
+int MediaProviderWrapper::CallDeleteFile(const string& path, uid_t uid) {
+    simulateUpcall();
+    // MediaProvider deletes the file along with its row
+    return unlink(path.c_str()) ? errno : 0;
+}
+
+std::vector<int> MediaProviderWrapper::CallBatch(Batch kind, const std::vector<string>& paths,
+                                                 const std::vector<uid_t>& uids) {
+    // A single upcall for the whole batch, which is what group commit saves on
+    simulateUpcall();
+    std::vector<int> res(paths.size(), 0);
+    if (kind == Batch::kDeleteFiles) {
+        for (size_t i = 0; i < paths.size(); i++) {
+            res[i] = unlink(paths[i].c_str()) ? errno : 0;
+        }
+    }
+    return res;
+}
+
+int MediaProviderWrapper::CallIsOpenAllowed(const string& path, uid_t uid, bool for_write) {
+    simulateUpcall();
+    return 0;
+}
+
+int MediaProviderWrapper::CallIsMkdirOrRmdirAllowed(const string& path, uid_t uid,
+                                                    bool for_create) {
+    simulateUpcall();
+    return 0;
+}
+
+int MediaProviderWrapper::CallIsOpendirAllowed(const string& path, uid_t uid, bool for_write) {
+    simulateUpcall();
+    return 0;
+}
+
+bool MediaProviderWrapper::CallIsUidForPackage(const string& pkg, uid_t uid) {
+    simulateUpcall();
+    return true;
+}
+
+DirectoryEntries MediaProviderWrapper::CallGetFilesInDirectory(uid_t uid, const string& path) {
+    simulateUpcall();
+    // As if the path was unknown to MediaProvider, which answers ["/"], so that it's listed from
+    // the lower file system
+    DirectoryEntries res;
+    res.Add("/", 1, DT_UNKNOWN);
+    return res;
+}
+
+int MediaProviderWrapper::CallRename(const string& old_path, const string& new_path, uid_t uid) {
+    simulateUpcall();
+    return rename(old_path.c_str(), new_path.c_str()) ? errno : 0;
+}
+
+void MediaProviderWrapper::CallSendPaths(Notification::Type type,
+                                         const std::vector<string>& paths) {
+    simulateUpcall();
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_FUSE_MEDIAPROVIDERWRAPPERSTUB_H_
+#define MEDIAPROVIDER_FUSE_MEDIAPROVIDERWRAPPERSTUB_H_
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * How the stub calls in MediaProviderWrapperStub.cpp answer upcalls. The stub is linked in place
+ * of MediaProviderWrapperJni.cpp to run FuseDaemon without MediaProvider or a JVM, behind the
+ * bypassing and caching of the real MediaProviderWrapper. It allows everything and spends
+ * upcall_latency_us on every upcall that gets through.
+ */
+struct MediaProviderStubConfig {
+    unsigned int upcall_latency_us = 0;
+    /** Files whose name ends with this are redacted. */
+    std::string redacted_suffix = ".mp4";
+    /** Start and end offsets of the ranges redacted from those files. */
+    std::vector<off64_t> redaction_ranges;
+};
+
+/** Replaces the config of the stub, which applies to all of its instances. */
+void SetMediaProviderStubConfig(const MediaProviderStubConfig& config);
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_FUSE_MEDIAPROVIDERWRAPPERSTUB_H_
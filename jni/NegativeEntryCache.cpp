@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FuseDaemon"
+
+#include "include/libfuse_jni/NegativeEntryCache.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <utility>
+
+namespace mediaprovider {
+namespace fuse {
+namespace {
+
+char foldChar(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// Folds |name| like strcasecmp does in the C locale
+std::string foldName(std::string_view name) {
+    std::string folded(name);
+    for (char& c : folded) {
+        c = foldChar(c);
+    }
+    return folded;
+}
+
+}  // namespace
+
+NegativeEntryCache::NegativeEntryCache(size_t max_entries)
+    : max_entries_(max_entries),
+      shards_(new Shard[kShards]),
+      parent_counts_(new std::atomic<uint32_t>[kParentSlots]),
+      size_(0),
+      inserted_(0),
+      rejected_(0),
+      invalidated_(0) {
+    for (size_t i = 0; i < kParentSlots; i++) {
+        parent_counts_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+size_t NegativeEntryCache::Hash(uint64_t parent, std::string_view name) {
+    // FNV-1a of the folded name, so that invalidating doesn't need to fold it into a copy
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : name) {
+        hash = (hash ^ static_cast<unsigned char>(foldChar(c))) * 1099511628211ULL;
+    }
+    return hash ^ std::hash<uint64_t>()(parent);
+}
+
+size_t NegativeEntryCache::KeyHash::operator()(const Key& key) const {
+    return Hash(key.parent, key.name);
+}
+
+NegativeEntryCache::Shard& NegativeEntryCache::GetShard(uint64_t parent,
+                                                        std::string_view name) const {
+    return shards_[Hash(parent, name) % kShards];
+}
+
+std::atomic<uint32_t>& NegativeEntryCache::GetParentCount(uint64_t parent) const {
+    return parent_counts_[std::hash<uint64_t>()(parent) % kParentSlots];
+}
+
+uint64_t NegativeEntryCache::GetGeneration(uint64_t parent, std::string_view name) const {
+    return GetShard(parent, name).generation.load();
+}
+
+bool NegativeEntryCache::Insert(uint64_t parent, std::string_view name, Clock::time_point expiry,
+                                uint64_t generation, Clock::time_point now) {
+    if (size_.load(std::memory_order_relaxed) >= max_entries_) {
+        // Make room from all shards, it is rare enough for locking them in turn not to matter
+        for (size_t i = 0; i < kShards; i++) {
+            std::lock_guard<std::mutex> guard(shards_[i].lock);
+            PruneLocked(&shards_[i], now);
+        }
+    }
+
+    Shard& shard = GetShard(parent, name);
+    std::atomic<uint32_t>& parent_count = GetParentCount(parent);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    // Counted before the generation is checked, so that an invalidation either sees the count
+    // and waits for the lock, or bumped the generation before it is checked here.
+    parent_count.fetch_add(1);
+    if (shard.generation.load() != generation) {
+        // The file may have been created after it was found missing
+        parent_count.fetch_sub(1, std::memory_order_relaxed);
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    Key key{parent, foldName(name)};
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end()) {
+        for (Entry& entry : it->second) {
+            if (entry.name == name) {
+                entry.expiry = std::max(entry.expiry, expiry);
+                parent_count.fetch_sub(1, std::memory_order_relaxed);
+                inserted_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+
+    if (size_.fetch_add(1, std::memory_order_relaxed) >= max_entries_) {
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        parent_count.fetch_sub(1, std::memory_order_relaxed);
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    shard.entries[std::move(key)].push_back({std::string(name), expiry});
+    inserted_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+std::vector<std::string> NegativeEntryCache::Invalidate(uint64_t parent, std::string_view name,
+                                                        Clock::time_point now) {
+    std::vector<std::string> names;
+    Shard& shard = GetShard(parent, name);
+    std::atomic<uint32_t>& parent_count = GetParentCount(parent);
+    shard.generation.fetch_add(1);
+    if (parent_count.load() == 0) {
+        // Nothing is tracked in |parent|, and any insertion racing with this one is rejected
+        return names;
+    }
+
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.entries.find(Key{parent, foldName(name)});
+    if (it == shard.entries.end()) {
+        return names;
+    }
+    for (Entry& entry : it->second) {
+        if (entry.expiry > now) {
+            names.push_back(std::move(entry.name));
+        }
+    }
+    size_.fetch_sub(it->second.size(), std::memory_order_relaxed);
+    parent_count.fetch_sub(it->second.size(), std::memory_order_relaxed);
+    shard.entries.erase(it);
+    invalidated_.fetch_add(names.size(), std::memory_order_relaxed);
+    return names;
+}
+
+NegativeEntryCache::Stats NegativeEntryCache::GetStats() const {
+    return {size_.load(std::memory_order_relaxed), inserted_.load(std::memory_order_relaxed),
+            rejected_.load(std::memory_order_relaxed),
+            invalidated_.load(std::memory_order_relaxed)};
+}
+
+void NegativeEntryCache::PruneLocked(Shard* shard, Clock::time_point now) {
+    for (auto it = shard->entries.begin(); it != shard->entries.end();) {
+        std::vector<Entry>& cases = it->second;
+        const size_t old_size = cases.size();
+        cases.erase(std::remove_if(cases.begin(), cases.end(),
+                                   [now](const Entry& entry) { return entry.expiry <= now; }),
+                    cases.end());
+        size_.fetch_sub(old_size - cases.size(), std::memory_order_relaxed);
+        GetParentCount(it->first.parent).fetch_sub(old_size - cases.size(),
+                                                   std::memory_order_relaxed);
+        it = cases.empty() ? shard->entries.erase(it) : std::next(it);
+    }
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "NegativeEntryCacheTest"
+
+#include "libfuse_jni/NegativeEntryCache.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+using namespace mediaprovider::fuse;
+using namespace std::chrono_literals;
+
+typedef NegativeEntryCache::Clock Clock;
+
+class NegativeEntryCacheTest : public ::testing::Test {
+  protected:
+    bool Insert(uint64_t parent, const std::string& name, Clock::duration timeout = 10s) {
+        const uint64_t generation = cache_.GetGeneration(parent, name);
+        return cache_.Insert(parent, name, now_ + timeout, generation, now_);
+    }
+
+    std::vector<std::string> Invalidate(uint64_t parent, const std::string& name) {
+        std::vector<std::string> names = cache_.Invalidate(parent, name, now_);
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+
+    const Clock::time_point now_ = Clock::now();
+    NegativeEntryCache cache_;
+};
+
+TEST_F(NegativeEntryCacheTest, testInvalidate_allCases) {
+    EXPECT_TRUE(Insert(1, ".nomedia"));
+    EXPECT_TRUE(Insert(1, ".NoMedia"));
+    EXPECT_TRUE(Insert(1, ".nomedia"));
+    EXPECT_TRUE(Insert(1, "other"));
+    EXPECT_TRUE(Insert(2, ".nomedia"));
+    EXPECT_EQ(4, cache_.GetStats().entries);
+
+    EXPECT_EQ(std::vector<std::string>({".NoMedia", ".nomedia"}), Invalidate(1, ".NOMEDIA"));
+    EXPECT_EQ(std::vector<std::string>(), Invalidate(1, ".nomedia"));
+    EXPECT_EQ(std::vector<std::string>({".nomedia"}), Invalidate(2, ".nomedia"));
+    EXPECT_EQ(std::vector<std::string>({"other"}), Invalidate(1, "other"));
+
+    const NegativeEntryCache::Stats stats = cache_.GetStats();
+    EXPECT_EQ(0, stats.entries);
+    EXPECT_EQ(5, stats.inserted);
+    EXPECT_EQ(4, stats.invalidated);
+}
+
+TEST_F(NegativeEntryCacheTest, testInvalidate_skipsExpired) {
+    EXPECT_TRUE(Insert(1, "a", 0s));
+    EXPECT_TRUE(Insert(1, "A", 1s));
+    EXPECT_EQ(std::vector<std::string>({"A"}), Invalidate(1, "a"));
+}
+
+TEST_F(NegativeEntryCacheTest, testInsert_afterInvalidation) {
+    EXPECT_TRUE(Insert(1, "b"));
+    const uint64_t generation = cache_.GetGeneration(1, "a");
+    cache_.Invalidate(1, "A", now_);
+    EXPECT_FALSE(cache_.Insert(1, "a", now_ + 10s, generation, now_));
+    EXPECT_EQ(1, cache_.GetStats().rejected);
+}
+
+TEST_F(NegativeEntryCacheTest, testInsert_afterInvalidationOfUntrackedParent) {
+    // Nothing is tracked in the directory, which must still be noticed by a racing insertion
+    const uint64_t generation = cache_.GetGeneration(1, "a");
+    EXPECT_EQ(std::vector<std::string>(), Invalidate(1, "a"));
+    EXPECT_FALSE(cache_.Insert(1, "a", now_ + 10s, generation, now_));
+    EXPECT_EQ(0, cache_.GetStats().entries);
+}
+
+TEST(NegativeEntryCacheLimitTest, testInsert_whenFull) {
+    const Clock::time_point now = Clock::now();
+    NegativeEntryCache cache(2);
+    EXPECT_TRUE(cache.Insert(1, "a", now + 1s, cache.GetGeneration(1, "a"), now));
+    EXPECT_TRUE(cache.Insert(1, "b", now + 2s, cache.GetGeneration(1, "b"), now));
+    EXPECT_FALSE(cache.Insert(1, "c", now + 2s, cache.GetGeneration(1, "c"), now));
+    // Refreshing a tracked name takes no room
+    EXPECT_TRUE(cache.Insert(1, "a", now + 2s, cache.GetGeneration(1, "a"), now));
+
+    // Room is made by dropping what expired
+    const Clock::time_point later = now + 2s;
+    EXPECT_TRUE(cache.Insert(1, "c", later + 1s, cache.GetGeneration(1, "c"), later));
+    EXPECT_EQ(1, cache.GetStats().entries);
+    EXPECT_EQ(1, cache.GetStats().rejected);
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures lookups and creation of nodes in directories of various sizes.
+
+#include "node-inl.h"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+using mediaprovider::fuse::node;
+using mediaprovider::fuse::NodeLock;
+using mediaprovider::fuse::NodeTracker;
+
+namespace {
+
+NodeLock lock;
+NodeTracker tracker;
+
+std::string childName(int i) {
+    return "IMG_20200101_" + std::to_string(100000 + i) + ".jpg";
+}
+
+// A directory with |num_children| children, deleted when going out of scope
+class Directory {
+  public:
+    Directory(node* parent, const std::string& name, int num_children)
+        : dir_(node::Create(parent, name, &lock, &tracker)) {
+        for (int i = 0; i < num_children; i++) {
+            children_.push_back(node::Create(dir_, childName(i), &lock, &tracker));
+        }
+    }
+
+    ~Directory() {
+        for (node* child : children_) {
+            child->Release(1);
+        }
+        dir_->Release(1);
+    }
+
+    node* get() const { return dir_; }
+
+  private:
+    node* const dir_;
+    std::vector<node*> children_;
+};
+
+node* root() {
+    static node* root = node::CreateRoot("/storage/emulated", &lock, &tracker);
+    return root;
+}
+
+void BM_LookupChildByName(benchmark::State& state) {
+    const int num_children = state.range(0);
+    Directory dir(root(), "0", num_children);
+
+    // Looked up with a different case than they were created with, as apps often do
+    std::vector<std::string> names;
+    for (int i = 0; i < 64; i++) {
+        std::string name = childName((i * 7919) % num_children);
+        name[0] = 'i';
+        names.push_back(name);
+    }
+
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+                dir.get()->LookupChildByName(names[i++ % names.size()], false /* acquire */));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LookupChildByName)->Arg(4)->Arg(64)->Arg(1024)->Arg(16 * 1024);
+
+void BM_LookupAbsolutePath(benchmark::State& state) {
+    Directory user(root(), "0", 0);
+    Directory dcim(user.get(), "DCIM", 0);
+    Directory camera(dcim.get(), "Camera", state.range(0));
+    const std::string path = "/storage/emulated/0/DCIM/Camera/" + childName(state.range(0) / 2);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(node::LookupAbsolutePath(root(), path, false /* acquire */));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LookupAbsolutePath)->Arg(64)->Arg(16 * 1024);
+
+void BM_CreateRelease(benchmark::State& state) {
+    Directory dir(root(), "0", state.range(0));
+    const std::string name = childName(state.range(0));
+
+    for (auto _ : state) {
+        node::Create(dir.get(), name, &lock, &tracker)->Release(1);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CreateRelease)->Arg(64)->Arg(16 * 1024);
+
+std::vector<node*> createChildren(node* dir, int num_children) {
+    std::vector<node*> children;
+    for (int i = 0; i < num_children; i++) {
+        children.push_back(node::Create(dir, childName(i), &lock, &tracker));
+    }
+    return children;
+}
+
+// Forgetting a whole directory node by node, as forgets used to be handled
+void BM_ForgetEach(benchmark::State& state) {
+    Directory dir(root(), "0", 0);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        const std::vector<node*> children = createChildren(dir.get(), state.range(0));
+        state.ResumeTiming();
+
+        for (node* child : children) {
+            node::FromInode(node::ToInode(child), &tracker)->Release(1);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ForgetEach)->Arg(64)->Arg(16 * 1024);
+
+// Forgetting a whole directory in one batch, deleting the nodes isn't measured since the daemon
+// does that on another thread
+void BM_ForgetBatch(benchmark::State& state) {
+    Directory dir(root(), "0", 0);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        const std::vector<node*> children = createChildren(dir.get(), state.range(0));
+        std::vector<node*> released;
+        state.ResumeTiming();
+
+        std::vector<node::Forget> forgets;
+        for (node* child : children) {
+            forgets.push_back({node::FromInode(node::ToInode(child), &tracker), 1});
+        }
+        node::ReleaseBatch(forgets, &released);
+
+        state.PauseTiming();
+        node::DeleteReleased(released);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ForgetBatch)->Arg(64)->Arg(16 * 1024);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#include "include/libfuse_jni/PermissionCache.h"
+
+#include <android-base/strings.h>
+
+#include <algorithm>
+#include <mutex>
+
+using std::string;
+
+namespace mediaprovider {
+namespace fuse {
+
+bool PermissionCache::LookupUidForPackage(uid_t uid, const string& pkg, bool* result) {
+    {
+        std::shared_lock<std::shared_mutex> guard(lock_);
+        auto uid_it = packages_.find(uid);
+        if (uid_it != packages_.end()) {
+            auto pkg_it = uid_it->second.find(pkg);
+            if (pkg_it != uid_it->second.end()) {
+                *result = pkg_it->second;
+                package_hits_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+    package_misses_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+bool PermissionCache::HasUidForPackage(uid_t uid, const string& pkg) const {
+    std::shared_lock<std::shared_mutex> guard(lock_);
+    auto uid_it = packages_.find(uid);
+    return uid_it != packages_.end() && uid_it->second.count(pkg);
+}
+
+void PermissionCache::InsertUidForPackage(uid_t uid, const string& pkg, bool result,
+                                          uint64_t epoch) {
+    std::lock_guard<std::shared_mutex> guard(lock_);
+    if (epoch_.load(std::memory_order_relaxed) != epoch) {
+        return;
+    }
+    packages_[uid][pkg] = result;
+}
+
+bool PermissionCache::LookupPathDecision(uid_t uid, const string& path, Op op, int* result,
+                                         Clock::time_point now) {
+    {
+        std::shared_lock<std::shared_mutex> guard(lock_);
+        auto it = path_decisions_.find(path);
+        if (it != path_decisions_.end()) {
+            for (const PathDecision& decision : it->second) {
+                if (decision.uid == uid && decision.op == op) {
+                    // Expired decisions stay until they are replaced or invalidated
+                    if (now >= decision.expiry) break;
+                    *result = decision.result;
+                    path_hits_.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+    }
+    path_misses_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void PermissionCache::InsertPathDecision(uid_t uid, const string& path, Op op, int result,
+                                         uint64_t epoch, Clock::time_point now) {
+    std::lock_guard<std::shared_mutex> guard(lock_);
+    if (epoch_.load(std::memory_order_relaxed) != epoch) {
+        return;
+    }
+
+    if (path_decision_count_ >= max_path_decisions_) {
+        // Keep it simple, the working set of a FUSE mount is usually much smaller than the limit
+        // and starting over is cheaper than tracking recency on every hit.
+        path_decisions_.clear();
+        path_decision_count_ = 0;
+    }
+
+    const Clock::time_point expiry = now + path_decision_ttl_;
+    std::vector<PathDecision>& decisions = path_decisions_[path];
+    for (PathDecision& decision : decisions) {
+        if (decision.uid == uid && decision.op == op) {
+            decision.result = result;
+            decision.expiry = expiry;
+            return;
+        }
+    }
+    decisions.push_back({uid, op, result, expiry});
+    path_decision_count_++;
+}
+
+void PermissionCache::InvalidateUid(uid_t uid) {
+    std::lock_guard<std::shared_mutex> guard(lock_);
+    epoch_.fetch_add(1, std::memory_order_release);
+
+    packages_.erase(uid);
+    for (auto it = path_decisions_.begin(); it != path_decisions_.end();) {
+        std::vector<PathDecision>& decisions = it->second;
+        const size_t old_size = decisions.size();
+        decisions.erase(std::remove_if(decisions.begin(), decisions.end(),
+                                       [uid](const PathDecision& d) { return d.uid == uid; }),
+                        decisions.end());
+        path_decision_count_ -= old_size - decisions.size();
+        it = decisions.empty() ? path_decisions_.erase(it) : std::next(it);
+    }
+}
+
+void PermissionCache::InvalidatePath(const string& path) {
+    std::lock_guard<std::shared_mutex> guard(lock_);
+    epoch_.fetch_add(1, std::memory_order_release);
+
+    // All paths starting with |path| sort right after it, but only those that are |path| itself
+    // or are below it are affected, e.g. "/a/b" must not invalidate "/a/bc".
+    for (auto it = path_decisions_.lower_bound(path);
+         it != path_decisions_.end() && android::base::StartsWith(it->first, path);) {
+        const string& key = it->first;
+        if (key.size() == path.size() || key[path.size()] == '/') {
+            path_decision_count_ -= it->second.size();
+            it = path_decisions_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void PermissionCache::InvalidateAll() {
+    std::lock_guard<std::shared_mutex> guard(lock_);
+    epoch_.fetch_add(1, std::memory_order_release);
+
+    packages_.clear();
+    path_decisions_.clear();
+    path_decision_count_ = 0;
+}
+
+PermissionCache::Stats PermissionCache::GetStats() const {
+    return {package_hits_.load(std::memory_order_relaxed),
+            package_misses_.load(std::memory_order_relaxed),
+            path_hits_.load(std::memory_order_relaxed), path_misses_.load(std::memory_order_relaxed)};
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "PermissionCacheTest"
+
+#include "libfuse_jni/PermissionCache.h"
+
+#include <gtest/gtest.h>
+
+#include <errno.h>
+
+using namespace mediaprovider::fuse;
+
+using Op = PermissionCache::Op;
+
+class PermissionCacheTest : public ::testing::Test {
+  protected:
+    void InsertPath(uid_t uid, const std::string& path, Op op, int result) {
+        cache_.InsertPathDecision(uid, path, op, result, cache_.GetEpoch());
+    }
+
+    bool HasPath(uid_t uid, const std::string& path, Op op) {
+        int result;
+        return cache_.LookupPathDecision(uid, path, op, &result);
+    }
+
+    PermissionCache cache_;
+};
+
+TEST_F(PermissionCacheTest, testUidForPackage) {
+    bool result = false;
+    EXPECT_FALSE(cache_.LookupUidForPackage(10001, "com.foo", &result));
+
+    cache_.InsertUidForPackage(10001, "com.foo", true, cache_.GetEpoch());
+    EXPECT_TRUE(cache_.LookupUidForPackage(10001, "com.foo", &result));
+    EXPECT_TRUE(result);
+
+    EXPECT_FALSE(cache_.LookupUidForPackage(10002, "com.foo", &result));
+    EXPECT_FALSE(cache_.LookupUidForPackage(10001, "com.bar", &result));
+}
+
+TEST_F(PermissionCacheTest, testPathDecision_keyedOnUidAndOp) {
+    InsertPath(10001, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen, 0);
+
+    int result = -1;
+    EXPECT_TRUE(cache_.LookupPathDecision(10001, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen,
+                                          &result));
+    EXPECT_EQ(0, result);
+    EXPECT_FALSE(HasPath(10001, "/storage/emulated/0/DCIM/a.jpg", Op::kOpenForWrite));
+    EXPECT_FALSE(HasPath(10002, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen));
+    EXPECT_FALSE(HasPath(10001, "/storage/emulated/0/DCIM/b.jpg", Op::kOpen));
+}
+
+TEST_F(PermissionCacheTest, testInvalidateUid) {
+    cache_.InsertUidForPackage(10001, "com.foo", true, cache_.GetEpoch());
+    InsertPath(10001, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen, 0);
+    InsertPath(10002, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen, 0);
+
+    cache_.InvalidateUid(10001);
+
+    bool result;
+    EXPECT_FALSE(cache_.LookupUidForPackage(10001, "com.foo", &result));
+    EXPECT_FALSE(HasPath(10001, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen));
+    EXPECT_TRUE(HasPath(10002, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen));
+}
+
+TEST_F(PermissionCacheTest, testInvalidatePath_invalidatesDescendants) {
+    InsertPath(10001, "/storage/emulated/0/DCIM", Op::kOpendir, 0);
+    InsertPath(10001, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen, 0);
+    InsertPath(10001, "/storage/emulated/0/DCIM/Camera/b.jpg", Op::kOpen, 0);
+    InsertPath(10001, "/storage/emulated/0/DCIM!", Op::kOpen, 0);
+    InsertPath(10001, "/storage/emulated/0/DCIMX/c.jpg", Op::kOpen, 0);
+
+    cache_.InvalidatePath("/storage/emulated/0/DCIM");
+
+    EXPECT_FALSE(HasPath(10001, "/storage/emulated/0/DCIM", Op::kOpendir));
+    EXPECT_FALSE(HasPath(10001, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen));
+    EXPECT_FALSE(HasPath(10001, "/storage/emulated/0/DCIM/Camera/b.jpg", Op::kOpen));
+    EXPECT_TRUE(HasPath(10001, "/storage/emulated/0/DCIM!", Op::kOpen));
+    EXPECT_TRUE(HasPath(10001, "/storage/emulated/0/DCIMX/c.jpg", Op::kOpen));
+}
+
+TEST_F(PermissionCacheTest, testInvalidateAll) {
+    cache_.InsertUidForPackage(10001, "com.foo", true, cache_.GetEpoch());
+    InsertPath(10001, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen, 0);
+
+    cache_.InvalidateAll();
+
+    bool result;
+    EXPECT_FALSE(cache_.LookupUidForPackage(10001, "com.foo", &result));
+    EXPECT_FALSE(HasPath(10001, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen));
+}
+
+TEST_F(PermissionCacheTest, testInsertAfterInvalidation_isDropped) {
+    const uint64_t epoch = cache_.GetEpoch();
+    cache_.InvalidateUid(10002);
+    cache_.InsertUidForPackage(10001, "com.foo", true, epoch);
+    cache_.InsertPathDecision(10001, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen, 0, epoch);
+
+    bool result;
+    EXPECT_FALSE(cache_.LookupUidForPackage(10001, "com.foo", &result));
+    EXPECT_FALSE(HasPath(10001, "/storage/emulated/0/DCIM/a.jpg", Op::kOpen));
+}
+
+TEST(PermissionCacheLimitTest, testMaxPathDecisions) {
+    PermissionCache cache(/* max_path_decisions */ 2);
+    cache.InsertPathDecision(10001, "/a", Op::kOpen, 0, cache.GetEpoch());
+    cache.InsertPathDecision(10001, "/b", Op::kOpen, 0, cache.GetEpoch());
+    cache.InsertPathDecision(10001, "/c", Op::kOpen, 0, cache.GetEpoch());
+
+    int result;
+    EXPECT_FALSE(cache.LookupPathDecision(10001, "/a", Op::kOpen, &result));
+    EXPECT_FALSE(cache.LookupPathDecision(10001, "/b", Op::kOpen, &result));
+    EXPECT_TRUE(cache.LookupPathDecision(10001, "/c", Op::kOpen, &result));
+}
+
+TEST(PermissionCacheExpiryTest, testPathDecisionsExpire) {
+    PermissionCache cache(PermissionCache::kDefaultMaxPathDecisions, std::chrono::seconds(2));
+    const PermissionCache::Clock::time_point now = PermissionCache::Clock::now();
+    cache.InsertPathDecision(10001, "/a", Op::kOpen, 0, cache.GetEpoch(), now);
+    cache.InsertUidForPackage(10001, "com.foo", true, cache.GetEpoch());
+
+    int result;
+    EXPECT_TRUE(cache.LookupPathDecision(10001, "/a", Op::kOpen, &result,
+                                         now + std::chrono::seconds(1)));
+    // A URI grant the decision was based on may have been revoked by then
+    EXPECT_FALSE(cache.LookupPathDecision(10001, "/a", Op::kOpen, &result,
+                                          now + std::chrono::seconds(2)));
+    bool pkg_result;
+    EXPECT_TRUE(cache.LookupUidForPackage(10001, "com.foo", &pkg_result));
+
+    // Making the decision again renews it
+    cache.InsertPathDecision(10001, "/a", Op::kOpen, EACCES, cache.GetEpoch(),
+                             now + std::chrono::seconds(2));
+    EXPECT_TRUE(cache.LookupPathDecision(10001, "/a", Op::kOpen, &result,
+                                         now + std::chrono::seconds(3)));
+    EXPECT_EQ(EACCES, result);
+}
+
+TEST(PermissionCacheStatsTest, testCountsHitsAndMisses) {
+    PermissionCache cache;
+    bool pkg_result;
+    int path_result;
+    cache.LookupUidForPackage(10001, "com.foo", &pkg_result);
+    cache.InsertUidForPackage(10001, "com.foo", true, cache.GetEpoch());
+    cache.LookupUidForPackage(10001, "com.foo", &pkg_result);
+    cache.LookupUidForPackage(10001, "com.foo", &pkg_result);
+    cache.LookupPathDecision(10001, "/a", Op::kOpen, &path_result);
+
+    const PermissionCache::Stats stats = cache.GetStats();
+    EXPECT_EQ(2, stats.package_hits);
+    EXPECT_EQ(1, stats.package_misses);
+    EXPECT_EQ(0, stats.path_hits);
+    EXPECT_EQ(1, stats.path_misses);
+}
@@ -17,7 +17,13 @@
 
 #include "libfuse_jni/ReaddirHelper.h"
 #include <android-base/logging.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#include <vector>
 
 namespace mediaprovider {
 namespace fuse {
@@ -34,27 +40,92 @@ bool isDirectory(const dirent& entry) {
     return false;
 }
 
-void addDirectoryEntriesFromLowerFs(DIR* dirp, bool (*const filter)(const dirent&),
-        std::vector<std::shared_ptr<DirectoryEntry>>* directory_entries) {
-    while (1) {
-        errno = 0;
-        const struct dirent* entry = readdir(dirp);
-        if (entry == nullptr) {
-            if (errno) {
-                PLOG(ERROR) << "DEBUG: readdir(): readdir failed with %d" << errno;
-                directory_entries->resize(0);
-                directory_entries->push_back(std::make_shared<DirectoryEntry>("", errno));
-            }
+void DirectoryEntries::Add(const char* name, size_t len, int type) {
+    const size_t off = names_.size();
+    names_.insert(names_.end(), name, name + len);
+    names_.push_back('\0');
+    entries_.push_back({static_cast<uint32_t>(off), static_cast<uint8_t>(len),
+                        static_cast<uint8_t>(type)});
+}
+
+bool DirectoryEntries::AddPacked(const char* data, size_t len) {
+    // Headers are two bytes, the name length and the type
+    constexpr size_t kHeaderSize = 2;
+
+    const size_t base = names_.size();
+    const size_t num_entries = entries_.size();
+    names_.insert(names_.end(), data, data + len);
+
+    size_t off = 0;
+    while (off < len) {
+        if (len - off < kHeaderSize) break;
+        const uint8_t name_len = static_cast<uint8_t>(data[off]);
+        const uint8_t type = static_cast<uint8_t>(data[off + 1]);
+        off += kHeaderSize;
+        if (len - off < name_len + 1u || data[off + name_len] != '\0' ||
+            memchr(data + off, '\0', name_len) != nullptr) {
             break;
         }
+        entries_.push_back({static_cast<uint32_t>(base + off), name_len, type});
+        off += name_len + 1;
+    }
+
+    if (off != len) {
+        names_.resize(base);
+        entries_.resize(num_entries);
+        return false;
+    }
+    return true;
+}
+
+void DirectoryEntries::SetError(int error) {
+    Clear();
+    error_ = error;
+}
+
+void DirectoryEntries::Clear() {
+    names_.clear();
+    entries_.clear();
+    error_ = 0;
+}
+
+bool DirectoryScanner::ScanNext(bool (*const filter)(const dirent&),
+                                DirectoryEntries* entries) {
+    if (done_) {
+        return false;
+    }
+
+    // Owned by the calling thread and reused across scans, directories are listed often
+    thread_local std::vector<char> buf(kBufferSize);
+    const long res = syscall(SYS_getdents64, fd_, buf.data(), buf.size());
+    if (res <= 0) {
+        if (res < 0) {
+            PLOG(ERROR) << "getdents64 failed";
+            entries->SetError(errno);
+        }
+        done_ = true;
+        return false;
+    }
+
+    // The records of getdents64 are laid out like struct dirent, up to the end of their name
+    for (long off = 0; off < res;) {
+        const struct dirent* entry = reinterpret_cast<const struct dirent*>(buf.data() + off);
+        off += entry->d_reclen;
         // Ignore '.' & '..' to maintain consistency with directory entries
         // returned by MediaProvider.
         if (is_dot_or_dotdot(entry->d_name)) continue;
         if (filter == nullptr || filter(*entry)) {
-            directory_entries->push_back(
-                    std::make_shared<DirectoryEntry>(entry->d_name, entry->d_type));
+            entries->Add(entry->d_name, strlen(entry->d_name), entry->d_type);
         }
     }
+    return true;
+}
+
+void addDirectoryEntriesFromLowerFs(DIR* dirp, bool (*const filter)(const dirent&),
+                                    DirectoryEntries* directory_entries) {
+    DirectoryScanner scanner(dirfd(dirp));
+    while (scanner.ScanNext(filter, directory_entries)) {
+    }
 }
 
 }  // namespace fuse
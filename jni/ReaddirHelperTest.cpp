@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ReaddirHelperTest"
+
+#include "libfuse_jni/ReaddirHelper.h"
+
+#include <gtest/gtest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace mediaprovider::fuse;
+
+namespace {
+
+// Names and types of directory entries
+typedef std::vector<std::pair<std::string, int>> Entries;
+
+Entries getEntries(const DirectoryEntries& entries) {
+    Entries res;
+    for (size_t i = 0; i < entries.size(); i++) {
+        EXPECT_EQ(strlen(entries.name(i)), entries.name_length(i));
+        res.emplace_back(entries.name(i), entries.type(i));
+    }
+    return res;
+}
+
+}  // namespace
+
+TEST(DirectoryEntriesTest, testAdd) {
+    DirectoryEntries entries;
+    EXPECT_TRUE(entries.empty());
+
+    entries.Add("a.jpg", 5, DT_REG);
+    entries.Add("DCIMX", 4, DT_DIR);
+    EXPECT_EQ(Entries({{"a.jpg", DT_REG}, {"DCIM", DT_DIR}}), getEntries(entries));
+    EXPECT_EQ(0, entries.error());
+}
+
+TEST(DirectoryEntriesTest, testAddPacked) {
+    const char packed[] = {5, DT_REG, 'a', '.', 'j', 'p', 'g', 0, 0, DT_REG, 0, 1, DT_DIR, 'b', 0};
+    DirectoryEntries entries;
+    entries.Add("c", 1, DT_REG);
+    EXPECT_TRUE(entries.AddPacked(packed, sizeof(packed)));
+    EXPECT_EQ(Entries({{"c", DT_REG}, {"a.jpg", DT_REG}, {"", DT_REG}, {"b", DT_DIR}}),
+              getEntries(entries));
+
+    EXPECT_TRUE(entries.AddPacked(packed, 0));
+    EXPECT_EQ(4, entries.size());
+}
+
+TEST(DirectoryEntriesTest, testAddPacked_malformed) {
+    DirectoryEntries entries;
+    entries.Add("c", 1, DT_REG);
+
+    // Truncated header, truncated name, missing nul and nul within the name
+    const char truncated_header[] = {1, DT_REG, 'a', 0, 1};
+    const char truncated_name[] = {3, DT_REG, 'a', 'b'};
+    const char missing_nul[] = {1, DT_REG, 'a', 'b'};
+    const char nul_in_name[] = {2, DT_REG, 'a', 0, 0};
+    EXPECT_FALSE(entries.AddPacked(truncated_header, sizeof(truncated_header)));
+    EXPECT_FALSE(entries.AddPacked(truncated_name, sizeof(truncated_name)));
+    EXPECT_FALSE(entries.AddPacked(missing_nul, sizeof(missing_nul)));
+    EXPECT_FALSE(entries.AddPacked(nul_in_name, sizeof(nul_in_name)));
+
+    // Nothing was added by any of them
+    EXPECT_EQ(Entries({{"c", DT_REG}}), getEntries(entries));
+    entries.Add("d", 1, DT_REG);
+    EXPECT_EQ(Entries({{"c", DT_REG}, {"d", DT_REG}}), getEntries(entries));
+}
+
+TEST(DirectoryEntriesTest, testSetError) {
+    DirectoryEntries entries;
+    entries.Add("a", 1, DT_REG);
+    entries.SetError(EPERM);
+    EXPECT_TRUE(entries.empty());
+    EXPECT_EQ(EPERM, entries.error());
+
+    entries.Clear();
+    EXPECT_EQ(0, entries.error());
+}
+
+TEST(DirectoryEntriesTest, testAddDirectoryEntriesFromLowerFs) {
+    char dir_template[] = "/data/local/tmp/ReaddirHelperTest.XXXXXX";
+    const char* dir = mkdtemp(dir_template);
+    ASSERT_NE(nullptr, dir);
+    const std::string path(dir);
+    ASSERT_EQ(0, mkdir((path + "/subdir").c_str(), 0700));
+    const int fd = open((path + "/file").c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+    ASSERT_LE(0, fd);
+    close(fd);
+
+    DirectoryEntries all;
+    DIR* dirp = opendir(dir);
+    ASSERT_NE(nullptr, dirp);
+    addDirectoryEntriesFromLowerFs(dirp, nullptr, &all);
+    Entries all_entries = getEntries(all);
+    std::sort(all_entries.begin(), all_entries.end());
+    EXPECT_EQ(Entries({{"file", DT_REG}, {"subdir", DT_DIR}}), all_entries);
+
+    DirectoryEntries dirs;
+    rewinddir(dirp);
+    addDirectoryEntriesFromLowerFs(dirp, &isDirectory, &dirs);
+    EXPECT_EQ(Entries({{"subdir", DT_DIR}}), getEntries(dirs));
+    closedir(dirp);
+
+    unlink((path + "/file").c_str());
+    rmdir((path + "/subdir").c_str());
+    rmdir(dir);
+}
+
+TEST(DirectoryEntriesTest, testDirectoryScanner_streams) {
+    char dir_template[] = "/data/local/tmp/ReaddirHelperTest.XXXXXX";
+    const char* dir = mkdtemp(dir_template);
+    ASSERT_NE(nullptr, dir);
+    const std::string path(dir);
+    // Enough entries to take several buffers
+    constexpr int kNumFiles = 4000;
+    std::vector<std::string> names;
+    for (int i = 0; i < kNumFiles; i++) {
+        names.push_back("IMG_20200101_" + std::to_string(100000 + i) + ".jpg");
+        const int fd = open((path + "/" + names.back()).c_str(),
+                            O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+        ASSERT_LE(0, fd);
+        close(fd);
+    }
+
+    const int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ASSERT_LE(0, dir_fd);
+    DirectoryScanner scanner(dir_fd);
+    DirectoryEntries entries;
+    ASSERT_TRUE(scanner.ScanNext(nullptr, &entries));
+    // The first entries come before the whole directory was read
+    EXPECT_LT(0, entries.size());
+    EXPECT_GT(kNumFiles, entries.size());
+    EXPECT_FALSE(scanner.done());
+    while (scanner.ScanNext(nullptr, &entries)) {
+    }
+    EXPECT_TRUE(scanner.done());
+    EXPECT_EQ(0, entries.error());
+
+    std::vector<std::string> scanned;
+    for (size_t i = 0; i < entries.size(); i++) {
+        scanned.push_back(entries.name(i));
+    }
+    std::sort(scanned.begin(), scanned.end());
+    std::sort(names.begin(), names.end());
+    EXPECT_EQ(names, scanned);
+    close(dir_fd);
+
+    for (const std::string& name : names) {
+        unlink((path + "/" + name).c_str());
+    }
+    rmdir(dir);
+}
+
+TEST(DirectoryEntriesTest, testDirectoryScanner_error) {
+    const int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    ASSERT_LE(0, fd);
+    DirectoryScanner scanner(fd);
+    DirectoryEntries entries;
+    EXPECT_FALSE(scanner.ScanNext(nullptr, &entries));
+    EXPECT_EQ(ENOTDIR, entries.error());
+    EXPECT_TRUE(scanner.done());
+    close(fd);
+}
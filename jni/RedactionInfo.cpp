@@ -16,7 +16,8 @@
 
 #include "include/libfuse_jni/RedactionInfo.h"
 
-using std::unique_ptr;
+#include <algorithm>
+
 using std::vector;
 
 namespace mediaprovider {
@@ -79,6 +80,11 @@ int RedactionInfo::size() const {
     return redaction_ranges_.size();
 }
 
+RedactionRangeSpan RedactionInfo::getRedactionRanges() const {
+    const RedactionRange* const ranges = redaction_ranges_.data();
+    return RedactionRangeSpan(ranges, ranges + redaction_ranges_.size());
+}
+
 bool RedactionInfo::isRedactionNeeded() const {
     return size() > 0;
 }
@@ -88,29 +94,21 @@ RedactionInfo::RedactionInfo(int redaction_ranges_num, const off64_t* redaction_
     processRedactionRanges(redaction_ranges_num, redaction_ranges);
 }
 
-unique_ptr<vector<RedactionRange>> RedactionInfo::getOverlappingRedactionRanges(size_t size,
-                                                                                off64_t off) const {
-    if (hasOverlapWithReadRequest(size, off)) {
-        auto first_redaction = redaction_ranges_.end();
-        auto last_redaction = redaction_ranges_.end();
-        for (auto iter = redaction_ranges_.begin(); iter != redaction_ranges_.end(); ++iter) {
-            const RedactionRange& rr = *iter;
-            // Look for the first range that overlaps with the read request
-            if (first_redaction == redaction_ranges_.end() && off <= rr.second &&
-                off + size >= rr.first) {
-                first_redaction = iter;
-            } else if (first_redaction != redaction_ranges_.end() && off + size < rr.first) {
-                // Once we're in the read request range, we start checking if
-                // we're out of it so we can return the result to the caller
-                break;
-            }
-            last_redaction = iter;
-        }
-        if (first_redaction != redaction_ranges_.end()) {
-            return std::make_unique<vector<RedactionRange>>(first_redaction, last_redaction + 1);
-        }
+RedactionRangeSpan RedactionInfo::getOverlappingRedactionRanges(size_t size, off64_t off) const {
+    const RedactionRange* const ranges = redaction_ranges_.data();
+    if (!hasOverlapWithReadRequest(size, off)) {
+        return RedactionRangeSpan(ranges, ranges);
     }
-    return std::make_unique<vector<RedactionRange>>();
+    // The ranges are sorted and don't overlap, so both their starts and ends are ascending.
+    // A range overlaps with the read request if it ends at or after off and starts at or
+    // before off + size.
+    const RedactionRange* const first = std::lower_bound(
+            ranges, ranges + redaction_ranges_.size(), off,
+            [](const RedactionRange& rr, off64_t off) { return rr.second < off; });
+    const RedactionRange* const last = std::upper_bound(
+            first, ranges + redaction_ranges_.size(), static_cast<off64_t>(off + size),
+            [](off64_t end, const RedactionRange& rr) { return end < rr.first; });
+    return RedactionRangeSpan(first, last);
 }
 }  // namespace fuse
 }  // namespace mediaprovider
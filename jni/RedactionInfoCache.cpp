@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#include "include/libfuse_jni/RedactionInfoCache.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+
+#include <functional>
+#include <vector>
+
+using std::string;
+
+namespace mediaprovider {
+namespace fuse {
+
+namespace {
+
+// Layout of a snapshot, see SaveSnapshot. It never leaves the device, so fields are in host byte
+// order, and it is versioned so that a newer daemon can ignore snapshots of an older one.
+constexpr uint32_t kSnapshotMagic = 0x53434952;  // "RICS"
+constexpr uint32_t kSnapshotVersion = 1;
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_entries;
+};
+
+// Followed by |path_len| bytes of path padded to 8 bytes, then |num_ranges| start and end offsets
+struct SnapshotEntry {
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t uid;
+    uint32_t path_len;
+    uint64_t num_ranges;
+};
+
+constexpr size_t alignSnapshot(size_t len) {
+    return (len + 7) & ~static_cast<size_t>(7);
+}
+
+template <typename T>
+void appendSnapshot(string* data, const T& value) {
+    data->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool isSameVersion(ino_t ino, off_t size, const struct timespec& mtime, const struct stat& st) {
+    return ino == st.st_ino && size == st.st_size && mtime.tv_sec == st.st_mtim.tv_sec &&
+           mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+}  // namespace
+
+std::atomic<uint64_t>& RedactionInfoCache::GetPathGeneration(std::string_view path) const {
+    return path_generations_[std::hash<std::string_view>()(path) % kGenerationSlots];
+}
+
+std::atomic<uint64_t>& RedactionInfoCache::GetUidGeneration(uid_t uid) const {
+    return uid_generations_[uid % kGenerationSlots];
+}
+
+uint64_t RedactionInfoCache::GetGeneration(const string& path, uid_t uid) const {
+    // Generations only grow, so their sum changes whenever any of them does. |path| is affected
+    // by the invalidation of any of its directories too.
+    uint64_t generation = generation_.load(std::memory_order_relaxed) +
+                          GetUidGeneration(uid).load(std::memory_order_relaxed) +
+                          GetPathGeneration(path).load(std::memory_order_relaxed);
+    for (size_t pos = path.find('/', 1); pos != string::npos; pos = path.find('/', pos + 1)) {
+        generation += GetPathGeneration(std::string_view(path).substr(0, pos))
+                              .load(std::memory_order_relaxed);
+    }
+    return generation;
+}
+
+std::unique_ptr<RedactionInfo> RedactionInfoCache::Lookup(const string& path, uid_t uid,
+                                                          const struct stat& st) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = index_.find(Key(path, uid));
+    if (it == index_.end()) {
+        misses_++;
+        return nullptr;
+    }
+
+    Entry& entry = *it->second;
+    if (!isSameVersion(entry.ino, entry.size, entry.mtime, st)) {
+        // The file changed since, the entry will never be used again.
+        EraseLocked(it->second);
+        misses_++;
+        return nullptr;
+    }
+
+    lru_.splice(lru_.begin(), lru_, it->second);
+    hits_++;
+    return std::make_unique<RedactionInfo>(entry.ri);
+}
+
+void RedactionInfoCache::Insert(const string& path, uid_t uid, const struct stat& st,
+                                const RedactionInfo& ri, uint64_t generation) {
+    const size_t bytes = GetEntryBytes(path, ri);
+    if (bytes > max_bytes_) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    if (generation != GetGeneration(path, uid)) {
+        return;
+    }
+
+    auto it = index_.find(Key(path, uid));
+    if (it != index_.end()) {
+        EraseLocked(it->second);
+    }
+    while (bytes_ + bytes > max_bytes_) {
+        EraseLocked(std::prev(lru_.end()));
+        evictions_++;
+    }
+
+    lru_.push_front({Key(path, uid), st.st_ino, st.st_size, st.st_mtim, ri, bytes});
+    index_.emplace(Key(path, uid), lru_.begin());
+    bytes_ += bytes;
+    version_++;
+}
+
+void RedactionInfoCache::InvalidatePath(const string& path) {
+    std::lock_guard<std::mutex> guard(lock_);
+    GetPathGeneration(path).fetch_add(1, std::memory_order_relaxed);
+
+    // All paths starting with |path| sort right after it, but only those that are |path| itself
+    // or are below it are affected, e.g. "/a/b" must not invalidate "/a/bc".
+    for (auto it = index_.lower_bound(Key(path, 0));
+         it != index_.end() && android::base::StartsWith(it->first.first, path);) {
+        const string& key_path = it->first.first;
+        auto next = std::next(it);
+        if (key_path.size() == path.size() || key_path[path.size()] == '/') {
+            EraseLocked(it->second);
+        }
+        it = next;
+    }
+}
+
+void RedactionInfoCache::InvalidateUid(uid_t uid) {
+    std::lock_guard<std::mutex> guard(lock_);
+    GetUidGeneration(uid).fetch_add(1, std::memory_order_relaxed);
+
+    for (auto it = lru_.begin(); it != lru_.end();) {
+        auto next = std::next(it);
+        if (it->key.second == uid) {
+            EraseLocked(it);
+        }
+        it = next;
+    }
+}
+
+void RedactionInfoCache::InvalidateAll() {
+    std::lock_guard<std::mutex> guard(lock_);
+    generation_.fetch_add(1, std::memory_order_relaxed);
+
+    lru_.clear();
+    index_.clear();
+    bytes_ = 0;
+    version_++;
+}
+
+RedactionInfoCache::Stats RedactionInfoCache::GetStats() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return {hits_, misses_, evictions_, lru_.size(), bytes_};
+}
+
+bool RedactionInfoCache::SaveSnapshot(const string& file) const {
+    std::lock_guard<std::mutex> save_guard(save_lock_);
+    string data;
+    uint64_t version;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        version = version_;
+        if (file == saved_file_ && version == saved_version_ &&
+            !utimensat(AT_FDCWD, file.c_str(), nullptr, 0)) {
+            // Still up to date, it only has to look recent to the next process
+            return true;
+        }
+        // More than enough, entries take less space in a snapshot than in memory
+        data.reserve(sizeof(SnapshotHeader) + bytes_);
+        appendSnapshot(&data, SnapshotHeader{kSnapshotMagic, kSnapshotVersion, lru_.size()});
+        for (const Entry& entry : lru_) {
+            const string& path = entry.key.first;
+            const RedactionRangeSpan ranges = entry.ri.getRedactionRanges();
+            appendSnapshot(&data, SnapshotEntry{static_cast<uint64_t>(entry.ino), entry.size,
+                                                entry.mtime.tv_sec, entry.mtime.tv_nsec,
+                                                entry.key.second,
+                                                static_cast<uint32_t>(path.size()),
+                                                ranges.size()});
+            data.append(path);
+            data.append(alignSnapshot(path.size()) - path.size(), '\0');
+            for (const RedactionRange& range : ranges) {
+                appendSnapshot(&data, static_cast<int64_t>(range.first));
+                appendSnapshot(&data, static_cast<int64_t>(range.second));
+            }
+        }
+    }
+
+    const string tmp_file = file + ".tmp";
+    if (!android::base::WriteStringToFile(data, tmp_file) ||
+        rename(tmp_file.c_str(), file.c_str())) {
+        PLOG(ERROR) << "Failed to save redaction info cache";
+        unlink(tmp_file.c_str());
+        return false;
+    }
+    saved_file_ = file;
+    saved_version_ = version;
+    return true;
+}
+
+size_t RedactionInfoCache::LoadSnapshot(const string& file) {
+    android::base::unique_fd fd(open(file.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            PLOG(WARNING) << "Failed to open redaction info cache snapshot";
+        }
+        return 0;
+    }
+    // Whatever is in it, it's only used once
+    unlink(file.c_str());
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < static_cast<off_t>(sizeof(SnapshotHeader))) {
+        return 0;
+    }
+    const size_t len = st.st_size;
+    void* const data = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        PLOG(WARNING) << "Failed to map redaction info cache snapshot";
+        return 0;
+    }
+    const size_t loaded = LoadSnapshotData(static_cast<const char*>(data), len);
+    munmap(data, len);
+    return loaded;
+}
+
+size_t RedactionInfoCache::GetEntryBytes(const string& path, const RedactionInfo& ri) {
+    return sizeof(Entry) + 2 * path.size() + ri.size() * sizeof(RedactionRange);
+}
+
+void RedactionInfoCache::EraseLocked(std::list<Entry>::iterator it) {
+    version_++;
+    bytes_ -= it->bytes;
+    index_.erase(it->key);
+    lru_.erase(it);
+}
+
+size_t RedactionInfoCache::LoadSnapshotData(const char* data, size_t len) {
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != kSnapshotMagic || header.version != kSnapshotVersion) {
+        LOG(WARNING) << "Ignoring redaction info cache snapshot of unknown version";
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    size_t loaded = 0;
+    size_t off = sizeof(header);
+    for (uint64_t i = 0; i < header.num_entries; i++) {
+        SnapshotEntry entry;
+        if (len - off < sizeof(entry)) break;
+        memcpy(&entry, data + off, sizeof(entry));
+        off += sizeof(entry);
+
+        const size_t path_size = alignSnapshot(entry.path_len);
+        if (len - off < path_size ||
+            entry.num_ranges > (len - off - path_size) / (2 * sizeof(int64_t))) {
+            LOG(WARNING) << "Ignoring truncated redaction info cache snapshot";
+            break;
+        }
+        Key key(string(data + off, entry.path_len), entry.uid);
+        off += path_size;
+        std::vector<off64_t> ranges(2 * entry.num_ranges);
+        memcpy(ranges.data(), data + off, ranges.size() * sizeof(off64_t));
+        off += ranges.size() * sizeof(off64_t);
+
+        // Only redacted files are ever cached, an entry without ranges can't be trusted
+        if (!entry.num_ranges || index_.count(key)) continue;
+        RedactionInfo ri(entry.num_ranges, ranges.data());
+        const size_t bytes = GetEntryBytes(key.first, ri);
+        if (bytes_ + bytes > max_bytes_) break;
+
+        struct timespec mtime = {};
+        mtime.tv_sec = entry.mtime_sec;
+        mtime.tv_nsec = entry.mtime_nsec;
+        // Most recently used first, like in the snapshot
+        lru_.push_back({key, static_cast<ino_t>(entry.ino), entry.size, mtime, std::move(ri),
+                        bytes});
+        index_.emplace(std::move(key), std::prev(lru_.end()));
+        bytes_ += bytes;
+        version_++;
+        loaded++;
+    }
+    return loaded;
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "RedactionInfoCacheTest"
+
+#include "libfuse_jni/RedactionInfoCache.h"
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include <string.h>
+#include <unistd.h>
+
+using namespace mediaprovider::fuse;
+
+namespace {
+
+struct stat makeStat(ino_t ino, off_t size, time_t mtime) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = ino;
+    st.st_size = size;
+    st.st_mtim.tv_sec = mtime;
+    return st;
+}
+
+const off64_t kRanges[] = {10, 20, 30, 40};
+const RedactionInfo kInfo(2, kRanges);
+
+}  // namespace
+
+class RedactionInfoCacheTest : public ::testing::Test {
+  protected:
+    void Insert(const std::string& path, uid_t uid, const struct stat& st) {
+        cache_.Insert(path, uid, st, kInfo, cache_.GetGeneration(path, uid));
+    }
+
+    bool Has(const std::string& path, uid_t uid, const struct stat& st) {
+        return cache_.Lookup(path, uid, st) != nullptr;
+    }
+
+    RedactionInfoCache cache_;
+};
+
+TEST_F(RedactionInfoCacheTest, testLookup) {
+    const struct stat st = makeStat(1, 100, 1000);
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10001, st));
+
+    Insert("/storage/emulated/0/DCIM/a.jpg", 10001, st);
+    std::unique_ptr<RedactionInfo> ri = cache_.Lookup("/storage/emulated/0/DCIM/a.jpg", 10001, st);
+    ASSERT_NE(nullptr, ri);
+    EXPECT_EQ(2, ri->size());
+
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10002, st));
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/b.jpg", 10001, st));
+}
+
+TEST_F(RedactionInfoCacheTest, testLookup_fileChanged) {
+    Insert("/storage/emulated/0/DCIM/a.jpg", 10001, makeStat(1, 100, 1000));
+
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10001, makeStat(2, 100, 1000)));
+    Insert("/storage/emulated/0/DCIM/a.jpg", 10001, makeStat(1, 100, 1000));
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10001, makeStat(1, 101, 1000)));
+    Insert("/storage/emulated/0/DCIM/a.jpg", 10001, makeStat(1, 100, 1000));
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10001, makeStat(1, 100, 1001)));
+
+    // Mismatches drop the entry
+    EXPECT_EQ(0, cache_.GetStats().entries);
+}
+
+TEST_F(RedactionInfoCacheTest, testInvalidatePath) {
+    const struct stat st = makeStat(1, 100, 1000);
+    Insert("/storage/emulated/0/DCIM/a.jpg", 10001, st);
+    Insert("/storage/emulated/0/DCIM/a.jpg", 10002, st);
+    Insert("/storage/emulated/0/DCIM/Camera/b.jpg", 10001, st);
+    Insert("/storage/emulated/0/DCIMX/c.jpg", 10001, st);
+
+    cache_.InvalidatePath("/storage/emulated/0/DCIM/a.jpg");
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10001, st));
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10002, st));
+    EXPECT_TRUE(Has("/storage/emulated/0/DCIM/Camera/b.jpg", 10001, st));
+
+    cache_.InvalidatePath("/storage/emulated/0/DCIM");
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/Camera/b.jpg", 10001, st));
+    EXPECT_TRUE(Has("/storage/emulated/0/DCIMX/c.jpg", 10001, st));
+}
+
+TEST_F(RedactionInfoCacheTest, testInvalidateUid) {
+    const struct stat st = makeStat(1, 100, 1000);
+    Insert("/storage/emulated/0/DCIM/a.jpg", 10001, st);
+    Insert("/storage/emulated/0/DCIM/a.jpg", 10002, st);
+
+    cache_.InvalidateUid(10001);
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10001, st));
+    EXPECT_TRUE(Has("/storage/emulated/0/DCIM/a.jpg", 10002, st));
+
+    cache_.InvalidateAll();
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10002, st));
+}
+
+TEST_F(RedactionInfoCacheTest, testInsertAfterInvalidation_isDropped) {
+    const struct stat st = makeStat(1, 100, 1000);
+    uint64_t generation = cache_.GetGeneration("/storage/emulated/0/DCIM/a.jpg", 10001);
+    cache_.InvalidatePath("/storage/emulated/0/DCIM/a.jpg");
+    cache_.Insert("/storage/emulated/0/DCIM/a.jpg", 10001, st, kInfo, generation);
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10001, st));
+
+    // So is one after a directory above it was invalidated, or its uid
+    generation = cache_.GetGeneration("/storage/emulated/0/DCIM/a.jpg", 10001);
+    cache_.InvalidatePath("/storage/emulated/0/DCIM");
+    cache_.Insert("/storage/emulated/0/DCIM/a.jpg", 10001, st, kInfo, generation);
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10001, st));
+
+    generation = cache_.GetGeneration("/storage/emulated/0/DCIM/a.jpg", 10001);
+    cache_.InvalidateUid(10001);
+    cache_.Insert("/storage/emulated/0/DCIM/a.jpg", 10001, st, kInfo, generation);
+    EXPECT_FALSE(Has("/storage/emulated/0/DCIM/a.jpg", 10001, st));
+}
+
+TEST_F(RedactionInfoCacheTest, testInsertAfterUnrelatedInvalidation_isKept) {
+    const struct stat st = makeStat(1, 100, 1000);
+    const uint64_t generation = cache_.GetGeneration("/storage/emulated/0/DCIM/a.jpg", 10001);
+    // Files written elsewhere don't affect ranges computed meanwhile
+    cache_.InvalidatePath("/storage/emulated/0/DCIM/b.jpg");
+    cache_.InvalidatePath("/storage/emulated/0/Download/a.jpg");
+    cache_.Insert("/storage/emulated/0/DCIM/a.jpg", 10001, st, kInfo, generation);
+    EXPECT_TRUE(Has("/storage/emulated/0/DCIM/a.jpg", 10001, st));
+}
+
+TEST(RedactionInfoCacheLimitTest, testEvictsLeastRecentlyUsed) {
+    RedactionInfoCache probe;
+    const struct stat st = makeStat(1, 100, 1000);
+    probe.Insert("/a", 10001, st, kInfo, probe.GetGeneration("/a", 10001));
+    const size_t entry_bytes = probe.GetStats().bytes;
+
+    // Room for two entries with single character paths
+    RedactionInfoCache cache(2 * entry_bytes);
+    cache.Insert("/a", 10001, st, kInfo, cache.GetGeneration("/a", 10001));
+    cache.Insert("/b", 10001, st, kInfo, cache.GetGeneration("/b", 10001));
+    EXPECT_NE(nullptr, cache.Lookup("/a", 10001, st));
+    cache.Insert("/c", 10001, st, kInfo, cache.GetGeneration("/c", 10001));
+
+    EXPECT_NE(nullptr, cache.Lookup("/a", 10001, st));
+    EXPECT_EQ(nullptr, cache.Lookup("/b", 10001, st));
+    EXPECT_NE(nullptr, cache.Lookup("/c", 10001, st));
+
+    const RedactionInfoCache::Stats stats = cache.GetStats();
+    EXPECT_EQ(2, stats.entries);
+    EXPECT_EQ(2 * entry_bytes, stats.bytes);
+    EXPECT_EQ(1, stats.evictions);
+    EXPECT_EQ(3, stats.hits);
+    EXPECT_EQ(1, stats.misses);
+}
+
+TEST(RedactionInfoCacheSnapshotTest, testSaveAndLoad) {
+    const std::string file = "/data/local/tmp/RedactionInfoCacheTest.snapshot";
+    const struct stat st = makeStat(1, 100, 1000);
+    const struct stat changed = makeStat(1, 200, 1000);
+    {
+        RedactionInfoCache cache;
+        cache.Insert("/storage/emulated/0/DCIM/a.mp4", 10001, st, kInfo,
+                     cache.GetGeneration("/storage/emulated/0/DCIM/a.mp4", 10001));
+        cache.Insert("/storage/emulated/0/DCIM/b.mp4", 10002, st, kInfo,
+                     cache.GetGeneration("/storage/emulated/0/DCIM/b.mp4", 10002));
+        ASSERT_TRUE(cache.SaveSnapshot(file));
+    }
+
+    RedactionInfoCache cache;
+    ASSERT_EQ(2, cache.LoadSnapshot(file));
+    // Only loaded once
+    EXPECT_NE(0, access(file.c_str(), F_OK));
+    EXPECT_EQ(0, cache.LoadSnapshot(file));
+
+    std::unique_ptr<RedactionInfo> ri = cache.Lookup("/storage/emulated/0/DCIM/a.mp4", 10001, st);
+    ASSERT_NE(nullptr, ri);
+    ASSERT_EQ(2, ri->size());
+    EXPECT_EQ(RedactionRange(10, 20), ri->getRedactionRanges()[0]);
+    EXPECT_EQ(RedactionRange(30, 40), ri->getRedactionRanges()[1]);
+    EXPECT_NE(nullptr, cache.Lookup("/storage/emulated/0/DCIM/b.mp4", 10002, st));
+    EXPECT_EQ(nullptr, cache.Lookup("/storage/emulated/0/DCIM/b.mp4", 10001, st));
+    // Files that changed since are redacted anew
+    EXPECT_EQ(nullptr, cache.Lookup("/storage/emulated/0/DCIM/a.mp4", 10001, changed));
+}
+
+TEST(RedactionInfoCacheSnapshotTest, testSave_onlyWritesChanges) {
+    const std::string file = "/data/local/tmp/RedactionInfoCacheTest.snapshot";
+    const struct stat st = makeStat(1, 100, 1000);
+    RedactionInfoCache cache;
+    cache.Insert("/storage/emulated/0/DCIM/a.mp4", 10001, st, kInfo,
+                 cache.GetGeneration("/storage/emulated/0/DCIM/a.mp4", 10001));
+    ASSERT_TRUE(cache.SaveSnapshot(file));
+
+    // Left as it is while the cache doesn't change
+    ASSERT_TRUE(android::base::WriteStringToFile("unchanged", file));
+    ASSERT_TRUE(cache.SaveSnapshot(file));
+    std::string data;
+    ASSERT_TRUE(android::base::ReadFileToString(file, &data));
+    EXPECT_EQ("unchanged", data);
+
+    // Written again once it's gone, or once the cache changed
+    ASSERT_EQ(0, unlink(file.c_str()));
+    ASSERT_TRUE(cache.SaveSnapshot(file));
+    EXPECT_EQ(1, RedactionInfoCache().LoadSnapshot(file));
+    ASSERT_TRUE(android::base::WriteStringToFile("unchanged", file));
+    cache.Insert("/storage/emulated/0/DCIM/b.mp4", 10001, st, kInfo,
+                 cache.GetGeneration("/storage/emulated/0/DCIM/b.mp4", 10001));
+    ASSERT_TRUE(cache.SaveSnapshot(file));
+    EXPECT_EQ(2, RedactionInfoCache().LoadSnapshot(file));
+}
+
+TEST(RedactionInfoCacheSnapshotTest, testLoad_badSnapshot) {
+    const std::string file = "/data/local/tmp/RedactionInfoCacheTest.snapshot";
+    const struct stat st = makeStat(1, 100, 1000);
+    std::string data;
+    {
+        RedactionInfoCache cache;
+        cache.Insert("/storage/emulated/0/DCIM/a.mp4", 10001, st, kInfo,
+                     cache.GetGeneration("/storage/emulated/0/DCIM/a.mp4", 10001));
+        cache.Insert("/storage/emulated/0/DCIM/b.mp4", 10001, st, kInfo,
+                     cache.GetGeneration("/storage/emulated/0/DCIM/b.mp4", 10001));
+        ASSERT_TRUE(cache.SaveSnapshot(file));
+        ASSERT_TRUE(android::base::ReadFileToString(file, &data));
+    }
+
+    RedactionInfoCache cache;
+    // Truncated in the middle of the last entry, the first one saved is still good
+    ASSERT_TRUE(android::base::WriteStringToFile(data.substr(0, data.size() - 1), file));
+    EXPECT_EQ(1, cache.LoadSnapshot(file));
+    EXPECT_NE(nullptr, cache.Lookup("/storage/emulated/0/DCIM/b.mp4", 10001, st));
+
+    ASSERT_TRUE(android::base::WriteStringToFile("not a snapshot of the cache", file));
+    EXPECT_EQ(0, cache.LoadSnapshot(file));
+    ASSERT_TRUE(android::base::WriteStringToFile("", file));
+    EXPECT_EQ(0, cache.LoadSnapshot(file));
+    EXPECT_NE(0, access(file.c_str(), F_OK));
+}
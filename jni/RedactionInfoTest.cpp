@@ -36,6 +36,10 @@ unique_ptr<vector<RedactionRange>> createRedactionRangeVector(int num_rr, off64_
     return res;
 }
 
+vector<RedactionRange> toVector(const RedactionRangeSpan& span) {
+    return vector<RedactionRange>(span.begin(), span.end());
+}
+
 /**
  * Test the case where there are no redaction ranges.
  */
@@ -45,7 +49,7 @@ TEST(RedactionInfoTest, testNoRedactionRanges) {
     EXPECT_EQ(false, info.isRedactionNeeded());
 
     auto overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 1000, /*off*/ 1000);
-    EXPECT_EQ(0, overlapping_rr->size());
+    EXPECT_EQ(0, overlapping_rr.size());
 }
 
 /**
@@ -61,26 +65,26 @@ TEST(RedactionInfoTest, testSingleRedactionRange) {
     EXPECT_EQ(true, info.isRedactionNeeded());
     // Overlapping ranges
     auto overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 1000, /*off*/ 0);
-    EXPECT_EQ(*(createRedactionRangeVector(1, ranges)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, ranges)), toVector(overlapping_rr));
 
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 5, /*off*/ 0);
-    EXPECT_EQ(*(createRedactionRangeVector(1, ranges)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, ranges)), toVector(overlapping_rr));
 
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 5, /*off*/ 5);
-    EXPECT_EQ(*(createRedactionRangeVector(1, ranges)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, ranges)), toVector(overlapping_rr));
 
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 10, /*off*/ 1);
-    EXPECT_EQ(*(createRedactionRangeVector(1, ranges)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, ranges)), toVector(overlapping_rr));
 
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 1, /*off*/ 1);
-    EXPECT_EQ(*(createRedactionRangeVector(1, ranges)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, ranges)), toVector(overlapping_rr));
 
     // Non-overlapping range
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 100, /*off*/ 11);
-    EXPECT_EQ(*(createRedactionRangeVector(0, nullptr)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(0, nullptr)), toVector(overlapping_rr));
 
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 1, /*off*/ 11);
-    EXPECT_EQ(*(createRedactionRangeVector(0, nullptr)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(0, nullptr)), toVector(overlapping_rr));
 }
 
 /**
@@ -100,7 +104,7 @@ TEST(RedactionInfoTest, testSortedAndNonOverlappingRedactionRanges) {
     off64_t expected1[] = {
             1, 10, 15, 21, 32, 40,
     };
-    EXPECT_EQ(*(createRedactionRangeVector(3, expected1)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(3, expected1)), toVector(overlapping_rr));
 
     // Read request strictly contains a subset of the ranges: [15, 40]
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 26, /*off*/ 15);
@@ -110,11 +114,11 @@ TEST(RedactionInfoTest, testSortedAndNonOverlappingRedactionRanges) {
             32,
             40,
     };
-    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), toVector(overlapping_rr));
 
     // Read request intersects with a subset of the ranges" [16, 32]
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 17, /*off*/ 16);
-    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), toVector(overlapping_rr));
 }
 
 /**
@@ -134,7 +138,7 @@ TEST(RedactionInfoTest, testSortRedactionRanges) {
     off64_t expected1[] = {
             1, 10, 15, 21, 32, 40,
     };
-    EXPECT_EQ(*(createRedactionRangeVector(3, expected1)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(3, expected1)), toVector(overlapping_rr));
 
     // Read request strictly contains a subset of the ranges: [15, 40]
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 26, /*off*/ 15);
@@ -144,11 +148,11 @@ TEST(RedactionInfoTest, testSortRedactionRanges) {
             32,
             40,
     };
-    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), toVector(overlapping_rr));
 
     // Read request intersects with a subset of the ranges" [16, 32]
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 17, /*off*/ 16);
-    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), toVector(overlapping_rr));
 }
 
 /**
@@ -168,7 +172,7 @@ TEST(RedactionInfoTest, testSortAndMergeRedactionRanges) {
     off64_t expected1[] = {
             1, 10, 15, 21, 32, 40,
     };
-    EXPECT_EQ(*(createRedactionRangeVector(3, expected1)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(3, expected1)), toVector(overlapping_rr));
 
     // Read request strictly contains a subset of the ranges: [15, 40]
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 26, /*off*/ 15);
@@ -178,11 +182,11 @@ TEST(RedactionInfoTest, testSortAndMergeRedactionRanges) {
             32,
             40,
     };
-    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), toVector(overlapping_rr));
 
     // Read request intersects with a subset of the ranges" [16, 32]
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 17, /*off*/ 16);
-    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(2, expected2)), toVector(overlapping_rr));
 }
 
 /**
@@ -200,15 +204,15 @@ TEST(RedactionInfoTest, testMergeAllRangesIntoTheFirstRange) {
     // Read request equals the range: [1, 100]
     auto overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 100, /*off*/ 1);
     off64_t expected[] = {1, 100};
-    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), toVector(overlapping_rr));
 
     // Read request is contained in the range: [15, 40]
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 26, /*off*/ 15);
-    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), toVector(overlapping_rr));
 
     // Read request that strictly contains all of the redaction ranges
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 1000, /*off*/ 0);
-    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), toVector(overlapping_rr));
 }
 
 /**
@@ -226,15 +230,15 @@ TEST(RedactionInfoTest, testMergeAllRangesIntoTheLastRange) {
     // Read request equals the range: [0, 100]
     auto overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 100, /*off*/ 0);
     off64_t expected[] = {0, 100};
-    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), toVector(overlapping_rr));
 
     // Read request is contained in the range: [15, 40]
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 26, /*off*/ 15);
-    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), toVector(overlapping_rr));
 
     // Read request that strictly contains all of the redaction ranges
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 1000, /*off*/ 0);
-    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), toVector(overlapping_rr));
 }
 
 /**
@@ -252,15 +256,15 @@ TEST(RedactionInfoTest, testMergeAllRangesProgressively) {
     // Read request equals the range: [1, 15]
     auto overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 15, /*off*/ 1);
     off64_t expected[] = {1, 15};
-    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), toVector(overlapping_rr));
 
     // Read request is contained in the range: [2, 12]
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 10, /*off*/ 2);
-    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), toVector(overlapping_rr));
 
     // Read request that strictly contains all of the redaction ranges
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 100, /*off*/ 0);
-    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), toVector(overlapping_rr));
 
     off64_t reverse_rr[10] = {
             5, 15, 4, 14, 3, 13, 2, 12, 1, 11,
@@ -272,5 +276,32 @@ TEST(RedactionInfoTest, testMergeAllRangesProgressively) {
 
     // Read request equals the range: [1, 15]
     overlapping_rr = info.getOverlappingRedactionRanges(/*size*/ 15, /*off*/ 1);
-    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), *overlapping_rr);
+    EXPECT_EQ(*(createRedactionRangeVector(1, expected)), toVector(overlapping_rr));
+}
+
+/**
+ * Test that the binary search finds the same ranges as a linear scan when there are many ranges.
+ */
+TEST(RedactionInfoTest, testManyRedactionRanges) {
+    // Ranges [10 * i, 10 * i + 4] for i in [0, 100)
+    vector<off64_t> ranges;
+    for (int i = 0; i < 100; ++i) {
+        ranges.push_back(10 * i);
+        ranges.push_back(10 * i + 4);
+    }
+    RedactionInfo info(100, ranges.data());
+    EXPECT_EQ(100, info.size());
+
+    for (off64_t off = 0; off < 1020; off += 3) {
+        for (size_t size : {1, 4, 5, 6, 10, 37, 200}) {
+            vector<RedactionRange> expected;
+            for (int i = 0; i < 100; ++i) {
+                if (off <= 10 * i + 4 && off + size >= 10 * i) {
+                    expected.push_back(RedactionRange(10 * i, 10 * i + 4));
+                }
+            }
+            EXPECT_EQ(expected, toVector(info.getOverlappingRedactionRanges(size, off)))
+                    << "size=" << size << " off=" << off;
+        }
+    }
 }
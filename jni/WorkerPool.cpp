@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FuseDaemon"
+
+#include "include/libfuse_jni/WorkerPool.h"
+
+#include <android-base/logging.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <thread>
+#include <utility>
+
+namespace mediaprovider {
+namespace fuse {
+
+void SetCurrentThreadCpus(uint64_t cpu_mask) {
+    if (!cpu_mask) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < 64; cpu++) {
+        if (cpu_mask & (1ULL << cpu)) CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        PLOG(WARNING) << "Failed to restrict thread to CPUs " << std::hex << cpu_mask;
+    }
+}
+
+WorkerPool::WorkerPool(const Config& config, const std::string& name)
+    : config_(config), name_(name) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (unsigned int i = 0; i < config_.min_threads; i++) {
+        StartThreadLocked();
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    quit_ = true;
+    work_cv_.notify_all();
+    exit_cv_.wait(lock, [this] { return threads_ == 0; });
+}
+
+void WorkerPool::Submit(std::function<void()> task) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    queue_.push_back(std::move(task));
+    // Only grow once every thread is busy, and never past max_threads
+    if (idle_threads_ < queue_.size() && threads_ < config_.max_threads) {
+        StartThreadLocked();
+    } else {
+        work_cv_.notify_one();
+    }
+}
+
+WorkerPool::Stats WorkerPool::GetStats() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return {threads_, idle_threads_, queue_.size(), executed_};
+}
+
+void WorkerPool::StartThreadLocked() {
+    threads_++;
+    // Threads exit on their own, and the destructor waits for threads_ to drop to 0
+    std::thread(&WorkerPool::ThreadLoop, this).detach();
+}
+
+void WorkerPool::ThreadLoop() {
+    pthread_setname_np(pthread_self(), name_.substr(0, 15).c_str());
+    SetCurrentThreadCpus(config_.cpu_mask);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        if (queue_.empty()) {
+            if (quit_) break;
+
+            idle_threads_++;
+            bool timed_out = false;
+            if (threads_ > config_.min_threads) {
+                timed_out = !work_cv_.wait_for(lock, config_.idle_timeout,
+                                               [this] { return quit_ || !queue_.empty(); });
+            } else {
+                work_cv_.wait(lock, [this] { return quit_ || !queue_.empty(); });
+            }
+            idle_threads_--;
+            // Another thread may have exited in the meantime, keep at least min_threads around
+            if (timed_out && threads_ > config_.min_threads) break;
+            continue;
+        }
+
+        std::function<void()> task = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+        executed_++;
+    }
+
+    threads_--;
+    exit_cv_.notify_all();
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
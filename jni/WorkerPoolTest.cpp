@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "WorkerPoolTest"
+
+#include "libfuse_jni/WorkerPool.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace mediaprovider::fuse;
+using namespace std::chrono_literals;
+
+namespace {
+
+// Holds up the tasks that wait on it until it is opened
+class Gate {
+  public:
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return open_; });
+    }
+
+    void Open() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        open_ = true;
+        cv_.notify_all();
+    }
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool open_ = false;
+};
+
+WorkerPool::Config makeConfig(unsigned int min_threads, unsigned int max_threads) {
+    WorkerPool::Config config;
+    config.min_threads = min_threads;
+    config.max_threads = max_threads;
+    config.idle_timeout = 50ms;
+    return config;
+}
+
+// Polls |pool| until |predicate| holds for its stats, or gives up after a few seconds
+template <typename Predicate>
+WorkerPool::Stats waitForStats(WorkerPool* pool, Predicate predicate) {
+    WorkerPool::Stats stats = pool->GetStats();
+    for (int i = 0; i < 500 && !predicate(stats); i++) {
+        std::this_thread::sleep_for(10ms);
+        stats = pool->GetStats();
+    }
+    return stats;
+}
+
+}  // namespace
+
+TEST(WorkerPoolTest, testRunsTasks) {
+    std::atomic<int> count(0);
+    {
+        WorkerPool pool(makeConfig(1, 4), "test");
+        for (int i = 0; i < 100; i++) {
+            pool.Submit([&count] { count++; });
+        }
+        const WorkerPool::Stats stats =
+                waitForStats(&pool, [](const WorkerPool::Stats& s) { return s.executed == 100; });
+        EXPECT_EQ(100, stats.executed);
+    }
+    EXPECT_EQ(100, count);
+}
+
+TEST(WorkerPoolTest, testGrowsUpToMaxThreads) {
+    Gate gate;
+    WorkerPool pool(makeConfig(1, 3), "test");
+    for (int i = 0; i < 5; i++) {
+        pool.Submit([&gate] { gate.Wait(); });
+    }
+
+    // Three tasks are running, the other two wait for a thread
+    WorkerPool::Stats stats = waitForStats(
+            &pool, [](const WorkerPool::Stats& s) { return s.threads == 3 && s.queued == 2; });
+    EXPECT_EQ(3, stats.threads);
+    EXPECT_EQ(2, stats.queued);
+    EXPECT_EQ(0, stats.idle_threads);
+
+    gate.Open();
+    stats = waitForStats(&pool, [](const WorkerPool::Stats& s) { return s.executed == 5; });
+    EXPECT_EQ(5, stats.executed);
+}
+
+TEST(WorkerPoolTest, testShrinksToMinThreads) {
+    Gate gate;
+    WorkerPool pool(makeConfig(2, 4), "test");
+    EXPECT_EQ(2, pool.GetStats().threads);
+    for (int i = 0; i < 4; i++) {
+        pool.Submit([&gate] { gate.Wait(); });
+    }
+    EXPECT_EQ(4, waitForStats(&pool, [](const WorkerPool::Stats& s) {
+                     return s.threads == 4;
+                 }).threads);
+
+    gate.Open();
+    const WorkerPool::Stats stats = waitForStats(&pool, [](const WorkerPool::Stats& s) {
+        return s.executed == 4 && s.threads == 2;
+    });
+    EXPECT_EQ(2, stats.threads);
+    EXPECT_EQ(2, stats.idle_threads);
+}
+
+TEST(WorkerPoolTest, testDestructorRunsQueuedTasks) {
+    Gate gate;
+    std::atomic<int> count(0);
+    std::thread opener;
+    {
+        WorkerPool pool(makeConfig(1, 1), "test");
+        pool.Submit([&gate] { gate.Wait(); });
+        for (int i = 0; i < 10; i++) {
+            pool.Submit([&count] { count++; });
+        }
+        opener = std::thread([&gate] {
+            std::this_thread::sleep_for(50ms);
+            gate.Open();
+        });
+    }
+    EXPECT_EQ(10, count);
+    opener.join();
+}
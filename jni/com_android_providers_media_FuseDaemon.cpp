@@ -20,6 +20,7 @@
 #include <nativehelper/scoped_utf_chars.h>
 
 #include <string>
+#include <string_view>
 
 #include "FuseDaemon.h"
 #include "MediaProviderWrapper.h"
@@ -39,7 +40,8 @@ jlong com_android_providers_media_FuseDaemon_new(JNIEnv* env, jobject self,
 }
 
 void com_android_providers_media_FuseDaemon_start(JNIEnv* env, jobject self, jlong java_daemon,
-                                                  jint fd, jstring java_path) {
+                                                  jint fd, jstring java_path,
+                                                  jstring java_snapshot_file) {
     LOG(DEBUG) << "Starting the FUSE daemon...";
     fuse::FuseDaemon* const daemon = reinterpret_cast<fuse::FuseDaemon*>(java_daemon);
 
@@ -50,7 +52,12 @@ void com_android_providers_media_FuseDaemon_start(JNIEnv* env, jobject self, jlo
         return;
     }
 
-    daemon->Start(std::move(ufd), utf_chars_path.c_str());
+    ScopedUtfChars utf_chars_snapshot_file(env, java_snapshot_file);
+    if (!utf_chars_snapshot_file.c_str()) {
+        return;
+    }
+
+    daemon->Start(std::move(ufd), utf_chars_path.c_str(), utf_chars_snapshot_file.c_str());
 }
 
 bool com_android_providers_media_FuseDaemon_is_started(JNIEnv* env, jobject self,
@@ -78,7 +85,8 @@ jboolean com_android_providers_media_FuseDaemon_should_open_with_fuse(JNIEnv* en
             return JNI_FALSE;
         }
 
-        return daemon->ShouldOpenWithFuse(fd, for_read, utf_chars_path.c_str());
+        return daemon->ShouldOpenWithFuse(
+                fd, for_read, std::string_view(utf_chars_path.c_str(), utf_chars_path.size()));
     }
     // TODO(b/145741852): Throw exception
     return JNI_FALSE;
@@ -101,6 +109,28 @@ void com_android_providers_media_FuseDaemon_invalidate_fuse_dentry_cache(JNIEnv*
     // TODO(b/145741152): Throw exception
 }
 
+void com_android_providers_media_FuseDaemon_invalidate_permission_cache(JNIEnv* env, jobject self,
+                                                                       jlong java_daemon,
+                                                                       jint uid) {
+    fuse::FuseDaemon* const daemon = reinterpret_cast<fuse::FuseDaemon*>(java_daemon);
+    if (daemon) {
+        daemon->InvalidatePermissionCache(static_cast<uid_t>(uid));
+    }
+}
+
+jstring com_android_providers_media_FuseDaemon_dump(JNIEnv* env, jobject self,
+                                                    jlong java_daemon) {
+    const fuse::FuseDaemon* daemon = reinterpret_cast<fuse::FuseDaemon*>(java_daemon);
+    if (!daemon) {
+        return nullptr;
+    }
+    return env->NewStringUTF(daemon->Dump().c_str());
+}
+
+jstring com_android_providers_media_FuseDaemon_dump_stats(JNIEnv* env, jclass clazz) {
+    return env->NewStringUTF(fuse::FuseDaemon::DumpStats().c_str());
+}
+
 bool com_android_providers_media_FuseDaemon_is_fuse_thread(JNIEnv* env, jclass clazz) {
     return pthread_getspecific(fuse::MediaProviderWrapper::gJniEnvKey) != nullptr;
 }
@@ -108,7 +138,7 @@ bool com_android_providers_media_FuseDaemon_is_fuse_thread(JNIEnv* env, jclass c
 const JNINativeMethod methods[] = {
         {"native_new", "(Lcom/android/providers/media/MediaProvider;)J",
          reinterpret_cast<void*>(com_android_providers_media_FuseDaemon_new)},
-        {"native_start", "(JILjava/lang/String;)V",
+        {"native_start", "(JILjava/lang/String;Ljava/lang/String;)V",
          reinterpret_cast<void*>(com_android_providers_media_FuseDaemon_start)},
         {"native_delete", "(J)V",
          reinterpret_cast<void*>(com_android_providers_media_FuseDaemon_delete)},
@@ -120,7 +150,14 @@ const JNINativeMethod methods[] = {
          reinterpret_cast<void*>(com_android_providers_media_FuseDaemon_is_started)},
         {"native_invalidate_fuse_dentry_cache", "(JLjava/lang/String;)V",
          reinterpret_cast<void*>(
-                 com_android_providers_media_FuseDaemon_invalidate_fuse_dentry_cache)}};
+                 com_android_providers_media_FuseDaemon_invalidate_fuse_dentry_cache)},
+        {"native_invalidate_permission_cache", "(JI)V",
+         reinterpret_cast<void*>(
+                 com_android_providers_media_FuseDaemon_invalidate_permission_cache)},
+        {"native_dump", "(J)Ljava/lang/String;",
+         reinterpret_cast<void*>(com_android_providers_media_FuseDaemon_dump)},
+        {"native_dump_stats", "()Ljava/lang/String;",
+         reinterpret_cast<void*>(com_android_providers_media_FuseDaemon_dump_stats)}};
 }  // namespace
 
 void register_android_providers_media_FuseDaemon(JavaVM* vm, JNIEnv* env) {
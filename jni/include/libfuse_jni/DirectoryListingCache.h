@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIA_PROVIDER_FUSE_DIRECTORYLISTINGCACHE_H_
+#define MEDIA_PROVIDER_FUSE_DIRECTORYLISTINGCACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "libfuse_jni/ReaddirHelper.h"
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Keeps the listings of directories for a short while, so that an app opening the same directory
+ * again and again only has it listed by MediaProvider once.
+ *
+ * Listings are kept per uid, since MediaProvider only lists what the uid may see. They are
+ * dropped when the directory changes through FUSE, and otherwise expire after a short time, which
+ * bounds how long changes made on the lower file system go unnoticed.
+ *
+ * This class is thread safe.
+ */
+class DirectoryListingCache final {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    /** Default upper bound on the number of cached listings. */
+    static constexpr size_t kDefaultMaxEntries = 64;
+
+    /** Counters, see GetStats. */
+    struct Stats {
+        // Listings currently cached
+        size_t entries;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t invalidated;
+    };
+
+    /** Caches listings for |ttl|, nothing is cached if it is zero. */
+    explicit DirectoryListingCache(Clock::duration ttl, size_t max_entries = kDefaultMaxEntries)
+        : ttl_(ttl), max_entries_(max_entries), epoch_(0), hits_(0), misses_(0), invalidated_(0) {}
+
+    /**
+     * Returns the current epoch, which changes whenever anything is invalidated. Callers must
+     * read it before listing a directory and pass it to Insert.
+     */
+    uint64_t GetEpoch() const;
+
+    /** Returns the listing of directory |parent| for |uid|, or nullptr if it isn't cached. */
+    std::shared_ptr<const DirectoryEntries> Lookup(uint64_t parent, uid_t uid,
+                                                   Clock::time_point now = Clock::now());
+
+    /**
+     * Caches |entries| as the listing of directory |parent| for |uid|, unless it failed or
+     * anything was invalidated since |epoch|. Evicts the listing closest to expiry if full.
+     */
+    void Insert(uint64_t parent, uid_t uid, const DirectoryEntries& entries, uint64_t epoch,
+                Clock::time_point now = Clock::now());
+
+    /** Drops the listings of directory |parent|, whose entries changed. */
+    void Invalidate(uint64_t parent);
+
+    /** Drops all listings, e.g. when what uids may see changed. */
+    void InvalidateAll();
+
+    /** Returns the counters since the cache was created. */
+    Stats GetStats() const;
+
+  private:
+    typedef std::pair<uint64_t, uid_t> Key;
+
+    struct Entry {
+        std::shared_ptr<const DirectoryEntries> entries;
+        Clock::time_point expiry;
+    };
+
+    const Clock::duration ttl_;
+    const size_t max_entries_;
+    mutable std::mutex lock_;
+    // All guarded by lock_.
+    uint64_t epoch_;
+    // Ordered by directory first, so that all listings of a directory are adjacent
+    std::map<Key, Entry> entries_;
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t invalidated_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIA_PROVIDER_FUSE_DIRECTORYLISTINGCACHE_H_
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIA_PROVIDER_FUSE_FADVISER_H_
+#define MEDIA_PROVIDER_FUSE_FADVISER_H_
+
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace mediaprovider {
+namespace fuse {
+
+/*
+ * In order to avoid double caching with fuse, call fadvise on the file handles
+ * in the underlying file system. However, if this is done on every read/write,
+ * the fadvises cause a very significant slowdown in tests (specifically fio
+ * seq_write). So call fadvise on the file handles with the most reads/writes
+ * only after a threshold is passed.
+ *
+ * Only the range of a file that was actually read or written is dropped, and files
+ * that are streamed through sequentially are dropped before those accessed at random,
+ * e.g. a video being scrubbed through. Sequential streams are also hinted to the
+ * lower filesystem so that it reads ahead of them.
+ *
+ * Record and Close are called on the I/O path from any thread, so they only push
+ * onto a preallocated lock-free ring. The I/O is accounted for on a separate thread,
+ * which is only woken up once enough has been queued for the accounting to matter.
+ *
+ * Since queued I/O may be accounted for long after its fd was closed and the number
+ * reused, every fd number has a generation that Close bumps, and advice is only given
+ * for the generation the I/O was recorded in.
+ */
+class FAdviser {
+  public:
+    /** Issues posix_fadvise(fd, offset, len, advice), may be replaced in tests. */
+    typedef std::function<void(int fd, off_t offset, off_t len, int advice)> Advise;
+
+    /** Tunables of when and how files are advised. */
+    struct Policy {
+        static constexpr size_t kDefaultThreshold = 64 * 1024 * 1024;
+        static constexpr size_t kDefaultTarget = 32 * 1024 * 1024;
+        static constexpr size_t kDefaultBatchSize = 4 * 1024 * 1024;
+        static constexpr size_t kDefaultReadaheadSize = 2 * 1024 * 1024;
+
+        /** Bytes of I/O through open files that trigger dropping them from the page cache. */
+        size_t threshold = kDefaultThreshold;
+        /** Bytes of I/O that may remain accounted for once files were dropped. */
+        size_t target = kDefaultTarget;
+        /** Bytes of I/O the accounting may lag behind by. */
+        size_t batch_size = kDefaultBatchSize;
+        /** Bytes to read ahead of sequential streams, 0 disables readahead hints. */
+        size_t readahead_size = kDefaultReadaheadSize;
+
+        /**
+         * Returns a policy scaled to a device with |total_ram| bytes of memory, so that devices
+         * with little memory don't wait for as long before dropping files, and devices with a
+         * lot of it keep more of them cached.
+         */
+        static Policy ForMemory(uint64_t total_ram);
+    };
+
+    FAdviser();
+    explicit FAdviser(const Policy& policy, Advise advise = posix_fadvise);
+    ~FAdviser();
+
+    /** Records |size| bytes of I/O at |off| on |fd|. */
+    void Record(int fd, off_t off, size_t size);
+
+    /**
+     * Forgets about |fd|, which is about to be closed. No advice meant for it is given once this
+     * returns, so that none reaches the file its number is reused for. Only waits for advice
+     * being given on |fd| at the same time, if any.
+     */
+    void Close(int fd);
+
+  private:
+    struct Message {
+        enum Type { record, close };
+        Type type;
+        int fd;
+        // Generation of |fd| the message was sent in
+        uint32_t gen;
+        off_t off;
+        size_t size;
+    };
+
+    // Slot of the ring, see Push.
+    struct Cell {
+        std::atomic<size_t> seq;
+        Message message;
+    };
+
+    struct File {
+        // Generation of the fd this is about
+        uint32_t gen = 0;
+        // Bytes of I/O since the file was last dropped
+        size_t size = 0;
+        // Range covering that I/O
+        off_t begin = 0;
+        off_t end = 0;
+        // Where the next I/O is expected if the file is accessed sequentially
+        off_t next_off = 0;
+        // Consecutive I/Os that were close to next_off
+        int sequential_count = 0;
+        // End of the range last hinted with POSIX_FADV_WILLNEED
+        off_t readahead_end = 0;
+
+        bool IsSequential() const;
+    };
+
+    // I/O within this distance of where a sequential stream is expected to continue still counts
+    // as sequential, since the kernel may have several reads of a stream in flight at once.
+    static constexpr off_t kSequentialSlack = 1024 * 1024;
+    // Consecutive sequential I/Os after which a file is considered streamed through.
+    static constexpr int kSequentialCount = 4;
+
+    // Upper bound on the messages waiting for the accounting thread, so that closes of files
+    // with little I/O don't pile up.
+    static constexpr size_t kMaxPendingMessages = 1024;
+    // Messages the ring holds, senders wait for room beyond that.
+    static constexpr size_t kRingSize = 2 * kMaxPendingMessages;
+    // Generations are kept per fd number modulo this. Fds sharing one only lose advice when
+    // either is closed, not get each other's.
+    static constexpr size_t kGenerations = 4096;
+    // Advising an fd and bumping its generation is serialized on one of these.
+    static constexpr size_t kAdviseLocks = 64;
+
+    void RecordImpl(int fd, uint32_t gen, off_t off, size_t size);
+    void UpdateAccessPattern(int fd, File* file, off_t off, size_t size);
+    void CloseImpl(int fd, uint32_t gen);
+    void MessageLoop();
+    void SendMessage(const Message& message);
+    bool Push(const Message& message);
+    bool Pop(Message* message);
+    void Wake();
+
+    std::atomic<uint32_t>& GetGeneration(int fd) {
+        return generations_[static_cast<unsigned int>(fd) % kGenerations];
+    }
+    std::mutex& GetAdviseLock(int fd) {
+        return advise_locks_[static_cast<unsigned int>(fd) % kAdviseLocks];
+    }
+    // Gives advice on |fd| unless it was closed since generation |gen|.
+    void AdviseIfOpen(int fd, uint32_t gen, off_t offset, off_t len, int advice);
+
+    const Policy policy_;
+    const Advise advise_;
+
+    // Bounded multi-producer single-consumer queue. A cell is free for the sender that claims
+    // position |pos| once its seq is |pos|, and holds a message for the accounting thread once it
+    // is |pos| + 1.
+    std::unique_ptr<Cell[]> ring_;
+    std::atomic<size_t> push_pos_;
+    // Only accessed by the accounting thread.
+    size_t pop_pos_;
+
+    // Bytes recorded and messages sent since the accounting thread last drained the ring.
+    std::atomic<size_t> pending_size_;
+    std::atomic<size_t> pending_messages_;
+
+    std::unique_ptr<std::atomic<uint32_t>[]> generations_;
+    std::unique_ptr<std::mutex[]> advise_locks_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    // Guarded by mutex_.
+    bool wake_ = false;
+    bool quit_ = false;
+
+    // Only accessed by the accounting thread.
+    std::unordered_map<int, File> files_;
+    size_t total_size_;
+
+    std::thread thread_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIA_PROVIDER_FUSE_FADVISER_H_
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIA_PROVIDER_FUSE_FUSESTATS_H_
+#define MEDIA_PROVIDER_FUSE_FUSESTATS_H_
+
+#include <stdint.h>
+
+#include <string>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Latencies counted in power of two buckets of microseconds. Bucket 0 counts latencies below 1us,
+ * bucket i those in [2^(i-1), 2^i)us, and the last bucket everything longer than that.
+ */
+struct LatencyHistogram {
+    static constexpr int kBuckets = 20;
+
+    uint64_t buckets[kBuckets] = {};
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+
+    static int GetBucket(uint64_t ns);
+
+    void Add(uint64_t ns);
+    void Merge(const LatencyHistogram& other);
+
+    /**
+     * Returns an upper bound for the |percentile| (between 0 and 1) of the latencies, in
+     * microseconds. That is the upper bound of its bucket, or the maximum for the last bucket.
+     */
+    uint64_t GetPercentileUs(double percentile) const;
+};
+
+/**
+ * Always-on counters and latency histograms of the FUSE daemon, covering all mounts of the
+ * process.
+ *
+ * Every thread records into its own set of counters, so that recording costs a few uncontended
+ * stores and no locking. The sets are only merged when the stats are read, and the counts of
+ * threads that exit are kept.
+ */
+class FuseStats {
+  public:
+    /** FUSE requests, one per lowlevel handler. */
+    enum Op {
+        kOpLookup,
+        kOpForget,
+        kOpForgetMulti,
+        kOpGetattr,
+        kOpSetattr,
+        kOpCanonicalPath,
+        kOpMknod,
+        kOpMkdir,
+        kOpUnlink,
+        kOpRmdir,
+        kOpRename,
+        kOpOpen,
+        kOpRead,
+        kOpWrite,
+        kOpFlush,
+        kOpRelease,
+        kOpFsync,
+        kOpOpendir,
+        kOpReaddir,
+        kOpReaddirplus,
+        kOpReleasedir,
+        kOpFsyncdir,
+        kOpStatfs,
+        kOpAccess,
+        kOpCreate,
+        kNumOps
+    };
+
+    /** Upcalls to MediaProvider, one per public method of MediaProviderWrapper making them. */
+    enum Upcall {
+        kUpcallGetRedactionInfo,
+        kUpcallInsertFile,
+        kUpcallDeleteFile,
+        kUpcallIsOpenAllowed,
+        kUpcallIsCreatingDirAllowed,
+        kUpcallIsDeletingDirAllowed,
+        kUpcallGetDirectoryEntries,
+        kUpcallIsOpendirAllowed,
+        kUpcallIsUidForPackage,
+        kUpcallRename,
+        kUpcallNotify,
+        kNumUpcalls
+    };
+
+    enum Counter {
+        /** Bytes requested by reads, which may go beyond the end of the file. */
+        kBytesRead,
+        kBytesWritten,
+        /** Bytes of reads that were replaced by zeroes. */
+        kBytesRedacted,
+        kNumCounters
+    };
+
+    struct Snapshot {
+        LatencyHistogram ops[kNumOps];
+        LatencyHistogram upcalls[kNumUpcalls];
+        /** Time spent waiting for the node tree lock, only when it was contended. */
+        LatencyHistogram lock_wait;
+        uint64_t counters[kNumCounters] = {};
+
+        /** Formats the stats for dumpsys, skipping what never happened. */
+        std::string ToString() const;
+    };
+
+    static const char* GetOpName(Op op);
+    static const char* GetUpcallName(Upcall upcall);
+
+    static uint64_t NowNs();
+
+    static void RecordOp(Op op, uint64_t ns);
+    static void RecordUpcall(Upcall upcall, uint64_t ns);
+    static void RecordLockWait(uint64_t ns);
+    static void Add(Counter counter, uint64_t value);
+
+    /** Returns the stats recorded so far by all threads. */
+    static Snapshot GetSnapshot();
+
+    /** Records the time until it goes out of scope as |op|. */
+    class ScopedOp {
+      public:
+        explicit ScopedOp(Op op) : op_(op), start_ns_(NowNs()) {}
+        ~ScopedOp() { RecordOp(op_, NowNs() - start_ns_); }
+
+      private:
+        const Op op_;
+        const uint64_t start_ns_;
+    };
+
+    /** Records the time until it goes out of scope as |upcall|. */
+    class ScopedUpcall {
+      public:
+        explicit ScopedUpcall(Upcall upcall) : upcall_(upcall), start_ns_(NowNs()) {}
+        ~ScopedUpcall() { RecordUpcall(upcall_, NowNs() - start_ns_); }
+
+      private:
+        const Upcall upcall_;
+        const uint64_t start_ns_;
+    };
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIA_PROVIDER_FUSE_FUSESTATS_H_
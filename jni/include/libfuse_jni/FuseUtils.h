@@ -18,10 +18,40 @@
 #define MEDIAPROVIDER_JNI_UTILS_H_
 
 #include <string>
+#include <string_view>
 
 namespace mediaprovider {
 namespace fuse {
 
+/**
+ * Describes the parts of a path that access checks are based on. See parsePath.
+ */
+struct PathInfo {
+    /**
+     * Holds <userid> for paths of the form "/storage/emulated/<userid>[...]", where <userid>
+     * is a run of digits, and is empty for any other path. Unlike package, this is matched
+     * case sensitively.
+     */
+    std::string_view emulated_userid;
+    /**
+     * Holds <package> for paths (ignoring case) of the form
+     * "/storage/<volume>/[<userid>/]Android/{data,obb,sandbox}/<package>[/...]",
+     * and is empty for any other path.
+     */
+    std::string_view package;
+};
+
+/**
+ * Classifies the given path in a single pass and without allocating. The returned views
+ * point into |path|, so they're only valid for as long as |path| is.
+ *
+ * Matching package is equivalent to matching PATTERN_OWNED_PATH in FileUtils.java (without
+ * the media directory) and emulated_userid is equivalent to searching for
+ * "^/storage/emulated/([0-9]+)". This is called on almost every request, hence we avoid
+ * std::regex which is very slow.
+ */
+PathInfo parsePath(std::string_view path);
+
 /**
  * Returns true if the given path (ignoring case) is mounted for the given
  * userid. Mounted paths are:
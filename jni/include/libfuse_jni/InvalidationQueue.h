@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIA_PROVIDER_FUSE_INVALIDATION_QUEUE_H_
+#define MEDIA_PROVIDER_FUSE_INVALIDATION_QUEUE_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "libfuse_jni/WorkerPool.h"
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Queues the dentries the kernel must be told to invalidate, and notifies it of them from a
+ * single worker thread.
+ *
+ * Notifying the kernel from a request it is waiting on deadlocks, see
+ * fuse_lowlevel_notify_inval_entry, and is slow from anywhere else, so callers never do it
+ * themselves. Invalidating the same dentry again before the first invalidation was notified is
+ * coalesced into one, and the worker notifies everything that queued up while it was busy at
+ * once. Its thread exits once there was nothing to notify for a while.
+ *
+ * This class is thread safe.
+ */
+class InvalidationQueue final {
+  public:
+    struct Invalidation {
+        uint64_t parent;
+        std::string name;
+        /** Inode whose attributes to invalidate if invalidating the dentry fails, 0 for none. */
+        uint64_t child;
+    };
+
+    /** Notifies the kernel of |invalidation|, called from the worker thread. */
+    typedef std::function<void(const Invalidation& invalidation)> Notifier;
+
+    struct Stats {
+        uint64_t queued;
+        // Invalidations that were already queued
+        uint64_t coalesced;
+        uint64_t notified;
+        // Times the worker picked up queued invalidations
+        uint64_t batches;
+    };
+
+    explicit InvalidationQueue(Notifier notifier);
+
+    /** Notifies what is still queued, see Shutdown. */
+    ~InvalidationQueue();
+
+    /**
+     * Queues the invalidation of dentry |name| in directory |parent|, and of the attributes of
+     * inode |child| if that fails and |child| isn't 0.
+     */
+    void Add(uint64_t parent, std::string_view name, uint64_t child = 0);
+
+    /** Waits until everything queued so far was notified. */
+    void Flush();
+
+    /**
+     * Notifies what is still queued and drops what is queued afterwards, before the session the
+     * notifier uses goes away.
+     */
+    void Shutdown();
+
+    Stats GetStats();
+
+  private:
+    // Maps the parent and name of each queued dentry to the child to invalidate with it
+    typedef std::map<std::pair<uint64_t, std::string>, uint64_t> Batch;
+
+    void Drain();
+
+    const Notifier notifier_;
+
+    std::mutex lock_;
+    std::condition_variable idle_cv_;
+    // All guarded by lock_.
+    Batch queued_;
+    // Whether the worker was asked to drain the queue and hasn't finished yet
+    bool draining_;
+    bool shutdown_;
+    Stats stats_;
+
+    // Declared last, so that it is done before the rest of the queue goes away.
+    WorkerPool worker_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIA_PROVIDER_FUSE_INVALIDATION_QUEUE_H_
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIA_PROVIDER_FUSE_NEGATIVEENTRYCACHE_H_
+#define MEDIA_PROVIDER_FUSE_NEGATIVEENTRYCACHE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Keeps track of the lookups the kernel was told to cache as failed, i.e. the negative dentries
+ * it may hold.
+ *
+ * The kernel only drops a negative dentry by itself when the exact same name is created through
+ * FUSE. Names are case insensitive though, so once a file is created, the negative dentries for
+ * all other cases of its name have to be invalidated too, and a file created on the lower file
+ * system needs all of them invalidated. The cache is bounded, and lookups that can't be tracked
+ * must not be cached by the kernel.
+ *
+ * Invalidation happens for every node created, so it only takes a lock if the directory has
+ * tracked entries at all, and the guard against racing lookups is kept per shard of names, so
+ * that creating one file does not prevent others from being cached as missing.
+ *
+ * This class is thread safe.
+ */
+class NegativeEntryCache final {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    /** Default upper bound on the number of tracked negative dentries. */
+    static constexpr size_t kDefaultMaxEntries = 4096;
+
+    /** Counters, see GetStats. */
+    struct Stats {
+        // Negative dentries currently tracked
+        size_t entries;
+        uint64_t inserted;
+        // Lookups that couldn't be cached
+        uint64_t rejected;
+        uint64_t invalidated;
+    };
+
+    explicit NegativeEntryCache(size_t max_entries = kDefaultMaxEntries);
+
+    /**
+     * Returns the generation of |name| in directory |parent|, which changes whenever it may have
+     * been invalidated. Callers must read it before finding out that a file is missing and pass
+     * it to Insert.
+     */
+    uint64_t GetGeneration(uint64_t parent, std::string_view name) const;
+
+    /**
+     * Records that the kernel is about to cache |name| in directory |parent| as missing until
+     * |expiry|. Returns false if that can't be tracked, because the cache is full or |name| may
+     * have been invalidated since |generation|, in which case the lookup must not be cached.
+     */
+    bool Insert(uint64_t parent, std::string_view name, Clock::time_point expiry,
+                uint64_t generation, Clock::time_point now = Clock::now());
+
+    /**
+     * Forgets about the names in directory |parent| that match |name| case insensitively, now
+     * that it exists, and returns those the kernel may still cache as missing.
+     */
+    std::vector<std::string> Invalidate(uint64_t parent, std::string_view name,
+                                        Clock::time_point now = Clock::now());
+
+    /** Returns the counters since the cache was created. */
+    Stats GetStats() const;
+
+  private:
+    struct Key {
+        uint64_t parent;
+        // Name folded to lower case
+        std::string name;
+
+        bool operator==(const Key& other) const {
+            return parent == other.parent && name == other.name;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    struct Entry {
+        std::string name;
+        Clock::time_point expiry;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex lock;
+        // Bumped on every invalidation of a name in the shard, before anything is looked up
+        std::atomic<uint64_t> generation{0};
+        // Cases of each name that are cached as missing, guarded by lock.
+        std::unordered_map<Key, std::vector<Entry>, KeyHash> entries;
+    };
+
+    // Shards names are spread over, see Shard.
+    static constexpr size_t kShards = 64;
+    // Directories are counted in this many slots, see GetParentCount.
+    static constexpr size_t kParentSlots = 1024;
+
+    static size_t Hash(uint64_t parent, std::string_view name);
+    Shard& GetShard(uint64_t parent, std::string_view name) const;
+    // Returns the number of entries tracked in |parent|, and any other directory sharing its slot.
+    std::atomic<uint32_t>& GetParentCount(uint64_t parent) const;
+
+    // Drops the entries that expired by |now| from |shard|. Must be called with its lock held.
+    void PruneLocked(Shard* shard, Clock::time_point now);
+
+    const size_t max_entries_;
+    const std::unique_ptr<Shard[]> shards_;
+    const std::unique_ptr<std::atomic<uint32_t>[]> parent_counts_;
+    std::atomic<size_t> size_;
+    std::atomic<uint64_t> inserted_;
+    std::atomic<uint64_t> rejected_;
+    std::atomic<uint64_t> invalidated_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIA_PROVIDER_FUSE_NEGATIVEENTRYCACHE_H_
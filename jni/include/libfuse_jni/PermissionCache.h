@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIA_PROVIDER_FUSE_PERMISSIONCACHE_H_
+#define MEDIA_PROVIDER_FUSE_PERMISSIONCACHE_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Caches the access decisions MediaProvider makes for FUSE requests, so that repeated checks
+ * by the same app don't have to call into Java.
+ *
+ * Entries are invalidated per uid when the packages or permissions of an app change and per path
+ * when a path is created, renamed or deleted. Path decisions also expire after a few seconds:
+ * MediaProvider bases them on URI grants too, and nothing tells the cache when those are revoked.
+ * Whether a package belongs to a uid only changes along with the packages and never expires.
+ *
+ * This class is thread safe.
+ */
+class PermissionCache final {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    /** Default upper bound on the number of cached path decisions. */
+    static constexpr size_t kDefaultMaxPathDecisions = 8192;
+    /** Default time after which a path decision has to be made again. */
+    static constexpr Clock::duration kDefaultPathDecisionTtl = std::chrono::seconds(2);
+
+    /** The access checks that path decisions are cached for. */
+    enum class Op : uint8_t {
+        kOpen,
+        kOpenForWrite,
+        kOpendir,
+        kOpendirForWrite,
+        kCreateDir,
+    };
+
+    /** Hit and miss counters, see GetStats. */
+    struct Stats {
+        uint64_t package_hits;
+        uint64_t package_misses;
+        uint64_t path_hits;
+        uint64_t path_misses;
+    };
+
+    /**
+     * Creates a cache which holds at most |max_path_decisions| path decisions, each for
+     * |path_decision_ttl|. Once the limit is exceeded, all path decisions are dropped.
+     */
+    explicit PermissionCache(size_t max_path_decisions = kDefaultMaxPathDecisions,
+                             Clock::duration path_decision_ttl = kDefaultPathDecisionTtl)
+        : max_path_decisions_(max_path_decisions), path_decision_ttl_(path_decision_ttl) {}
+
+    /**
+     * Returns the current epoch, which changes whenever anything is invalidated. Callers must
+     * read it before computing a decision and pass it to the matching Insert* method, which
+     * drops the decision if anything was invalidated in the meantime.
+     */
+    uint64_t GetEpoch() const { return epoch_.load(std::memory_order_acquire); }
+
+    /**
+     * Looks up whether |pkg| belongs to |uid|. Returns true and sets |result| on a hit.
+     */
+    bool LookupUidForPackage(uid_t uid, const std::string& pkg, bool* result);
+
+    /**
+     * Returns whether it is cached if |pkg| belongs to |uid|, without counting a hit or miss.
+     */
+    bool HasUidForPackage(uid_t uid, const std::string& pkg) const;
+
+    /** Caches whether |pkg| belongs to |uid|, unless the cache was invalidated since |epoch|. */
+    void InsertUidForPackage(uid_t uid, const std::string& pkg, bool result, uint64_t epoch);
+
+    /**
+     * Looks up the decision for |uid| doing |op| on |path|. Returns true and sets |result| to 0
+     * or the errno the check failed with on a hit.
+     */
+    bool LookupPathDecision(uid_t uid, const std::string& path, Op op, int* result,
+                            Clock::time_point now = Clock::now());
+
+    /**
+     * Caches the decision for |uid| doing |op| on |path|, unless the cache was invalidated since
+     * |epoch|.
+     */
+    void InsertPathDecision(uid_t uid, const std::string& path, Op op, int result,
+                            uint64_t epoch, Clock::time_point now = Clock::now());
+
+    /** Drops all decisions made for |uid|. */
+    void InvalidateUid(uid_t uid);
+
+    /** Drops all decisions made for |path| and any path below it. */
+    void InvalidatePath(const std::string& path);
+
+    /** Drops all decisions. */
+    void InvalidateAll();
+
+    /** Returns the hit and miss counters since the cache was created. */
+    Stats GetStats() const;
+
+  private:
+    struct PathDecision {
+        uid_t uid;
+        Op op;
+        int result;
+        Clock::time_point expiry;
+    };
+
+    const size_t max_path_decisions_;
+    const Clock::duration path_decision_ttl_;
+
+    mutable std::shared_mutex lock_;
+    // Incremented under an exclusive lock_ on every invalidation.
+    std::atomic<uint64_t> epoch_ = 0;
+    // Packages known to belong (or not) to each uid.
+    std::unordered_map<uid_t, std::unordered_map<std::string, bool>> packages_;
+    // Path decisions, ordered by path so that all paths below a directory are adjacent.
+    std::map<std::string, std::vector<PathDecision>> path_decisions_;
+    size_t path_decision_count_ = 0;
+
+    std::atomic<uint64_t> package_hits_ = 0;
+    std::atomic<uint64_t> package_misses_ = 0;
+    std::atomic<uint64_t> path_hits_ = 0;
+    std::atomic<uint64_t> path_misses_ = 0;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIA_PROVIDER_FUSE_PERMISSIONCACHE_H_
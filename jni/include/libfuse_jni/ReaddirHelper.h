@@ -18,39 +18,109 @@
 #define MEDIA_PROVIDER_FUSE_READDIR_HELPER_H
 
 #include <dirent.h>
-#include <string>
+#include <stdint.h>
+
 #include <vector>
 
 namespace mediaprovider {
 namespace fuse {
 
 /**
- * Holds a directory entry.
+ * Holds the entries of a directory.
  *
- * DirectoryEntry object holds information about the directory entry such as
- * name and type of the file or directory.
+ * Names are stored back to back in a single buffer, so that listing a directory with many
+ * entries doesn't need an allocation for each of them. A listing that failed holds no entries
+ * and an errno instead.
  */
-struct DirectoryEntry {
+class DirectoryEntries {
+  public:
+    DirectoryEntries() : error_(0) {}
+
+    /** Number of entries. */
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+    /** Nul terminated name of entry |i|, valid until entries are added or cleared. */
+    const char* name(size_t i) const { return names_.data() + entries_[i].name_off; }
+    size_t name_length(size_t i) const { return entries_[i].name_len; }
+    /** Type of entry |i|, corresponding to d_type of dirent structure defined in dirent.h */
+    int type(size_t i) const { return entries_[i].type; }
+
+    /** errno the listing failed with, 0 if it didn't fail. */
+    int error() const { return error_; }
+
+    /** Adds an entry named by the |len| bytes at |name|, which must not contain a nul byte. */
+    void Add(const char* name, size_t len, int type);
+
     /**
-     * Create a directory entry.
+     * Adds the entries packed in the |len| bytes at |data|. Each entry is made of
      *
-     * @param name directory entry name.
-     * @param type directory entry type. Directory entry type corresponds to
-     * d_type of dirent structure defined in dirent.h
+     *   uint8_t name_len, uint8_t d_type, char name[name_len], '\0'
+     *
+     * This is copied as is, and the names are used in place. Returns false and adds nothing if
+     * |data| is malformed.
+     */
+    bool AddPacked(const char* data, size_t len);
+
+    /** Fails the listing with |error|, dropping all entries. */
+    void SetError(int error);
+
+    /** Drops all entries and any error. */
+    void Clear();
+
+  private:
+    struct Entry {
+        uint32_t name_off;
+        uint8_t name_len;
+        uint8_t type;
+    };
+
+    // Names of all entries, each followed by a nul byte, possibly interleaved with the headers
+    // they were packed with.
+    std::vector<char> names_;
+    std::vector<Entry> entries_;
+    int error_;
+};
+
+/**
+ * Reads a directory of the lower file system a buffer at a time, with getdents64, so that the
+ * first entries can be used before the whole directory was read.
+ *
+ * The scanner reads from the current offset of the directory and doesn't own its fd. The fd must
+ * not be read from by other means in the meantime, e.g. by readdir() on a stream it belongs to.
+ */
+class DirectoryScanner {
+  public:
+    /** Bytes read from the directory at a time. */
+    static constexpr size_t kBufferSize = 64 * 1024;
+
+    explicit DirectoryScanner(int dir_fd) : fd_(dir_fd), done_(false) {}
+
+    /**
+     * Reads the next buffer of entries from the directory and adds those that satisfy |filter|
+     * to |entries|, or all of them if it is null. '.' and '..' are skipped. Returns false once
+     * the end of the directory was reached or reading it failed, in which case |entries| holds
+     * the errno.
      */
-    DirectoryEntry(const std::string& name, int type) : d_name(name), d_type(type) {}
-    const std::string d_name;
-    const int d_type;
+    bool ScanNext(bool (*const filter)(const dirent&), DirectoryEntries* entries);
+
+    /** Whether the whole directory was read, or reading it failed. */
+    bool done() const { return done_; }
+
+  private:
+    const int fd_;
+    bool done_;
 };
 
 /**
  * Adds directory entries from lower file system to the list.
  *
  * If a filter is specified, directory entries must satisfy the given filter. If filter is null,
- * all directory entries(except '.' & '..') are returned.
+ * all directory entries(except '.' & '..') are returned. The directory stream must not have been
+ * read from since it was opened or rewound.
  */
 void addDirectoryEntriesFromLowerFs(DIR* dirp, bool (*const filter)(const dirent&),
-        std::vector<std::shared_ptr<DirectoryEntry>>* directory_entries);
+                                    DirectoryEntries* directory_entries);
 
 /**
  * Checks if the given dirent is directory.
@@ -30,6 +30,28 @@ namespace fuse {
  */
 typedef std::pair<off64_t, off64_t> RedactionRange;
 
+/**
+ * Non-owning view of consecutive redaction ranges held by a RedactionInfo.
+ * It's only valid for as long as the RedactionInfo it was obtained from.
+ */
+class RedactionRangeSpan {
+  public:
+    RedactionRangeSpan(const RedactionRange* begin, const RedactionRange* end)
+        : begin_(begin), end_(end) {}
+
+    const RedactionRange* begin() const { return begin_; }
+    const RedactionRange* end() const { return end_; }
+    size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+    const RedactionRange& front() const { return *begin_; }
+    const RedactionRange& back() const { return *(end_ - 1); }
+    const RedactionRange& operator[](size_t i) const { return begin_[i]; }
+
+  private:
+    const RedactionRange* begin_;
+    const RedactionRange* end_;
+};
+
 class RedactionInfo {
   public:
     /**
@@ -63,13 +85,14 @@ class RedactionInfo {
      *     * Non-overlapping (with each other)
      *     * Sorted in an ascending order of offset
      *
+     * <p>This doesn't allocate, the ranges are found with a binary search.
+     *
      * @param size size of the read request
      * @param off offset of the first byte of the read request
-     * @return unique_ptr to a vector of RedactionRanges. If there are no
-     * relevant redaction ranges, the vector will be empty.
+     * @return span of the relevant RedactionRanges within this RedactionInfo.
+     * If there are no relevant redaction ranges, the span will be empty.
      */
-    std::unique_ptr<std::vector<RedactionRange>> getOverlappingRedactionRanges(size_t size,
-                                                                               off64_t off) const;
+    RedactionRangeSpan getOverlappingRedactionRanges(size_t size, off64_t off) const;
     /**
      * Returns whether any ranges need to be redacted.
      */
@@ -78,6 +101,10 @@ class RedactionInfo {
      * Returns number of redaction ranges.
      */
     int size() const;
+    /**
+     * Returns all redaction ranges, sorted and without overlaps.
+     */
+    RedactionRangeSpan getRedactionRanges() const;
 
   private:
     std::vector<RedactionRange> redaction_ranges_;
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIA_PROVIDER_FUSE_REDACTIONINFOCACHE_H_
+#define MEDIA_PROVIDER_FUSE_REDACTIONINFOCACHE_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <array>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "libfuse_jni/RedactionInfo.h"
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * LRU cache of the redaction ranges MediaProvider computed for an app reading a file, so that
+ * apps repeatedly opening the same media file don't have its metadata parsed each time.
+ *
+ * Entries are keyed on the path and the uid of the reader, since whether ranges are redacted
+ * depends on the permissions of the reader. Each entry also remembers the inode, size and
+ * modification time of the file it was computed for, and is ignored once the file changes.
+ *
+ * Files are invalidated on every write and attribute change, so ranges computed concurrently are
+ * only dropped if their own path, one of its directories, or their uid was invalidated, see
+ * GetGeneration.
+ *
+ * This class is thread safe.
+ */
+class RedactionInfoCache final {
+  public:
+    /** Default upper bound on the memory used by cached entries. */
+    static constexpr size_t kDefaultMaxBytes = 512 * 1024;
+
+    /** Counters and current size, see GetStats. */
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t entries;
+        size_t bytes;
+    };
+
+    /**
+     * Creates a cache whose entries use at most |max_bytes| bytes. The least recently used entries
+     * are evicted once that is exceeded.
+     */
+    explicit RedactionInfoCache(size_t max_bytes = kDefaultMaxBytes) : max_bytes_(max_bytes) {}
+
+    /**
+     * Returns the generation of the entry for |uid| reading |path|, which changes whenever it may
+     * have been invalidated. Callers must read it before computing redaction ranges and pass it to
+     * Insert.
+     */
+    uint64_t GetGeneration(const std::string& path, uid_t uid) const;
+
+    /**
+     * Returns a copy of the redaction ranges cached for |uid| reading |path|, or nullptr if
+     * there are none for the version of the file described by |st|.
+     */
+    std::unique_ptr<RedactionInfo> Lookup(const std::string& path, uid_t uid,
+                                          const struct stat& st);
+
+    /**
+     * Caches |ri| for |uid| reading the version of |path| described by |st|, unless the entry
+     * may have been invalidated since |generation|.
+     */
+    void Insert(const std::string& path, uid_t uid, const struct stat& st, const RedactionInfo& ri,
+                uint64_t generation);
+
+    /** Drops all entries for |path| and any path below it. */
+    void InvalidatePath(const std::string& path);
+
+    /** Drops all entries for |uid|. */
+    void InvalidateUid(uid_t uid);
+
+    /** Drops all entries. */
+    void InvalidateAll();
+
+    /** Returns the counters since the cache was created and its current size. */
+    Stats GetStats() const;
+
+    /**
+     * Writes all entries to |file|, most recently used first, so that the cache of a later
+     * process can start with them, see LoadSnapshot. The file is replaced atomically. If nothing
+     * changed since the last snapshot was saved to |file|, only its modification time is updated,
+     * so that it is cheap to call periodically. Returns false on failure.
+     */
+    bool SaveSnapshot(const std::string& file) const;
+
+    /**
+     * Adds the entries saved to |file| by SaveSnapshot, as many as fit, and deletes it so that it
+     * is only used once. Like all others, the entries are checked against the version of their
+     * file when they are looked up. Returns the number of entries added, which is 0 if |file|
+     * doesn't exist or isn't a snapshot.
+     */
+    size_t LoadSnapshot(const std::string& file);
+
+  private:
+    typedef std::pair<std::string, uid_t> Key;
+
+    struct Entry {
+        Key key;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        RedactionInfo ri;
+        size_t bytes;
+    };
+
+    // Generations are kept for paths and uids hashed into this many slots each.
+    static constexpr size_t kGenerationSlots = 256;
+
+    std::atomic<uint64_t>& GetPathGeneration(std::string_view path) const;
+    std::atomic<uint64_t>& GetUidGeneration(uid_t uid) const;
+
+    // Memory accounted for an entry.
+    static size_t GetEntryBytes(const std::string& path, const RedactionInfo& ri);
+
+    // Removes |it| from lru_ and index_. Caller must hold lock_.
+    void EraseLocked(std::list<Entry>::iterator it);
+
+    // Adds the entries of the |len| bytes of a snapshot at |data|, see LoadSnapshot.
+    size_t LoadSnapshotData(const char* data, size_t len);
+
+    const size_t max_bytes_;
+
+    // Incremented on every invalidation of a path, of a uid, or of everything. Only changed with
+    // lock_ held, so that Insert sees them change before the entries are dropped.
+    mutable std::array<std::atomic<uint64_t>, kGenerationSlots> path_generations_{};
+    mutable std::array<std::atomic<uint64_t>, kGenerationSlots> uid_generations_{};
+    std::atomic<uint64_t> generation_{0};
+
+    mutable std::mutex lock_;
+    // Most recently used entries first.
+    std::list<Entry> lru_;
+    // Ordered by path so that all paths below a directory are adjacent.
+    std::map<Key, std::list<Entry>::iterator> index_;
+    size_t bytes_ = 0;
+
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t evictions_ = 0;
+    // Incremented whenever entries are added or dropped.
+    uint64_t version_ = 0;
+
+    // Serializes SaveSnapshot, and guards what it last saved.
+    mutable std::mutex save_lock_;
+    mutable std::string saved_file_;
+    mutable uint64_t saved_version_ = 0;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIA_PROVIDER_FUSE_REDACTIONINFOCACHE_H_
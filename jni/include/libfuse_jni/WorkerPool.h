@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIA_PROVIDER_FUSE_WORKER_POOL_H_
+#define MEDIA_PROVIDER_FUSE_WORKER_POOL_H_
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Runs tasks on a pool of threads that grows with demand up to a maximum, and shrinks back to a
+ * minimum once threads have been idle for a while.
+ *
+ * The FUSE daemon hands requests that end in upcalls to MediaProvider to such a pool, so that they
+ * don't hold up cheap requests. Threads are kept around for longer than libfuse keeps its own,
+ * because each new thread has to attach to the JVM before its first upcall.
+ */
+class WorkerPool {
+  public:
+    struct Config {
+        /** Threads that are kept around even when idle. */
+        unsigned int min_threads = 1;
+        /** Threads that run tasks at once, tasks queue up beyond that. */
+        unsigned int max_threads = 4;
+        /** How long threads above min_threads wait for a task before exiting. */
+        std::chrono::milliseconds idle_timeout = std::chrono::seconds(10);
+        /** CPUs the threads may run on, one bit per CPU. 0 allows all of them. */
+        uint64_t cpu_mask = 0;
+    };
+
+    struct Stats {
+        size_t threads;
+        size_t idle_threads;
+        size_t queued;
+        uint64_t executed;
+    };
+
+    /** Starts min_threads threads, named |name| for debugging. */
+    WorkerPool(const Config& config, const std::string& name);
+
+    /** Runs the tasks that are still queued and waits for all threads to exit. */
+    ~WorkerPool();
+
+    /** Queues |task| to run on one of the threads of the pool. */
+    void Submit(std::function<void()> task);
+
+    Stats GetStats();
+
+  private:
+    void StartThreadLocked();
+    void ThreadLoop();
+
+    const Config config_;
+    const std::string name_;
+
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable exit_cv_;
+    // All guarded by mutex_.
+    std::deque<std::function<void()>> queue_;
+    size_t threads_ = 0;
+    size_t idle_threads_ = 0;
+    uint64_t executed_ = 0;
+    bool quit_ = false;
+};
+
+/** Restricts the calling thread to the CPUs in |cpu_mask|, does nothing if it is 0. */
+void SetCurrentThreadCpus(uint64_t cpu_mask);
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIA_PROVIDER_FUSE_WORKER_POOL_H_
@@ -18,19 +18,26 @@
 #define MEDIA_PROVIDER_JNI_NODE_INL_H_
 
 #include <android-base/logging.h>
+#include <sys/stat.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
-#include <limits>
+#include <future>
 #include <list>
 #include <memory>
 #include <mutex>
-#include <set>
+#include <new>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "libfuse_jni/FuseStats.h"
 #include "libfuse_jni/ReaddirHelper.h"
 #include "libfuse_jni/RedactionInfo.h"
 
@@ -39,20 +46,232 @@ class NodeTest;
 namespace mediaprovider {
 namespace fuse {
 
+// Allocates objects of type T out of blocks of them, rather than one at a time. After a full
+// media scan there are hundreds of thousands of nodes, and allocating them individually costs an
+// allocator header each and scatters them all over the heap.
+//
+// Each thread allocates from one of kShards shards, so that threads creating and freeing objects
+// rarely contend, and objects are freed back into the shard that owns their block. Blocks are
+// aligned to their size, so that the block of an object is found from its address. A block whose
+// objects were all freed is returned, e.g. once the kernel forgot about a large tree, unless it's
+// the last block a shard has room in, which is kept so that a shard doesn't allocate and free a
+// block over and over.
+template <typename T>
+class Slab {
+  public:
+    static void* Allocate(size_t size) {
+        CHECK_EQ(size, sizeof(T));
+        return Get().shards_[GetShardIndex()].AllocateSlot();
+    }
+
+    static void Free(void* ptr) {
+        Slot* slot = static_cast<Slot*>(ptr);
+        Block* block =
+                reinterpret_cast<Block*>(reinterpret_cast<uintptr_t>(slot) & ~(kBlockSize - 1));
+        block->shard->FreeSlot(block, slot);
+    }
+
+    // Returns the number of blocks currently allocated, for tests.
+    static size_t GetBlockCount() {
+        size_t count = 0;
+        for (Shard& shard : Get().shards_) {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            count += shard.blocks;
+        }
+        return count;
+    }
+
+    static constexpr size_t kShards = 16;
+
+  private:
+    static constexpr size_t kBlockSize = 16 * 1024;
+
+    union Slot {
+        Slot* next;
+        alignas(T) char storage[sizeof(T)];
+    };
+
+    struct Shard;
+
+    // Header of a block, followed by its slots.
+    struct Block {
+        Shard* shard;
+        // Links the blocks of |shard| that have free slots
+        Block* prev;
+        Block* next;
+        // Slots freed since they were handed out
+        Slot* free;
+        // Slots at the start of the block that were ever handed out, and those in use
+        size_t carved;
+        size_t used;
+    };
+
+    static constexpr size_t kHeaderSize = (sizeof(Block) + alignof(Slot) - 1) & ~(alignof(Slot) - 1);
+    static constexpr size_t kSlotsPerBlock = (kBlockSize - kHeaderSize) / sizeof(Slot);
+    static_assert(kSlotsPerBlock >= 16, "Objects too large for the blocks of a slab");
+
+    static Slot* GetSlot(Block* block, size_t i) {
+        return reinterpret_cast<Slot*>(reinterpret_cast<char*>(block) + kHeaderSize) + i;
+    }
+
+    // Padded to a cache line so that threads using adjacent shards don't invalidate each other's
+    // caches.
+    struct alignas(64) Shard {
+        void* AllocateSlot() {
+            std::lock_guard<std::mutex> guard(lock);
+            Block* block = available;
+            if (block == nullptr) {
+                block = static_cast<Block*>(
+                        ::operator new(kBlockSize, std::align_val_t(kBlockSize)));
+                *block = {this, nullptr, nullptr, nullptr, 0, 0};
+                Push(block);
+                blocks++;
+            }
+
+            Slot* slot;
+            if (block->free) {
+                slot = block->free;
+                block->free = slot->next;
+            } else {
+                // Carved in order, so that consecutive allocations are next to each other and the
+                // pages of a block are only touched once they're needed
+                slot = GetSlot(block, block->carved++);
+            }
+            if (++block->used == kSlotsPerBlock) {
+                Unlink(block);
+            }
+            return slot;
+        }
+
+        void FreeSlot(Block* block, Slot* slot) {
+            std::lock_guard<std::mutex> guard(lock);
+            slot->next = block->free;
+            block->free = slot;
+            if (block->used-- == kSlotsPerBlock) {
+                Push(block);
+            } else if (block->used == 0 && (block->prev || block->next)) {
+                Unlink(block);
+                ::operator delete(block, std::align_val_t(kBlockSize));
+                blocks--;
+            }
+        }
+
+        void Push(Block* block) {
+            block->prev = nullptr;
+            block->next = available;
+            if (available) available->prev = block;
+            available = block;
+        }
+
+        void Unlink(Block* block) {
+            if (block->prev) {
+                block->prev->next = block->next;
+            } else {
+                available = block->next;
+            }
+            if (block->next) block->next->prev = block->prev;
+            block->prev = block->next = nullptr;
+        }
+
+        std::mutex lock;
+        // Guarded by |lock|.
+        Block* available = nullptr;
+        size_t blocks = 0;
+    };
+
+    Slab() = default;
+
+    // Never destroyed, so that objects may still be freed by other static destructors.
+    static Slab& Get() {
+        static Slab* slab = new Slab;
+        return *slab;
+    }
+
+    // Spreads threads over the shards as they first allocate.
+    static size_t GetShardIndex() {
+        static std::atomic<size_t> next_shard(0);
+        static thread_local const size_t shard =
+                next_shard.fetch_add(1, std::memory_order_relaxed) % kShards;
+        return shard;
+    }
+
+    std::array<Shard, kShards> shards_;
+};
+
 struct handle {
-    explicit handle(int fd, const RedactionInfo* ri, bool cached) : fd(fd), ri(ri), cached(cached) {
+    // Keeps track of the version of the file that the redaction ranges of a handle were computed
+    // for, when the file was being written as the handle was opened. The ranges are recomputed
+    // once the file changed, until they were computed after the last writer was gone.
+    struct RedactionWatch {
+        RedactionWatch(uid_t uid, pid_t pid, const struct stat& st)
+            : uid(uid), pid(pid), size(st.st_size), mtime(st.st_mtim), done(false) {}
+
+        // Whether |st| is the version of the file the ranges were computed for, as far as can
+        // be told. Must be called with |lock| held.
+        bool IsCurrentLocked(const struct stat& st) const {
+            return st.st_size == size && st.st_mtim.tv_sec == mtime.tv_sec &&
+                   st.st_mtim.tv_nsec == mtime.tv_nsec;
+        }
+
+        // Who opened the handle, whom the ranges are computed for.
+        const uid_t uid;
+        const pid_t pid;
+        // Serializes recomputing the ranges.
+        std::mutex lock;
+        // Guarded by |lock|.
+        off64_t size;
+        struct timespec mtime;
+        // Set once the ranges no longer need to be checked.
+        std::atomic<bool> done;
+    };
+
+    explicit handle(int fd, const RedactionInfo* ri, bool cached, bool passthrough = false,
+                    bool for_write = false, std::unique_ptr<RedactionWatch> watch = nullptr)
+        : fd(fd),
+          cached(cached),
+          passthrough(passthrough),
+          for_write(for_write),
+          watch(std::move(watch)),
+          ri_(ri) {
         CHECK(ri != nullptr);
     }
 
+    // Returns the redaction ranges of reads through this handle. Must only be called once they
+    // are no longer replaced, i.e. if the handle has no |watch| or watch->done was seen set.
+    const RedactionInfo& GetRedactionInfo() const { return *ri_; }
+
+    // Like GetRedactionInfo, for handles whose ranges may still be replaced.
+    std::shared_ptr<const RedactionInfo> LoadRedactionInfo() const {
+        return std::atomic_load(&ri_);
+    }
+
+    void SetRedactionInfo(std::unique_ptr<const RedactionInfo> ri) {
+        CHECK(watch != nullptr);
+        CHECK(ri != nullptr);
+        std::atomic_store(&ri_, std::shared_ptr<const RedactionInfo>(std::move(ri)));
+    }
+
     const int fd;
-    const std::unique_ptr<const RedactionInfo> ri;
     const bool cached;
+    // Whether the kernel reads and writes |fd| directly, so that reads and writes of this handle
+    // never reach the daemon
+    const bool passthrough;
+    // Whether the file was opened for writing
+    const bool for_write;
+    // Set if the redaction ranges may go stale, see RedactionWatch.
+    const std::unique_ptr<RedactionWatch> watch;
 
     ~handle() { close(fd); }
+
+    static void* operator new(size_t size) { return Slab<handle>::Allocate(size); }
+    static void operator delete(void* ptr) { Slab<handle>::Free(ptr); }
+
+  private:
+    std::shared_ptr<const RedactionInfo> ri_;
 };
 
 struct dirhandle {
-    explicit dirhandle(DIR* dir) : d(dir), next_off(0) { CHECK(dir != nullptr); }
+    explicit dirhandle(DIR* dir) : d(dir), next_off(0), prefetch_uid(0) { CHECK(dir != nullptr); }
 
     DIR* const d;
     off_t next_off;
@@ -60,74 +279,222 @@ struct dirhandle {
     // number of directory entries in the given directory. 'de' holds the list
     // of directory entries for the directory handle and this list is available
     // across subsequent readdir() calls for the same directory handle.
-    std::vector<std::shared_ptr<DirectoryEntry>> de;
+    DirectoryEntries de;
+    // Attributes of the entries in 'de', with attrs[i] corresponding to entry i. For readdirplus(),
+    // the entries of each reply are stat'ed in one pass relative to 'd' before it is filled, so
+    // that filling it only has to look up their nodes.
+    struct entry_attr {
+        // errno if the entry couldn't be stat'ed, 0 otherwise
+        int error;
+        struct stat attr;
+    };
+    std::vector<entry_attr> attrs;
+    // Valid while 'de' and 'attrs' are filled in the background for the first readdir() call,
+    // which has to wait for it before touching them or 'd'. They were listed for 'prefetch_uid'.
+    std::future<void> prefetch;
+    uid_t prefetch_uid;
+    // Set while 'de' is streamed from the lower file system and not read in full yet, see
+    // scan_directory_entries in FuseDaemon.cpp. Reads from 'd'.
+    std::unique_ptr<DirectoryScanner> scanner;
+
+    ~dirhandle() {
+        if (prefetch.valid()) prefetch.wait();
+        closedir(d);
+    }
 
-    ~dirhandle() { closedir(d); }
+    static void* operator new(size_t size) { return Slab<dirhandle>::Allocate(size); }
+    static void operator delete(void* ptr) { Slab<dirhandle>::Free(ptr); }
 };
 
-// Whether inode tracking is enabled or not. When enabled, we maintain a
-// separate mapping from inode numbers to "live" nodes so we can detect when
-// we receive a request to a node that has been deleted.
-static constexpr bool kEnableInodeTracking = true;
+// Number of independent locks that the children and handles of all nodes in a
+// tree (and the set of nodes in a NodeTracker) are spread across.
+static constexpr size_t kNodeLockStripes = 64;
+
+// Maps a pointer to one of kNodeLockStripes stripes. Nodes are heap allocated
+// so the low bits of their addresses carry little entropy, hence the multiplicative hash.
+static inline size_t GetLockStripe(const void* ptr) {
+    const uint64_t hash = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)) *
+                          UINT64_C(0x9e3779b97f4a7c15);
+    return static_cast<size_t>(hash >> 32) % kNodeLockStripes;
+}
 
 class node;
 
-// Tracks the set of active nodes associated with a FUSE instance so that we
-// can assert that we only ever return an active node in response to a lookup.
-class NodeTracker {
+// A shared mutex that accounts for the time spent waiting for it in FuseStats. Only contended
+// acquisitions are timed, taking it uncontended costs an extra try_lock.
+class TimedSharedMutex {
   public:
-    explicit NodeTracker(std::recursive_mutex* lock) : lock_(lock) {}
-
-    void CheckTracked(__u64 ino) const {
-        if (kEnableInodeTracking) {
-            const node* node = reinterpret_cast<const class node*>(ino);
-            std::lock_guard<std::recursive_mutex> guard(*lock_);
-            CHECK(active_nodes_.find(node) != active_nodes_.end());
-        }
+    void lock() {
+        if (mutex_.try_lock()) return;
+        const uint64_t start_ns = FuseStats::NowNs();
+        mutex_.lock();
+        FuseStats::RecordLockWait(FuseStats::NowNs() - start_ns);
     }
+    bool try_lock() { return mutex_.try_lock(); }
+    void unlock() { mutex_.unlock(); }
+
+    void lock_shared() {
+        if (mutex_.try_lock_shared()) return;
+        const uint64_t start_ns = FuseStats::NowNs();
+        mutex_.lock_shared();
+        FuseStats::RecordLockWait(FuseStats::NowNs() - start_ns);
+    }
+    bool try_lock_shared() { return mutex_.try_lock_shared(); }
+    void unlock_shared() { mutex_.unlock_shared(); }
 
-    void NodeDeleted(const node* node) {
-        if (kEnableInodeTracking) {
-            std::lock_guard<std::recursive_mutex> guard(*lock_);
-            LOG(DEBUG) << "Node: " << reinterpret_cast<uintptr_t>(node) << " deleted.";
+  private:
+    std::shared_mutex mutex_;
+};
 
-            CHECK(active_nodes_.find(node) != active_nodes_.end());
-            active_nodes_.erase(node);
-        }
-    }
+// Locks protecting a tree of nodes.
+//
+// The shape of the tree, i.e. the parent and the name of every node, is guarded by
+// the tree lock. It is held shared by everything that walks or queries the tree, and
+// only operations that move nodes around (Rename and DeleteTree) hold it exclusively.
+//
+// The set of children of a node and its file and directory handles are guarded by
+// one of kNodeLockStripes mutexes, picked by the address of that node. This lets
+// lookups in unrelated directories proceed in parallel.
+//
+// Opening a file is serialized on a separate set of stripes, see node::OpenLock, as it holds
+// its stripe across syscalls.
+//
+// Lock ordering: the tree lock must always be acquired before a stripe lock, and
+// at most one stripe lock may be held at any given time. An open lock is acquired
+// before either, and at most one may be held at any given time.
+class NodeLock {
+  public:
+    NodeLock() = default;
 
-    void NodeCreated(const node* node) {
-        if (kEnableInodeTracking) {
-            std::lock_guard<std::recursive_mutex> guard(*lock_);
-            LOG(DEBUG) << "Node: " << reinterpret_cast<uintptr_t>(node) << " created.";
+    TimedSharedMutex& TreeLock() { return tree_lock_; }
 
-            CHECK(active_nodes_.find(node) == active_nodes_.end());
-            active_nodes_.insert(node);
+    std::mutex& StripeLock(const node* node) { return stripes_[GetLockStripe(node)].lock; }
+
+    std::mutex& OpenLock(const node* node) { return open_stripes_[GetLockStripe(node)].lock; }
+
+  private:
+    NodeLock(const NodeLock&) = delete;
+    void operator=(const NodeLock&) = delete;
+
+    // Padded to a cache line so that threads spinning on adjacent stripes don't
+    // invalidate each other's caches.
+    struct alignas(64) Stripe {
+        std::mutex lock;
+    };
+
+    TimedSharedMutex tree_lock_;
+    std::array<Stripe, kNodeLockStripes> stripes_;
+    std::array<Stripe, kNodeLockStripes> open_stripes_;
+};
+
+// Maps the inode numbers of a FUSE instance to its nodes.
+//
+// An inode number is made of the index of a slot in a table of nodes, in its low 32 bits, and
+// of the generation of that slot, which is bumped every time the slot is freed. Mapping an inode
+// number back to its node takes a bounds check and a generation compare, without locking or
+// hashing, and a stale inode number is told apart from one that reuses the same slot. Inode
+// numbers are therefore dense and, along with their generation, unique for the lifetime of the
+// instance.
+//
+// The table is made of fixed size chunks that are never moved or freed before the tracker, so
+// that it can grow while being read. Only assigning and freeing slots takes a lock.
+//
+// When |cross_check| is set, the set of live nodes is also tracked separately by node address,
+// and every inode number checked against it as well. That is slower, and meant for debugging.
+class NodeTracker {
+  public:
+    explicit NodeTracker(bool cross_check = false);
+    ~NodeTracker();
+
+    // Returns the node of |ino|, which must be live.
+    node* Get(__u64 ino) const {
+        const uint32_t index = static_cast<uint32_t>(ino);
+        CHECK(index >= kFirstIndex && index < size_.load(std::memory_order_acquire))
+                << "Unknown inode " << ino;
+        const Slot& slot = GetSlot(index);
+        CHECK_EQ(GetGeneration(ino), slot.generation.load(std::memory_order_acquire))
+                << "Stale inode " << ino;
+        node* node = slot.live_node.load(std::memory_order_relaxed);
+        if (cross_check_) {
+            CheckLive(node);
         }
+        return node;
     }
 
+    // Assigns an inode number to |node|, which is being created.
+    __u64 NodeCreated(node* node);
+
+    // Frees the inode number |ino| of |node|, which is being deleted.
+    void NodeDeleted(const node* node, __u64 ino);
+
+    // Returns the generation of |ino|, for the kernel to tell inode numbers that were reused apart.
+    static uint32_t GetGeneration(__u64 ino) { return static_cast<uint32_t>(ino >> 32); }
+
   private:
-    std::recursive_mutex* lock_;
-    std::unordered_set<const node*> active_nodes_;
+    NodeTracker(const NodeTracker&) = delete;
+    void operator=(const NodeTracker&) = delete;
+
+    // Below this, inode numbers would clash with 0, which is invalid, or FUSE_ROOT_ID, which
+    // FUSE reserves for the root, in the first generation.
+    static constexpr uint32_t kFirstIndex = 2;
+    static constexpr uint32_t kChunkBits = 12;
+    static constexpr uint32_t kChunkSize = 1 << kChunkBits;
+    // Up to 64M live nodes
+    static constexpr uint32_t kMaxChunks = 1 << 14;
+
+    struct Slot {
+        std::atomic<uint32_t> generation{0};
+        // Null if the slot is free
+        std::atomic<node*> live_node{nullptr};
+    };
+
+    Slot& GetSlot(uint32_t index) const {
+        Slot* chunk = chunks_[index >> kChunkBits].load(std::memory_order_acquire);
+        return chunk[index & (kChunkSize - 1)];
+    }
+
+    void CheckLive(const node* node) const {
+        const Shard& shard = shards_[GetLockStripe(node)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        CHECK(shard.active_nodes.find(node) != shard.active_nodes.end());
+    }
+
+    const bool cross_check_;
+
+    // Allocated up front, since readers may look at any of them without a lock.
+    std::unique_ptr<std::atomic<Slot*>[]> chunks_;
+    // Number of slots that were ever assigned, all of them in allocated chunks.
+    std::atomic<uint32_t> size_;
+
+    std::mutex lock_;
+    // Indices of freed slots, reused most recently freed first. Guarded by lock_.
+    std::vector<uint32_t> free_;
+
+    // Only used if cross_check_ is set.
+    struct alignas(64) Shard {
+        mutable std::mutex lock;
+        std::unordered_set<const node*> active_nodes;
+    };
+
+    std::array<Shard, kNodeLockStripes> shards_;
 };
 
 class node {
   public:
     // Creates a new node with the specified parent, name and lock.
-    static node* Create(node* parent, const std::string& name, std::recursive_mutex* lock,
+    static node* Create(node* parent, std::string_view name, NodeLock* lock,
                         NodeTracker* tracker) {
-        // Place the entire constructor under a critical section to make sure
-        // node creation, tracking (if enabled) and the addition to a parent are
-        // atomic.
-        std::lock_guard<std::recursive_mutex> guard(*lock);
+        // Place the entire constructor under the tree lock to make sure the parent
+        // can't be moved around while node creation, tracking (if enabled) and the
+        // addition to a parent take place.
+        std::shared_lock<TimedSharedMutex> guard(lock->TreeLock());
         return new node(parent, name, lock, tracker);
     }
 
     // Creates a new root node. Root nodes have no parents by definition
     // and their "name" must signify an absolute path.
-    static node* CreateRoot(const std::string& path, std::recursive_mutex* lock,
-                            NodeTracker* tracker) {
-        std::lock_guard<std::recursive_mutex> guard(*lock);
+    static node* CreateRoot(const std::string& path, NodeLock* lock, NodeTracker* tracker) {
+        std::shared_lock<TimedSharedMutex> guard(lock->TreeLock());
         node* root = new node(nullptr, path, lock, tracker);
 
         // The root always has one extra reference to avoid it being
@@ -138,144 +505,174 @@ class node {
 
     // Maps an inode to its associated node.
     static inline node* FromInode(__u64 ino, const NodeTracker* tracker) {
-        tracker->CheckTracked(ino);
-        return reinterpret_cast<node*>(static_cast<uintptr_t>(ino));
+        return tracker->Get(ino);
     }
 
     // Maps a node to its associated inode.
-    static __u64 ToInode(node* node) {
-        return static_cast<__u64>(reinterpret_cast<uintptr_t>(node));
-    }
+    static __u64 ToInode(node* node) { return node->ino_; }
 
     // Releases a reference to a node. Returns true iff the refcount dropped to
     // zero as a result of this call to Release, meaning that it's no longer
     // safe to perform any operations on references to this node.
     bool Release(uint32_t count) {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
-        if (refcount_ >= count) {
-            refcount_ -= count;
-            if (refcount_ == 0) {
-                delete this;
-                return true;
-            }
-        } else {
-            LOG(ERROR) << "Mismatched reference count: refcount_ = " << this->refcount_
-                       << " ,count = " << count;
+        if (ReleaseUnlessLast(count)) {
+            return false;
         }
 
-        return false;
+        std::shared_lock<TimedSharedMutex> guard(lock_->TreeLock());
+        return ReleaseLocked(this, count);
     }
 
+    // References to release from a node, as asked for by a forget from the kernel.
+    struct Forget {
+        node* target;
+        uint32_t count;
+    };
+
+    // Releases the references of all of |forgets|, which must belong to the same tree, like
+    // Release does but with the tree lock taken only once. Nodes whose refcount drops to zero
+    // are removed from the tree but not deleted; they are added to |released|, for
+    // DeleteReleased to delete without holding any lock.
+    static void ReleaseBatch(const std::vector<Forget>& forgets, std::vector<node*>* released);
+
+    // Deletes the nodes released by ReleaseBatch. Needs no lock, they can't be reached anymore.
+    static void DeleteReleased(const std::vector<node*>& released);
+
     // Builds the full path associated with this node, including all path segments
     // associated with its descendants.
     std::string BuildPath() const;
 
+    // Returns the full path associated with this node without copying it. The path is
+    // cached on the node and only recomputed when the node is added to a parent or renamed,
+    // so this is cheap enough to call on every request.
+    std::shared_ptr<const std::string> GetPath() const {
+        std::shared_lock<TimedSharedMutex> guard(lock_->TreeLock());
+        return path_;
+    }
+
+    // Returned by GetPathFlags until flags were set for the current path of this node.
+    static constexpr uint32_t kPathFlagsUnknown = UINT32_MAX;
+
+    // Returns the flags the FUSE daemon derived from the path of this node, see SetPathFlags,
+    // or kPathFlagsUnknown. They are dropped along with the cached path, so that callers
+    // don't have to classify the path of a node on every request.
+    uint32_t GetPathFlags() const { return path_flags_.load(std::memory_order_relaxed); }
+
+    // Caches |flags| as derived from |path|, unless that is no longer the path of this node.
+    void SetPathFlags(const std::shared_ptr<const std::string>& path, uint32_t flags) {
+        CHECK_NE(kPathFlagsUnknown, flags);
+        std::shared_lock<TimedSharedMutex> guard(lock_->TreeLock());
+        if (path == path_) {
+            path_flags_.store(flags, std::memory_order_relaxed);
+        }
+    }
+
     // Builds the full PII safe path associated with this node, including all path segments
     // associated with its descendants.
     std::string BuildSafePath() const;
 
     // Looks up a direct descendant of this node by name. If |acquire| is true,
     // also Acquire the node before returning a reference to it.
-    node* LookupChildByName(const std::string& name, bool acquire) const {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
-
-        // lower_bound will give us the first child with strcasecmp(child->name, name) >=0.
-        // For more context see comment on the NodeCompare struct.
-        auto start = children_.lower_bound(std::make_pair(name, 0));
-        // upper_bound will give us the first child with strcasecmp(child->name, name) > 0
-        auto end =
-                children_.upper_bound(std::make_pair(name, std::numeric_limits<uintptr_t>::max()));
-        for (auto it = start; it != end; it++) {
-            node* child = *it;
-            if (!child->deleted_) {
-                if (acquire) {
-                    child->Acquire();
-                }
-                return child;
-            }
-        }
-        return nullptr;
+    node* LookupChildByName(std::string_view name, bool acquire) const {
+        std::shared_lock<TimedSharedMutex> guard(lock_->TreeLock());
+        return LookupChildByNameLocked(name, acquire);
     }
 
     // Marks this node as deleted. It is still associated with its parent, and
     // all open handles etc. to this node are preserved until its refcount goes
     // to zero.
     void SetDeleted() {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
+        std::shared_lock<TimedSharedMutex> guard(lock_->TreeLock());
+        if (parent_ == nullptr) {
+            deleted_ = true;
+            return;
+        }
 
+        std::lock_guard<std::mutex> children_guard(lock_->StripeLock(parent_));
         deleted_ = true;
     }
 
-    void Rename(const std::string& name, node* new_parent) {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
+    void Rename(std::string_view name, node* new_parent) {
+        std::unique_lock<TimedSharedMutex> guard(lock_->TreeLock());
 
         if (new_parent != parent_) {
             RemoveFromParent();
-            name_ = name;
+            SetNameLocked(name);
             AddToParent(new_parent);
             return;
         }
 
-        // Changing name_ will change the expected position of this node in parent's set of
-        // children. Consider following scenario:
-        // 1. This node: "b"; parent's set: {"a", "b", "c"}
-        // 2. Rename("b", "d")
-        //
-        // After rename, parent's set should become: {"a", "b", "d"}, but if we simply change the
-        // name it will be {"a", "d", "b"}, which violates properties of the set.
-        //
-        // To make sure that parent's set is always valid, changing name is 3 steps procedure:
-        // 1. Remove this node from parent's set.
-        // 2  Change the name.
-        // 3. Add it back to the set.
-        // Rename of node without changing its parent. Still need to remove and re-add it to make
-        // sure lookup index is correct.
+        // Changing name_ will change where this node is expected in the index of its parent's
+        // children, so it has to be removed from the index, renamed and added back to it.
         if (name_ != name) {
             // If this is a root node, simply rename it.
             if (parent_ == nullptr) {
-                name_ = name;
+                SetNameLocked(name);
+                UpdatePathLocked();
                 return;
             }
 
-            auto it = parent_->children_.find(this);
-            CHECK(it != parent_->children_.end());
-            parent_->children_.erase(it);
-
-            name_ = name;
-
-            parent_->children_.insert(this);
+            // The tree lock is held exclusively so nobody else can be looking at the
+            // parent's set of children.
+            parent_->children_.Erase(this);
+            SetNameLocked(name);
+            parent_->children_.Insert(this);
+            UpdatePathLocked();
         }
     }
 
-    const std::string& GetName() const {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
+    std::string GetName() const {
+        std::shared_lock<TimedSharedMutex> guard(lock_->TreeLock());
         return name_;
     }
 
     node* GetParent() const {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
+        std::shared_lock<TimedSharedMutex> guard(lock_->TreeLock());
         return parent_;
     }
 
     inline void AddHandle(handle* h) {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
+        std::lock_guard<std::mutex> guard(lock_->StripeLock(this));
         handles_.emplace_back(std::unique_ptr<handle>(h));
+        if (h->cached) {
+            cached_handles_.fetch_add(1, std::memory_order_relaxed);
+        }
     }
 
     void DestroyHandle(handle* h) {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
-
-        auto comp = [h](const std::unique_ptr<handle>& ptr) { return ptr.get() == h; };
-        auto it = std::find_if(handles_.begin(), handles_.end(), comp);
-        CHECK(it != handles_.end());
-        handles_.erase(it);
+        std::unique_ptr<handle> destroyed;
+        {
+            std::lock_guard<std::mutex> guard(lock_->StripeLock(this));
+
+            auto comp = [h](const std::unique_ptr<handle>& ptr) { return ptr.get() == h; };
+            auto it = std::find_if(handles_.begin(), handles_.end(), comp);
+            CHECK(it != handles_.end());
+            destroyed = std::move(*it);
+            handles_.erase(it);
+            if (destroyed->cached) {
+                cached_handles_.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        // |destroyed| closes the underlying fd once we're out of the critical section.
     }
 
-    bool HasCachedHandle() const {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
+    // Returns whether the file is open through any handle whose pages the kernel caches. Takes
+    // no lock: a handle may be added right after this returns false, unless OpenLock is held
+    // both here and while adding it. Once it returns true, the answer may only go stale by the
+    // handle being destroyed.
+    bool HasCachedHandle() const { return cached_handles_.load(std::memory_order_relaxed) != 0; }
+
+    // Held while deciding whether a handle of the file may be cached, and through adding it,
+    // and while deciding whether MediaProvider may give out an fd to the file on the lower
+    // filesystem instead, so that the file doesn't end up open both ways.
+    std::mutex& OpenLock() const { return lock_->OpenLock(this); }
+
+    // Returns whether the file is open for writing through any handle.
+    bool HasWriteHandle() const {
+        std::lock_guard<std::mutex> guard(lock_->StripeLock(this));
 
         for (const auto& handle : handles_) {
-            if (handle->cached) {
+            if (handle->for_write) {
                 return true;
             }
         }
@@ -283,143 +680,241 @@ class node {
     }
 
     inline void AddDirHandle(dirhandle* d) {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
+        std::lock_guard<std::mutex> guard(lock_->StripeLock(this));
 
         dirhandles_.emplace_back(std::unique_ptr<dirhandle>(d));
     }
 
     void DestroyDirHandle(dirhandle* d) {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
-
-        auto comp = [d](const std::unique_ptr<dirhandle>& ptr) { return ptr.get() == d; };
-        auto it = std::find_if(dirhandles_.begin(), dirhandles_.end(), comp);
-        CHECK(it != dirhandles_.end());
-        dirhandles_.erase(it);
+        std::unique_ptr<dirhandle> destroyed;
+        {
+            std::lock_guard<std::mutex> guard(lock_->StripeLock(this));
+
+            auto comp = [d](const std::unique_ptr<dirhandle>& ptr) { return ptr.get() == d; };
+            auto it = std::find_if(dirhandles_.begin(), dirhandles_.end(), comp);
+            CHECK(it != dirhandles_.end());
+            destroyed = std::move(*it);
+            dirhandles_.erase(it);
+        }
     }
 
     // Deletes the tree of nodes rooted at |tree|.
     static void DeleteTree(node* tree);
 
     // Looks up an absolute path rooted at |root|, or nullptr if no such path
-    // through the hierarchy exists.
-    static const node* LookupAbsolutePath(const node* root, const std::string& absolute_path);
+    // through the hierarchy exists. If |acquire| is true, also Acquire the node
+    // before returning a reference to it; callers that use the node after this
+    // returns must do so, as it may otherwise be deleted concurrently.
+    static node* LookupAbsolutePath(const node* root, std::string_view absolute_path,
+                                    bool acquire);
+
+    // Looks up the deepest node on an absolute path rooted at |root| and Acquires it, or returns
+    // nullptr if the path isn't below |root|. Sets |missing| to the first component of the path
+    // that the node has no child for, or to an empty string if the whole path exists.
+    static node* LookupDeepestNode(const node* root, std::string_view absolute_path,
+                                   std::string_view* missing);
 
   private:
-    node(node* parent, const std::string& name, std::recursive_mutex* lock, NodeTracker* tracker)
+    node(node* parent, std::string_view name, NodeLock* lock, NodeTracker* tracker)
         : name_(name),
+          name_hash_(HashName(name)),
+          path_flags_(kPathFlagsUnknown),
           refcount_(0),
           parent_(nullptr),
+          cached_handles_(0),
           deleted_(false),
           lock_(lock),
-          tracker_(tracker) {
-        tracker_->NodeCreated(this);
+          tracker_(tracker),
+          ino_(tracker->NodeCreated(this)) {
         Acquire();
         // This is a special case for the root node. All other nodes will have a
         // non-null parent.
         if (parent != nullptr) {
             AddToParent(parent);
+        } else {
+            UpdatePathLocked();
         }
     }
 
     // Acquires a reference to a node. This maps to the "lookup count" specified
     // by the FUSE documentation and must only happen under the circumstances
     // documented in libfuse/include/fuse_lowlevel.h.
-    inline void Acquire() {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
-        refcount_++;
+    inline void Acquire() { refcount_.fetch_add(1, std::memory_order_relaxed); }
+
+    // Releases |count| references to |node|. If its refcount drops to zero, it is removed
+    // from its parent and deleted, which in turn releases the reference it held on its parent.
+    // Nodes are added to |released_nodes| instead of being deleted, unless it's null.
+    // Returns true iff |node| itself was released. Must be called with the tree lock held.
+    static bool ReleaseLocked(node* node, uint32_t count,
+                              std::vector<class node*>* released_nodes = nullptr);
+
+    // Releases |count| references unless that would release the last one. As long as the
+    // refcount doesn't drop to zero, nobody else can observe the difference so there's no need
+    // to take any locks. Returns whether the references were released.
+    bool ReleaseUnlessLast(uint32_t count) {
+        uint32_t refcount = refcount_.load(std::memory_order_relaxed);
+        while (refcount > count) {
+            if (refcount_.compare_exchange_weak(refcount, refcount - count,
+                                                std::memory_order_acq_rel)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Deletes the tree of nodes rooted at |tree|. Must be called with the tree lock held
+    // exclusively.
+    static void DeleteTreeLocked(node* tree);
+
+    // Walks down |absolute_path| from |root| as far as it exists, see LookupDeepestNode. The node
+    // returned holds a reference taken by the walk, unless it is |root|. Caller must hold the tree
+    // lock.
+    static node* WalkAbsolutePathLocked(const node* root, std::string_view absolute_path,
+                                        std::string_view* missing);
+
+    // Looks up a direct descendant of this node by name. Must be called with the tree lock held.
+    node* LookupChildByNameLocked(std::string_view name, bool acquire) const {
+        std::lock_guard<std::mutex> guard(lock_->StripeLock(this));
+
+        node* child = children_.Find(name);
+        if (child && acquire) {
+            child->Acquire();
+        }
+        return child;
     }
 
-    // Adds this node to a specified parent.
+    // Adds this node to a specified parent. Must be called with the tree lock held,
+    // exclusively unless this node hasn't been published yet.
     void AddToParent(node* parent) {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
         // This method assumes this node is currently unparented.
         CHECK(parent_ == nullptr);
         // Check that the new parent isn't nullptr either.
         CHECK(parent != nullptr);
 
         parent_ = parent;
-        parent_->children_.insert(this);
+        // Compute the path before the node becomes reachable through its parent.
+        UpdatePathLocked();
+
+        std::lock_guard<std::mutex> guard(lock_->StripeLock(parent));
+        parent_->children_.Insert(this);
 
         // TODO(narayan, zezeozue): It's unclear why we need to call Acquire on the
         // parent node when we're adding a child to it.
         parent_->Acquire();
     }
 
-    // Removes this node from its current parent, and set its parent to nullptr.
+    // Removes this node from its current parent, and set its parent to nullptr. Must be
+    // called with the tree lock held exclusively, or on a node that can no longer be
+    // reached by any other thread.
     void RemoveFromParent() {
-        std::lock_guard<std::recursive_mutex> guard(*lock_);
-
         if (parent_ != nullptr) {
-            auto it = parent_->children_.find(this);
-            CHECK(it != parent_->children_.end());
-            parent_->children_.erase(it);
-
-            parent_->Release(1);
+            node* parent = parent_;
+            {
+                std::lock_guard<std::mutex> guard(lock_->StripeLock(parent));
+                parent->children_.Erase(this);
+            }
             parent_ = nullptr;
+
+            ReleaseLocked(parent, 1);
         }
     }
 
-    // A custom heterogeneous comparator used for set of this node's children_ to speed up child
-    // node by name lookups.
+    // Index of the children of a node by name, compared case insensitively.
     //
-    // This comparator treats node* as pair (node->name_, node): two nodes* are first
-    // compared by their name using case-insenstive comparison function. If their names are equal,
-    // then pointers are compared as integers.
-    //
-    // See LookupChildByName function to see how this comparator is used.
-    //
-    // Note that it's important to first compare by name_, since it will make all nodes with same
-    // name (compared using strcasecmp) together, which allows LookupChildByName function to find
-    // range of the candidate nodes by issuing two binary searches.
-    struct NodeCompare {
-        using is_transparent = void;
-
-        bool operator()(const node* lhs, const node* rhs) const {
-            int cmp = strcasecmp(lhs->name_.c_str(), rhs->name_.c_str());
-            if (cmp != 0) {
-                return cmp < 0;
-            }
-            return reinterpret_cast<uintptr_t>(lhs) < reinterpret_cast<uintptr_t>(rhs);
-        }
+    // Children are kept in a vector, which is scanned through as long as there are only a few
+    // of them. Past that, they're also indexed by an open addressing hash table that holds
+    // positions in that vector, so that a lookup in a directory with many children costs about
+    // one or two name comparisons.
+    class ChildIndex {
+      public:
+        ChildIndex() : mask_(0) {}
+
+        // Adds |child|, which may have the same name as other children.
+        void Insert(node* child);
+        // Removes |child|, which must have been inserted under its current name.
+        void Erase(node* child);
+        // Returns the child named |name| that isn't deleted, or nullptr if there's none. If several
+        // of them match, the one with the lowest address is returned.
+        node* Find(std::string_view name) const;
+
+        bool empty() const { return children_.empty(); }
+        size_t size() const { return children_.size(); }
+        std::vector<node*>::const_iterator begin() const { return children_.begin(); }
+        std::vector<node*>::const_iterator end() const { return children_.end(); }
+
+      private:
+        // Children are only hashed once there are more than this many of them
+        static constexpr size_t kMaxUnindexed = 8;
+        static constexpr size_t kMinBuckets = 32;
+
+        // Returns the bucket holding |pos|, which must be indexed.
+        size_t FindBucket(const node* child, uint32_t pos) const;
+        void IndexPosition(uint32_t pos);
+        void UnindexBucket(size_t bucket);
+        void Rehash(size_t num_buckets);
+
+        std::vector<node*> children_;
+        // Positions in children_ plus one, or 0 for empty buckets. Null while children_ has no
+        // more than kMaxUnindexed entries.
+        std::unique_ptr<uint32_t[]> buckets_;
+        // Number of buckets minus one, the number of buckets being a power of two.
+        uint32_t mask_;
+    };
 
-        bool operator()(const node* lhs, const std::pair<std::string, uintptr_t>& rhs) const {
-            int cmp = strcasecmp(lhs->name_.c_str(), rhs.first.c_str());
-            if (cmp != 0) {
-                return cmp < 0;
-            }
-            return reinterpret_cast<uintptr_t>(lhs) < rhs.second;
-        }
+    // Returns a hash of |name| folded to lower case, so that names that are equal according to
+    // strcasecmp have the same hash.
+    static uint32_t HashName(std::string_view name);
 
-        bool operator()(const std::pair<std::string, uintptr_t>& lhs, const node* rhs) const {
-            int cmp = strcasecmp(lhs.first.c_str(), rhs->name_.c_str());
-            if (cmp != 0) {
-                return cmp < 0;
-            }
-            return lhs.second < reinterpret_cast<uintptr_t>(rhs);
-        }
-    };
+    // Sets the name of this node. Must be called with the tree lock held exclusively, and
+    // with this node out of the index of its parent's children.
+    void SetNameLocked(std::string_view name) {
+        name_ = name;
+        name_hash_ = HashName(name);
+    }
 
     // A helper function to recursively construct the absolute path of a given node.
     // If |safe| is true, builds a PII safe path instead
     void BuildPathForNodeRecursive(bool safe, const node* node, std::stringstream* path) const;
 
+    // Recomputes the cached path of this node and of all of its descendants, and drops their
+    // path flags. Must be called with the tree lock held exclusively, unless this node hasn't
+    // been published yet.
+    void UpdatePathLocked();
+
     // The name of this node. Non-const because it can change during renames.
+    // Guarded by the tree lock.
     std::string name_;
-    // The reference count for this node. Guarded by |lock_|.
-    uint32_t refcount_;
-    // Set of children of this node. All of them contain a back reference
-    // to their parent. Guarded by |lock_|.
-    std::set<node*, NodeCompare> children_;
-    // Containing directory for this node. Guarded by |lock_|.
+    // Hash of |name_| folded to lower case, see HashName. Guarded by the tree lock.
+    uint32_t name_hash_;
+    // The absolute path of this node, i.e. the path of |parent_| followed by |name_|.
+    // Shared with callers of GetPath, so it's replaced rather than modified in place.
+    // Guarded by the tree lock.
+    std::shared_ptr<const std::string> path_;
+    // Flags derived from |path_|, see GetPathFlags. Only changes under the tree lock, held
+    // exclusively unless it's to set flags for the current path.
+    std::atomic<uint32_t> path_flags_;
+    // The reference count for this node. Only drops to zero with the stripe lock of
+    // |parent_| held, so that LookupChildByName never hands out a dying node.
+    std::atomic<uint32_t> refcount_;
+    // Children of this node. All of them contain a back reference
+    // to their parent. Guarded by the stripe lock of this node.
+    ChildIndex children_;
+    // Containing directory for this node. Guarded by the tree lock.
     node* parent_;
-    // List of file handles associated with this node. Guarded by |lock_|.
+    // List of file handles associated with this node. Guarded by the stripe lock of this node.
     std::vector<std::unique_ptr<handle>> handles_;
-    // List of directory handles associated with this node. Guarded by |lock_|.
+    // Number of |handles_| that are cached, maintained along with it
+    std::atomic<uint32_t> cached_handles_;
+    // List of directory handles associated with this node. Guarded by the stripe lock of
+    // this node.
     std::vector<std::unique_ptr<dirhandle>> dirhandles_;
+    // Guarded by the stripe lock of |parent_|.
     bool deleted_;
-    std::recursive_mutex* lock_;
+    NodeLock* const lock_;
 
     NodeTracker* const tracker_;
+    // Assigned by |tracker_|.
+    const __u64 ino_;
 
     ~node() {
         RemoveFromParent();
@@ -427,9 +922,12 @@ class node {
         handles_.clear();
         dirhandles_.clear();
 
-        tracker_->NodeDeleted(this);
+        tracker_->NodeDeleted(this, ino_);
     }
 
+    static void* operator new(size_t size) { return Slab<node>::Allocate(size); }
+    static void operator delete(void* ptr) { Slab<node>::Free(ptr); }
+
     friend class ::NodeTest;
 };
 
@@ -16,29 +16,192 @@
 
 #include "node-inl.h"
 
-static std::vector<std::string> GetPathSegments(int segment_start, const std::string& path) {
-    std::vector<std::string> segments;
-    int segment_end = path.find_first_of('/', segment_start);
-
-    while (segment_end != std::string::npos) {
-        if (segment_end == segment_start) {
-            // First character is '/' ignore
-            segment_end = path.find_first_of('/', ++segment_start);
-            continue;
+#include <strings.h>
+
+#include <algorithm>
+
+namespace mediaprovider {
+namespace fuse {
+
+NodeTracker::NodeTracker(bool cross_check)
+    : cross_check_(cross_check),
+      chunks_(std::make_unique<std::atomic<Slot*>[]>(kMaxChunks)),
+      size_(kFirstIndex) {
+    chunks_[0].store(new Slot[kChunkSize], std::memory_order_relaxed);
+}
+
+NodeTracker::~NodeTracker() {
+    for (uint32_t i = 0; i < kMaxChunks; i++) {
+        delete[] chunks_[i].load(std::memory_order_relaxed);
+    }
+}
+
+__u64 NodeTracker::NodeCreated(node* node) {
+    if (cross_check_) {
+        Shard& shard = shards_[GetLockStripe(node)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        CHECK(shard.active_nodes.insert(node).second);
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    uint32_t index;
+    if (!free_.empty()) {
+        index = free_.back();
+        free_.pop_back();
+    } else {
+        index = size_.load(std::memory_order_relaxed);
+        CHECK_LT(index, kMaxChunks * kChunkSize) << "Out of inodes";
+        if ((index & (kChunkSize - 1)) == 0) {
+            chunks_[index >> kChunkBits].store(new Slot[kChunkSize], std::memory_order_release);
         }
+    }
 
-        segments.push_back(path.substr(segment_start, segment_end - segment_start));
-        segment_start = segment_end + 1;
-        segment_end = path.find_first_of('/', segment_start);
+    Slot& slot = GetSlot(index);
+    slot.live_node.store(node, std::memory_order_relaxed);
+    if (index == size_.load(std::memory_order_relaxed)) {
+        size_.store(index + 1, std::memory_order_release);
     }
-    if (segment_start < path.size()) {
-        segments.push_back(path.substr(segment_start));
+    return (static_cast<__u64>(slot.generation.load(std::memory_order_relaxed)) << 32) | index;
+}
+
+void NodeTracker::NodeDeleted(const node* node, __u64 ino) {
+    if (cross_check_) {
+        Shard& shard = shards_[GetLockStripe(node)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        CHECK_EQ(1, shard.active_nodes.erase(node));
     }
-    return segments;
+
+    const uint32_t index = static_cast<uint32_t>(ino);
+    std::lock_guard<std::mutex> guard(lock_);
+    Slot& slot = GetSlot(index);
+    CHECK_EQ(node, slot.live_node.load(std::memory_order_relaxed));
+    // Requests still holding |ino| are now told that it is stale
+    slot.generation.store(GetGeneration(ino) + 1, std::memory_order_release);
+    slot.live_node.store(nullptr, std::memory_order_relaxed);
+    free_.push_back(index);
 }
 
-namespace mediaprovider {
-namespace fuse {
+uint32_t node::HashName(std::string_view name) {
+    // FNV-1a of the name, folded like strcasecmp does in the C locale. Computed inline rather than
+    // with tolower, since every lookup and every new name goes through this.
+    uint32_t hash = 2166136261u;
+    for (const char c : name) {
+        const uint8_t folded = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+        hash = (hash ^ folded) * 16777619u;
+    }
+    return hash;
+}
+
+void node::ChildIndex::Insert(node* child) {
+    children_.push_back(child);
+    if (children_.size() <= kMaxUnindexed) {
+        return;
+    }
+    // Keep at most half of the buckets in use, so that probe sequences stay short
+    if (children_.size() * 2 > mask_ + 1u) {
+        Rehash(std::max<size_t>(kMinBuckets, (mask_ + 1u) * 2));
+    } else {
+        IndexPosition(children_.size() - 1);
+    }
+}
+
+void node::ChildIndex::Erase(node* child) {
+    uint32_t pos;
+    if (buckets_) {
+        const size_t bucket = FindBucket(child, UINT32_MAX);
+        pos = buckets_[bucket] - 1;
+        UnindexBucket(bucket);
+    } else {
+        auto it = std::find(children_.begin(), children_.end(), child);
+        CHECK(it != children_.end());
+        pos = it - children_.begin();
+    }
+
+    // Fill the hole with the last child, so that children_ stays dense
+    const uint32_t last = children_.size() - 1;
+    if (pos != last) {
+        if (buckets_) {
+            buckets_[FindBucket(children_[last], last)] = pos + 1;
+        }
+        children_[pos] = children_[last];
+    }
+    children_.pop_back();
+
+    // Drop the table with some slack, so that a directory hovering around the limit isn't
+    // rehashed over and over
+    if (buckets_ && children_.size() <= kMaxUnindexed / 2) {
+        buckets_.reset();
+        mask_ = 0;
+    }
+}
+
+node* node::ChildIndex::Find(std::string_view name) const {
+    // Only the hash is compared for most children, and strcasecmp doesn't change the length
+    // of what it compares
+    const uint32_t hash = HashName(name);
+    node* found = nullptr;
+    auto match = [&](node* child) {
+        if (child->name_hash_ == hash && child->name_.size() == name.size() && !child->deleted_ &&
+            strncasecmp(child->name_.data(), name.data(), name.size()) == 0 &&
+            (found == nullptr || child < found)) {
+            found = child;
+        }
+    };
+
+    if (!buckets_) {
+        for (node* child : children_) {
+            match(child);
+        }
+        return found;
+    }
+    for (size_t bucket = hash & mask_; buckets_[bucket]; bucket = (bucket + 1) & mask_) {
+        match(children_[buckets_[bucket] - 1]);
+    }
+    return found;
+}
+
+size_t node::ChildIndex::FindBucket(const node* child, uint32_t pos) const {
+    for (size_t bucket = child->name_hash_ & mask_; buckets_[bucket];
+         bucket = (bucket + 1) & mask_) {
+        const uint32_t candidate = buckets_[bucket] - 1;
+        if (candidate == pos || (pos == UINT32_MAX && children_[candidate] == child)) {
+            return bucket;
+        }
+    }
+    LOG(FATAL) << "Child not found in index";
+    return 0;
+}
+
+void node::ChildIndex::IndexPosition(uint32_t pos) {
+    size_t bucket = children_[pos]->name_hash_ & mask_;
+    while (buckets_[bucket]) {
+        bucket = (bucket + 1) & mask_;
+    }
+    buckets_[bucket] = pos + 1;
+}
+
+void node::ChildIndex::UnindexBucket(size_t bucket) {
+    // Shift back the entries that follow in the probe sequence rather than leaving a tombstone,
+    // so that lookups never have to skip over removed entries
+    size_t hole = bucket;
+    for (size_t next = (hole + 1) & mask_; buckets_[next]; next = (next + 1) & mask_) {
+        const size_t home = children_[buckets_[next] - 1]->name_hash_ & mask_;
+        // Move the entry into the hole, unless its home bucket lies within (hole, next]
+        if (((next - home) & mask_) >= ((next - hole) & mask_)) {
+            buckets_[hole] = buckets_[next];
+            hole = next;
+        }
+    }
+    buckets_[hole] = 0;
+}
+
+void node::ChildIndex::Rehash(size_t num_buckets) {
+    buckets_.reset(new uint32_t[num_buckets]());
+    mask_ = num_buckets - 1;
+    for (uint32_t pos = 0; pos < children_.size(); pos++) {
+        IndexPosition(pos);
+    }
+}
 
 // Assumes that |node| has at least one child.
 void node::BuildPathForNodeRecursive(bool safe, const node* node, std::stringstream* path) const {
@@ -59,50 +222,190 @@ void node::BuildPathForNodeRecursive(bool safe, const node* node, std::stringstr
 }
 
 std::string node::BuildPath() const {
-    std::lock_guard<std::recursive_mutex> guard(*lock_);
-    std::stringstream path;
-
-    BuildPathForNodeRecursive(false, this, &path);
-    return path.str();
+    std::shared_lock<TimedSharedMutex> guard(lock_->TreeLock());
+    return *path_;
 }
 
 std::string node::BuildSafePath() const {
-    std::lock_guard<std::recursive_mutex> guard(*lock_);
+    std::shared_lock<TimedSharedMutex> guard(lock_->TreeLock());
     std::stringstream path;
 
     BuildPathForNodeRecursive(true, this, &path);
     return path.str();
 }
 
-const node* node::LookupAbsolutePath(const node* root, const std::string& absolute_path) {
-    if (absolute_path.find(root->GetName()) != 0) {
+void node::UpdatePathLocked() {
+    if (parent_) {
+        const std::string& parent_path = *parent_->path_;
+        std::string path;
+        path.reserve(parent_path.size() + 1 + name_.size());
+        path.append(parent_path).append("/").append(name_);
+        path_ = std::make_shared<const std::string>(std::move(path));
+    } else {
+        path_ = std::make_shared<const std::string>(name_);
+    }
+    path_flags_.store(kPathFlagsUnknown, std::memory_order_relaxed);
+
+    for (node* child : children_) {
+        child->UpdatePathLocked();
+    }
+}
+
+node* node::LookupAbsolutePath(const node* root, std::string_view absolute_path, bool acquire) {
+    std::shared_lock<TimedSharedMutex> guard(root->lock_->TreeLock());
+
+    std::string_view missing;
+    node* node = WalkAbsolutePathLocked(root, absolute_path, &missing);
+    if (!node) {
         return nullptr;
     }
+    if (!missing.empty()) {
+        if (node != root && !node->ReleaseUnlessLast(1)) {
+            ReleaseLocked(node, 1);
+        }
+        return nullptr;
+    }
+
+    if (node == root) {
+        if (acquire) {
+            node->Acquire();
+        }
+    } else if (!acquire && !node->ReleaseUnlessLast(1)) {
+        ReleaseLocked(node, 1);
+    }
+    return node;
+}
 
-    std::vector<std::string> segments = GetPathSegments(root->GetName().size(), absolute_path);
+node* node::LookupDeepestNode(const node* root, std::string_view absolute_path,
+                              std::string_view* missing) {
+    std::shared_lock<TimedSharedMutex> guard(root->lock_->TreeLock());
 
-    std::lock_guard<std::recursive_mutex> guard(*root->lock_);
+    node* node = WalkAbsolutePathLocked(root, absolute_path, missing);
+    if (node == root) {
+        node->Acquire();
+    }
+    return node;
+}
+
+node* node::WalkAbsolutePathLocked(const node* root, std::string_view absolute_path,
+                                   std::string_view* missing) {
+    if (absolute_path.compare(0, root->name_.size(), root->name_) != 0) {
+        return nullptr;
+    }
+    std::string_view remaining = absolute_path;
+    remaining.remove_prefix(root->name_.size());
 
-    const node* node = root;
-    for (const std::string& segment : segments) {
-        node = node->LookupChildByName(segment, false /* acquire */);
-        if (!node) {
-            return nullptr;
+    // Walk down the tree hand over hand: holding a reference to the node we're
+    // visiting keeps it from being deleted by a concurrent Release. The root is
+    // never deleted, so it doesn't need one.
+    node* node = const_cast<class node*>(root);
+    while (!remaining.empty()) {
+        const size_t segment_end = remaining.find('/');
+        const std::string_view segment = remaining.substr(0, segment_end);
+        remaining.remove_prefix(segment_end == std::string_view::npos ? remaining.size()
+                                                                      : segment_end + 1);
+        if (segment.empty()) {
+            continue;
+        }
+
+        class node* child = node->LookupChildByNameLocked(segment, true /* acquire */);
+        if (!child) {
+            *missing = segment;
+            return node;
+        }
+        // Intermediate nodes are held by their children too, so this rarely needs the lock
+        if (node != root && !node->ReleaseUnlessLast(1)) {
+            ReleaseLocked(node, 1);
         }
+        node = child;
     }
+    *missing = std::string_view();
     return node;
 }
 
+bool node::ReleaseLocked(node* node, uint32_t count, std::vector<class node*>* released_nodes) {
+    bool released = false;
+    class node* current = node;
+
+    while (current) {
+        class node* parent = current->parent_;
+        {
+            // Decrement the refcount with the lock guarding the children of the parent
+            // held, so that a concurrent LookupChildByName can't hand out a reference to
+            // a node that's about to be deleted.
+            std::unique_lock<std::mutex> children_guard;
+            if (parent) {
+                children_guard = std::unique_lock<std::mutex>(current->lock_->StripeLock(parent));
+            }
+
+            uint32_t refcount = current->refcount_.load(std::memory_order_relaxed);
+            do {
+                if (refcount < count) {
+                    LOG(ERROR) << "Mismatched reference count: refcount_ = " << refcount
+                               << " ,count = " << count;
+                    return released;
+                }
+            } while (!current->refcount_.compare_exchange_weak(refcount, refcount - count,
+                                                               std::memory_order_acq_rel));
+
+            if (refcount != count) {
+                return released;
+            }
+
+            if (parent) {
+                parent->children_.Erase(current);
+                current->parent_ = nullptr;
+            }
+        }
+
+        if (current == node) {
+            released = true;
+        }
+        if (released_nodes) {
+            released_nodes->push_back(current);
+        } else {
+            delete current;
+        }
+
+        // The deleted node held a reference to its parent.
+        current = parent;
+        count = 1;
+    }
+    return released;
+}
+
+void node::ReleaseBatch(const std::vector<Forget>& forgets, std::vector<node*>* released) {
+    if (forgets.empty()) {
+        return;
+    }
+
+    std::shared_lock<TimedSharedMutex> guard(forgets[0].target->lock_->TreeLock());
+    for (const Forget& forget : forgets) {
+        if (!forget.target->ReleaseUnlessLast(forget.count)) {
+            ReleaseLocked(forget.target, forget.count, released);
+        }
+    }
+}
+
+void node::DeleteReleased(const std::vector<node*>& released) {
+    for (node* node : released) {
+        delete node;
+    }
+}
+
 void node::DeleteTree(node* tree) {
-    std::lock_guard<std::recursive_mutex> guard(*tree->lock_);
+    std::unique_lock<TimedSharedMutex> guard(tree->lock_->TreeLock());
+    DeleteTreeLocked(tree);
+}
 
+void node::DeleteTreeLocked(node* tree) {
     if (tree) {
         // Make a copy of the list of children because calling Delete tree
         // will modify the list of children, which will cause issues while
         // iterating over them.
         std::vector<node*> children(tree->children_.begin(), tree->children_.end());
         for (node* child : children) {
-            DeleteTree(child);
+            DeleteTreeLocked(child);
         }
 
         CHECK(tree->children_.empty());
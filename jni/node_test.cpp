@@ -2,27 +2,35 @@
 
 #include "node-inl.h"
 
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <limits>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
 
 using mediaprovider::fuse::dirhandle;
 using mediaprovider::fuse::handle;
 using mediaprovider::fuse::node;
+using mediaprovider::fuse::NodeLock;
 using mediaprovider::fuse::NodeTracker;
+using mediaprovider::fuse::Slab;
 
 // Listed as a friend class to struct node so it can observe implementation
 // details if required. The only implementation detail that is worth writing
 // tests around at the moment is the reference count.
 class NodeTest : public ::testing::Test {
   public:
-    NodeTest() : tracker_(NodeTracker(&lock_)) {}
+    NodeTest() {}
 
     uint32_t GetRefCount(node* node) { return node->refcount_; }
 
-    std::recursive_mutex lock_;
-    NodeTracker tracker_;
+    NodeLock lock_;
+    NodeTracker tracker_{true /* cross_check */};
 
     // Forward destruction here, as NodeTest is a friend class.
     static void destroy(node* node) { delete node; }
@@ -35,8 +43,10 @@ class NodeTest : public ::testing::Test {
         return unique_node_ptr(node::Create(parent, path, &lock_, &tracker_), &NodeTest::destroy);
     }
 
-    // Expose NodeCompare for testing.
-    node::NodeCompare cmp;
+    // Looks up |path| without acquiring the resulting node.
+    static node* LookupAbsolutePath(const node* root, const std::string& path) {
+        return node::LookupAbsolutePath(root, path, false /* acquire */);
+    }
 };
 
 TEST_F(NodeTest, TestCreate) {
@@ -147,6 +157,48 @@ TEST_F(NodeTest, TestBuildPath) {
     ASSERT_EQ("/path/subdir2/subsubdir", subchild->BuildPath());
 }
 
+TEST_F(NodeTest, TestBuildPath_renameUpdatesDescendants) {
+    unique_node_ptr parent1 = CreateNode(nullptr, "/path1");
+    unique_node_ptr parent2 = CreateNode(nullptr, "/path2");
+    unique_node_ptr child = CreateNode(parent1.get(), "subdir");
+    unique_node_ptr subchild = CreateNode(child.get(), "subsubdir");
+
+    std::shared_ptr<const std::string> old_path = subchild->GetPath();
+    ASSERT_EQ("/path1/subdir/subsubdir", *old_path);
+
+    child->Rename("subdir_new", parent1.get());
+    ASSERT_EQ("/path1/subdir_new/subsubdir", subchild->BuildPath());
+
+    child->Rename("subdir", parent2.get());
+    ASSERT_EQ("/path2/subdir", *child->GetPath());
+    ASSERT_EQ("/path2/subdir/subsubdir", *subchild->GetPath());
+
+    // Paths handed out earlier are unaffected by the rename.
+    ASSERT_EQ("/path1/subdir/subsubdir", *old_path);
+}
+
+TEST_F(NodeTest, TestPathFlags_droppedOnRename) {
+    unique_node_ptr parent = CreateNode(nullptr, "/path");
+    unique_node_ptr child = CreateNode(parent.get(), "subdir");
+    unique_node_ptr subchild = CreateNode(child.get(), "subsubdir");
+    ASSERT_EQ(node::kPathFlagsUnknown, child->GetPathFlags());
+
+    child->SetPathFlags(child->GetPath(), 1);
+    subchild->SetPathFlags(subchild->GetPath(), 2);
+    ASSERT_EQ(1, child->GetPathFlags());
+    ASSERT_EQ(2, subchild->GetPathFlags());
+
+    // Renaming a node drops the flags of its descendants too, since their paths changed.
+    std::shared_ptr<const std::string> old_path = subchild->GetPath();
+    child->Rename("subdir_new", parent.get());
+    ASSERT_EQ(node::kPathFlagsUnknown, child->GetPathFlags());
+    ASSERT_EQ(node::kPathFlagsUnknown, subchild->GetPathFlags());
+
+    // Flags derived from a path the node no longer has are ignored.
+    subchild->SetPathFlags(old_path, 2);
+    ASSERT_EQ(node::kPathFlagsUnknown, subchild->GetPathFlags());
+}
+
 TEST_F(NodeTest, TestSetDeleted) {
     unique_node_ptr parent = CreateNode(nullptr, "/path");
     unique_node_ptr child = CreateNode(parent.get(), "subdir");
@@ -156,6 +208,58 @@ TEST_F(NodeTest, TestSetDeleted) {
     ASSERT_EQ(nullptr, parent->LookupChildByName("subdir", false /* acquire */));
 }
 
+TEST_F(NodeTest, ReleaseBatch) {
+    unique_node_ptr parent = CreateNode(nullptr, "/path");
+    node* dir = node::Create(parent.get(), "dir", &lock_, &tracker_);
+    node* file1 = node::Create(dir, "file1", &lock_, &tracker_);
+    node* file2 = node::Create(dir, "file2", &lock_, &tracker_);
+    acquire(file2);
+    ASSERT_EQ(3, GetRefCount(dir));
+    ASSERT_EQ(file1, node::FromInode(node::ToInode(file1), &tracker_));
+
+    // Released nodes leave the tree right away, but are only deleted later.
+    std::vector<node*> released;
+    node::ReleaseBatch({{file1, 1}, {file2, 1}}, &released);
+    ASSERT_EQ(std::vector<node*>{file1}, released);
+    ASSERT_EQ(nullptr, dir->LookupChildByName("file1", false /* acquire */));
+    ASSERT_EQ(file2, dir->LookupChildByName("file2", false /* acquire */));
+    ASSERT_EQ(1, GetRefCount(file2));
+    ASSERT_EQ(2, GetRefCount(dir));
+
+    // Releasing a node along with its last child releases both.
+    std::vector<node*> released_dir;
+    node::ReleaseBatch({{file2, 1}, {dir, 1}}, &released_dir);
+    ASSERT_EQ((std::vector<node*>{file2, dir}), released_dir);
+    ASSERT_EQ(nullptr, parent->LookupChildByName("dir", false /* acquire */));
+    ASSERT_EQ(1, GetRefCount(parent.get()));
+
+    node::DeleteReleased(released);
+    node::DeleteReleased(released_dir);
+}
+
+TEST_F(NodeTest, InodeReuse) {
+    unique_node_ptr parent = CreateNode(nullptr, "/path");
+    node* file1 = node::Create(parent.get(), "file1", &lock_, &tracker_);
+    const __u64 ino1 = node::ToInode(file1);
+    ASSERT_NE(0, ino1);
+    // Nor FUSE_ROOT_ID
+    ASSERT_NE(1, ino1);
+    ASSERT_EQ(file1, node::FromInode(ino1, &tracker_));
+    ASSERT_TRUE(file1->Release(1));
+
+    // The inode number of a deleted node is reused, in a new generation.
+    unique_node_ptr file2 = CreateNode(parent.get(), "file2");
+    const __u64 ino2 = node::ToInode(file2.get());
+    ASSERT_EQ(static_cast<uint32_t>(ino1), static_cast<uint32_t>(ino2));
+    ASSERT_EQ(NodeTracker::GetGeneration(ino1) + 1, NodeTracker::GetGeneration(ino2));
+    ASSERT_EQ(file2.get(), node::FromInode(ino2, &tracker_));
+
+    // The stale inode number isn't mistaken for the new node.
+    EXPECT_DEATH(node::FromInode(ino1, &tracker_), "");
+    // Nor is an inode number that was never handed out.
+    EXPECT_DEATH(node::FromInode(ino2 + 1000, &tracker_), "");
+}
+
 TEST_F(NodeTest, DeleteTree) {
     unique_node_ptr parent = CreateNode(nullptr, "/path");
 
@@ -195,23 +299,73 @@ TEST_F(NodeTest, LookupAbsolutePath) {
     unique_node_ptr child2 = CreateNode(parent.get(), "subdir2");
     unique_node_ptr subchild = CreateNode(child2.get(), "subsubdir");
 
-    ASSERT_EQ(parent.get(), node::LookupAbsolutePath(parent.get(), "/path"));
-    ASSERT_EQ(parent.get(), node::LookupAbsolutePath(parent.get(), "/path/"));
-    ASSERT_EQ(nullptr, node::LookupAbsolutePath(parent.get(), "/path2"));
+    ASSERT_EQ(parent.get(), LookupAbsolutePath(parent.get(), "/path"));
+    ASSERT_EQ(parent.get(), LookupAbsolutePath(parent.get(), "/path/"));
+    ASSERT_EQ(nullptr, LookupAbsolutePath(parent.get(), "/path2"));
 
-    ASSERT_EQ(child.get(), node::LookupAbsolutePath(parent.get(), "/path/subdir"));
-    ASSERT_EQ(child.get(), node::LookupAbsolutePath(parent.get(), "/path/subdir/"));
+    ASSERT_EQ(child.get(), LookupAbsolutePath(parent.get(), "/path/subdir"));
+    ASSERT_EQ(child.get(), LookupAbsolutePath(parent.get(), "/path/subdir/"));
     // TODO(narayan): Are the two cases below intentional behaviour ?
-    ASSERT_EQ(child.get(), node::LookupAbsolutePath(parent.get(), "/path//subdir"));
-    ASSERT_EQ(child.get(), node::LookupAbsolutePath(parent.get(), "/path///subdir"));
+    ASSERT_EQ(child.get(), LookupAbsolutePath(parent.get(), "/path//subdir"));
+    ASSERT_EQ(child.get(), LookupAbsolutePath(parent.get(), "/path///subdir"));
 
-    ASSERT_EQ(child2.get(), node::LookupAbsolutePath(parent.get(), "/path/subdir2"));
-    ASSERT_EQ(child2.get(), node::LookupAbsolutePath(parent.get(), "/path/subdir2/"));
+    ASSERT_EQ(child2.get(), LookupAbsolutePath(parent.get(), "/path/subdir2"));
+    ASSERT_EQ(child2.get(), LookupAbsolutePath(parent.get(), "/path/subdir2/"));
 
-    ASSERT_EQ(nullptr, node::LookupAbsolutePath(parent.get(), "/path/subdir3/"));
+    ASSERT_EQ(nullptr, LookupAbsolutePath(parent.get(), "/path/subdir3/"));
 
-    ASSERT_EQ(subchild.get(), node::LookupAbsolutePath(parent.get(), "/path/subdir2/subsubdir"));
-    ASSERT_EQ(nullptr, node::LookupAbsolutePath(parent.get(), "/path/subdir/subsubdir"));
+    ASSERT_EQ(subchild.get(), LookupAbsolutePath(parent.get(), "/path/subdir2/subsubdir"));
+    ASSERT_EQ(nullptr, LookupAbsolutePath(parent.get(), "/path/subdir/subsubdir"));
+}
+
+TEST_F(NodeTest, LookupDeepestNode) {
+    unique_node_ptr parent = CreateNode(nullptr, "/path");
+    unique_node_ptr child = CreateNode(parent.get(), "subdir");
+    std::string_view missing = "unset";
+
+    ASSERT_EQ(child.get(), node::LookupDeepestNode(parent.get(), "/path/subdir", &missing));
+    ASSERT_EQ("", missing);
+    ASSERT_EQ(2, GetRefCount(child.get()));
+    child->Release(1);
+
+    ASSERT_EQ(child.get(), node::LookupDeepestNode(parent.get(), "/path/subdir/file", &missing));
+    ASSERT_EQ("file", missing);
+    child->Release(1);
+
+    // The intermediate directories are missing too, and the first one of them is what the kernel
+    // has to forget about
+    ASSERT_EQ(child.get(),
+              node::LookupDeepestNode(parent.get(), "/path/subdir/new//newer/file", &missing));
+    ASSERT_EQ("new", missing);
+    ASSERT_EQ(2, GetRefCount(child.get()));
+    child->Release(1);
+
+    ASSERT_EQ(parent.get(), node::LookupDeepestNode(parent.get(), "/path/other/file", &missing));
+    ASSERT_EQ("other", missing);
+    // Held by its child too
+    ASSERT_EQ(3, GetRefCount(parent.get()));
+    parent->Release(1);
+
+    ASSERT_EQ(nullptr, node::LookupDeepestNode(parent.get(), "/elsewhere/file", &missing));
+    ASSERT_EQ(1, GetRefCount(child.get()));
+}
+
+TEST_F(NodeTest, LookupAbsolutePath_refcounts) {
+    unique_node_ptr parent = CreateNode(nullptr, "/path");
+    unique_node_ptr child = CreateNode(parent.get(), "subdir");
+    unique_node_ptr subchild = CreateNode(child.get(), "subsubdir");
+
+    // The walk holds a reference on each node it visits, and gives all of them back
+    ASSERT_EQ(subchild.get(), LookupAbsolutePath(parent.get(), "/path/subdir/subsubdir"));
+    ASSERT_EQ(nullptr, LookupAbsolutePath(parent.get(), "/path/subdir/missing"));
+    ASSERT_EQ(2, GetRefCount(child.get()));
+    ASSERT_EQ(1, GetRefCount(subchild.get()));
+
+    ASSERT_EQ(subchild.get(),
+              node::LookupAbsolutePath(parent.get(), "/path/subdir/subsubdir", true /* acquire */));
+    ASSERT_EQ(2, GetRefCount(child.get()));
+    ASSERT_EQ(2, GetRefCount(subchild.get()));
+    ASSERT_FALSE(subchild->Release(1));
 }
 
 TEST_F(NodeTest, AddDestroyHandle) {
@@ -224,6 +378,20 @@ TEST_F(NodeTest, AddDestroyHandle) {
     node->DestroyHandle(h);
     ASSERT_FALSE(node->HasCachedHandle());
 
+    // Only cached handles count
+    handle* uncached = new handle(-1, new mediaprovider::fuse::RedactionInfo, false /* cached */);
+    node->AddHandle(uncached);
+    ASSERT_FALSE(node->HasCachedHandle());
+    handle* cached1 = new handle(-1, new mediaprovider::fuse::RedactionInfo, true /* cached */);
+    handle* cached2 = new handle(-1, new mediaprovider::fuse::RedactionInfo, true /* cached */);
+    node->AddHandle(cached1);
+    node->AddHandle(cached2);
+    node->DestroyHandle(cached1);
+    ASSERT_TRUE(node->HasCachedHandle());
+    node->DestroyHandle(cached2);
+    ASSERT_FALSE(node->HasCachedHandle());
+    node->DestroyHandle(uncached);
+
     // Should all crash the process as the handle is no longer associated with
     // the node in question.
     EXPECT_DEATH(node->DestroyHandle(h), "");
@@ -233,6 +401,110 @@ TEST_F(NodeTest, AddDestroyHandle) {
     EXPECT_DEATH(node->DestroyHandle(h2.get()), "");
 }
 
+TEST_F(NodeTest, Slab_returnsFreeBlocks) {
+    const size_t before = Slab<handle>::GetBlockCount();
+
+    // Allocated on other threads, freed on this one
+    std::vector<std::unique_ptr<handle>> handles(8000);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&handles, t] {
+            for (size_t i = t; i < handles.size(); i += 4) {
+                handles[i].reset(new handle(-1, new mediaprovider::fuse::RedactionInfo,
+                                            false /* cached */));
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    ASSERT_GT(Slab<handle>::GetBlockCount(), before + 4);
+
+    handles.clear();
+    // Each of the threads' shards keeps a block at most
+    ASSERT_LE(Slab<handle>::GetBlockCount(), before + 4);
+}
+
+TEST_F(NodeTest, HasWriteHandle) {
+    unique_node_ptr node = CreateNode(nullptr, "/path");
+
+    handle* reader = new handle(-1, new mediaprovider::fuse::RedactionInfo, true /* cached */);
+    node->AddHandle(reader);
+    ASSERT_FALSE(node->HasWriteHandle());
+
+    handle* writer = new handle(-1, new mediaprovider::fuse::RedactionInfo, true /* cached */,
+                                false /* passthrough */, true /* for_write */);
+    node->AddHandle(writer);
+    ASSERT_TRUE(node->HasWriteHandle());
+
+    node->DestroyHandle(writer);
+    ASSERT_FALSE(node->HasWriteHandle());
+    node->DestroyHandle(reader);
+}
+
+// Races an open of the file through FUSE with MediaProvider handing out an fd to it on the lower
+// filesystem, as create_handle_for_node and FuseDaemon::ShouldOpenWithFuse do
+TEST_F(NodeTest, OpenLock_excludesLowerFsLocks) {
+    unique_node_ptr node = CreateNode(nullptr, "/path");
+    const std::string file = "/data/local/tmp/node_test_open_lock";
+    android::base::unique_fd(open(file.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0600));
+
+    for (int i = 0; i < 200; i++) {
+        android::base::unique_fd lower_fd(open(file.c_str(), O_RDONLY | O_CLOEXEC));
+        const int fuse_fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        ASSERT_NE(-1, lower_fd.get());
+        ASSERT_NE(-1, fuse_fd);
+
+        bool lower_locked = false;
+        std::thread lower([&] {
+            std::lock_guard<std::mutex> guard(node->OpenLock());
+            if (!node->HasCachedHandle()) {
+                struct flock fl{};
+                fl.l_type = F_RDLCK;
+                fl.l_whence = SEEK_SET;
+                lower_locked = !fcntl(lower_fd.get(), F_OFD_SETLK, &fl);
+            }
+        });
+        handle* h;
+        std::thread fuse([&] {
+            std::lock_guard<std::mutex> guard(node->OpenLock());
+            struct flock fl{};
+            fl.l_type = F_WRLCK;
+            fl.l_whence = SEEK_SET;
+            const bool locked = fcntl(fuse_fd, F_OFD_GETLK, &fl) || fl.l_type != F_UNLCK;
+            h = new handle(fuse_fd, new mediaprovider::fuse::RedactionInfo, !locked /* cached */);
+            node->AddHandle(h);
+        });
+        lower.join();
+        fuse.join();
+
+        // Either may go first, but the file is never both locked and cached
+        ASSERT_FALSE(lower_locked && h->cached);
+        node->DestroyHandle(h);
+    }
+    unlink(file.c_str());
+}
+
+TEST_F(NodeTest, SetRedactionInfo) {
+    struct stat st = {};
+    st.st_size = 10;
+    std::unique_ptr<handle> h(new handle(
+            -1, new mediaprovider::fuse::RedactionInfo, false /* cached */,
+            false /* passthrough */, false /* for_write */,
+            std::make_unique<handle::RedactionWatch>(1000, 1, st)));
+    ASSERT_TRUE(h->watch->IsCurrentLocked(st));
+    st.st_size = 20;
+    ASSERT_FALSE(h->watch->IsCurrentLocked(st));
+
+    // Readers holding on to the old ranges can keep using them
+    std::shared_ptr<const mediaprovider::fuse::RedactionInfo> old_ri = h->LoadRedactionInfo();
+    ASSERT_FALSE(old_ri->isRedactionNeeded());
+    const off64_t ranges[] = {0, 4};
+    h->SetRedactionInfo(std::make_unique<mediaprovider::fuse::RedactionInfo>(1, ranges));
+    ASSERT_TRUE(h->LoadRedactionInfo()->isRedactionNeeded());
+    ASSERT_FALSE(old_ri->isRedactionNeeded());
+}
+
 TEST_F(NodeTest, CaseInsensitive) {
     unique_node_ptr parent = CreateNode(nullptr, "/path");
     unique_node_ptr mixed_child = CreateNode(parent.get(), "cHiLd");
@@ -244,6 +516,23 @@ TEST_F(NodeTest, CaseInsensitive) {
     ASSERT_EQ(mixed_child.get(), upper_child);
 }
 
+TEST_F(NodeTest, LookupChildByName_stringView) {
+    unique_node_ptr parent = CreateNode(nullptr, "/path");
+    unique_node_ptr child = CreateNode(parent.get(), "child");
+    unique_node_ptr longer_child = CreateNode(parent.get(), "children");
+
+    // Names don't have to be nul terminated
+    const std::string names = "CHILDREN";
+    ASSERT_EQ(child.get(), parent->LookupChildByName(std::string_view(names.data(), 5), false));
+    ASSERT_EQ(longer_child.get(), parent->LookupChildByName(names, false /* acquire */));
+    ASSERT_EQ(nullptr, parent->LookupChildByName(std::string_view(names.data(), 6), false));
+
+    // The name hash follows renames
+    child->Rename("Renamed", parent.get());
+    ASSERT_EQ(nullptr, parent->LookupChildByName("child", false /* acquire */));
+    ASSERT_EQ(child.get(), parent->LookupChildByName("rENAMED", false /* acquire */));
+}
+
 TEST_F(NodeTest, RenameSameNameSameParent) {
     unique_node_ptr parent = CreateNode(nullptr, "/path1");
     unique_node_ptr child = CreateNode(parent.get(), "subdir");
@@ -267,30 +556,42 @@ TEST_F(NodeTest, RenameRoot) {
     ASSERT_EQ(1, GetRefCount(root.get()));
 }
 
-TEST_F(NodeTest, NodeCompareDefinesLinearOrder) {
-    unique_node_ptr node_a = CreateNode(nullptr, "a");
-    unique_node_ptr node_b = CreateNode(nullptr, "B");
-    unique_node_ptr node_c = CreateNode(nullptr, "c");
+TEST_F(NodeTest, LookupChildByName_manyChildren) {
+    constexpr int kChildren = 1000;
 
-    ASSERT_FALSE(cmp.operator()(node_a.get(), node_a.get()));
-    ASSERT_FALSE(cmp.operator()(node_b.get(), node_b.get()));
-    ASSERT_FALSE(cmp.operator()(node_c.get(), node_c.get()));
-
-    auto check_fn = [&](const node* lhs_node, const node* rhs_node) {
-        ASSERT_TRUE(cmp.operator()(lhs_node, rhs_node));
-        ASSERT_FALSE(cmp.operator()(rhs_node, lhs_node));
-    };
+    unique_node_ptr parent = CreateNode(nullptr, "/path");
+    std::vector<node*> children;
+    for (int i = 0; i < kChildren; i++) {
+        children.push_back(node::Create(parent.get(), "File" + std::to_string(i), &lock_, &tracker_));
+    }
+    for (int i = 0; i < kChildren; i++) {
+        ASSERT_EQ(children[i],
+                  parent->LookupChildByName("fILE" + std::to_string(i), false /* acquire */));
+    }
+    ASSERT_EQ(nullptr, parent->LookupChildByName("file" + std::to_string(kChildren), false));
 
-    check_fn(node_a.get(), node_b.get());
-    check_fn(node_b.get(), node_c.get());
-    check_fn(node_a.get(), node_c.get());
+    // Renames within the parent move children around in its index
+    for (int i = 0; i < kChildren; i += 2) {
+        children[i]->Rename("renamed" + std::to_string(i), parent.get());
+    }
+    for (int i = 0; i < kChildren; i++) {
+        const std::string name = (i % 2 ? "file" : "RENAMED") + std::to_string(i);
+        ASSERT_EQ(children[i], parent->LookupChildByName(name, false /* acquire */));
+    }
 
-    // ("A", 0) < node_a < ("a", max_uintptr_t) < node_b
-    ASSERT_TRUE(cmp.operator()(std::make_pair("A", 0), node_a.get()));
-    ASSERT_TRUE(cmp.operator()(node_a.get(),
-                               std::make_pair("A", std::numeric_limits<uintptr_t>::max())));
-    ASSERT_TRUE(cmp.operator()(std::make_pair("A", std::numeric_limits<uintptr_t>::max()),
-                               node_b.get()));
+    // Shrinking the directory back to a few children keeps the rest reachable
+    for (int i = 3; i < kChildren; i++) {
+        ASSERT_TRUE(children[i]->Release(1));
+    }
+    ASSERT_EQ(children[0], parent->LookupChildByName("renamed0", false /* acquire */));
+    ASSERT_EQ(children[1], parent->LookupChildByName("file1", false /* acquire */));
+    ASSERT_EQ(children[2], parent->LookupChildByName("renamed2", false /* acquire */));
+    ASSERT_EQ(nullptr, parent->LookupChildByName("file3", false /* acquire */));
+    ASSERT_EQ(4, GetRefCount(parent.get()));
+
+    for (int i = 0; i < 3; i++) {
+        ASSERT_TRUE(children[i]->Release(1));
+    }
 }
 
 TEST_F(NodeTest, LookupChildByName_ChildrenWithSameName) {
@@ -318,3 +619,57 @@ TEST_F(NodeTest, LookupChildByName_ChildrenWithSameName) {
     test_fn("bAr", bar1.get(), bar2.get());
     test_fn("BaZ", baz1.get(), baz2.get());
 }
+
+TEST_F(NodeTest, LookupAbsolutePath_acquire) {
+    unique_node_ptr parent = CreateNode(nullptr, "/path");
+    unique_node_ptr child = CreateNode(parent.get(), "subdir");
+    ASSERT_EQ(1, GetRefCount(child.get()));
+
+    ASSERT_EQ(child.get(),
+              node::LookupAbsolutePath(parent.get(), "/path/subdir", true /* acquire */));
+    ASSERT_EQ(2, GetRefCount(child.get()));
+    ASSERT_FALSE(child->Release(1));
+
+    // Intermediate nodes are only referenced for the duration of the walk.
+    unique_node_ptr subchild = CreateNode(child.get(), "subsubdir");
+    ASSERT_EQ(subchild.get(), node::LookupAbsolutePath(parent.get(), "/path/subdir/subsubdir",
+                                                       true /* acquire */));
+    ASSERT_EQ(2, GetRefCount(child.get()));
+    ASSERT_EQ(2, GetRefCount(subchild.get()));
+    ASSERT_FALSE(subchild->Release(1));
+}
+
+TEST_F(NodeTest, ConcurrentLookupsInDifferentSubtrees) {
+    constexpr int kThreads = 8;
+    constexpr int kIterations = 1000;
+
+    unique_node_ptr root = CreateNode(nullptr, "/path");
+    std::vector<unique_node_ptr> dirs;
+    for (int i = 0; i < kThreads; i++) {
+        dirs.push_back(CreateNode(root.get(), "dir" + std::to_string(i)));
+    }
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; i++) {
+        node* dir = dirs[i].get();
+        threads.emplace_back([this, dir]() {
+            node* file = node::Create(dir, "file", &lock_, &tracker_);
+            for (int j = 0; j < kIterations; j++) {
+                ASSERT_EQ(file, dir->LookupChildByName("FILE", true /* acquire */));
+                ASSERT_EQ("/path/" + dir->GetName() + "/file", file->BuildPath());
+                ASSERT_FALSE(file->Release(1));
+            }
+            // Dropping the last reference deletes the node and releases its parent.
+            ASSERT_TRUE(file->Release(1));
+            ASSERT_EQ(nullptr, dir->LookupChildByName("file", false /* acquire */));
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (const auto& dir : dirs) {
+        ASSERT_EQ(1, GetRefCount(dir.get()));
+    }
+    ASSERT_EQ(1 + kThreads, GetRefCount(root.get()));
+}
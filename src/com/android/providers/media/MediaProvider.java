@@ -522,24 +522,41 @@ public class MediaProvider extends ContentProvider {
                     String pkg = uri != null ? uri.getSchemeSpecificPart() : null;
                     if (pkg != null) {
                         invalidateLocalCallingIdentityCache(pkg, "package " + intent.getAction());
+                        if (Intent.ACTION_PACKAGE_REMOVED.equals(intent.getAction())) {
+                            invalidateFuseMediaDir(pkg);
+                        }
                     } else {
                         Log.w(TAG, "Failed to retrieve package from intent: " + intent.getAction());
                     }
                     break;
+                case Intent.ACTION_PACKAGE_DATA_CLEARED:
+                    Uri clearedUri = intent.getData();
+                    String clearedPkg = clearedUri != null ? clearedUri.getSchemeSpecificPart()
+                            : null;
+                    if (clearedPkg != null) {
+                        invalidateFuseMediaDir(clearedPkg);
+                    }
+                    break;
             }
         }
     };
 
     private void invalidateLocalCallingIdentityCache(String packageName, String reason) {
+        int uid = android.os.Process.INVALID_UID;
         synchronized (mCachedCallingIdentityForFuse) {
             try {
                 Log.i(TAG, "Invalidating LocalCallingIdentity cache for package " + packageName
                         + ". Reason: " + reason);
-                mCachedCallingIdentityForFuse.remove(
-                        getContext().getPackageManager().getPackageUid(packageName, 0));
+                uid = getContext().getPackageManager().getPackageUid(packageName, 0);
+                mCachedCallingIdentityForFuse.remove(uid);
             } catch (NameNotFoundException ignored) {
             }
         }
+        // The FUSE daemons cache decisions derived from the calling identity, so they have to be
+        // invalidated too. If we don't know the uid (e.g. the package is gone), drop everything.
+        for (FuseDaemon daemon : ExternalStorageServiceImpl.getFuseDaemons()) {
+            daemon.invalidatePermissionCache(uid);
+        }
     }
 
     private final void updateQuotaTypeForUri(@NonNull Uri uri, int mediaType) {
@@ -871,6 +888,7 @@ public class MediaProvider extends ContentProvider {
         packageFilter.addDataScheme("package");
         packageFilter.addAction(Intent.ACTION_PACKAGE_ADDED);
         packageFilter.addAction(Intent.ACTION_PACKAGE_REMOVED);
+        packageFilter.addAction(Intent.ACTION_PACKAGE_DATA_CLEARED);
         context.registerReceiver(mPackageReceiver, packageFilter);
 
         // Watch for invalidation of cached volumes
@@ -1120,11 +1138,38 @@ public class MediaProvider extends ContentProvider {
      */
     @Keep
     public void onFileCreatedForFuse(String path) {
-        // Make sure we update the quota type of the file
+        onFilesCreatedForFuse(new String[] {path});
+    }
+
+    /**
+     * Makes MediaScanner scan the given files, in order.
+     * @param files paths of the files to be scanned
+     *
+     * Called from JNI in jni/MediaProviderWrapper.cpp
+     */
+    @Keep
+    public void scanFilesForFuse(String[] files) {
+        for (String file : files) {
+            scanFileForFuse(file);
+        }
+    }
+
+    /**
+     * Called when new files are created through FUSE
+     *
+     * @param paths paths of the files that were created
+     *
+     * Called from JNI in jni/MediaProviderWrapper.cpp
+     */
+    @Keep
+    public void onFilesCreatedForFuse(String[] paths) {
+        // Make sure we update the quota type of the files
         BackgroundThread.getExecutor().execute(() -> {
-            File file = new File(path);
-            int mediaType = MimeUtils.resolveMediaType(MimeUtils.resolveMimeType(file));
-            updateQuotaTypeForFileInternal(file, mediaType);
+            for (String path : paths) {
+                File file = new File(path);
+                int mediaType = MimeUtils.resolveMediaType(MimeUtils.resolveMimeType(file));
+                updateQuotaTypeForFileInternal(file, mediaType);
+            }
         });
     }
 
@@ -1528,6 +1573,56 @@ public class MediaProvider extends ContentProvider {
         }
     }
 
+    /** Longest file name in bytes, as defined in limits.h */
+    private static final int NAME_MAX = 255;
+    /** Type of regular files, as defined in dirent.h */
+    private static final byte DT_REG = 8;
+
+    /**
+     * Same as {@link #getFilesInDirectoryForFuse}, except that the file names are packed into a
+     * single array for the FUSE daemon to copy out in one go, rather than one string at a time.
+     *
+     * See {@link #packDirectoryEntries} for the format.
+     *
+     * Called from JNI in jni/MediaProviderWrapper.cpp
+     */
+    @Keep
+    public byte[] getPackedFilesInDirectoryForFuse(String path, int uid) {
+        return packDirectoryEntries(getFilesInDirectoryForFuse(path, uid));
+    }
+
+    /**
+     * Packs the given file names as regular files, each one as its length in bytes, its
+     * {@code d_type}, its UTF-8 encoding and a nul byte. Names longer than {@link #NAME_MAX}
+     * bytes can't exist on the lower file system and are left out.
+     */
+    @VisibleForTesting
+    static byte[] packDirectoryEntries(String[] fileNames) {
+        final byte[][] encodedNames = new byte[fileNames.length][];
+        int size = 0;
+        for (int i = 0; i < fileNames.length; i++) {
+            encodedNames[i] = fileNames[i].getBytes(StandardCharsets.UTF_8);
+            if (encodedNames[i].length > NAME_MAX) {
+                Log.w(TAG, "Skipping file name that is too long: " + fileNames[i]);
+                encodedNames[i] = null;
+                continue;
+            }
+            size += encodedNames[i].length + 3;
+        }
+
+        final byte[] packed = new byte[size];
+        int offset = 0;
+        for (byte[] encodedName : encodedNames) {
+            if (encodedName == null) continue;
+            packed[offset++] = (byte) encodedName.length;
+            packed[offset++] = DT_REG;
+            System.arraycopy(encodedName, 0, packed, offset, encodedName.length);
+            offset += encodedName.length;
+            packed[offset++] = 0;
+        }
+        return packed;
+    }
+
     /**
      * Scan files during directory renames for the following reasons:
      * <ul>
@@ -5980,6 +6075,15 @@ public class MediaProvider extends ContentProvider {
         }
     }
 
+    /**
+     * Installd may delete Android/media/<package> behind the back of the FUSE daemon, which lets
+     * the kernel cache entries below Android/media for a while.
+     */
+    private void invalidateFuseMediaDir(@NonNull String packageName) {
+        invalidateFuseDentry(new File(Environment.getExternalStorageDirectory(),
+                "Android/media/" + packageName));
+    }
+
     private void invalidateFuseDentry(@NonNull File file) {
         invalidateFuseDentry(file.getAbsolutePath());
     }
@@ -6840,6 +6944,63 @@ public class MediaProvider extends ContentProvider {
         }
     }
 
+    /**
+     * Same as {@link #insertFileIfNecessaryForFuse} for each of {@code paths}, created by the
+     * corresponding {@code uids}, committed to the database at once.
+     *
+     * @return the result for each of {@code paths}, in order
+     *
+     * Called from JNI in jni/MediaProviderWrapper.cpp
+     */
+    @Keep
+    public int[] insertFilesIfNecessaryForFuse(@NonNull String[] paths, @NonNull int[] uids) {
+        final int[] res = new int[paths.length];
+        mExternalDatabase.runWithTransaction((db) -> {
+            for (int i = 0; i < paths.length; i++) {
+                // Fail only this path, like a single call would, rather than rolling back the
+                // rows of everyone else in the batch
+                try {
+                    res[i] = insertFileIfNecessaryForFuse(paths[i], uids[i]);
+                } catch (RuntimeException e) {
+                    Log.e(TAG, "Failed to insert " + paths[i], e);
+                    res[i] = OsConstants.EFAULT;
+                }
+            }
+            return null;
+        });
+        return res;
+    }
+
+    /**
+     * Same as {@link #deleteFileForFuse} for each of {@code paths}, deleted by the
+     * corresponding {@code uids}, committed to the database at once.
+     *
+     * @return the result for each of {@code paths}, in order
+     *
+     * Called from JNI in jni/MediaProviderWrapper.cpp
+     */
+    @Keep
+    public int[] deleteFilesForFuse(@NonNull String[] paths, @NonNull int[] uids) {
+        final int[] res = new int[paths.length];
+        mExternalDatabase.runWithTransaction((db) -> {
+            for (int i = 0; i < paths.length; i++) {
+                // Fail only this path, like a single call would. Files of others in the batch
+                // may already be gone from disk, so their rows must be committed regardless.
+                try {
+                    res[i] = deleteFileForFuse(paths[i], uids[i]);
+                } catch (IOException e) {
+                    Log.e(TAG, "Failed to delete " + paths[i], e);
+                    res[i] = OsConstants.EIO;
+                } catch (RuntimeException e) {
+                    Log.e(TAG, "Failed to delete " + paths[i], e);
+                    res[i] = OsConstants.EFAULT;
+                }
+            }
+            return null;
+        });
+        return res;
+    }
+
     /**
      * Deletes file with the given {@code path} on behalf of the app with the given {@code uid}.
      * <p>Before deleting, checks if app has permissions to delete this file.
@@ -7811,6 +7972,15 @@ public class MediaProvider extends ContentProvider {
         }
         writer.println();
 
+        final List<FuseDaemon> daemons = ExternalStorageServiceImpl.getFuseDaemons();
+        for (FuseDaemon daemon : daemons) {
+            daemon.dump(writer);
+        }
+        if (!daemons.isEmpty()) {
+            FuseDaemon.dumpStats(writer);
+        }
+        writer.println();
+
         Logging.dumpPersistent(writer);
     }
 }
@@ -35,7 +35,9 @@ import com.android.providers.media.MediaService;
 
 import java.io.File;
 import java.io.IOException;
+import java.util.ArrayList;
 import java.util.HashMap;
+import java.util.List;
 import java.util.Map;
 
 /**
@@ -122,6 +124,13 @@ public final class ExternalStorageServiceImpl extends ExternalStorageService {
         }
     }
 
+    @NonNull
+    public static List<FuseDaemon> getFuseDaemons() {
+        synchronized (sLock) {
+            return new ArrayList<>(sFuseDaemons.values());
+        }
+    }
+
     private MediaProvider getMediaProvider() {
         try (ContentProviderClient cpc =
                 getContentResolver().acquireContentProviderClient(MediaStore.AUTHORITY)) {
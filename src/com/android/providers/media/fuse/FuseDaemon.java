@@ -24,6 +24,8 @@ import androidx.annotation.NonNull;
 import com.android.internal.annotations.GuardedBy;
 import com.android.providers.media.MediaProvider;
 
+import java.io.File;
+import java.io.PrintWriter;
 import java.util.Objects;
 
 /**
@@ -38,6 +40,7 @@ public final class FuseDaemon extends Thread {
     private final MediaProvider mMediaProvider;
     private final int mFuseDeviceFd;
     private final String mPath;
+    private final String mSnapshotFile;
     private final ExternalStorageServiceImpl mService;
     @GuardedBy("mLock")
     private long mPtr;
@@ -50,6 +53,9 @@ public final class FuseDaemon extends Thread {
         setName(Objects.requireNonNull(sessionId));
         mFuseDeviceFd = Objects.requireNonNull(fd).detachFd();
         mPath = Objects.requireNonNull(path);
+        // Where the native daemon keeps its caches between sessions of the same volume
+        mSnapshotFile = new File(mediaProvider.getContext().getCacheDir(),
+                "fuse_" + sessionId.replaceAll("[^A-Za-z0-9]", "_")).getPath();
     }
 
     /** Starts a FUSE session. Does not return until the lower filesystem is unmounted. */
@@ -65,7 +71,7 @@ public final class FuseDaemon extends Thread {
         }
 
         Log.i(TAG, "Starting thread for " + getName() + " ...");
-        native_start(ptr, mFuseDeviceFd, mPath); // Blocks
+        native_start(ptr, mFuseDeviceFd, mPath, mSnapshotFile); // Blocks
         Log.i(TAG, "Exiting thread for " + getName() + " ...");
 
         synchronized (mLock) {
@@ -151,15 +157,53 @@ public final class FuseDaemon extends Thread {
         }
     }
 
+    /**
+     * Invalidates the access decisions cached by FUSE for {@code uid}, or for all uids if
+     * {@code uid} is {@link android.os.Process#INVALID_UID}
+     */
+    public void invalidatePermissionCache(int uid) {
+        synchronized (mLock) {
+            if (mPtr == 0) {
+                Log.i(TAG, "invalidatePermissionCache failed, FUSE daemon unavailable");
+                return;
+            }
+            native_invalidate_permission_cache(mPtr, uid);
+        }
+    }
+
+    /**
+     * Dumps the state of the FUSE daemon
+     */
+    public void dump(@NonNull PrintWriter writer) {
+        synchronized (mLock) {
+            if (mPtr == 0) {
+                writer.println(getName() + ": unavailable");
+                return;
+            }
+            writer.println(getName() + ": " + native_dump(mPtr));
+        }
+    }
+
+    /**
+     * Dumps the request latencies and I/O counters shared by all FUSE daemons of the process
+     */
+    public static void dumpStats(@NonNull PrintWriter writer) {
+        writer.println("FUSE stats: " + native_dump_stats());
+    }
+
     private native long native_new(MediaProvider mediaProvider);
 
     // Takes ownership of the passed in file descriptor!
-    private native void native_start(long daemon, int deviceFd, String path);
+    private native void native_start(long daemon, int deviceFd, String path,
+            String snapshotFile);
 
     private native void native_delete(long daemon);
     private native boolean native_should_open_with_fuse(long daemon, String path, boolean readLock,
             int fd);
     private native void native_invalidate_fuse_dentry_cache(long daemon, String path);
+    private native void native_invalidate_permission_cache(long daemon, int uid);
+    private native String native_dump(long daemon);
+    private static native String native_dump_stats();
     private native boolean native_is_started(long daemon);
     public static native boolean native_is_fuse_thread();
 }
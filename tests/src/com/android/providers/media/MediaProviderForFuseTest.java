@@ -137,6 +137,42 @@ public class MediaProviderForFuseTest {
                 renamed.getPath(), sTestUid))).contains(file.getName());
     }
 
+    @Test
+    public void testBatch() throws Exception {
+        final File first = new File(sTestDir, "first" + System.nanoTime() + ".jpg");
+        final File second = new File(sTestDir, "second" + System.nanoTime() + ".jpg");
+        final String[] paths = {first.getPath(), second.getPath()};
+        final int[] uids = {sTestUid, sTestUid};
+
+        Truth.assertThat(sMediaProvider.insertFilesIfNecessaryForFuse(paths, uids))
+                .isEqualTo(new int[] {0, 0});
+        Truth.assertThat(Arrays.asList(sMediaProvider.getFilesInDirectoryForFuse(
+                sTestDir.getPath(), sTestUid))).containsAtLeast(first.getName(), second.getName());
+
+        Truth.assertThat(first.createNewFile()).isTrue();
+        Truth.assertThat(second.createNewFile()).isTrue();
+        sMediaProvider.onFilesCreatedForFuse(paths);
+        sMediaProvider.scanFilesForFuse(paths);
+
+        Truth.assertThat(sMediaProvider.deleteFilesForFuse(paths, uids))
+                .isEqualTo(new int[] {0, 0});
+        Truth.assertThat(Arrays.asList(sMediaProvider.getFilesInDirectoryForFuse(
+                sTestDir.getPath(), sTestUid))).containsNoneOf(first.getName(), second.getName());
+    }
+
+    @Test
+    public void testPackDirectoryEntries() throws Exception {
+        final String tooLong = new String(new char[256]).replace('\0', 'a');
+        Truth.assertThat(MediaProvider.packDirectoryEntries(
+                new String[] {"a.jpg", "", "\u00e9", tooLong}))
+                .isEqualTo(new byte[] {
+                        5, 8, 'a', '.', 'j', 'p', 'g', 0,
+                        0, 8, 0,
+                        2, 8, (byte) 0xc3, (byte) 0xa9, 0});
+        Truth.assertThat(MediaProvider.packDirectoryEntries(new String[0]))
+                .isEqualTo(new byte[0]);
+    }
+
     @Test
     public void test_scanFileForFuse() throws Exception {
         final File file = new File(sTestDir, "test" + System.nanoTime() + ".jpg");